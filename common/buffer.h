@@ -30,6 +30,7 @@
 
 #include <deque>
 #include <vector>
+#include <common/memory_budget.h>
 #include <common/thread/atomic.h>
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -110,6 +111,7 @@ class BufferSegment {
 	{
 		/* XXX Built-in slab allocator?  */
 		data_ = (uint8_t *)malloc(BUFFER_SEGMENT_SIZE);
+		memory_budget.charge(MemoryUseBuffers, BUFFER_SEGMENT_SIZE);
 	}
 
 	/*
@@ -122,6 +124,7 @@ class BufferSegment {
 		if (data_ != NULL) {
 			free(data_);
 			data_ = NULL;
+			memory_budget.release(MemoryUseBuffers, BUFFER_SEGMENT_SIZE);
 		}
 	}
 
@@ -1009,6 +1012,33 @@ public:
 		return (SegmentIterator(data_));
 	}
 
+	/*
+	 * Returns the number of BufferSegments in this Buffer.
+	 */
+	size_t segment_count(void) const
+	{
+		return (data_.size());
+	}
+
+	/*
+	 * Get a pointer to the data of the BufferSegment at a given position
+	 * that can be modified in place, replacing it first with a copy of its
+	 * own if it is shared with another Buffer.  Its length is returned
+	 * through lenp and must not change.
+	 */
+	uint8_t *writable(size_t index, size_t *lenp)
+	{
+		ASSERT("/buffer", index < data_.size());
+		BufferSegment *seg = data_[index];
+		if (seg->refs() != 1) {
+			data_[index] = seg->copy();
+			seg->unref();
+			seg = data_[index];
+		}
+		*lenp = seg->length();
+		return (seg->head());
+	}
+
 	/*
 	 * Returns true if this Buffer is empty.
 	 */
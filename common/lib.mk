@@ -3,5 +3,6 @@ VPATH+=	${TOPDIR}/common
 SRCS+=	buffer.cc
 SRCS+=	log.cc
 SRCS+=	count_filter.cc
+SRCS+=	memory_budget.cc
 
 CXXFLAGS+=-include common/common.h
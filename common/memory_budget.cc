@@ -0,0 +1,38 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+// File:           memory_budget.cc                                           //
+// Description:    process-wide accounting of buffer, codec and cache memory  //
+// Project:        WANProxy XTech                                             //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+#include <common/memory_budget.h>
+
+size_t MemoryBudget::used () const
+{
+	size_t n = 0;
+
+	for (int i = 0; i < MemoryUses; ++i)
+		n += used_[i];
+
+	return n;
+}
+
+/*
+ * Pressure turns tight at three quarters of the limit, leaving room for
+ * the connections already running to finish what they are doing.
+ */
+MemoryPressure MemoryBudget::pressure () const
+{
+	size_t n;
+
+	if (! limit_)
+		return MemoryPressureNone;
+	if ((n = used ()) >= limit_)
+		return MemoryPressureExhausted;
+	if (n >= limit_ - limit_ / 4)
+		return MemoryPressureTight;
+	return MemoryPressureNone;
+}
+
+MemoryBudget memory_budget;
@@ -0,0 +1,55 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+// File:           memory_budget.h                                            //
+// Description:    process-wide accounting of buffer, codec and cache memory  //
+// Project:        WANProxy XTech                                             //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef	COMMON_MEMORY_BUDGET_H
+#define	COMMON_MEMORY_BUDGET_H
+
+enum MemoryUse
+{
+	MemoryUseBuffers,
+	MemoryUseCodecs,
+	MemoryUseCaches,
+	MemoryUses
+};
+
+enum MemoryPressure
+{
+	MemoryPressureNone,
+	MemoryPressureTight,
+	MemoryPressureExhausted
+};
+
+/*
+ * Every large allocation that grows with the traffic or the number of
+ * connections is charged here, from any thread.  With a limit set, the
+ * pressure it reports lets the proxy slow down reads, stop admitting
+ * connections and shed compression before the system runs out of memory;
+ * without one it only keeps the counts.  It has no constructor so that
+ * charges made during static initialization are never reset.
+ */
+class MemoryBudget
+{
+private:
+	size_t used_[MemoryUses];
+	size_t limit_;
+
+public:
+	void charge (MemoryUse use, size_t n)		{ __sync_add_and_fetch (&used_[use], n); }
+	void release (MemoryUse use, size_t n)		{ __sync_sub_and_fetch (&used_[use], n); }
+
+	size_t used (MemoryUse use) const			{ return used_[use]; }
+	size_t used () const;
+	size_t limit () const							{ return limit_; }
+	void set_limit (size_t n)						{ limit_ = n; }
+
+	MemoryPressure pressure () const;
+};
+
+extern MemoryBudget memory_budget;
+
+#endif /* !COMMON_MEMORY_BUDGET_H */
@@ -20,9 +20,9 @@ all: ${PROGRAM}
 # Build and run regression tests.
 regress: ${PROGRAM}
 ifdef TEST_WRAPPER
-	${TEST_WRAPPER} ${PWD}/${PROGRAM}
+	${TEST_WRAPPER} ${PWD}/bin/${PROGRAM}
 else
-	${PWD}/${PROGRAM}
+	${PWD}/bin/${PROGRAM}
 endif
 else
 # Build but don't run regression tests.
@@ -101,10 +101,12 @@ ${PROGRAM}: ${OBJS}
 	${CXX} ${CXXFLAGS} ${CFLAGS} ${LDFLAGS} -o bin/$@ ${OBJS} ${LDADD}
 
 bin/%.o: %.cc
+	@mkdir -p bin
 	${CXX} ${CPPFLAGS} ${CXXFLAGS} ${CFLAGS} -c -o $@ $<
 
 bin/%.o: %.c
+	@mkdir -p bin
 	${CC} ${CPPFLAGS} ${CFLAGS} -c -o $@ $<
 
 clean:
-	rm -f ${PROGRAM} ${OBJS}
+	rm -f bin/${PROGRAM} ${OBJS}
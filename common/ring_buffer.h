@@ -98,6 +98,7 @@ private:
 	RingBuffer<T> ring;
 	pthread_mutex_t mutex;
 	pthread_cond_t ready;
+	bool notified;
 
 public:
    WaitBuffer ();
@@ -107,12 +108,14 @@ public:
    int write (const T& src);
 	
 	void wakeup ()		{ if (ring.is_empty ()) pthread_cond_signal (&ready); }
+	void notify ();
 };
    
 template<typename T> WaitBuffer<T>::WaitBuffer () 
 {
 	pthread_mutex_init (&mutex, 0);
 	pthread_cond_init (&ready, 0);
+	notified = false;
 }
 
 template<typename T> WaitBuffer<T>::~WaitBuffer () 
@@ -126,8 +129,9 @@ template<typename T> int WaitBuffer<T>::read (T& trg)
 	if (ring.is_empty ())
 	{
 		pthread_mutex_lock (&mutex);
-		if (ring.is_empty ())
+		if (ring.is_empty () && ! notified)
 			pthread_cond_wait (&ready, &mutex);
+		notified = false;
 		pthread_mutex_unlock (&mutex);
 	}
 	
@@ -148,4 +152,12 @@ template<typename T> int WaitBuffer<T>::write (const T& src)
 	return rsl;
 }
 
+template<typename T> void WaitBuffer<T>::notify () 
+{
+	pthread_mutex_lock (&mutex);
+	notified = true;
+	pthread_cond_signal (&ready);
+	pthread_mutex_unlock (&mutex);
+}
+
 #endif /* !COMMON_RING_BUFFER_H */
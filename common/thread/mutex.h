@@ -0,0 +1,80 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+// File:           mutex.h                                                    //
+// Description:    lightweight mutual exclusion for shared structures         //
+// Project:        WANProxy XTech                                             //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef	COMMON_THREAD_MUTEX_H
+#define	COMMON_THREAD_MUTEX_H
+
+#include <pthread.h>
+
+class Mutex
+{
+private:
+	pthread_mutex_t mutex_;
+
+public:
+	Mutex ()						{ pthread_mutex_init (&mutex_, 0); }
+	~Mutex ()					{ pthread_mutex_destroy (&mutex_); }
+
+	void lock ()				{ pthread_mutex_lock (&mutex_); }
+	void unlock ()				{ pthread_mutex_unlock (&mutex_); }
+	bool try_lock ()			{ return (pthread_mutex_trylock (&mutex_) == 0); }
+
+private:
+	Mutex (const Mutex&);
+	Mutex& operator= (const Mutex&);
+};
+
+class RWLock
+{
+private:
+	pthread_rwlock_t lock_;
+
+public:
+	RWLock ()					{ pthread_rwlock_init (&lock_, 0); }
+	~RWLock ()					{ pthread_rwlock_destroy (&lock_); }
+
+	void read_lock ()			{ pthread_rwlock_rdlock (&lock_); }
+	void write_lock ()		{ pthread_rwlock_wrlock (&lock_); }
+	void unlock ()				{ pthread_rwlock_unlock (&lock_); }
+
+private:
+	RWLock (const RWLock&);
+	RWLock& operator= (const RWLock&);
+};
+
+class ScopedLock
+{
+private:
+	Mutex& mutex_;
+
+public:
+	ScopedLock (Mutex& m) : mutex_ (m)	{ mutex_.lock (); }
+	~ScopedLock ()								{ mutex_.unlock (); }
+};
+
+class ScopedReadLock
+{
+private:
+	RWLock& lock_;
+
+public:
+	ScopedReadLock (RWLock& l) : lock_ (l)	{ lock_.read_lock (); }
+	~ScopedReadLock ()							{ lock_.unlock (); }
+};
+
+class ScopedWriteLock
+{
+private:
+	RWLock& lock_;
+
+public:
+	ScopedWriteLock (RWLock& l) : lock_ (l)	{ lock_.write_lock (); }
+	~ScopedWriteLock ()							{ lock_.unlock (); }
+};
+
+#endif /* !COMMON_THREAD_MUTEX_H */
@@ -47,6 +47,10 @@ ConfigClassAddress::Instance::activate(const ConfigObject *)
 			ERROR("/config/class/address") << "Unix domain socket has host and/or port field set, which is only valid for IP sockets.";
 			return (false);
 		}
+		if (path_ == "" || path_ == "@") {
+			ERROR("/config/class/address") << "Unix domain socket has no path.";
+			return (false);
+		}
 		return (true);
 
 	default:
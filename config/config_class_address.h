@@ -49,6 +49,20 @@ public:
 		}
 
 		bool activate(const ConfigObject *);
+
+		/*
+		 * The address as sockets take it: "[host]:port", or the path
+		 * of a Unix domain socket, where a leading '@' stands for an
+		 * abstract name.  Empty while incomplete.
+		 */
+		std::string address(void) const
+		{
+			if (family_ == SocketAddressFamilyUnix)
+				return (path_);
+			if (host_ == "" || port_ == "")
+				return ("");
+			return ('[' + host_ + ']' + ':' + port_);
+		}
 	};
 
 	ConfigClassAddress(const std::string& xname = "address")
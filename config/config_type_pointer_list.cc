@@ -0,0 +1,54 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+// File:           config_type_pointer_list.cc                                //
+// Description:    member referring to several configuration objects          //
+// Project:        WANProxy XTech                                             //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+#include <config/config.h>
+#include <config/config_class.h>
+#include <config/config_exporter.h>
+#include <config/config_object.h>
+#include <config/config_type_pointer_list.h>
+
+ConfigTypePointerList config_type_pointer_list;
+
+void
+ConfigTypePointerList::marshall(ConfigExporter *exp, const std::vector<ConfigObject *> *listp) const
+{
+	std::vector<ConfigObject *>::const_iterator it;
+	std::string names;
+
+	for (it = listp->begin(); it != listp->end(); ++it)
+		names += (names.empty() ? "" : ",") + (*it)->name_;
+
+	exp->value(this, (names.empty() ? "None" : names));
+}
+
+bool
+ConfigTypePointerList::set(ConfigObject *co, const std::string& vstr, std::vector<ConfigObject *> *listp)
+{
+	std::vector<ConfigObject *> list;
+	std::string::size_type pos = 0, end;
+	ConfigObject *target;
+
+	if (vstr != "None") {
+		while (pos <= vstr.length()) {
+			end = vstr.find(',', pos);
+			if (end == std::string::npos)
+				end = vstr.length();
+			target = co->config_->lookup(vstr.substr(pos, end - pos));
+			if (target == NULL) {
+				ERROR("/config/type/pointer-list") << "Referenced object (" << vstr.substr(pos, end - pos) << ") does not exist.";
+				return (false);
+			}
+			list.push_back(target);
+			pos = end + 1;
+		}
+	}
+
+	listp->swap(list);
+
+	return (true);
+}
@@ -0,0 +1,38 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+// File:           config_type_pointer_list.h                                 //
+// Description:    member referring to several configuration objects          //
+// Project:        WANProxy XTech                                             //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef	CONFIG_CONFIG_TYPE_POINTER_LIST_H
+#define	CONFIG_CONFIG_TYPE_POINTER_LIST_H
+
+#include <vector>
+
+#include <config/config_type.h>
+
+struct ConfigObject;
+
+/*
+ * Takes the names of the objects separated by commas, without spaces, as
+ * in "peer0,peer1,peer2", or None for an empty list.
+ */
+class ConfigTypePointerList : public ConfigType {
+public:
+	ConfigTypePointerList(void)
+	: ConfigType("pointer-list")
+	{ }
+
+	~ConfigTypePointerList()
+	{ }
+
+	void marshall(ConfigExporter *, const std::vector<ConfigObject *> *) const;
+
+	bool set(ConfigObject *, const std::string&, std::vector<ConfigObject *> *);
+};
+
+extern ConfigTypePointerList config_type_pointer_list;
+
+#endif /* !CONFIG_CONFIG_TYPE_POINTER_LIST_H */
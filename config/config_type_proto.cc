@@ -3,6 +3,7 @@
 static struct ConfigTypeProto::Mapping config_type_proto_map[] = {
 	{ "TCP",	ConfigProtoTCP },
 	{ "TCP_POOL",	ConfigProtoTCPPool },
+	{ "UDP",	ConfigProtoUDP },
 	{ NULL,		ConfigProtoNone }
 };
 
@@ -6,6 +6,7 @@
 enum ConfigProto {
 	ConfigProtoTCP,
 	ConfigProtoTCPPool,
+	ConfigProtoUDP,
 	ConfigProtoNone,
 };
 
@@ -7,6 +7,7 @@ SRCS+=	config_object.cc
 SRCS+=	config_type_int.cc
 SRCS+=	config_type_log_level.cc
 SRCS+=	config_type_pointer.cc
+SRCS+=	config_type_pointer_list.cc
 SRCS+=	config_type_string.cc
 SRCS+=	config_type_proto.cc
 
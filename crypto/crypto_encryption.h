@@ -52,12 +52,14 @@ namespace CryptoEncryption {
 		CAST,
 		IDEA,
 		RC4,
+		ChaCha20,
 	};
 
 	enum Mode {
 		CBC,
 		CTR,
 		Stream,
+		GCM,
 	};
 	typedef	std::pair<Algorithm, Mode> Cipher;
 
@@ -84,6 +86,31 @@ namespace CryptoEncryption {
 		virtual bool initialize(Operation, const Buffer *, const Buffer *) = 0;
 
 		virtual bool cipher(Buffer *, const Buffer *) = 0;
+		virtual bool cipher(Buffer *) = 0;	/* In place.  */
+
+		/*
+		 * Starts over from a new IV with the same key, as stream ciphers
+		 * used with a nonce per message need.
+		 */
+		virtual bool restart(const uint8_t *)
+		{
+			return (false);
+		}
+
+		/*
+		 * Authenticated modes cipher the data in place, taking the
+		 * additional data into the tag, which is appended to the last
+		 * Buffer when encrypting and checked against it when decrypting.
+		 */
+		virtual unsigned tag_size(void) const
+		{
+			return (0);
+		}
+
+		virtual bool cipher(Buffer *, const Buffer *, Buffer *)
+		{
+			return (false);
+		}
 
 		//virtual Action *submit(Buffer *, EventCallback *) = 0;
 	};
@@ -41,6 +41,52 @@
 ////////////////////////////////////////////////////////////////////////////////
 
 namespace {
+	/*
+	 * Runs a cipher over the data of a Buffer where it lies, a BufferSegment
+	 * at a time: whole blocks are processed in place, and a block split
+	 * between segments is gathered into a small array, processed there and
+	 * put back.  The length must be a multiple of the block size.
+	 */
+	template<typename T>
+	bool cipher_in_place(T *session, unsigned block_size, Buffer *buf)
+	{
+		uint8_t block[EVP_MAX_BLOCK_LENGTH];
+		uint8_t *parts[EVP_MAX_BLOCK_LENGTH];
+		unsigned held, j;
+		size_t i, len, n;
+		uint8_t *p;
+
+		if (block_size == 0)
+			block_size = 1;
+		ASSERT("/crypto/encryption/openssl", block_size <= EVP_MAX_BLOCK_LENGTH);
+
+		held = 0;
+		for (i = 0; i < buf->segment_count(); i++) {
+			p = buf->writable(i, &len);
+			while (len != 0) {
+				if (held == 0 && len >= block_size) {
+					n = len - len % block_size;
+					if (!session->crypt(p, n))
+						return (false);
+					p += n;
+					len -= n;
+					continue;
+				}
+				parts[held] = p;
+				block[held++] = *p++;
+				len--;
+				if (held == block_size) {
+					if (!session->crypt(block, block_size))
+						return (false);
+					for (j = 0; j < block_size; j++)
+						*parts[j] = block[j];
+					held = 0;
+				}
+			}
+		}
+		return (held == 0);
+	}
+
 	class SessionEVP : public CryptoEncryption::Session {
 		LogHandle log_;
 		const EVP_CIPHER *cipher_;
@@ -114,24 +160,28 @@ namespace {
 
 		bool cipher(Buffer *out, const Buffer *in)
 		{
-			/*
-			 * We process a single, large, linear byte buffer here rather
-			 * than going a BufferSegment at a time, even though the byte
-			 * buffer is less efficient than some alternatives, because
-			 * there are padding and buffering implications if each
-			 * BufferSegment's length is not modular to the block size.
-			 */
-			uint8_t indata[in->length()];
-			in->copyout(indata, sizeof indata);
-
-			uint8_t outdata[sizeof indata];
-			int rv = EVP_Cipher(ctx_, outdata, indata, sizeof indata);
-			if (rv == 0)
+			Buffer data(*in);
+			if (!cipher(&data))
 				return (false);
-			out->append(outdata, sizeof outdata);
+			data.moveout(out);
 			return (true);
 		}
 
+		bool cipher(Buffer *data)
+		{
+			return (cipher_in_place(this, EVP_CIPHER_block_size(cipher_), data));
+		}
+
+		bool crypt(uint8_t *data, size_t len)
+		{
+			return (EVP_Cipher(ctx_, data, data, len) != 0);
+		}
+
+		bool restart(const uint8_t *iv)
+		{
+			return (EVP_CipherInit_ex(ctx_, NULL, NULL, NULL, iv, -1) != 0);
+		}
+
 		/*
 		Action *submit(Buffer *in, EventCallback *cb)
 		{
@@ -204,8 +254,22 @@ namespace {
 
 		bool cipher(Buffer *out, const Buffer *in)
 		{
-			ASSERT(log_, in->length() % AES_BLOCK_SIZE == 0);
+			Buffer data(*in);
+			if (!cipher(&data))
+				return (false);
+			data.moveout(out);
+			return (true);
+		}
+
+		bool cipher(Buffer *data)
+		{
+			ASSERT(log_, data->length() % AES_BLOCK_SIZE == 0);
 
+			return (cipher_in_place(this, AES_BLOCK_SIZE, data));
+		}
+
+		bool crypt(uint8_t *data, size_t len)
+		{
 			/*
 			 * Temporaries for AES_ctr128_encrypt.
 			 *
@@ -216,20 +280,7 @@ namespace {
 			uint8_t counterbuf[AES_BLOCK_SIZE]; /* Will be initialized if countern==0.  */
 			unsigned countern = 0;
 
-			/*
-			 * We process a single, large, linear byte buffer here rather
-			 * than going a BufferSegment at a time, even though the byte
-			 * buffer is less efficient than some alternatives, because
-			 * there are padding and buffering implications if each
-			 * BufferSegment's length is not modular to the block size.
-			 */
-			uint8_t indata[in->length()];
-			in->copyout(indata, sizeof indata);
-
-			uint8_t outdata[sizeof indata];
-			CRYPTO_ctr128_encrypt(indata, outdata, sizeof indata, &key_, iv_, counterbuf, &countern, (block128_f)AES_encrypt);
-
-			out->append(outdata, sizeof outdata);
+			CRYPTO_ctr128_encrypt(data, data, len, &key_, iv_, counterbuf, &countern, (block128_f)AES_encrypt);
 			return (true);
 		}
 
@@ -249,6 +300,138 @@ namespace {
 		*/
 	};
 
+	/*
+	 * AES in Galois/Counter Mode.  The IV is set again for every message,
+	 * and the data is ciphered a BufferSegment at a time where it lies.
+	 */
+	class SessionGCM : public CryptoEncryption::Session {
+		LogHandle log_;
+		const EVP_CIPHER *cipher_;
+		EVP_CIPHER_CTX *ctx_;
+		bool encrypt_;
+	public:
+		SessionGCM(const EVP_CIPHER *xcipher)
+		: log_("/crypto/encryption/session/openssl"),
+		  cipher_(xcipher),
+		  ctx_(EVP_CIPHER_CTX_new()),
+		  encrypt_(true)
+		{ }
+
+		~SessionGCM()
+		{
+			EVP_CIPHER_CTX_free(ctx_);
+		}
+
+		unsigned block_size(void) const
+		{
+			return (AES_BLOCK_SIZE);
+		}
+
+		unsigned key_size(void) const
+		{
+			return (EVP_CIPHER_key_length(cipher_));
+		}
+
+		unsigned iv_size(void) const
+		{
+			return (EVP_CIPHER_iv_length(cipher_));
+		}
+
+		unsigned tag_size(void) const
+		{
+			return (AES_BLOCK_SIZE);
+		}
+
+		Session *clone(void) const
+		{
+			return (new SessionGCM(cipher_));
+		}
+
+		bool initialize(CryptoEncryption::Operation operation, const Buffer *key, const Buffer *iv)
+		{
+			if (key->length() < (size_t)EVP_CIPHER_key_length(cipher_))
+				return (false);
+
+			if (iv->length() < (size_t)EVP_CIPHER_iv_length(cipher_))
+				return (false);
+
+			switch (operation) {
+			case CryptoEncryption::Encrypt:
+				encrypt_ = true;
+				break;
+			case CryptoEncryption::Decrypt:
+				encrypt_ = false;
+				break;
+			default:
+				return (false);
+			}
+
+			uint8_t keydata[EVP_MAX_KEY_LENGTH];
+			key->copyout(keydata, EVP_CIPHER_key_length(cipher_));
+
+			uint8_t ivdata[EVP_MAX_IV_LENGTH];
+			iv->copyout(ivdata, EVP_CIPHER_iv_length(cipher_));
+
+			return (EVP_CipherInit_ex(ctx_, cipher_, NULL, keydata, ivdata, encrypt_ ? 1 : 0) != 0);
+		}
+
+		bool restart(const uint8_t *iv)
+		{
+			return (EVP_CipherInit_ex(ctx_, NULL, NULL, NULL, iv, -1) != 0);
+		}
+
+		bool cipher(Buffer *, const Buffer *)
+		{
+			return (false);
+		}
+
+		bool cipher(Buffer *)
+		{
+			return (false);
+		}
+
+		bool cipher(Buffer *data, const Buffer *aad, Buffer *tag)
+		{
+			uint8_t tagdata[AES_BLOCK_SIZE];
+			size_t i, len;
+			uint8_t *p;
+			int outl;
+
+			if (!encrypt_) {
+				if (tag->length() != sizeof tagdata)
+					return (false);
+				tag->copyout(tagdata, sizeof tagdata);
+				if (!EVP_CIPHER_CTX_ctrl(ctx_, EVP_CTRL_GCM_SET_TAG, sizeof tagdata, tagdata))
+					return (false);
+			}
+
+			Buffer::SegmentIterator iter = aad->segments();
+			while (!iter.end()) {
+				const BufferSegment *seg = *iter;
+				if (!EVP_CipherUpdate(ctx_, NULL, &outl, seg->data(), seg->length()))
+					return (false);
+				iter.next();
+			}
+
+			for (i = 0; i < data->segment_count(); i++) {
+				p = data->writable(i, &len);
+				if (!EVP_CipherUpdate(ctx_, p, &outl, p, len))
+					return (false);
+				ASSERT(log_, (size_t)outl == len);
+			}
+
+			if (!EVP_CipherFinal_ex(ctx_, tagdata, &outl))
+				return (false);
+
+			if (encrypt_) {
+				if (!EVP_CIPHER_CTX_ctrl(ctx_, EVP_CTRL_GCM_GET_TAG, sizeof tagdata, tagdata))
+					return (false);
+				tag->append(tagdata, sizeof tagdata);
+			}
+			return (true);
+		}
+	};
+
 	class MethodOpenSSL : public CryptoEncryption::Method {
 		LogHandle log_;
 		FactoryMap<CryptoEncryption::Cipher, CryptoEncryption::Session> cipher_map_;
@@ -284,6 +467,13 @@ namespace {
 #endif
 			cipher_map_.enter(CryptoEncryption::Cipher(CryptoEncryption::RC4, CryptoEncryption::Stream), evp_factory(EVP_rc4()));
 
+			factory<SessionGCM> gcm_factory;
+			cipher_map_.enter(CryptoEncryption::Cipher(CryptoEncryption::AES128, CryptoEncryption::GCM), gcm_factory(EVP_aes_128_gcm()));
+			cipher_map_.enter(CryptoEncryption::Cipher(CryptoEncryption::AES256, CryptoEncryption::GCM), gcm_factory(EVP_aes_256_gcm()));
+#ifndef	OPENSSL_NO_CHACHA
+			cipher_map_.enter(CryptoEncryption::Cipher(CryptoEncryption::ChaCha20, CryptoEncryption::Stream), evp_factory(EVP_chacha20()));
+#endif
+
 			/* XXX Register.  */
 		}
 
@@ -49,6 +49,7 @@ namespace CryptoMAC {
 		SHA256,
 		SHA512,
 		RIPEMD160,
+		Poly1305,
 	};
 
 	class Instance {
@@ -67,6 +68,7 @@ namespace CryptoMAC {
 		virtual bool initialize(const Buffer * = NULL) = 0;
 
 		virtual bool mac(Buffer *, const Buffer *) = 0;
+		virtual bool mac(Buffer *, const uint8_t *, size_t, const Buffer *) = 0;	/* Over a prefix and a Buffer.  */
 
 		//virtual Action *submit(Buffer *, EventCallback *) = 0;
 	};
@@ -84,6 +86,8 @@ namespace CryptoMAC {
 
 		static const Method *method(Algorithm);
 	};
+
+	bool verify(const Buffer *, const Buffer *);	/* Compares MACs in constant time.  */
 }
 
 std::ostream& operator<< (std::ostream&, CryptoMAC::Algorithm);
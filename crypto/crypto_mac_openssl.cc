@@ -23,8 +23,14 @@
  * SUCH DAMAGE.
  */
 
+#include <openssl/crypto.h>
 #include <openssl/evp.h>
 #include <openssl/hmac.h>
+#include <openssl/opensslv.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#include <openssl/params.h>
+#endif
 
 #include <common/factory.h>
 #include <crypto/crypto_mac.h>
@@ -45,16 +51,35 @@ namespace {
 		const EVP_MD *algorithm_;
 		uint8_t key_[EVP_MAX_KEY_LENGTH];
 		size_t key_length_;
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+		EVP_MAC *hmac_;
+		EVP_MAC_CTX *ctx_;
+#else
+		HMAC_CTX *ctx_;
+#endif
 	public:
 		InstanceEVP(const EVP_MD *algorithm)
 		: log_("/crypto/mac/instance/openssl"),
 		  algorithm_(algorithm),
 		  key_(),
-		  key_length_(0)
+		  key_length_(0),
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+		  hmac_(EVP_MAC_fetch(NULL, "HMAC", NULL)),
+		  ctx_(hmac_ == NULL ? NULL : EVP_MAC_CTX_new(hmac_))
+#else
+		  ctx_(HMAC_CTX_new())
+#endif
 		{ }
 
 		~InstanceEVP()
-		{ }
+		{
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+			EVP_MAC_CTX_free(ctx_);
+			EVP_MAC_free(hmac_);
+#else
+			HMAC_CTX_free(ctx_);
+#endif
+		}
 
 		unsigned size(void) const
 		{
@@ -75,29 +100,82 @@ namespace {
 			key->copyout(key_, key->length());
 			key_length_ = key->length();
 
-			return (true);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+			OSSL_PARAM params[2];
+			char digest[32];
+
+			if (ctx_ == NULL)
+				return (false);
+			snprintf(digest, sizeof digest, "%s", EVP_MD_get0_name(algorithm_));
+			params[0] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, digest, 0);
+			params[1] = OSSL_PARAM_construct_end();
+			return (EVP_MAC_init(ctx_, key_, key_length_, params) != 0);
+#else
+			return (HMAC_Init_ex(ctx_, key_, key_length_, algorithm_, NULL) != 0);
+#endif
 		}
 
 		bool mac(Buffer *out, const Buffer *in)
 		{
-			/*
-			 * We process a single, large, linear byte buffer here rather
-			 * than going a BufferSegment at a time, even though the byte
-			 * buffer is less efficient than some alternatives, because
-			 * there are padding and buffering implications if each
-			 * BufferSegment's length is not modular to the block size.
-			 */
-			uint8_t indata[in->length()];
-			in->copyout(indata, sizeof indata);
-
-			uint8_t macdata[EVP_MD_size(algorithm_)];
+			return (mac(out, NULL, 0, in));
+		}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+		/*
+		 * The context keeps the key and digest as set up by initialize,
+		 * and is only reset for each message, which is fed a BufferSegment
+		 * at a time.
+		 */
+		bool mac(Buffer *out, const uint8_t *prefix, size_t prefix_len, const Buffer *in)
+		{
+			uint8_t macdata[EVP_MAX_MD_SIZE];
+			size_t maclen;
+
+			if (!EVP_MAC_init(ctx_, NULL, 0, NULL))
+				return (false);
+			if (prefix_len != 0 && !EVP_MAC_update(ctx_, prefix, prefix_len))
+				return (false);
+			Buffer::SegmentIterator iter = in->segments();
+			while (!iter.end()) {
+				const BufferSegment *seg = *iter;
+				if (!EVP_MAC_update(ctx_, seg->data(), seg->length()))
+					return (false);
+				iter.next();
+			}
+			if (!EVP_MAC_final(ctx_, macdata, &maclen, sizeof macdata))
+				return (false);
+			ASSERT(log_, maclen == (size_t)EVP_MD_size(algorithm_));
+			out->append(macdata, maclen);
+			return (true);
+		}
+#else
+		/*
+		 * The context keeps the key as set up by initialize, and is only
+		 * reset for each message, which is fed a BufferSegment at a time.
+		 */
+		bool mac(Buffer *out, const uint8_t *prefix, size_t prefix_len, const Buffer *in)
+		{
+			uint8_t macdata[EVP_MAX_MD_SIZE];
 			unsigned maclen;
-			if (HMAC(algorithm_, key_, key_length_, indata, sizeof indata, macdata, &maclen) == NULL)
+
+			if (!HMAC_Init_ex(ctx_, NULL, 0, NULL, NULL))
+				return (false);
+			if (prefix_len != 0 && !HMAC_Update(ctx_, prefix, prefix_len))
 				return (false);
-			ASSERT(log_, maclen == sizeof macdata);
+			Buffer::SegmentIterator iter = in->segments();
+			while (!iter.end()) {
+				const BufferSegment *seg = *iter;
+				if (!HMAC_Update(ctx_, seg->data(), seg->length()))
+					return (false);
+				iter.next();
+			}
+			if (!HMAC_Final(ctx_, macdata, &maclen))
+				return (false);
+			ASSERT(log_, maclen == (unsigned)EVP_MD_size(algorithm_));
 			out->append(macdata, maclen);
 			return (true);
 		}
+#endif
 
 		/*
 		Action *submit(Buffer *in, EventCallback *cb)
@@ -115,6 +193,79 @@ namespace {
 		*/
 	};
 
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#define	POLY1305_KEY_SIZE	32
+#define	POLY1305_SIZE		16
+
+	/*
+	 * Poly1305 takes a new one-time key for every message, so initialize
+	 * has to be called before each of them.
+	 */
+	class InstancePoly1305 : public CryptoMAC::Instance {
+		LogHandle log_;
+		EVP_MAC *algorithm_;
+		EVP_MAC_CTX *ctx_;
+	public:
+		InstancePoly1305(void)
+		: log_("/crypto/mac/instance/openssl"),
+		  algorithm_(EVP_MAC_fetch(NULL, "POLY1305", NULL)),
+		  ctx_(algorithm_ == NULL ? NULL : EVP_MAC_CTX_new(algorithm_))
+		{ }
+
+		~InstancePoly1305()
+		{
+			EVP_MAC_CTX_free(ctx_);
+			EVP_MAC_free(algorithm_);
+		}
+
+		unsigned size(void) const
+		{
+			return (POLY1305_SIZE);
+		}
+
+		Instance *clone(void) const
+		{
+			return (new InstancePoly1305());
+		}
+
+		bool initialize(const Buffer *key)
+		{
+			uint8_t keydata[POLY1305_KEY_SIZE];
+
+			if (ctx_ == NULL || key == NULL || key->length() != sizeof keydata)
+				return (false);
+			key->copyout(keydata, sizeof keydata);
+
+			return (EVP_MAC_init(ctx_, keydata, sizeof keydata, NULL) != 0);
+		}
+
+		bool mac(Buffer *out, const Buffer *in)
+		{
+			return (mac(out, NULL, 0, in));
+		}
+
+		bool mac(Buffer *out, const uint8_t *prefix, size_t prefix_len, const Buffer *in)
+		{
+			uint8_t macdata[POLY1305_SIZE];
+			size_t maclen;
+
+			if (prefix_len != 0 && !EVP_MAC_update(ctx_, prefix, prefix_len))
+				return (false);
+			Buffer::SegmentIterator iter = in->segments();
+			while (!iter.end()) {
+				const BufferSegment *seg = *iter;
+				if (!EVP_MAC_update(ctx_, seg->data(), seg->length()))
+					return (false);
+				iter.next();
+			}
+			if (!EVP_MAC_final(ctx_, macdata, &maclen, sizeof macdata))
+				return (false);
+			out->append(macdata, maclen);
+			return (true);
+		}
+	};
+#endif
+
 	class MethodOpenSSL : public CryptoMAC::Method {
 		LogHandle log_;
 		FactoryMap<CryptoMAC::Algorithm, CryptoMAC::Instance> algorithm_map_;
@@ -132,6 +283,10 @@ namespace {
 			algorithm_map_.enter(CryptoMAC::SHA256, evp_factory(EVP_sha256()));
 			algorithm_map_.enter(CryptoMAC::SHA512, evp_factory(EVP_sha512()));
 			algorithm_map_.enter(CryptoMAC::RIPEMD160, evp_factory(EVP_ripemd160()));
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+			factory<InstancePoly1305> poly1305_factory;
+			algorithm_map_.enter(CryptoMAC::Poly1305, poly1305_factory());
+#endif
 
 			/* XXX Register.  */
 		}
@@ -154,3 +309,20 @@ namespace {
 
 	static MethodOpenSSL crypto_mac_method_openssl;
 }
+
+/*
+ * Tells whether a received MAC or tag is the expected one, taking the same
+ * time wherever they differ.  Only their lengths may be told apart.
+ */
+bool
+CryptoMAC::verify(const Buffer *expected, const Buffer *received)
+{
+	uint8_t a[EVP_MAX_MD_SIZE], b[EVP_MAX_MD_SIZE];
+	size_t len = expected->length();
+
+	if (len == 0 || len > sizeof a || received->length() != len)
+		return (false);
+	expected->copyout(a, len);
+	received->copyout(b, len);
+	return (CRYPTO_memcmp(a, b, len) == 0);
+}
@@ -104,7 +104,7 @@ void IoService::poll (int ms)
 			if (node && (act = node->write_action))
 			{
 				Event& ev = (act->callback_ ? act->callback_->param () : ok);
-				if ((act->mode_ == StreamModeConnect && (ev.type_ = Event::Done)) || 
+				if ((act->mode_ == StreamModeConnect && connect_result (node->fd, ev)) || 
 					 (act->mode_ == StreamModeWrite && write_channel (node->fd, ev)) ||
 					 (act->mode_ == StreamModeEnd && close_channel (node->fd, ev)))
 				{
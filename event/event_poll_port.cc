@@ -128,7 +128,7 @@ void IoService::poll (int ms)
 			if (node && (act = node->write_action))
 			{
 				Event& ev = (act->callback_ ? act->callback_->param () : ok);
-				if ((act->mode_ == StreamModeConnect && (ev.type_ = Event::Done)) || 
+				if ((act->mode_ == StreamModeConnect && connect_result (sck, ev)) || 
 					 (act->mode_ == StreamModeWrite && write_channel (sck, ev)) ||
 					 (act->mode_ == StreamModeEnd && close_channel (sck, ev)))
 				{
@@ -9,6 +9,7 @@
 ////////////////////////////////////////////////////////////////////////////////
 
 #include <unistd.h>
+#include <pthread.h>
 #include <signal.h>
 #include <sys/resource.h>
 #include <event/event_system.h>
@@ -17,10 +18,18 @@ namespace
 {
 	static void signal_reload (int)   { event_system.reload (); }
 	static void signal_stop (int)     { event_system.stop (); }
+	
+	static __thread EventSystem* current_system = 0;
+	static pthread_t main_thread;
 }
 
-EventSystem::EventSystem () : log_ ("/event/system"), reload_ (false), stop_ (false)
+EventSystem::EventSystem (int index) : log_ ("/event/system"), io_service_ (*this), index_ (index), 
+													posted_ (false), finished_ (false), reload_ (false), stop_ (false)
 {
+	if (index_ > 0)
+		return;
+	
+	main_thread = pthread_self ();
 	::signal (SIGHUP, signal_reload);
 	::signal (SIGINT, signal_stop);
 	::signal (SIGPIPE, SIG_IGN);
@@ -34,33 +43,52 @@ EventSystem::EventSystem () : log_ ("/event/system"), reload_ (false), stop_ (fa
 	}
 }
 
+EventSystem::~EventSystem ()
+{
+	std::deque<Callback*>::iterator it;
+	for (it = post_queue_.begin (); it != post_queue_.end (); ++it)
+		delete *it;
+	for (unsigned n = 0; n < shards_.size (); ++n)
+		delete shards_[n];
+}
+
 void EventSystem::run ()
 {
 	EventMessage msg;
 	
-	INFO(log_) << "Starting event system.";
+	if (index_ == 0)
+		INFO(log_) << "Starting event system" << (direct () ? " in direct mode." : ".");
+	else
+		INFO(log_) << "Starting event shard " << index_ << ".";
 	
-	io_service_.start ();
+	current_system = this;
+	if (direct ())
+		io_service_.attach ();
+	else
+		io_service_.start ();
+	
+	for (unsigned n = 0; n < shards_.size (); ++n)
+		shards_[n]->launch ();
 	
 	while (1)
 	{
-		if (gateway_.read (msg)) 
+		if (direct ())
 		{
-			if (msg.op >= 0)
-			{
-				if (msg.action && ! msg.action->is_cancelled ())
-				{
-					if (msg.action->callback_)
-						msg.action->callback_->execute ();
-					else
-						msg.action->cancel ();
-				}
-			}
-			else
+			io_service_.cycle ();
+			while (! completed_.empty ())
 			{
-				delete msg.action;
+				msg = completed_.front ();
+				completed_.pop_front ();
+				dispatch (msg);
 			}
 		}
+		else if (gateway_.read (msg)) 
+		{
+			dispatch (msg);
+		}
+		
+		if (posted_)
+			run_posted ();
 
 		if (reload_) 
 		{
@@ -71,7 +99,12 @@ void EventSystem::run ()
 				INFO(log_) << "Reload handlers have been run.";
 			}
 			reload_ = false;
-			::signal (SIGHUP, signal_reload);
+			if (index_ == 0)
+			{
+				for (unsigned n = 0; n < shards_.size (); ++n)
+					shards_[n]->system ().reload ();
+				::signal (SIGHUP, signal_reload);
+			}
 		}
 
 		if (stop_) 
@@ -86,21 +119,36 @@ void EventSystem::run ()
 		}
 	}
 	
-	io_service_.stop ();
+	for (unsigned n = 0; n < shards_.size (); ++n)
+		shards_[n]->stop ();
+	
+	if (direct ())
+		io_service_.detach ();
+	else
+		io_service_.stop ();
+	
+	post_mutex_.lock ();
+	finished_ = true;
+	post_mutex_.unlock ();
+	
+	if (posted_)
+		run_posted ();
 }
 
 void EventSystem::reload ()
 {
-	::signal (SIGHUP, SIG_IGN);
 	reload_ = true;
-	gateway_.wakeup ();
+	if (index_ == 0)
+		::signal (SIGHUP, SIG_IGN);
+	wakeup (index_ == 0);
 }
 
 void EventSystem::stop ()
 {
-	::signal (SIGINT, SIG_IGN);
 	stop_ = true;
-	gateway_.wakeup ();
+	if (index_ == 0)
+		::signal (SIGINT, SIG_IGN);
+	wakeup (index_ == 0);
 }
 
 Action* EventSystem::register_interest (EventInterest interest, Callback* cb)
@@ -129,5 +177,144 @@ void EventSystem::cancel (EventAction* act)
 		io_service_.take_message (msg);
 	}
 }
+
+/*
+ * Hands a callback over to the thread running this event system.  Objects
+ * bound to a shard may only be touched from that shard, so listeners and
+ * other shard-local structures are created and destroyed through here.
+ * Once the loop has exited the callback is simply run by the caller.
+ */
+void EventSystem::post (Callback* cb)
+{
+	if (! cb)
+		return;
+	
+	post_mutex_.lock ();
+	if (! finished_)
+	{
+		post_queue_.push_back (cb);
+		posted_ = true;
+		post_mutex_.unlock ();
+		wakeup (false);
+		return;
+	}
+	post_mutex_.unlock ();
+	
+	cb->execute ();
+	delete cb;
+}
+
+/*
+ * Completions come from the IO service only, which in direct mode runs on
+ * the loop thread itself, so the local queue needs no lock.
+ */
+int EventSystem::take_message (const EventMessage& msg)
+{
+	if (! direct ())
+		return gateway_.write (msg);
+	
+	ASSERT(log_, current_system == this);
+	completed_.push_back (msg);
+	return 1;
+}
+
+/*
+ * Direct mode runs the poll backend on this thread and executes the
+ * completions inline, saving the thread hop and pipe write per event on
+ * single core machines.  It must be chosen before the loop is started.
+ */
+void EventSystem::set_direct (bool on)
+{
+	io_service_.set_direct (on);
+	for (unsigned n = 0; n < shards_.size (); ++n)
+		shards_[n]->system ().set_direct (on);
+}
+
+void EventSystem::dispatch (const EventMessage& msg)
+{
+	if (msg.op >= 0)
+	{
+		if (msg.action && ! msg.action->is_cancelled ())
+		{
+			if (msg.action->callback_)
+				msg.action->callback_->execute ();
+			else
+				msg.action->cancel ();
+		}
+	}
+	else
+	{
+		delete msg.action;
+	}
+}
+
+void EventSystem::wakeup (bool signalled)
+{
+	if (direct ())
+		io_service_.wakeup ();
+	else if (signalled)
+		gateway_.wakeup ();
+	else
+		gateway_.notify ();
+}
+
+void EventSystem::run_posted ()
+{
+	std::deque<Callback*> queue;
+	
+	post_mutex_.lock ();
+	queue.swap (post_queue_);
+	posted_ = false;
+	post_mutex_.unlock ();
+	
+	while (! queue.empty ())
+	{
+		Callback* cb = queue.front ();
+		queue.pop_front ();
+		cb->execute ();
+		delete cb;
+	}
+}
+
+bool EventSystem::launch_shards (int count)
+{
+	if (index_ > 0)
+		return false;
+	
+	while ((int) shards_.size () + 1 < count)
+	{
+		EventShard* shard = new EventShard (shards_.size () + 1);
+		shard->system ().set_direct (direct ());
+		if (current_system == this && ! shard->launch ())
+		{
+			ERROR(log_) << "Unable to start event shard.";
+			delete shard;
+			return false;
+		}
+		shards_.push_back (shard);
+	}
+	
+	return true;
+}
+
+EventSystem& EventSystem::shard (int n)
+{
+	if (n <= 0 || n > (int) shards_.size ())
+		return *this;
+	return shards_[n - 1]->system ();
+}
+
+/*
+ * The loop of the calling thread.  Before the main loop runs, the main
+ * thread is setting it up and gets it too; any other thread has no loop
+ * and must keep a reference to the one its objects belong to.
+ */
+EventSystem& EventSystem::current ()
+{
+	if (current_system)
+		return *current_system;
+	ASSERT("/event/system", pthread_equal (pthread_self (), main_thread));
+	return event_system;
+}
 	
 EventSystem event_system;
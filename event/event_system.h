@@ -11,8 +11,12 @@
 #ifndef	EVENT_EVENT_SYSTEM_H
 #define	EVENT_EVENT_SYSTEM_H
 
+#include <deque>
+#include <vector>
 #include <common/buffer.h>
 #include <common/ring_buffer.h>
+#include <common/thread/mutex.h>
+#include <common/thread/thread.h>
 #include <event/action.h>
 #include <event/event_callback.h>
 #include <event/object_callback.h>
@@ -21,6 +25,7 @@
 #include <event/io_service.h>
 
 class EventAction;
+class EventShard;
 
 enum EventInterest 
 {
@@ -45,11 +50,18 @@ private:
 	LogHandle log_;
 	IoService io_service_;
 	WaitBuffer<EventMessage> gateway_;
+	std::deque<EventMessage> completed_;
 	CallbackQueue interest_queue_[EventInterests];
+	Mutex post_mutex_;
+	std::deque<Callback*> post_queue_;
+	std::vector<EventShard*> shards_;
+	int index_;
+	volatile bool posted_, finished_;
 	bool reload_, stop_;
 	
 public:
-	EventSystem ();
+	EventSystem (int index = 0);
+	~EventSystem ();
 
 	void run ();
 	void reload ();
@@ -58,8 +70,41 @@ public:
 	Action* register_interest (EventInterest interest, Callback* cb);
 	Action* track (int fd, StreamMode mode, EventCallback* cb);
 	void cancel (EventAction* act);
+	void post (Callback* cb);
 	
-	int take_message (const EventMessage& msg)   { return gateway_.write (msg); }
+	bool launch_shards (int count);
+	EventSystem& shard (int n);
+	int shard_count () const							{ return (shards_.size () + 1); }
+	int index () const									{ return index_; }
+	
+	void set_direct (bool on);
+	bool direct () const									{ return io_service_.direct (); }
+	bool pending () const								{ return (! completed_.empty () || posted_ || reload_ || stop_); }
+	
+	int take_message (const EventMessage& msg);
+	
+	static EventSystem& current ();
+	
+private:
+	void dispatch (const EventMessage& msg);
+	void wakeup (bool signalled);
+	void run_posted ();
+};
+
+class EventShard : public Thread 
+{
+private:
+	EventSystem system_;
+	bool started_;
+	
+public:
+	EventShard (int index) : Thread ("EventShard"), system_ (index), started_ (false)	{ }
+	
+	EventSystem& system ()				{ return system_; }
+	bool launch ()							{ if (! started_) started_ = start (); return started_; }
+	
+	virtual void main ()					{ system_.run (); }
+	virtual void stop ()					{ if (started_) system_.stop (), Thread::stop (), started_ = false; }
 };
 
 class EventAction : public Action 
@@ -17,9 +17,10 @@
 #include <event/event_system.h>
 #include <event/io_service.h>
 
-IoService::IoService () : Thread ("IoService"), log_ ("/io/thread")
+IoService::IoService (EventSystem& sys) : Thread ("IoService"), log_ ("/io/thread"), system_ (sys)
 {
 	timeout_ = handle_ = rfd_ = wfd_ = -1;
+	direct_ = false;
 	
 	int fd[2];
 	if (::pipe (fd) == 0)
@@ -36,39 +37,107 @@ IoService::~IoService ()
 
 void IoService::main ()
 {
-	EventMessage msg;
-	
 	INFO(log_) << "Starting IO thread.";
 	
-	open_resources ();
-	IoNode node = {rfd_, true, false, 0, 0};
-	set_fd (rfd_, 1, 0, &node);
+	attach ();
 	
 	while (! stop_) 
+		cycle ();
+
+	detach ();
+}
+
+void IoService::stop ()
+{
+	stop_ = true;
+	wakeup ();
+	Thread::stop ();
+}
+
+/*
+ * In direct mode there is no IO thread: the event system calls cycle ()
+ * itself, requests are queued locally and completions are handed back
+ * through take_message without crossing threads.  The pipe stays open so
+ * that signals and other threads can still interrupt a blocking poll.
+ */
+void IoService::attach ()
+{
+	IoNode node = {rfd_, true, false, 0, 0};
+	
+	owner_ = pthread_self ();
+	open_resources ();
+	wake_node_ = node;
+	set_fd (rfd_, 1, 0, &wake_node_);
+}
+
+void IoService::cycle ()
+{
+	EventMessage msg;
+	
+	if (direct_)
 	{
-		while (gateway_.read (msg)) 
+		std::deque<EventMessage> queue;
+		while (take_requests (queue))
 		{
-			if (msg.op >= 0)
-				handle_request (msg.action);
-			else
-				cancel (msg.action);
+			while (! queue.empty ())
+			{
+				msg = queue.front ();
+				queue.pop_front ();
+				dispatch (msg);
+			}
 		}
-				
-		poll (timeout_);
-		
-		if (timeout_ > 0)
-			wakeup_readers ();
 	}
+	else
+	{
+		while (gateway_.read (msg)) 
+			dispatch (msg);
+	}
+			
+	poll (direct_ && system_.pending () ? 0 : timeout_);
+	
+	if (timeout_ > 0)
+		wakeup_readers ();
+}
 
+/*
+ * Worker threads track and cancel actions of the connections they serve
+ * even in direct mode, so the local queue is locked, and a request coming
+ * from any other thread than the loop wakes up its poll.
+ */
+void IoService::take_message (const EventMessage& msg)
+{
+	if (! direct_)
+	{
+		gateway_.write (msg), wakeup ();
+		return;
+	}
+	
+	requests_mutex_.lock ();
+	requests_.push_back (msg);
+	requests_mutex_.unlock ();
+	if (! pthread_equal (pthread_self (), owner_))
+		wakeup ();
+}
+
+bool IoService::take_requests (std::deque<EventMessage>& queue)
+{
+	ScopedLock guard (requests_mutex_);
+	queue.swap (requests_);
+	return (! queue.empty ());
+}
+
+void IoService::detach ()
+{
 	set_fd (rfd_, -1, 0);
 	close_resources ();
 }
 
-void IoService::stop ()
+void IoService::dispatch (const EventMessage& msg)
 {
-	stop_ = true;
-	wakeup ();
-	Thread::stop ();
+	if (msg.op >= 0)
+		handle_request (msg.action);
+	else
+		cancel (msg.action);
 }
 
 void IoService::handle_request (EventAction* act)
@@ -124,13 +193,13 @@ void IoService::handle_request (EventAction* act)
 
 bool IoService::connect_channel (int fd, Event& ev)
 {
-	struct sockaddr adr;
+	struct sockaddr_storage adr;
 	int n = 0;
 	
 	if (ev.buffer_.length () <= sizeof adr)
 		ev.buffer_.copyout ((uint8_t*) &adr, (n = ev.buffer_.length ()));
 		
-	int rv = ::connect (fd, &adr, n);
+	int rv = ::connect (fd, (struct sockaddr*) &adr, n);
 	switch (rv) 
 	{
 	case 0:
@@ -153,6 +222,26 @@ bool IoService::connect_channel (int fd, Event& ev)
 	return true;
 }
 
+/*
+ * A socket becomes writable when its connect is over, whether it has
+ * succeeded or not: the outcome is in its pending error.
+ */
+bool IoService::connect_result (int fd, Event& ev)
+{
+	int err = 0;
+	socklen_t len = sizeof err;
+	
+	if (::getsockopt (fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1)
+		err = errno;
+	
+	if (err)
+		ev.type_ = Event::Error, ev.error_ = err;
+	else
+		ev.type_ = Event::Done;
+	
+	return true;
+}
+
 bool IoService::read_channel (int fd, Event& ev, int flg)
 {
 	ssize_t len;
@@ -202,6 +291,7 @@ bool IoService::write_channel (int fd, Event& ev)
 			switch (errno) 
 			{
 			case EAGAIN:
+			case EINPROGRESS:
 				return false;
 			default:
 				ev.type_ = Event::Error;
@@ -253,7 +343,7 @@ void IoService::track (EventAction* act)
 				IoNode node = {fd, true, false, act, 0};
 				set_fd (fd, 1, 0, &(fd_map_[fd] = node));
 			}
-			else if (act->mode_ == StreamModeRead)
+			else if (act->mode_ == StreamModeRead || ! it->second.reading)
 			{
 				it->second.reading = true,	it->second.read_action = act;
 				set_fd (fd, 1, (it->second.writing ? 2 : 0), &it->second);
@@ -303,9 +393,9 @@ void IoService::cancel (EventAction* act)
 			if (it != fd_map_.end () && it->second.read_action == act) 
 			{
 				it->second.reading = false, it->second.read_action = 0;
+				set_fd (act->fd_, -1, (it->second.writing ? 2 : 0), &it->second);
 				if (it->second.write_action == 0)
 					fd_map_.erase (it);
-				set_fd (act->fd_, -1, (it->second.writing ? 2 : 0), &it->second);
 			}
 			break;
 			
@@ -316,9 +406,9 @@ void IoService::cancel (EventAction* act)
 			if (it != fd_map_.end () && it->second.write_action == act) 
 			{
 				it->second.writing = false, it->second.write_action = 0;
+				set_fd (act->fd_, (it->second.reading ? 2 : 0), -1, &it->second);
 				if (it->second.read_action == 0)
 					fd_map_.erase (it);
-				set_fd (act->fd_, (it->second.reading ? 2 : 0), -1, &it->second);
 			}
 			break;
 			
@@ -353,11 +443,11 @@ void IoService::wakeup_readers ()
 void IoService::schedule (EventAction* act)
 {
 	EventMessage msg = {1, act};
-	event_system.take_message (msg);
+	system_.take_message (msg);
 }
 
 void IoService::terminate (EventAction* act)
 {
 	EventMessage msg = {-1, act};
-	event_system.take_message (msg);
+	system_.take_message (msg);
 }
@@ -17,6 +17,7 @@
 #include <deque>
 #include <common/buffer.h>
 #include <common/ring_buffer.h>
+#include <common/thread/mutex.h>
 #include <common/thread/thread.h>
 #include <event/action.h>
 #include <event/event_callback.h>
@@ -26,6 +27,8 @@
 #define IO_POLL_EVENT_COUNT	512
 #define IO_POLL_TIMEOUT			150		
 
+class EventSystem;
+
 struct IoNode
 {
 	int fd;
@@ -45,24 +48,37 @@ class IoService : public Thread
 {
 private:
 	LogHandle log_;
+	EventSystem& system_;
 	RingBuffer<EventMessage> gateway_;
+	Mutex requests_mutex_;
+	std::deque<EventMessage> requests_;
+	pthread_t owner_;
 	uint8_t read_pool_[IO_READ_BUFFER_SIZE];
 	std::map<int, IoNode> fd_map_;
 	std::deque<WaitNode> wait_list_;
+	IoNode wake_node_;
 	int timeout_;
 	int handle_;
 	int rfd_, wfd_;
+	bool direct_;
 	
 public:
-	IoService ();
+	IoService (EventSystem& sys);
 	virtual ~IoService ();
 
 	virtual void main ();
 	virtual void stop ();
 	
+	void attach ();
+	void cycle ();
+	void detach ();
+	
 private:
+	void dispatch (const EventMessage& msg);
+	bool take_requests (std::deque<EventMessage>& queue);
 	void handle_request (EventAction* act);
 	bool connect_channel (int fd, Event& ev);
+	bool connect_result (int fd, Event& ev);
 	bool read_channel (int fd, Event& ev, int flg);
 	bool write_channel (int fd, Event& ev);
 	bool close_channel (int fd, Event& ev);
@@ -79,8 +95,10 @@ private:
 
 public:
 	bool idle () const									{ return fd_map_.empty (); }
+	bool direct () const									{ return direct_; }
+	void set_direct (bool on)							{ direct_ = on; }
 	void wakeup ()											{ ::write (wfd_, "*", 1); }
-	void take_message (const EventMessage& msg)	{ gateway_.write (msg); wakeup (); }
+	void take_message (const EventMessage& msg);
 	long current_time ()									{ struct timeval tv; gettimeofday (&tv, 0); 
 																  return ((tv.tv_sec & 0xFF) * 1000 + tv.tv_usec / 1000); }
 };
@@ -2,6 +2,7 @@ VPATH+=	${TOPDIR}/event
 
 SRCS+=	event_system.cc
 SRCS+=	io_service.cc
+SRCS+=	worker_pool.cc
 
 ifndef USE_POLL
 ifeq "${OSNAME}" "Darwin"
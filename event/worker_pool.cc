@@ -0,0 +1,138 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+// File:           worker_pool.cc                                             //
+// Description:    threads for offloading data processing from event loops    //
+// Project:        WANProxy XTech                                             //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+#include <event/worker_pool.h>
+
+static __thread Worker* current_worker = 0;
+
+Worker::Worker () : Thread ("Worker")
+{
+	pthread_mutex_init (&mutex_, 0);
+	pthread_cond_init (&ready_, 0);
+}
+
+Worker::~Worker ()
+{
+	std::deque<Callback*>::iterator it;
+	for (it = queue_.begin (); it != queue_.end (); ++it)
+		delete *it;
+	pthread_mutex_destroy (&mutex_);
+	pthread_cond_destroy (&ready_);
+}
+
+void Worker::post (Callback* cb)
+{
+	pthread_mutex_lock (&mutex_);
+	queue_.push_back (cb);
+	if (queue_.size () == 1)
+		pthread_cond_signal (&ready_);
+	pthread_mutex_unlock (&mutex_);
+}
+
+/*
+ * The worker running the calling thread, or null on any other thread.
+ */
+Worker* Worker::current ()
+{
+	return current_worker;
+}
+
+/*
+ * Jobs already queued when the worker is stopped are still run, as they
+ * carry data and references that their chains are waiting for.
+ */
+void Worker::main ()
+{
+	Callback* cb;
+
+	current_worker = this;
+	while (1)
+	{
+		pthread_mutex_lock (&mutex_);
+		while (queue_.empty () && ! stop_)
+			pthread_cond_wait (&ready_, &mutex_);
+		if (queue_.empty ())
+		{
+			pthread_mutex_unlock (&mutex_);
+			break;
+		}
+		cb = queue_.front ();
+		queue_.pop_front ();
+		pthread_mutex_unlock (&mutex_);
+
+		cb->execute ();
+		delete cb;
+	}
+}
+
+void Worker::stop ()
+{
+	pthread_mutex_lock (&mutex_);
+	stop_ = true;
+	pthread_cond_signal (&ready_);
+	pthread_mutex_unlock (&mutex_);
+
+	void* val;
+	if (pthread_join (thread_id_, &val) != 0)
+		ERROR("/event/worker") << "Worker join failed.";
+}
+
+WorkerPool::~WorkerPool ()
+{
+	stop ();
+	for (unsigned n = 0; n < workers_.size (); ++n)
+		delete workers_[n];
+}
+
+bool WorkerPool::launch (int count)
+{
+	ScopedLock guard (lock_);
+
+	if (! running_ && ! workers_.empty ())
+		return false;
+
+	while ((int) workers_.size () < count)
+	{
+		Worker* w = new Worker ();
+		if (! w->start ())
+		{
+			ERROR(log_) << "Unable to start worker thread.";
+			delete w;
+			break;
+		}
+		workers_.push_back (w);
+		running_ = true;
+	}
+
+	return (! workers_.empty ());
+}
+
+Worker* WorkerPool::assign ()
+{
+	ScopedLock guard (lock_);
+
+	if (! running_ || workers_.empty ())
+		return 0;
+	return workers_[next_++ % workers_.size ()];
+}
+
+void WorkerPool::stop ()
+{
+	ScopedLock guard (lock_);
+
+	if (! running_)
+		return;
+
+	running_ = false;
+	for (unsigned n = 0; n < workers_.size (); ++n)
+		workers_[n]->stop ();
+
+	INFO(log_) << "Worker threads have been stopped.";
+}
+
+WorkerPool worker_pool;
@@ -0,0 +1,63 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+// File:           worker_pool.h                                              //
+// Description:    threads for offloading data processing from event loops    //
+// Project:        WANProxy XTech                                             //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef	EVENT_WORKER_POOL_H
+#define	EVENT_WORKER_POOL_H
+
+#include <pthread.h>
+#include <deque>
+#include <vector>
+#include <common/thread/mutex.h>
+#include <common/thread/thread.h>
+#include <event/callback.h>
+
+class Worker : public Thread
+{
+private:
+	std::deque<Callback*> queue_;
+	pthread_mutex_t mutex_;
+	pthread_cond_t ready_;
+
+public:
+	Worker ();
+	virtual ~Worker ();
+
+	void post (Callback* cb);
+	static Worker* current ();
+
+	virtual void main ();
+	virtual void stop ();
+};
+
+/*
+ * Jobs posted to the same worker run in order, so a connection that keeps
+ * using the worker it was assigned never sees its data reordered.
+ */
+class WorkerPool
+{
+private:
+	LogHandle log_;
+	Mutex lock_;
+	std::vector<Worker*> workers_;
+	unsigned next_;
+	bool running_;
+
+public:
+	WorkerPool () : log_ ("/event/worker/pool"), next_ (0), running_ (false)	{ }
+	~WorkerPool ();
+
+	bool launch (int count);
+	Worker* assign ();
+	void stop ();
+
+	bool running () const		{ return running_; }
+};
+
+extern WorkerPool worker_pool;
+
+#endif /* !EVENT_WORKER_POOL_H */
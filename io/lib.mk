@@ -2,4 +2,5 @@ VPATH+=	${TOPDIR}/io
 
 SRCS+=	stream_handle.cc
 SRCS+=	sink_filter.cc
+SRCS+=	splice.cc
 
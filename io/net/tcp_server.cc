@@ -35,7 +35,7 @@
 //                                                                            //
 ////////////////////////////////////////////////////////////////////////////////
 
-bool TCPServer::listen (SocketAddressFamily family, const std::string& name)
+bool TCPServer::listen (SocketAddressFamily family, const std::string& name, bool shared, bool fast)
 {
 	if (socket_)
 	{
@@ -49,11 +49,13 @@ bool TCPServer::listen (SocketAddressFamily family, const std::string& name)
 		ERROR("/tcp/server") << "Unable to create socket.";
 		return false;
 	}
-	if (! socket_->bind (name)) 
+	if (! socket_->bind (name, shared)) 
 	{
 		ERROR("/tcp/server") << "Socket bind failed";
 		return false;
 	}
+	if (fast && ! socket_->fast_open (true))
+		INFO("/tcp/server") << "TCP Fast Open is not available.";
 	if (! socket_->listen ()) 
 	{
 		ERROR("/tcp/server") << "Socket listen failed";
@@ -52,7 +52,7 @@ public:
 		delete socket_;
 	}
 
-	bool listen (SocketAddressFamily family, const std::string& name);
+	bool listen (SocketAddressFamily family, const std::string& name, bool shared = false, bool fast = false);
 	
 	Action* accept (SocketEventCallback* cb)
 	{
@@ -9,17 +9,21 @@
 ////////////////////////////////////////////////////////////////////////////////
 
 #include <unistd.h>
+#include <string.h>
 #include <sys/errno.h>
 #include "sink_filter.h"
 
 SinkFilter::SinkFilter (const LogHandle& log, Socket* sck, bool cln) : BufferedFilter (log)   
 { 
 	sink_ = sck; write_action_ = 0; client_ = cln, down_ = closing_ = false; 
+	in_flight_ = 0; pause_ = resume_ = 0; throttled_ = held_ = false;
 }
 
 SinkFilter::~SinkFilter ()   
 { 
 	if (write_action_) write_action_->cancel (); 
+	delete pause_;
+	delete resume_;
 }
 
 bool SinkFilter::consume (Buffer& buf, int flg)
@@ -27,45 +31,139 @@ bool SinkFilter::consume (Buffer& buf, int flg)
 	if (! sink_ || closing_)
 		return false;
 		
-	if (write_action_)
+	if (write_action_ || held_)
+	{
 		pending_.append (buf);
-	else
-		write_action_ = sink_->write (buf, callback (this, &SinkFilter::write_complete));
+		regulate ();
+		return true;
+	}
+	
+	/*
+	 * Try the socket directly first, most of the times it has room for the
+	 * whole buffer.  Only what is left after a short write or EAGAIN is
+	 * handed to the IO thread, and later data accumulates in pending_ to be
+	 * sent in a single writev when that write completes.
+	 */
+	if (sink_->write_now (buf) < 0 && errno != EAGAIN && errno != EINTR && errno != EINPROGRESS)
+	{
+		fail (errno);
+		return false;
+	}
+	if (buf.empty ())
+		return true;
 	
+	in_flight_ = buf.length ();
+	write_action_ = sink_->write (buf, callback (this, &SinkFilter::write_complete));
+	regulate ();
 	return (write_action_ != 0);
 }
 
+/*
+ * A held sink keeps what it is given, and any flush, until released: the
+ * chain can start working before its socket is connected.
+ */
+void SinkFilter::release ()
+{
+	Buffer tmp;
+	
+	held_ = false;
+	if (! pending_.empty ())
+	{
+		tmp.append (pending_);
+		pending_.clear ();
+		consume (tmp);
+	}
+	if (flushing_ && ! write_action_)
+		flush (0);
+}
+
 void SinkFilter::write_complete (Event e)
 {
 	if (write_action_)
 		write_action_->cancel (), write_action_ = 0;
+	in_flight_ = 0;
 		
 	switch (e.type_) 
 	{
 	case Event::Done:
 		if (! pending_.empty ())
 		{
+			in_flight_ = pending_.length ();
 			write_action_ = sink_->write (pending_, callback (this, &SinkFilter::write_complete));
 			pending_.clear ();
 		}
-		else if (flushing_)
+		regulate ();
+		if (flushing_ && ! write_action_)
 			flush (0);
 		break;
 	case Event::Error:
-		if (e.error_ == EPIPE && client_)
-			DEBUG(log_) << "Client closed connection";
-		else
-			ERROR(log_) << "Write failed: " << e;
-		closing_ = true;
+		fail (e.error_);
 		break;
 	}
 }
 
+/*
+ * Lets the owner of the chain stop reading from the source of the data
+ * while the backlog of this sink is over the high watermark, so a slow
+ * destination does not make buffers pile up without limit.
+ */
+void SinkFilter::set_throttle (Callback* pause, Callback* resume)
+{
+	delete pause_;
+	delete resume_;
+	pause_ = pause, resume_ = resume;
+}
+
+/*
+ * The watermarks come down as the process memory budget fills up: when it
+ * is exhausted every source waits until its sink has written everything.
+ */
+void SinkFilter::regulate ()
+{
+	size_t high = SINK_HIGH_WATERMARK, low = SINK_LOW_WATERMARK;
+	
+	switch (memory_budget.pressure ())
+	{
+	case MemoryPressureTight:
+		high = SINK_LOW_WATERMARK, low = SINK_LOW_WATERMARK / 4;
+		break;
+	case MemoryPressureExhausted:
+		high = low = 0;
+		break;
+	default:
+		break;
+	}
+	
+	if (! throttled_ && ! closing_ && backlog () > high)
+	{
+		throttled_ = true;
+		if (pause_)
+			pause_->execute ();
+	}
+	else if (throttled_ && (closing_ || backlog () <= low))
+	{
+		throttled_ = false;
+		if (resume_)
+			resume_->execute ();
+	}
+}
+
+void SinkFilter::fail (int err)
+{
+	if (err == EPIPE && client_)
+		DEBUG(log_) << "Client closed connection";
+	else
+		ERROR(log_) << "Write failed: " << strerror (err);
+	closing_ = true;
+	pending_.clear ();
+	regulate ();
+}
+
 void SinkFilter::flush (int flg)
 {
 	flushing_ = true;
 	flush_flags_ |= flg;
-	if (flushing_ && ! write_action_)
+	if (flushing_ && ! write_action_ && ! held_)
 	{
 		if (! down_)
 			down_ = (sink_->shutdown (false, true) == 0);
@@ -9,16 +9,25 @@
 ////////////////////////////////////////////////////////////////////////////////
 
 #include <common/filter.h>
+#include <event/callback.h>
 #include <event/action.h>
 #include <event/event.h>
 #include <io/socket/socket.h>
 
+#define SINK_HIGH_WATERMARK	0x400000		// backlog that pauses the source of the data
+#define SINK_LOW_WATERMARK		0x100000		// backlog that lets it resume
+
 class SinkFilter : public BufferedFilter
 {
 private:
    Socket* sink_;
 	Action* write_action_;
 	bool client_, down_, closing_;
+	size_t in_flight_;
+	Callback* pause_;
+	Callback* resume_;
+	bool throttled_;
+	bool held_;
    
 public:
 	SinkFilter (const LogHandle& log, Socket* sck, bool cln = 0);
@@ -27,5 +36,15 @@ public:
    virtual bool consume (Buffer& buf, int flg = 0);
 	void write_complete (Event e);
    virtual void flush (int flg);
+	
+	void set_throttle (Callback* pause, Callback* resume);
+	void hold ()					{ held_ = true; }
+	void release ();
+	void retarget (Socket* sck)	{ sink_ = sck; }
+	size_t backlog () const		{ return (in_flight_ + pending_.length ()); }
+	
+private:
+	void fail (int err);
+	void regulate ();
 };
 
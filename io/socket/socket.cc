@@ -26,17 +26,24 @@
 #include <sys/errno.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/un.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <netdb.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <common/endian.h>
 #include <event/event_system.h>
 #include <io/socket/socket.h>
 
+#define SOCKET_BATCH_SIZE			64				// datagrams in a single system call
+#define SOCKET_DATAGRAM_SIZE		2048			// largest datagram received
+#define SOCKET_DATAGRAM_IOV		8				// buffer segments in a datagram sent
+
 ////////////////////////////////////////////////////////////////////////////////
 //                                                                            //
 // File:           socket.cc                                                  //
@@ -249,9 +256,24 @@ struct socket_address {
 			break;
 		}
 		case AF_UNIX:
+			if (str.size() >= sizeof addr_.unix_.sun_path) {
+				ERROR("/socket/address") << "Path too long for a Unix domain socket: " << str;
+				return (false);
+			}
 			addr_.unix_.sun_family = domain;
-			snprintf(addr_.unix_.sun_path, sizeof addr_.unix_.sun_path, "%s", str.c_str());
-			addrlen_ = sizeof addr_.unix_;
+			memcpy(addr_.unix_.sun_path, str.data(), str.size());
+			addrlen_ = offsetof(struct sockaddr_un, sun_path) + str.size() + 1;
+#if defined(__linux__)
+			/*
+			 * A name starting with '@' belongs to the abstract
+			 * namespace: it is not bound to a file, and its length
+			 * is that of the address.
+			 */
+			if (str[0] == '@') {
+				addr_.unix_.sun_path[0] = '\0';
+				addrlen_--;
+			}
+#endif
 #if !defined(__linux__) && !defined(__sun__) && !defined(__OPENNT)
 			addr_.unix_.sun_len = addrlen_;
 #endif
@@ -289,7 +311,10 @@ struct socket_address {
 			break;
 		}
 		case AF_UNIX:
-			str << addr_.unix_.sun_path;
+			if (addrlen_ > offsetof(struct sockaddr_un, sun_path) + 1 && addr_.unix_.sun_path[0] == '\0')
+				str << '@' << std::string(addr_.unix_.sun_path + 1, addrlen_ - offsetof(struct sockaddr_un, sun_path) - 1);
+			else
+				str << addr_.unix_.sun_path;
 			break;
 		default:
 			return  ("<address-family-not-supported>");
@@ -317,7 +342,7 @@ Action* Socket::accept (SocketEventCallback* cb)
 	ASSERT(log_, accept_check_ == 0);
 
 	accept_request_ = new SocketEventAction (this, &Socket::accept_cancel, cb);
-	accept_check_ = event_system.track (fd_, StreamModeAccept, callback (this, &Socket::accept_complete));
+	accept_check_ = EventSystem::current ().track (fd_, StreamModeAccept, callback (this, &Socket::accept_complete));
 	
 	return accept_request_;
 }
@@ -364,7 +389,7 @@ void Socket::accept_complete (Event e)
 		cb->param (Event::Done, sck);
 		cb->execute ();
 		
-		accept_check_ = event_system.track (fd_, StreamModeAccept, callback (this, &Socket::accept_complete));
+		accept_check_ = EventSystem::current ().track (fd_, StreamModeAccept, callback (this, &Socket::accept_complete));
 	}
 }
 
@@ -390,10 +415,10 @@ Action* Socket::connect (const std::string& name, EventCallback* cb)
 	if (cb)
 		cb->param ().buffer_ = Buffer ((uint8_t*) &addr.addr_.sockaddr_, addr.addrlen_);
 	
-	return event_system.track (fd_, StreamModeConnect, cb);
+	return EventSystem::current ().track (fd_, StreamModeConnect, cb);
 }
 
-bool Socket::bind (const std::string& name)
+bool Socket::bind (const std::string& name, bool shared)
 {
 	socket_address addr;
 
@@ -408,6 +433,24 @@ bool Socket::bind (const std::string& name)
 	if (rv == -1)
 		ERROR(log_) << "Could not setsockopt(SO_REUSEADDR): " << strerror(errno);
 
+	if (shared)
+	{
+#ifdef SO_REUSEPORT
+		rv = setsockopt (fd_, SOL_SOCKET, SO_REUSEPORT, &on, sizeof on);
+		if (rv == -1)
+		{
+			ERROR(log_) << "Could not setsockopt(SO_REUSEPORT): " << strerror(errno);
+			return (false);
+		}
+#else
+		ERROR(log_) << "Shared listening sockets are not supported on this platform.";
+		return (false);
+#endif
+	}
+
+	if (domain_ == AF_UNIX && addr.addr_.unix_.sun_path[0] != '\0')
+		unlink_stale (addr.addr_.unix_.sun_path);
+
 	rv = ::bind (fd_, &addr.addr_.sockaddr_, addr.addrlen_);
 	if (rv == -1) 
 	{
@@ -418,12 +461,64 @@ bool Socket::bind (const std::string& name)
 	return (true);
 }
 
+/*
+ * A Unix domain socket file nobody listens on any more is left from an
+ * earlier run, and would make the bind fail.
+ */
+void Socket::unlink_stale (const char* path)
+{
+	struct sockaddr_un sun;
+	struct stat st;
+	int s;
+
+	if (::stat (path, &st) == -1 || ! S_ISSOCK (st.st_mode) || (s = ::socket (AF_UNIX, SOCK_STREAM, 0)) == -1)
+		return;
+
+	memset (&sun, 0, sizeof sun);
+	sun.sun_family = AF_UNIX;
+	snprintf (sun.sun_path, sizeof sun.sun_path, "%s", path);
+	if (::connect (s, (struct sockaddr*) &sun, sizeof sun) == -1 && errno == ECONNREFUSED)
+	{
+		INFO(log_) << "Removing stale socket " << path;
+		::unlink (path);
+	}
+	::close (s);
+}
+
 bool Socket::listen (void)
 {
 	int rv = ::listen (fd_, 128);
 	return (rv != -1);
 }
 
+/*
+ * TCP Fast Open: a listening socket accepts data in the SYN of clients
+ * holding a cookie for it, and on a connecting socket connect () returns
+ * at once so that the first write goes out with the SYN.  Both ends also
+ * need it enabled by the system (net.ipv4.tcp_fastopen on Linux).
+ */
+bool Socket::fast_open (bool server)
+{
+	int rv = -1;
+	
+	if (server)
+	{
+#ifdef TCP_FASTOPEN
+		int qlen = 128;
+		rv = setsockopt (fd_, IPPROTO_TCP, TCP_FASTOPEN, &qlen, sizeof qlen);
+#endif
+	}
+	else
+	{
+#ifdef TCP_FASTOPEN_CONNECT
+		int on = 1;
+		rv = setsockopt (fd_, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &on, sizeof on);
+#endif
+	}
+	
+	return (rv != -1);
+}
+
 bool Socket::shutdown (bool shut_read, bool shut_write)
 {
 	int how;
@@ -441,6 +536,176 @@ bool Socket::shutdown (bool shut_read, bool shut_write)
 	return (rv != -1);
 }
 
+/*
+ * Checks an idle connection without taking anything from it: data waiting
+ * to be read stays there for whoever reads the socket next.
+ */
+bool Socket::alive () const
+{
+	char c;
+	int rv = ::recv (fd_, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+	
+	return (rv > 0 || (rv == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)));
+}
+
+/*
+ * Waits until there is something to read, without reading it.
+ */
+Action* Socket::poll (EventCallback* cb)
+{
+	return EventSystem::current ().track (fd_, StreamModeAccept, cb);
+}
+
+/*
+ * Waits until the socket can take more data, writing nothing: a write of
+ * an empty buffer completes as soon as the descriptor becomes writable.
+ */
+Action* Socket::poll_write (EventCallback* cb)
+{
+	cb->param ().buffer_.clear ();
+	return EventSystem::current ().track (fd_, StreamModeWrite, cb);
+}
+
+/*
+ * Reads the datagrams queued on the socket, up to the given count, with as
+ * few system calls as the platform allows.  Returns how many were read, or
+ * -1 with errno set (EAGAIN included) when there was none.
+ */
+ssize_t Socket::receive_batch (std::vector<Datagram>& out, size_t max)
+{
+	static __thread uint8_t pool[SOCKET_BATCH_SIZE][SOCKET_DATAGRAM_SIZE];
+	socket_address from[SOCKET_BATCH_SIZE];
+	ssize_t total = 0;
+	int want, n, i;
+
+	while ((size_t) total < max)
+	{
+		want = (max - total < SOCKET_BATCH_SIZE ? max - total : SOCKET_BATCH_SIZE);
+#if defined(__linux__)
+		struct mmsghdr msg[SOCKET_BATCH_SIZE];
+		struct iovec iov[SOCKET_BATCH_SIZE];
+
+		memset (msg, 0, want * sizeof msg[0]);
+		for (i = 0; i < want; ++i)
+		{
+			iov[i].iov_base = pool[i];
+			iov[i].iov_len = SOCKET_DATAGRAM_SIZE;
+			msg[i].msg_hdr.msg_name = &from[i].addr_;
+			msg[i].msg_hdr.msg_namelen = sizeof from[i].addr_;
+			msg[i].msg_hdr.msg_iov = &iov[i];
+			msg[i].msg_hdr.msg_iovlen = 1;
+		}
+		if ((n = ::recvmmsg (fd_, msg, want, MSG_DONTWAIT, 0)) <= 0)
+			break;
+		for (i = 0; i < n; ++i)
+		{
+			if (msg[i].msg_hdr.msg_flags & MSG_TRUNC)
+				continue;
+			out.push_back (Datagram ());
+			out.back ().address_.assign ((const char*) &from[i].addr_, msg[i].msg_hdr.msg_namelen);
+			out.back ().data_.append (pool[i], msg[i].msg_len);
+		}
+#else
+		ssize_t len;
+
+		for (n = 0; n < want; ++n)
+		{
+			from[n].addrlen_ = sizeof from[n].addr_;
+			if ((len = ::recvfrom (fd_, pool[n], SOCKET_DATAGRAM_SIZE, MSG_DONTWAIT, &from[n].addr_.sockaddr_, &from[n].addrlen_)) < 0)
+				break;
+			out.push_back (Datagram ());
+			out.back ().address_.assign ((const char*) &from[n].addr_, from[n].addrlen_);
+			out.back ().data_.append (pool[n], len);
+		}
+		if (n == 0)
+			break;
+#endif
+		total += n;
+		if (n < want)
+			break;
+	}
+
+	return (total > 0 ? total : -1);
+}
+
+/*
+ * Points the iovec at the segments of a datagram.  One spread over more
+ * segments than it has room for is copied in one piece into flat, as a
+ * datagram cannot be sent in parts.
+ */
+static size_t datagram_iovec (const Buffer& data, struct iovec* iov, std::string& flat)
+{
+	if (data.segment_count () <= SOCKET_DATAGRAM_IOV)
+		return (data.fill_iovec (iov, SOCKET_DATAGRAM_IOV));
+
+	flat.resize (data.length ());
+	data.copyout ((uint8_t*) &flat[0], flat.size ());
+	iov[0].iov_base = &flat[0];
+	iov[0].iov_len = flat.size ();
+	return (1);
+}
+
+/*
+ * Sends the datagrams given, to their own address or to the connected
+ * peer.  Returns how many went out, or -1 with errno set when none did.
+ */
+ssize_t Socket::send_batch (const std::vector<Datagram>& dgs)
+{
+	ssize_t total = 0;
+	int want, n, i;
+
+	while ((size_t) total < dgs.size ())
+	{
+		want = (dgs.size () - total < SOCKET_BATCH_SIZE ? dgs.size () - total : SOCKET_BATCH_SIZE);
+#if defined(__linux__)
+		struct mmsghdr msg[SOCKET_BATCH_SIZE];
+		struct iovec iov[SOCKET_BATCH_SIZE][SOCKET_DATAGRAM_IOV];
+		std::string flat[SOCKET_BATCH_SIZE];
+
+		memset (msg, 0, want * sizeof msg[0]);
+		for (i = 0; i < want; ++i)
+		{
+			const Datagram& d = dgs[total + i];
+			if (! d.address_.empty ())
+			{
+				msg[i].msg_hdr.msg_name = const_cast<char*> (d.address_.data ());
+				msg[i].msg_hdr.msg_namelen = d.address_.size ();
+			}
+			msg[i].msg_hdr.msg_iov = iov[i];
+			msg[i].msg_hdr.msg_iovlen = datagram_iovec (d.data_, iov[i], flat[i]);
+		}
+		if ((n = ::sendmmsg (fd_, msg, want, MSG_DONTWAIT)) <= 0)
+			break;
+#else
+		struct iovec iov[SOCKET_DATAGRAM_IOV];
+		struct msghdr msg;
+		std::string flat;
+
+		for (n = 0; n < want; ++n)
+		{
+			const Datagram& d = dgs[total + n];
+			memset (&msg, 0, sizeof msg);
+			if (! d.address_.empty ())
+			{
+				msg.msg_name = (void*) d.address_.data ();
+				msg.msg_namelen = d.address_.size ();
+			}
+			msg.msg_iov = iov;
+			msg.msg_iovlen = datagram_iovec (d.data_, iov, flat);
+			if (::sendmsg (fd_, &msg, MSG_DONTWAIT) < 0)
+				break;
+		}
+		if (n == 0)
+			break;
+#endif
+		total += n;
+		if (n < want)
+			break;
+	}
+
+	return (total > 0 ? total : -1);
+}
+
 std::string Socket::getpeername (void) const
 {
 	socket_address sa;
@@ -559,6 +824,10 @@ Socket* Socket::create(SocketAddressFamily family, SocketType type, const std::s
 		return (NULL);
 	}
 
+	/* Unix domain sockets take no protocol, whatever an IP one would use.  */
+	if (domainnum == AF_UNIX)
+		protonum = 0;
+
 	int s = ::socket(domainnum, typenum, protonum);
 	if (s == -1) {
 #if defined(AF_INET6)
@@ -26,6 +26,8 @@
 #ifndef	IO_SOCKET_SOCKET_H
 #define	IO_SOCKET_SOCKET_H
 
+#include <vector>
+#include <common/buffer.h>
 #include <event/action.h>
 #include <event/event_callback.h>
 #include <event/typed_pair_callback.h>
@@ -45,6 +47,16 @@
 typedef class TypedPairCallback<Event, Socket*> SocketEventCallback;
 typedef class CallbackAction<Socket, SocketEventCallback> SocketEventAction;
 
+/*
+ * A datagram with the raw address of the other end, left empty when it
+ * goes out on a connected socket.
+ */
+struct Datagram
+{
+	std::string address_;
+	Buffer data_;
+};
+
 class Socket : public StreamHandle 
 {
 	LogHandle log_;
@@ -56,15 +68,22 @@ class Socket : public StreamHandle
 
 private:
 	Socket (int, int, int, int);
+	void unlink_stale (const char* path);
 	
 public:
 	Action* accept (SocketEventCallback*);
 	void accept_complete (Event);
 	void accept_cancel ();
 	Action* connect (const std::string&, EventCallback*);
-	bool bind (const std::string&);
+	bool bind (const std::string&, bool shared = false);
 	bool listen ();
+	bool fast_open (bool server);
 	bool shutdown (bool, bool);
+	bool alive () const;
+	Action* poll (EventCallback*);
+	Action* poll_write (EventCallback*);
+	ssize_t receive_batch (std::vector<Datagram>&, size_t);
+	ssize_t send_batch (const std::vector<Datagram>&);
 
 	std::string getpeername () const;
 	std::string getsockname () const;
@@ -0,0 +1,173 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+// File:           splice.cc                                                  //
+// Description:    relay between two sockets without copying to user space    //
+// Project:        WANProxy XTech                                             //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <event/event_system.h>
+#include <io/splice.h>
+
+Splice::Splice (const LogHandle& log, Socket* source, Socket* sink)
+ : log_(log),
+   source_(source),
+   sink_(sink),
+   queued_(0),
+   eos_(false),
+   poll_action_(0),
+   write_action_(0),
+   request_(0)
+{
+	pipe_[0] = pipe_[1] = -1;
+#if defined(__linux__)
+	if (::pipe2 (pipe_, O_NONBLOCK | O_CLOEXEC) == 0)
+		::fcntl (pipe_[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+	else
+		pipe_[0] = pipe_[1] = -1;
+#endif
+}
+
+Splice::~Splice ()
+{
+	if (request_)
+		request_->cancel ();
+	if (poll_action_)
+		poll_action_->cancel ();
+	if (write_action_)
+		write_action_->cancel ();
+	if (pipe_[0] >= 0)
+		::close (pipe_[0]);
+	if (pipe_[1] >= 0)
+		::close (pipe_[1]);
+}
+
+bool Splice::available ()
+{
+#if defined(__linux__)
+	return true;
+#else
+	return false;
+#endif
+}
+
+Action* Splice::start (EventCallback* cb)
+{
+	request_ = new SpliceAction (this, &Splice::cancel, cb);
+	poll_action_ = source_->poll (callback (this, &Splice::on_readable));
+	return request_;
+}
+
+/*
+ * Whatever the source has is moved into the pipe and on to the destination,
+ * a bounded number of times before waiting for more so that other streams
+ * of the event loop get their turn.
+ */
+void Splice::on_readable (Event e)
+{
+	ssize_t n;
+	int i;
+
+	if (poll_action_)
+		poll_action_->cancel (), poll_action_ = 0;
+
+	if (e.type_ == Event::Error)
+	{
+		complete (e);
+		return;
+	}
+
+	for (i = 0; i < SPLICE_ROUNDS; ++i)
+	{
+		n = source_->splice_to (pipe_[1], SPLICE_CHUNK);
+		if (n < 0 && errno != EAGAIN)
+		{
+			complete (Event (Event::Error, errno));
+			return;
+		}
+		if (n > 0)
+			queued_ += n;
+		else if (n == 0)
+			eos_ = true;
+		if (! move ())
+			return;
+		if (n <= 0)
+			break;
+	}
+
+	if (eos_)
+		complete (Event (Event::Done));
+	else
+		poll_action_ = source_->poll (callback (this, &Splice::on_readable));
+}
+
+void Splice::on_writable (Event e)
+{
+	if (write_action_)
+		write_action_->cancel (), write_action_ = 0;
+
+	if (e.type_ != Event::Done)
+		complete (e);
+	else if (! move ())
+		return;
+	else if (eos_)
+		complete (Event (Event::Done));
+	else
+		poll_action_ = source_->poll (callback (this, &Splice::on_readable));
+}
+
+void Splice::cancel ()
+{
+	if (poll_action_)
+		poll_action_->cancel (), poll_action_ = 0;
+	if (write_action_)
+		write_action_->cancel (), write_action_ = 0;
+	delete request_;
+	request_ = 0;
+}
+
+/*
+ * Empties the pipe into the destination.  When it stops taking data, the
+ * rest stays in the pipe until the destination is writable again, and the
+ * source is left alone until then.  Returns false when the splice has to
+ * wait for it, or has failed.
+ */
+bool Splice::move ()
+{
+	ssize_t n;
+
+	while (queued_ > 0)
+	{
+		if ((n = sink_->splice_from (pipe_[0], queued_)) > 0)
+			queued_ -= n;
+		else if (n < 0 && errno == EAGAIN)
+		{
+			write_action_ = sink_->poll_write (callback (this, &Splice::on_writable));
+			return false;
+		}
+		else
+		{
+			complete (Event (Event::Error, (n < 0 ? errno : EPIPE)));
+			return false;
+		}
+	}
+
+	return true;
+}
+
+void Splice::complete (Event e)
+{
+	EventCallback* cb;
+
+	if (poll_action_)
+		poll_action_->cancel (), poll_action_ = 0;
+
+	if (! request_ || ! (cb = request_->callback_))
+		return;
+
+	cb->param (e);
+	cb->execute ();
+}
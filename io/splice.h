@@ -0,0 +1,61 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+// File:           splice.h                                                   //
+// Description:    relay between two sockets without copying to user space    //
+// Project:        WANProxy XTech                                             //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef	IO_SPLICE_H
+#define	IO_SPLICE_H
+
+#include <event/action.h>
+#include <event/event.h>
+#include <event/event_callback.h>
+#include <io/socket/socket.h>
+
+#define SPLICE_PIPE_SIZE		0x100000		// capacity asked for the pipe between both sockets
+#define SPLICE_CHUNK				0x40000		// bytes moved by a single call
+#define SPLICE_ROUNDS			16				// calls made before waiting for input again
+
+/*
+ * Moves one direction of a stream from a socket to another through a pipe,
+ * the data never leaving the kernel.  When the destination cannot take it
+ * all, the data stays in the pipe and the splice waits for the destination
+ * to become writable again before moving on; the source is not read
+ * meanwhile.  The request completes with Done once
+ * the source has ended and everything has been written, or with Error.
+ */
+class Splice
+{
+	typedef CallbackAction<Splice, EventCallback> SpliceAction;
+
+	LogHandle log_;
+	Socket* source_;
+	Socket* sink_;
+	int pipe_[2];
+	size_t queued_;
+	bool eos_;
+	Action* poll_action_;
+	Action* write_action_;
+	SpliceAction* request_;
+
+public:
+	Splice (const LogHandle& log, Socket* source, Socket* sink);
+	~Splice ();
+
+	bool ready () const										{ return (pipe_[0] >= 0); }
+	Action* start (EventCallback* cb);
+
+	void on_readable (Event e);
+	void on_writable (Event e);
+	void cancel ();
+
+	static bool available ();
+
+private:
+	bool move ();
+	void complete (Event e);
+};
+
+#endif /* !IO_SPLICE_H */
@@ -23,7 +23,10 @@
  * SUCH DAMAGE.
  */
 
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <sys/uio.h>
 #include <event/event_system.h>
 #include <io/stream_handle.h>
 
@@ -52,7 +55,7 @@ StreamHandle::StreamHandle (int fd) : log_("/file/descriptor"), fd_(fd)
 
 Action* StreamHandle::read (EventCallback* cb)
 {
-	return event_system.track (fd_, StreamModeRead, cb);
+	return EventSystem::current ().track (fd_, StreamModeRead, cb);
 }
 
 Action* StreamHandle::write (Buffer& buf, EventCallback* cb)
@@ -60,10 +63,57 @@ Action* StreamHandle::write (Buffer& buf, EventCallback* cb)
 	if (cb)
 		cb->param ().buffer_ = buf;
 		
-	return event_system.track (fd_, StreamModeWrite, cb);
+	return EventSystem::current ().track (fd_, StreamModeWrite, cb);
+}
+
+/*
+ * Writes as much as the descriptor takes right away, without going through
+ * the IO thread, and removes it from the buffer.  Returns -1 with errno set
+ * (EAGAIN included) when nothing could be written.
+ */
+ssize_t StreamHandle::write_now (Buffer& buf)
+{
+	struct iovec iov[IOV_MAX];
+	size_t iovcnt;
+	ssize_t len;
+	
+	if (buf.empty ())
+		return 0;
+		
+	iovcnt = buf.fill_iovec (iov, IOV_MAX);
+	len = ::writev (fd_, iov, iovcnt);
+	if (len > 0)
+		buf.skip (len);
+		
+	return len;
+}
+
+/*
+ * Move up to len bytes from the descriptor into a pipe, or out of the pipe
+ * into the descriptor, without copying them to user space.  They return
+ * as splice does, -1 with ENOSYS where it is not available.
+ */
+ssize_t StreamHandle::splice_to (int pipe, size_t len)
+{
+#if defined(__linux__)
+	return ::splice (fd_, 0, pipe, 0, len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+ssize_t StreamHandle::splice_from (int pipe, size_t len)
+{
+#if defined(__linux__)
+	return ::splice (pipe, 0, fd_, 0, len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK | SPLICE_F_MORE);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
 }
 
 Action* StreamHandle::close (EventCallback* cb)
 {
-	return event_system.track (fd_, StreamModeEnd, cb);
+	return EventSystem::current ().track (fd_, StreamModeEnd, cb);
 }
@@ -48,6 +48,9 @@ public:
 
 	virtual Action* read (EventCallback* cb);
 	virtual Action* write (Buffer& buf, EventCallback* cb);
+	virtual ssize_t write_now (Buffer& buf);
+	ssize_t splice_to (int pipe, size_t len);
+	ssize_t splice_from (int pipe, size_t len);
 	virtual Action* close (EventCallback* cb = 0);
 };
 
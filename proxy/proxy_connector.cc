@@ -24,13 +24,19 @@
  */
 
 #include <event/event_system.h>
+#include <event/worker_pool.h>
 #include <io/socket/socket.h>
 #include <io/sink_filter.h>
+#include <io/splice.h>
 #include <ssh/ssh_filter.h>
 #include <xcodec/xcodec_filter.h>
 #include <zlib/zlib_filter.h>
 #include <common/count_filter.h>
 #include "proxy_connector.h"
+#include "proxy_datagram.h"
+#include "proxy_listener.h"
+#include "proxy_peers.h"
+#include "proxy_stripe.h"
 
 ////////////////////////////////////////////////////////////////////////////////
 //                                                                            //
@@ -48,14 +54,25 @@ ProxyConnector::ProxyConnector (const std::string& name,
           Socket* local_socket,
 			 SocketAddressFamily family,
 			 const std::string& remote_name,
-			 bool cln, bool ssh)
+			 const ProxySettings& settings,
+			 Socket* remote,
+			 const std::string& key)
  : log_("/wanproxy/" + name + "/connector"),
    local_codec_(local_codec),
    remote_codec_(remote_codec),
    local_socket_(local_socket),
-   remote_socket_(0),
-	is_cln_(cln),
-	is_ssh_(ssh),
+   remote_socket_(remote),
+	local_link_(0),
+	remote_link_(0),
+	is_cln_(settings.is_cln_),
+	is_ssh_(settings.is_ssh_),
+	early_(false),
+	request_sink_(0),
+	request_splice_(0),
+	response_splice_(0),
+	peers_(settings.peers_),
+	peer_key_(key),
+	remote_name_(remote_name),
    request_chain_(this),
    response_chain_(this),
    connect_action_(0),
@@ -63,17 +80,79 @@ ProxyConnector::ProxyConnector (const std::string& name,
 	request_action_(0),
 	response_action_(0),
 	close_action_(0),
-	flushing_(0)
+	flushing_(0),
+	paused_(0),
+	worker_(0),
+	response_worker_(0),
+	outstanding_(1),
+	offload_flushing_(0),
+	system_(EventSystem::current ()),
+	concluding_(false)
 {
-	if (local_socket_ && (remote_socket_ = Socket::create (family, SocketTypeStream, "tcp", remote_name)))
-	{
-		connect_action_ = remote_socket_->connect (remote_name, callback (this, &ProxyConnector::connect_complete));
-		stop_action_ = event_system.register_interest (EventInterestStop, callback (this, &ProxyConnector::conclude));
-	}
+	if (settings.workers_ > 0)
+		worker_ = response_worker_ = worker_pool.assign ();
+	if (settings.workers_ > 1 && ! is_ssh_)
+		response_worker_ = worker_pool.assign ();
+	if (! response_worker_)
+		response_worker_ = worker_;
+
+	if (local_socket_)
+		launch (name, family, remote_name, settings);
 	else
-	{
-		close_action_ = event_system.track (0, StreamModeWait, callback (this, &ProxyConnector::conclude));
-	}
+		close_action_ = EventSystem::current ().track (0, StreamModeWait, callback (this, &ProxyConnector::conclude));
+}
+
+/*
+ * Serves a stream that arrived from the peer other than on a single
+ * socket: gathered from its parallel connections, or carried by UDP.
+ */
+ProxyConnector::ProxyConnector (const std::string& name,
+          WANProxyCodec* local_codec,
+			 WANProxyCodec* remote_codec,
+          PeerLink* local_link,
+			 SocketAddressFamily family,
+			 const std::string& remote_name,
+			 int workers)
+ : log_("/wanproxy/" + name + "/connector"),
+   local_codec_(local_codec),
+   remote_codec_(remote_codec),
+   local_socket_(0),
+   remote_socket_(0),
+	local_link_(local_link),
+	remote_link_(0),
+	is_cln_(false),
+	is_ssh_(false),
+	early_(false),
+	request_sink_(0),
+	request_splice_(0),
+	response_splice_(0),
+	peers_(0),
+	remote_name_(remote_name),
+   request_chain_(this),
+   response_chain_(this),
+   connect_action_(0),
+   stop_action_(0),
+	request_action_(0),
+	response_action_(0),
+	close_action_(0),
+	flushing_(0),
+	paused_(0),
+	worker_(0),
+	response_worker_(0),
+	outstanding_(1),
+	offload_flushing_(0),
+	system_(EventSystem::current ()),
+	concluding_(false)
+{
+	if (workers > 0)
+		worker_ = response_worker_ = worker_pool.assign ();
+	if (workers > 1)
+		response_worker_ = worker_pool.assign ();
+	if (! response_worker_)
+		response_worker_ = worker_;
+
+	local_link_->start ();
+	launch (name, family, remote_name, ProxySettings ());
 }
 
 ProxyConnector::~ProxyConnector ()
@@ -88,12 +167,63 @@ ProxyConnector::~ProxyConnector ()
       response_action_->cancel ();
 	if (close_action_)
 		close_action_->cancel ();
+	delete request_splice_;
+	delete response_splice_;
 	if (local_socket_)
 		local_socket_->close ();
 	if (remote_socket_)
 		remote_socket_->close ();
    delete local_socket_;
    delete remote_socket_;
+	delete local_link_;
+	delete remote_link_;
+	while (! handoffs_.empty ())
+		delete handoffs_.front (), handoffs_.pop_front ();
+}
+
+void ProxyConnector::launch (const std::string& name, SocketAddressFamily family, const std::string& remote_name, const ProxySettings& settings)
+{
+	int stripes = (is_ssh_ ? 0 : settings.stripes_);
+	
+	stop_action_ = EventSystem::current ().register_interest (EventInterestStop, callback (this, &ProxyConnector::conclude));
+	
+	if (remote_socket_)
+	{
+		start ();
+		return;
+	}
+	
+	if (settings.remote_udp_ || stripes > 1)
+	{
+		if (settings.remote_udp_)
+			remote_link_ = new DatagramLink (name);
+		else
+			remote_link_ = new StripeSet (name, stripes);
+		connect_action_ = remote_link_->connect (family, remote_name, callback (this, &ProxyConnector::connect_complete));
+	}
+	else if ((remote_socket_ = Socket::create (family, SocketTypeStream, "tcp", remote_name)))
+	{
+		if (settings.fast_open_)
+			remote_socket_->fast_open (false);
+		connect_action_ = remote_socket_->connect (remote_name, callback (this, &ProxyConnector::connect_complete));
+	}
+	
+	/*
+	 * The request is read and encoded while the connect is in progress,
+	 * its output waiting in the held sink, so that it is ready to go
+	 * as soon as the peer answers.  SSH sessions wait, as their
+	 * handshake must not start before the other end is reachable.
+	 */
+	if (connect_action_ && ! is_ssh_ && ! relayed () && (early_ = build_chains (local_codec_, remote_codec_, local_socket_, remote_socket_)))
+	{
+		if (request_sink_)
+			request_sink_->hold ();
+		request_action_ = read_request ();
+	}
+	else if (! connect_action_)
+	{
+		close_action_ = EventSystem::current ().track (0, StreamModeWait, callback (this, &ProxyConnector::conclude));
+	}
 }
 
 void ProxyConnector::connect_complete (Event e)
@@ -104,9 +234,13 @@ void ProxyConnector::connect_complete (Event e)
 	switch (e.type_) 
 	{
 	case Event::Done:
+		if (peers_)
+			peers_->report (remote_name_, true);
 		break;
 	case Event::Error:
 		INFO(log_) << "Connect failed: " << e;
+		if (fail_over ())
+			return;
 		conclude (e);
 		return;
 	default:
@@ -115,26 +249,119 @@ void ProxyConnector::connect_complete (Event e)
 		return;
 	}
 
+	if (early_)
+	{
+		if (request_sink_)
+			request_sink_->release ();
+		response_action_ = read_response ();
+	}
+	else
+	{
+		start ();
+	}
+}
+
+/*
+ * When the peer could not be reached, the next one in the ring for the
+ * same key is tried, until all of them have failed.  A request read in
+ * the meantime is still waiting in the held sink and goes to the new
+ * socket.  Striped streams are not moved, as part of their set may have
+ * connected already.
+ */
+bool ProxyConnector::fail_over ()
+{
+	PeerAddress peer;
+	Socket* sck;
+	
+	if (! peers_ || remote_link_ || ! remote_socket_)
+		return false;
+	
+	peers_->report (remote_name_, false);
+	tried_.push_back (remote_name_);
+	if (! peers_->select (peer_key_, peer, tried_))
+		return false;
+	
+	if (! (sck = Socket::create (peer.family_, SocketTypeStream, "tcp", peer.address_)))
+		return false;
+	
+	remote_socket_->close ();
+	delete remote_socket_;
+	remote_socket_ = sck;
+	if (request_sink_)
+		request_sink_->retarget (remote_socket_);
+	
+	remote_name_ = peer.address_;
+	INFO(log_) << "Trying peer " << remote_name_;
+	connect_action_ = remote_socket_->connect (remote_name_, callback (this, &ProxyConnector::connect_complete));
+	return (connect_action_ != 0);
+}
+
+void ProxyConnector::start ()
+{
+	if (splice ())
+		return;
+	
    if (build_chains (local_codec_, remote_codec_, local_socket_, remote_socket_))
 	{
-		request_action_ = local_socket_->read (callback (this, &ProxyConnector::on_request_data));
-		response_action_ = remote_socket_->read (callback (this, &ProxyConnector::on_response_data));
+		request_action_ = read_request ();
+		response_action_ = read_response ();
+	}
+}
+
+/*
+ * With no codec on either side, nor SSH, nothing has to look at the data:
+ * both directions are moved by the kernel from one socket to the other.
+ */
+bool ProxyConnector::relayed () const
+{
+	WANProxyCodec* cdc[2] = { local_codec_, remote_codec_ };
+	
+	if (is_ssh_ || local_link_ || remote_link_ || ! Splice::available ())
+		return false;
+	for (int i = 0; i < 2; ++i)
+		if (cdc[i] && (cdc[i]->xcache_ || cdc[i]->compressor_ || cdc[i]->counting_))
+			return false;
+	return true;
+}
+
+bool ProxyConnector::splice ()
+{
+	if (! relayed () || ! local_socket_ || ! remote_socket_)
+		return false;
+	
+	request_splice_ = new Splice (log_, local_socket_, remote_socket_);
+	response_splice_ = new Splice (log_, remote_socket_, local_socket_);
+	if (! request_splice_->ready () || ! response_splice_->ready ())
+	{
+		delete request_splice_, request_splice_ = 0;
+		delete response_splice_, response_splice_ = 0;
+		return false;
 	}
+	
+	request_action_ = request_splice_->start (callback (this, &ProxyConnector::on_spliced, (int) REQUEST_CHAIN_READY));
+	response_action_ = response_splice_->start (callback (this, &ProxyConnector::on_spliced, (int) RESPONSE_CHAIN_READY));
+	return true;
 }
 
 bool ProxyConnector::build_chains (WANProxyCodec* cdc1, WANProxyCodec* cdc2, Socket* sck1, Socket* sck2)
 {
-   if (! sck1 || ! sck2)
+	SSH::EncryptFilter* local_enc = 0;
+	SSH::EncryptFilter* remote_enc = 0;
+	
+   if ((! sck1 && ! local_link_) || (! sck2 && ! remote_link_))
       return false;
       
-   response_chain_.prepend (new SinkFilter ("/wanproxy/response", sck1, is_cln_));
+   response_chain_.prepend (sink_for (RESPONSE_CHAIN_READY, sck1));
+	if (worker_)
+		response_chain_.prepend (new Relay (*this, RESPONSE_CHAIN_READY));
 	
 	if (is_ssh_)
 	{
-		SSH::EncryptFilter* enc; SSH::DecryptFilter* dec;
-		request_chain_.append ((dec = new SSH::DecryptFilter ((cdc1 ? SSH::SOURCE_ENCODED : 0))));
-		response_chain_.prepend ((enc = new SSH::EncryptFilter (SSH::ServerRole, (cdc1 ? SSH::SOURCE_ENCODED : 0))));
-		dec->set_encrypter (enc);
+		SSH::DecryptFilter* dec;
+		int flg = (cdc1 && (cdc1->xcache_ || cdc1->compressor_) ? SSH::SOURCE_ENCODED : 0);
+		request_chain_.append ((dec = new SSH::DecryptFilter (flg)));
+		response_chain_.prepend ((local_enc = new SSH::EncryptFilter (SSH::ServerRole, flg)));
+		dec->set_encrypter (local_enc);
 	}
    
 	if (cdc1) 
@@ -148,15 +375,15 @@ bool ProxyConnector::build_chains (WANProxyCodec* cdc1, WANProxyCodec* cdc2, Soc
 		if (cdc1->compressor_) 
       {
 			request_chain_.append (new InflateFilter ());
-			response_chain_.prepend (new DeflateFilter (cdc1->compressor_level_));
+			response_chain_.prepend (new DeflateFilter (cdc1->compressor_level_, cdc1->compressor_threads_));
 		}
 
 		if (cdc1->xcache_) 
       {
 			EncodeFilter* enc; DecodeFilter* dec;
 			request_chain_.append ((dec = new DecodeFilter ("/wanproxy/" + cdc1->name_ + "/dec", cdc1)));
-			response_chain_.prepend ((enc = new EncodeFilter ("/wanproxy/" + cdc1->name_ + "/enc", cdc1, 1)));
-         dec->set_upstream (enc);
+			response_chain_.prepend ((enc = new EncodeFilter ("/wanproxy/" + cdc1->name_ + "/enc", cdc1, (worker_ ? 0 : 1))));
+         dec->set_upstream (couple (enc, RESPONSE_CHAIN_READY));
 		}
 
 		if (cdc1->counting_) 
@@ -179,12 +406,12 @@ bool ProxyConnector::build_chains (WANProxyCodec* cdc1, WANProxyCodec* cdc2, Soc
 			EncodeFilter* enc; DecodeFilter* dec;
 			request_chain_.append ((enc = new EncodeFilter ("/wanproxy/" + cdc2->name_ + "/enc", cdc2)));
 			response_chain_.prepend ((dec = new DecodeFilter ("/wanproxy/" + cdc2->name_ + "/dec", cdc2)));
-         dec->set_upstream (enc);
+         dec->set_upstream (couple (enc, REQUEST_CHAIN_READY));
 		}
 
 		if (cdc2->compressor_) 
       {
-			request_chain_.append (new DeflateFilter (cdc2->compressor_level_));
+			request_chain_.append (new DeflateFilter (cdc2->compressor_level_, cdc2->compressor_threads_));
 			response_chain_.prepend (new InflateFilter ());
 		}
 
@@ -197,17 +424,65 @@ bool ProxyConnector::build_chains (WANProxyCodec* cdc1, WANProxyCodec* cdc2, Soc
    
 	if (is_ssh_)
 	{
-		SSH::EncryptFilter* enc; SSH::DecryptFilter* dec;
-		request_chain_.append ((enc = new SSH::EncryptFilter (SSH::ClientRole, (cdc2 ? SSH::SOURCE_ENCODED : 0))));
-		response_chain_.prepend ((dec = new SSH::DecryptFilter ((cdc2 ? SSH::SOURCE_ENCODED : 0))));
-		dec->set_encrypter (enc);
+		SSH::DecryptFilter* dec;
+		int flg = (cdc2 && (cdc2->xcache_ || cdc2->compressor_) ? SSH::SOURCE_ENCODED : 0);
+		request_chain_.append ((remote_enc = new SSH::EncryptFilter (SSH::ClientRole, flg)));
+		response_chain_.prepend ((dec = new SSH::DecryptFilter (flg)));
+		dec->set_encrypter (remote_enc);
 	}
    
-   request_chain_.append (new SinkFilter ("/wanproxy/request", sck2));
+	if (worker_)
+		request_chain_.append (new Relay (*this, REQUEST_CHAIN_READY));
+   request_chain_.append (sink_for (REQUEST_CHAIN_READY, sck2));
    
+	if (local_enc)
+		local_enc->identify ();
+	if (remote_enc)
+		remote_enc->identify ();
+	
    return true;
 }
 
+/*
+ * The last filter of each chain writes to the socket of its side, or
+ * hands the data to the link when the peer is reached through several
+ * connections or over UDP.
+ */
+Filter* ProxyConnector::sink_for (int chain, Socket* sck)
+{
+	PeerLink* link = (chain == REQUEST_CHAIN_READY ? remote_link_ : local_link_);
+	Callback* pause = callback (this, &ProxyConnector::pause, chain);
+	Callback* resume = callback (this, &ProxyConnector::resume, chain);
+	SinkFilter* sink;
+	
+	if (link)
+	{
+		link->set_throttle (pause, resume);
+		return link->sink ();
+	}
+	
+	if (chain == REQUEST_CHAIN_READY)
+		sink = request_sink_ = new SinkFilter ("/wanproxy/request", sck);
+	else
+		sink = new SinkFilter ("/wanproxy/response", sck, is_cln_);
+	sink->set_throttle (pause, resume);
+	return sink;
+}
+
+Action* ProxyConnector::read_request ()
+{
+	EventCallback* cb = callback (this, &ProxyConnector::on_request_data);
+	
+	return (local_link_ ? local_link_->read (cb) : local_socket_->read (cb));
+}
+
+Action* ProxyConnector::read_response ()
+{
+	EventCallback* cb = callback (this, &ProxyConnector::on_response_data);
+	
+	return (remote_link_ ? remote_link_->read (cb) : remote_socket_->read (cb));
+}
+
 void ProxyConnector::on_request_data (Event e)
 {
 	if (request_action_)
@@ -218,13 +493,14 @@ void ProxyConnector::on_request_data (Event e)
 	switch (e.type_) 
 	{
 	case Event::Done:
-		request_action_ = local_socket_->read (callback (this, &ProxyConnector::on_request_data));
-		if (request_chain_.consume (e.buffer_))
+		if (! (paused_ & REQUEST_CHAIN_READY))
+			request_action_ = read_request ();
+		if (forward (REQUEST_CHAIN_READY, e.buffer_))
 			break;
 	case Event::EOS:
 		DEBUG(log_) << "Flushing request";
 		flushing_ |= REQUEST_CHAIN_FLUSHING;
-		request_chain_.flush (REQUEST_CHAIN_READY);
+		finish (REQUEST_CHAIN_READY);
 		break;
 	default:
 		DEBUG(log_) << "Unexpected event: " << e;
@@ -243,13 +519,14 @@ void ProxyConnector::on_response_data (Event e)
 	switch (e.type_) 
 	{
 	case Event::Done:
-		response_action_ = remote_socket_->read (callback (this, &ProxyConnector::on_response_data));
-		if (response_chain_.consume (e.buffer_))
+		if (! (paused_ & RESPONSE_CHAIN_READY))
+			response_action_ = read_response ();
+		if (forward (RESPONSE_CHAIN_READY, e.buffer_))
 			break;
 	case Event::EOS:
 		DEBUG(log_) << "Flushing response";
 		flushing_ |= RESPONSE_CHAIN_FLUSHING;
-		response_chain_.flush (RESPONSE_CHAIN_READY);
+		finish (RESPONSE_CHAIN_READY);
 		break;
 	default:
 		DEBUG(log_) << "Unexpected event: " << e;
@@ -258,15 +535,237 @@ void ProxyConnector::on_response_data (Event e)
 	}
 }
 
+/*
+ * A spliced direction is over once its source has ended and the rest has
+ * been written: the other end is told so, as a sink filter would do.
+ */
+void ProxyConnector::on_spliced (Event e, int chain)
+{
+	Action*& act = (chain == REQUEST_CHAIN_READY ? request_action_ : response_action_);
+	
+	if (act)
+		act->cancel (), act = 0;
+		
+	switch (e.type_) 
+	{
+	case Event::Done:
+		DEBUG(log_) << "Spliced " << (chain == REQUEST_CHAIN_READY ? "request" : "response");
+		(chain == REQUEST_CHAIN_READY ? remote_socket_ : local_socket_)->shutdown (false, true);
+		flushing_ |= (chain == REQUEST_CHAIN_READY ? REQUEST_CHAIN_FLUSHING : RESPONSE_CHAIN_FLUSHING);
+		flush (chain);
+		break;
+	default:
+		DEBUG(log_) << "Unexpected event: " << e;
+		conclude (e);
+		return;
+	}
+}
+
+/*
+ * Called by the sink of a chain when its backlog crosses the watermarks.
+ * A read already requested is left to complete, as cancelling it could
+ * lose data; the source is simply not read again until resumed.
+ */
+void ProxyConnector::pause (int chain)
+{
+	DEBUG(log_) << "Pausing " << (chain == REQUEST_CHAIN_READY ? "request" : "response");
+	paused_ |= chain;
+}
+
+void ProxyConnector::resume (int chain)
+{
+	DEBUG(log_) << "Resuming " << (chain == REQUEST_CHAIN_READY ? "request" : "response");
+	paused_ &= ~chain;
+	ProxyListener::readmit ();
+	if (chain == REQUEST_CHAIN_READY)
+	{
+		if (! request_action_ && ! (flushing_ & REQUEST_CHAIN_FLUSHING))
+			request_action_ = read_request ();
+	}
+	else
+	{
+		if (! response_action_ && ! (flushing_ & RESPONSE_CHAIN_FLUSHING))
+			response_action_ = read_response ();
+	}
+}
+
 void ProxyConnector::flush (int flg)
 {
 	flushing_ |= flg;
 	if ((flushing_ & (REQUEST_CHAIN_READY | RESPONSE_CHAIN_READY)) == (REQUEST_CHAIN_READY | RESPONSE_CHAIN_READY))
 		if (! close_action_)
-			close_action_ = event_system.track (0, StreamModeWait, callback (this, &ProxyConnector::conclude));
+			close_action_ = EventSystem::current ().track (0, StreamModeWait, callback (this, &ProxyConnector::conclude));
 }
 
+/*
+ * The connection holds one count of outstanding_ for itself until it
+ * concludes.  Dropping it here leaves the deletion to whoever releases the
+ * last count, which is this call when no work is queued on a worker or
+ * on the event loop.
+ */
 void ProxyConnector::conclude (Event e)
+{
+	if (concluding_)
+		return;
+	concluding_ = true;
+
+	if (request_action_)
+		request_action_->cancel (), request_action_ = 0;
+	if (response_action_)
+		response_action_->cancel (), response_action_ = 0;
+	flushing_ |= (REQUEST_CHAIN_FLUSHING | RESPONSE_CHAIN_FLUSHING);
+	if (close_action_)
+		close_action_->cancel (), close_action_ = 0;
+
+	if (outstanding_.subtract (1) == 0)
+		dispose ();
+}
+
+/*
+ * Called from any thread when a parcel has been handled.  The last one
+ * after the connection has concluded posts its deletion to the event loop
+ * that owns it; nothing else touches the connection by then.
+ */
+void ProxyConnector::release ()
+{
+	if (outstanding_.subtract (1) == 0)
+		system_.post (callback (this, &ProxyConnector::dispose));
+}
+
+void ProxyConnector::dispose ()
 {
    delete this;
+	ProxyListener::readmit ();
+}
+
+/*
+ * With a worker assigned, the chains of the connection run on that worker
+ * and the event loop only moves buffers around.  When the pool has more
+ * than one worker each direction gets its own, and the decoder to encoder
+ * references are routed through a Handoff to keep every chain on a single
+ * thread.  SSH sessions share too much state between both directions and
+ * always stay on one worker.
+ */
+Filter* ProxyConnector::couple (Filter* enc, int chain)
+{
+	if (worker_ == response_worker_)
+		return enc;
+	
+	Handoff* h = new Handoff (*this, (chain == REQUEST_CHAIN_READY ? worker_ : response_worker_), enc);
+	handoffs_.push_back (h);
+	return h;
+}
+
+bool ProxyConnector::forward (int chain, Buffer& buf)
+{
+	if (! worker_)
+		return (chain == REQUEST_CHAIN_READY ? request_chain_ : response_chain_).consume (buf);
+	
+	Parcel* p = new Parcel (chain, 0, false);
+	p->data_.append (buf);
+	outstanding_.add (1);
+	(chain == REQUEST_CHAIN_READY ? worker_ : response_worker_)->post (callback (this, &ProxyConnector::process, p));
+	return true;
+}
+
+void ProxyConnector::finish (int chain)
+{
+	if (! worker_)
+	{
+		(chain == REQUEST_CHAIN_READY ? request_chain_ : response_chain_).flush (chain);
+		return;
+	}
+	
+	outstanding_.add (1);
+	(chain == REQUEST_CHAIN_READY ? worker_ : response_worker_)->post (callback (this, &ProxyConnector::process, new Parcel (chain, chain, true)));
+}
+
+void ProxyConnector::process (Parcel* p)
+{
+	FilterChain& chain = (p->chain_ == REQUEST_CHAIN_READY ? request_chain_ : response_chain_);
+	
+	if (! (offload_flushing_.val () & p->chain_))
+	{
+		if (p->flush_ || ! chain.consume (p->data_))
+		{
+			offload_flushing_.set (p->chain_);
+			chain.flush (p->chain_);
+		}
+	}
+	
+	delete p;
+	release ();
+}
+
+ProxyConnector::Relay::Relay (ProxyConnector& owner, int chain) 
+ : owner_ (owner), 
+   system_ (EventSystem::current ()), 
+   chain_ (chain)
+{
+}
+
+bool ProxyConnector::Relay::consume (Buffer& buf, int flg)
+{
+	Parcel* p = new Parcel (chain_, flg, false);
+	p->data_.append (buf);
+	owner_.outstanding_.add (1);
+	system_.post (callback (this, &Relay::deliver, p));
+	return true;
+}
+
+void ProxyConnector::Relay::flush (int flg)
+{
+	owner_.outstanding_.add (1);
+	system_.post (callback (this, &Relay::deliver, new Parcel (chain_, flg, true)));
+}
+
+void ProxyConnector::Relay::deliver (Parcel* p)
+{
+	int bit = (chain_ == REQUEST_CHAIN_READY ? REQUEST_CHAIN_FLUSHING : RESPONSE_CHAIN_FLUSHING);
+	
+	if (p->flush_)
+	{
+		Filter::flush (p->flags_);
+	}
+	else if (! produce (p->data_, p->flags_) && ! (owner_.flushing_ & bit))
+	{
+		owner_.flushing_ |= bit;
+		owner_.finish (chain_);
+	}
+	
+	delete p;
+	owner_.release ();
+}
+
+ProxyConnector::Handoff::Handoff (ProxyConnector& owner, Worker* worker, Filter* target) 
+ : owner_ (owner), 
+   worker_ (worker), 
+   target_ (target)
+{
+}
+
+bool ProxyConnector::Handoff::produce (Buffer& buf, int flg)
+{
+	Parcel* p = new Parcel (0, flg, false);
+	p->data_.append (buf);
+	owner_.outstanding_.add (1);
+	worker_->post (callback (this, &Handoff::deliver, p));
+	return true;
+}
+
+void ProxyConnector::Handoff::flush (int flg)
+{
+	owner_.outstanding_.add (1);
+	worker_->post (callback (this, &Handoff::deliver, new Parcel (0, flg, true)));
+}
+
+void ProxyConnector::Handoff::deliver (Parcel* p)
+{
+	if (p->flush_)
+		target_->flush (p->flags_);
+	else
+		target_->produce (p->data_, p->flags_);
+	
+	delete p;
+	owner_.release ();
 }
@@ -31,10 +31,13 @@
 #define REQUEST_CHAIN_READY		0x40000
 #define RESPONSE_CHAIN_READY		0x80000
 
+#include <vector>
 #include <common/filter.h>
+#include <common/thread/atomic.h>
 #include <event/action.h>
 #include <event/event.h>
 #include <io/socket/socket_types.h>
+#include "proxy_link.h"
 #include "wanproxy_codec.h"
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -47,14 +50,75 @@
 //                                                                            //
 ////////////////////////////////////////////////////////////////////////////////
 
+class EventSystem;
+class SinkFilter;
+class Splice;
+class Worker;
+
 class ProxyConnector : public Filter
 {
+	struct Parcel
+	{
+		int chain_;
+		int flags_;
+		bool flush_;
+		Buffer data_;
+		
+		Parcel (int chain, int flg, bool fls) : chain_ (chain), flags_ (flg), flush_ (fls)	{ }
+	};
+	
+	/*
+	 * Last filter run by a worker thread: hands its output back to the event
+	 * loop of the connection, where the sink is written.
+	 */
+	class Relay : public Filter
+	{
+		ProxyConnector& owner_;
+		EventSystem& system_;
+		int chain_;
+		
+	public:
+		Relay (ProxyConnector& owner, int chain);
+		
+		virtual bool consume (Buffer& buf, int flg = 0);
+		virtual void flush (int flg);
+		void deliver (Parcel* p);
+	};
+	
+	/*
+	 * Stands in for the encoder a decoder talks to when both sit on chains
+	 * run by different workers: <ASK>, <LEARN> and <EOS_ACK> are queued on
+	 * the worker that owns the encoder instead of being produced in place.
+	 */
+	class Handoff : public Filter
+	{
+		ProxyConnector& owner_;
+		Worker* worker_;
+		Filter* target_;
+		
+	public:
+		Handoff (ProxyConnector& owner, Worker* worker, Filter* target);
+		
+		virtual bool produce (Buffer& buf, int flg = 0);
+		virtual void flush (int flg);
+		void deliver (Parcel* p);
+	};
+	
 	LogHandle log_;
 	WANProxyCodec* local_codec_;
 	WANProxyCodec* remote_codec_;
 	Socket* local_socket_;
 	Socket* remote_socket_;
-	bool is_cln_, is_ssh_;
+	PeerLink* local_link_;
+	PeerLink* remote_link_;
+	bool is_cln_, is_ssh_, early_;
+	SinkFilter* request_sink_;
+	Splice* request_splice_;
+	Splice* response_splice_;
+	PeerSelector* peers_;
+	std::string peer_key_;
+	std::string remote_name_;
+	std::vector<std::string> tried_;
 	FilterChain request_chain_;
 	FilterChain response_chain_;
 	Action* connect_action_;
@@ -63,18 +127,48 @@ class ProxyConnector : public Filter
 	Action* response_action_;
 	Action* close_action_;
    int flushing_;
+	int paused_;
+	Worker* worker_;
+	Worker* response_worker_;
+	std::list<Handoff*> handoffs_;
+	Atomic<int> outstanding_;
+	Atomic<int> offload_flushing_;
+	EventSystem& system_;
+	bool concluding_;
 
 public:
 	ProxyConnector (const std::string&, WANProxyCodec*, WANProxyCodec*, 
-						 Socket*, SocketAddressFamily, const std::string&, bool cln, bool ssh);
+						 Socket*, SocketAddressFamily, const std::string&, const ProxySettings&, Socket* remote = 0,
+						 const std::string& key = std::string ());
+	ProxyConnector (const std::string&, WANProxyCodec*, WANProxyCodec*, 
+						 PeerLink*, SocketAddressFamily, const std::string&, int workers = 0);
 	virtual ~ProxyConnector ();
 
 	void connect_complete (Event e);
+	void start ();
 	bool build_chains (WANProxyCodec* cdc1, WANProxyCodec* cdc2, Socket* sck1, Socket* sck2);
 	void on_request_data (Event e);
 	void on_response_data (Event e);
+	void on_spliced (Event e, int chain);
+	void pause (int chain);
+	void resume (int chain);
    virtual void flush (int flg);
    void conclude (Event e);
+	
+private:
+	void launch (const std::string& name, SocketAddressFamily family, const std::string& remote_name, const ProxySettings& settings);
+	bool fail_over ();
+	bool relayed () const;
+	bool splice ();
+	Filter* sink_for (int chain, Socket* sck);
+	Action* read_request ();
+	Action* read_response ();
+	Filter* couple (Filter* enc, int chain);
+	bool forward (int chain, Buffer& buf);
+	void finish (int chain);
+	void process (Parcel* p);
+	void release ();
+	void dispose ();
 };
 
 #endif /* !PROGRAMS_WANPROXY_PROXY_CONNECTOR_H */
@@ -0,0 +1,982 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+// File:           proxy_datagram.cc                                          //
+// Description:    reliable encoded stream between proxies carried over UDP   //
+// Project:        WANProxy XTech                                             //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+#include <errno.h>
+#include <algorithm>
+#include <unistd.h>
+#include <sys/time.h>
+#include <common/endian.h>
+#include <crypto/crypto_random.h>
+#include <event/event_system.h>
+#include "proxy_connector.h"
+#include "proxy_datagram.h"
+
+// Link
+
+DatagramLink::DatagramLink (const std::string& name)
+ : log_("/wanproxy/" + name + "/datagrams"),
+   socket_(0),
+   service_(0),
+   sink_(0),
+   client_(true),
+   open_(false),
+   failed_(false),
+   opened_(0),
+   heard_(0),
+   probed_(0),
+   spoken_(0),
+   send_base_(0),
+   send_next_(0),
+   in_flight_(0),
+   out_bytes_(0),
+   order_(0),
+   rack_(0),
+   cwnd_(DATAGRAM_INITIAL_WINDOW),
+   ssthresh_(DATAGRAM_WINDOW),
+   recovery_(0),
+   srtt_(0),
+   rttvar_(0),
+   rto_(DATAGRAM_INITIAL_RTO),
+   peer_window_(DATAGRAM_INITIAL_WINDOW),
+   draining_(false),
+   fin_sent_(false),
+   fin_acked_(false),
+   drain_flags_(0),
+   recv_next_(0),
+   fin_seq_(0),
+   got_fin_(false),
+   eos_(false),
+   ack_due_(0),
+   ack_now_(false),
+   connect_request_(0),
+   read_request_(0),
+   connect_action_(0),
+   poll_action_(0),
+   tick_action_(0),
+   deliver_action_(0),
+   pause_(0),
+   resume_(0),
+   throttled_(false),
+   idling_(false)
+{
+	static uint32_t serial;
+
+	id_ = (uint32_t) (now () * 2654435761u) ^ ((uint32_t) getpid () << 16) ^ ++serial;
+
+	/*
+	 * Zeros stand for the cookie until the server gives one, so that an
+	 * <OPEN> is never smaller than the <ACCEPT> it draws.
+	 */
+	cookie_.append ((const uint8_t*) "\0\0\0\0\0\0\0\0", DATAGRAM_COOKIE);
+}
+
+/*
+ * A link opened by a client, whose datagrams come through the service.
+ */
+DatagramLink::DatagramLink (const std::string& name, DatagramService* svc, uint32_t id, const std::string& address)
+ : log_("/wanproxy/" + name + "/datagrams"),
+   id_(id),
+   socket_(0),
+   service_(svc),
+   address_(address),
+   sink_(0),
+   client_(false),
+   open_(true),
+   failed_(false),
+   opened_(now ()),
+   heard_(opened_),
+   probed_(0),
+   spoken_(opened_),
+   send_base_(0),
+   send_next_(0),
+   in_flight_(0),
+   out_bytes_(0),
+   order_(0),
+   rack_(0),
+   cwnd_(DATAGRAM_INITIAL_WINDOW),
+   ssthresh_(DATAGRAM_WINDOW),
+   recovery_(0),
+   srtt_(0),
+   rttvar_(0),
+   rto_(DATAGRAM_INITIAL_RTO),
+   peer_window_(DATAGRAM_INITIAL_WINDOW),
+   draining_(false),
+   fin_sent_(false),
+   fin_acked_(false),
+   drain_flags_(0),
+   recv_next_(0),
+   fin_seq_(0),
+   got_fin_(false),
+   eos_(false),
+   ack_due_(0),
+   ack_now_(false),
+   connect_request_(0),
+   read_request_(0),
+   connect_action_(0),
+   poll_action_(0),
+   tick_action_(0),
+   deliver_action_(0),
+   pause_(0),
+   resume_(0),
+   throttled_(false),
+   idling_(false)
+{
+}
+
+/*
+ * The other end is told when the link goes away before both streams
+ * have ended.
+ */
+DatagramLink::~DatagramLink ()
+{
+	if (open_ && ! failed_ && ! (fin_acked_ && eos_))
+	{
+		std::vector<Datagram> out (1);
+		if (! client_)
+			out[0].address_ = address_;
+		header (out[0].data_, DATAGRAM_OP_RESET);
+		transmit (out);
+	}
+
+	if (connect_action_)
+		connect_action_->cancel ();
+	if (poll_action_)
+		poll_action_->cancel ();
+	if (tick_action_)
+		tick_action_->cancel ();
+	if (deliver_action_)
+		deliver_action_->cancel ();
+	if (socket_)
+		socket_->close ();
+	delete socket_;
+	if (service_)
+		service_->forget (id_, address_);
+	delete connect_request_;
+	delete read_request_;
+	delete pause_;
+	delete resume_;
+}
+
+Action* DatagramLink::connect (SocketAddressFamily family, const std::string& address, EventCallback* cb)
+{
+	if (! (socket_ = Socket::create (family, SocketTypeDatagram, "udp", address)) ||
+		 ! (connect_action_ = socket_->connect (address, callback (this, &DatagramLink::opened))))
+	{
+		delete cb;
+		return 0;
+	}
+
+	address_ = address;
+	return (connect_request_ = new LinkAction (this, &DatagramLink::connect_cancel, cb));
+}
+
+/*
+ * The socket is bound to the peer address: the link starts asking for an
+ * <ACCEPT>.
+ */
+void DatagramLink::opened (Event e)
+{
+	if (connect_action_)
+		connect_action_->cancel (), connect_action_ = 0;
+
+	if (e.type_ != Event::Done)
+	{
+		fail ("Could not reach " + address_);
+		return;
+	}
+
+	opened_ = heard_ = now ();
+	poll_action_ = socket_->poll (callback (this, &DatagramLink::on_readable));
+	pump ();
+}
+
+void DatagramLink::start ()
+{
+	schedule ();
+}
+
+Filter* DatagramLink::sink ()
+{
+	return (sink_ = new Sink (*this));
+}
+
+void DatagramLink::set_throttle (Callback* pause, Callback* resume)
+{
+	delete pause_;
+	delete resume_;
+	pause_ = pause, resume_ = resume;
+}
+
+Action* DatagramLink::read (EventCallback* cb)
+{
+	read_request_ = new LinkAction (this, &DatagramLink::read_cancel, cb);
+	schedule ();
+	return read_request_;
+}
+
+void DatagramLink::detach ()
+{
+	service_ = 0;
+	fail ("Datagram service closed.");
+}
+
+/*
+ * Everything a client link receives comes on its own socket, as many
+ * datagrams at a time as are waiting, and is answered once the whole
+ * batch has been taken in.
+ */
+void DatagramLink::on_readable (Event e)
+{
+	std::vector<Datagram> in;
+	std::vector<Datagram>::iterator it;
+	uint32_t id;
+
+	if (poll_action_)
+		poll_action_->cancel (), poll_action_ = 0;
+
+	if (e.type_ != Event::Done)
+	{
+		fail ("Cannot read from " + address_);
+		return;
+	}
+
+	while (socket_->receive_batch (in, DATAGRAM_BATCH) > 0)
+	{
+		for (it = in.begin (); it != in.end (); ++it)
+		{
+			if (it->data_.length () < DATAGRAM_HEADER)
+				continue;
+			it->data_.extract (&id);
+			if (BigEndian::decode (id) == id_)
+				receive (it->data_);
+		}
+		in.clear ();
+	}
+	if (errno == ECONNREFUSED && ! open_)
+	{
+		fail ("Connection refused by " + address_);
+		return;
+	}
+
+	if (! failed_)
+		poll_action_ = socket_->poll (callback (this, &DatagramLink::on_readable));
+	pump ();
+}
+
+void DatagramLink::receive (Buffer& dgm)
+{
+	uint32_t ack, seq;
+	uint16_t window;
+	uint64_t sack;
+	uint8_t op;
+
+	if (failed_)
+		return;
+
+	dgm.skip (sizeof id_);
+	op = dgm.peek ();
+	dgm.skip (sizeof op);
+	dgm.moveout (&ack);
+	dgm.moveout (&window);
+	dgm.moveout (&sack);
+	heard_ = now ();
+
+	if (op == DATAGRAM_OP_RESET)
+	{
+		fail ("Link reset by the peer.");
+		return;
+	}
+	if (op == DATAGRAM_OP_OPEN)
+	{
+		ack_now_ = ! client_;
+		return;
+	}
+	if (op == DATAGRAM_OP_ACCEPT)
+	{
+		if (client_ && ! open_ && dgm.length () >= DATAGRAM_COOKIE)
+		{
+			cookie_.clear ();
+			dgm.moveout (&cookie_, DATAGRAM_COOKIE);
+			probed_ = 0;
+		}
+		return;
+	}
+	if (op == DATAGRAM_OP_KEEPALIVE)
+		ack_now_ = ! client_;
+
+	/*
+	 * Anything else from the server but a <RESET> means it has set the
+	 * link up on the cookie, even when its first <ACK> got lost.
+	 */
+	if (! open_)
+	{
+		EventCallback* cb;
+		open_ = true;
+		DEBUG(log_) << "Link open to " << address_;
+		if (connect_request_ && (cb = connect_request_->callback_))
+		{
+			cb->param (Event (Event::Done));
+			cb->execute ();
+		}
+	}
+
+	acknowledge (BigEndian::decode (ack), BigEndian::decode (sack), BigEndian::decode (window));
+
+	if ((op == DATAGRAM_OP_DATA || op == DATAGRAM_OP_FIN) && dgm.length () >= sizeof seq)
+	{
+		dgm.moveout (&seq);
+		accept_data (BigEndian::decode (seq), dgm, (op == DATAGRAM_OP_FIN));
+	}
+}
+
+/*
+ * Packets acknowledged in order or selectively leave the flight.  The
+ * round trip is measured on those sent only once, and a packet still
+ * unacknowledged when several sent after it have been is taken as lost.
+ */
+void DatagramLink::acknowledge (uint32_t ack, uint64_t sack, uint16_t window)
+{
+	std::deque<Packet>::iterator it;
+	long t = now (), rtt = -1;
+	uint64_t latest = 0;
+	int acked = 0, lost = 0;
+	uint32_t seq;
+
+	peer_window_ = window;
+
+	for (it = flight_.begin (), seq = send_base_; it != flight_.end (); ++it, ++seq)
+	{
+		int32_t d = (int32_t) (seq - ack);
+		if (it->acked_ || (d >= 0 && (d == 0 || d > 64 || ! (sack & ((uint64_t) 1 << (d - 1))))))
+			continue;
+		it->acked_ = true;
+		if (! it->lost_)
+			--in_flight_;
+		out_bytes_ -= it->data_.length ();
+		if (it->order_ > latest)
+		{
+			latest = it->order_;
+			rtt = (it->sends_ == 1 ? t - it->sent_ : -1);
+		}
+		if (it->fin_)
+			fin_acked_ = true;
+		++acked;
+	}
+
+	if (latest > rack_)
+		rack_ = latest;
+	if (rtt >= 0)
+		sample (rtt);
+
+	for (it = flight_.begin (), seq = send_base_; it != flight_.end (); ++it, ++seq)
+	{
+		if (! it->acked_ && ! it->lost_ && it->order_ + DATAGRAM_REORDERING <= rack_)
+		{
+			it->lost_ = true;
+			--in_flight_;
+			if ((int32_t) (seq - recovery_) >= 0)
+				++lost;
+		}
+	}
+
+	while (! flight_.empty () && flight_.front ().acked_)
+		flight_.pop_front (), ++send_base_;
+
+	if (lost)
+	{
+		ssthresh_ = cwnd_ * 0.7;
+		if (ssthresh_ < DATAGRAM_MINIMUM_WINDOW)
+			ssthresh_ = DATAGRAM_MINIMUM_WINDOW;
+		cwnd_ = ssthresh_;
+		recovery_ = send_next_;
+		DEBUG(log_) << "Lost " << lost << " packets, window now " << (long) cwnd_;
+	}
+	else if (acked)
+	{
+		cwnd_ += (cwnd_ < ssthresh_ ? acked : acked / cwnd_);
+		if (cwnd_ > DATAGRAM_WINDOW)
+			cwnd_ = DATAGRAM_WINDOW;
+	}
+
+	if (acked && fin_acked_ && flight_.empty () && sink_)
+	{
+		DEBUG(log_) << "Stream to " << address_ << " acknowledged.";
+		sink_->drained (drain_flags_);
+		sink_ = 0;
+	}
+}
+
+void DatagramLink::sample (long rtt)
+{
+	if (srtt_ == 0)
+	{
+		srtt_ = rtt;
+		rttvar_ = rtt / 2;
+	}
+	else
+	{
+		rttvar_ = (3 * rttvar_ + (srtt_ > rtt ? srtt_ - rtt : rtt - srtt_)) / 4;
+		srtt_ = (7 * srtt_ + rtt) / 8;
+	}
+
+	rto_ = srtt_ + 4 * rttvar_ + DATAGRAM_TICK;
+	if (rto_ < DATAGRAM_MINIMUM_RTO)
+		rto_ = DATAGRAM_MINIMUM_RTO;
+	if (rto_ > DATAGRAM_MAXIMUM_RTO)
+		rto_ = DATAGRAM_MAXIMUM_RTO;
+}
+
+/*
+ * Nothing acknowledged for a whole timeout: every packet in flight is
+ * sent again and the window halved.
+ */
+void DatagramLink::lose (long t)
+{
+	std::deque<Packet>::iterator it;
+	long oldest = t;
+
+	for (it = flight_.begin (); it != flight_.end (); ++it)
+		if (! it->acked_ && ! it->lost_ && it->sent_ < oldest)
+			oldest = it->sent_;
+
+	if (in_flight_ <= 0 || t - oldest < rto_)
+		return;
+
+	for (it = flight_.begin (); it != flight_.end (); ++it)
+		if (! it->acked_)
+			it->lost_ = true;
+	in_flight_ = 0;
+
+	cwnd_ = cwnd_ / 2;
+	if (cwnd_ < DATAGRAM_MINIMUM_WINDOW)
+		cwnd_ = DATAGRAM_MINIMUM_WINDOW;
+	ssthresh_ = cwnd_;
+	recovery_ = send_next_;
+	rto_ = (rto_ * 2 > DATAGRAM_MAXIMUM_RTO ? DATAGRAM_MAXIMUM_RTO : rto_ * 2);
+	DEBUG(log_) << "Retransmission timeout, window now " << (long) cwnd_;
+}
+
+/*
+ * Packets are put in order as they arrive, the ones ahead of a gap waiting
+ * aside.  Anything out of order is acknowledged at once so that the sender
+ * learns about the gap, the rest every other packet or at the next tick.
+ */
+void DatagramLink::accept_data (uint32_t seq, Buffer& dgm, bool fin)
+{
+	std::map<uint32_t, Buffer>::iterator it;
+	int32_t d = (int32_t) (seq - recv_next_);
+
+	++ack_due_;
+	if (d != 0 || fin)
+		ack_now_ = true;
+	if (d < 0 || d >= DATAGRAM_WINDOW || unordered_.count (seq))
+		return;
+
+	if (fin)
+		got_fin_ = true, fin_seq_ = seq;
+	unordered_[seq].append (dgm);
+
+	while ((it = unordered_.find (recv_next_)) != unordered_.end ())
+	{
+		ready_.append (it->second);
+		unordered_.erase (it);
+		if (got_fin_ && recv_next_ == fin_seq_)
+			eos_ = true;
+		++recv_next_;
+	}
+
+	schedule ();
+}
+
+bool DatagramLink::send (Buffer& buf)
+{
+	if (failed_)
+		return false;
+
+	unsent_.append (buf);
+	buf.clear ();
+	pump ();
+
+	if (! throttled_ && out_bytes_ + (long) unsent_.length () > DATAGRAM_SEND_LIMIT && pause_)
+	{
+		throttled_ = true;
+		pause_->execute ();
+	}
+	return true;
+}
+
+void DatagramLink::drain (int flg)
+{
+	drain_flags_ |= flg;
+	draining_ = true;
+	pump ();
+}
+
+/*
+ * Sends whatever is due: the handshake, packets taken as lost, new data
+ * as far as the congestion and receive windows allow, and a bare <ACK>
+ * when nothing else carried the acknowledgement.
+ */
+void DatagramLink::pump ()
+{
+	std::vector<Datagram> out;
+	std::deque<Packet>::iterator it;
+	uint32_t seq;
+	long t = now ();
+
+	if (failed_ || (client_ && ! socket_))
+		return;
+
+	if (! open_)
+	{
+		if (t - probed_ >= rto_)
+		{
+			out.resize (1);
+			header (out[0].data_, DATAGRAM_OP_OPEN);
+			out[0].data_.append (cookie_);
+			probed_ = t;
+			transmit (out);
+		}
+		arm ();
+		return;
+	}
+
+	for (it = flight_.begin (), seq = send_base_; it != flight_.end () && in_flight_ < cwnd_; ++it, ++seq)
+	{
+		if (it->acked_ || ! it->lost_)
+			continue;
+		out.push_back (Datagram ());
+		header (out.back ().data_, (it->fin_ ? DATAGRAM_OP_FIN : DATAGRAM_OP_DATA));
+		BigEndian::append (&out.back ().data_, seq);
+		out.back ().data_.append (it->data_);
+		it->lost_ = false;
+		it->sent_ = t;
+		it->order_ = ++order_;
+		++it->sends_;
+		++in_flight_;
+	}
+
+	while (in_flight_ < cwnd_ && (! unsent_.empty () || (draining_ && ! fin_sent_)))
+	{
+		bool probe = false;
+		if ((send_next_ - send_base_) >= peer_window_)
+		{
+			if (in_flight_ > 0 || t - probed_ < rto_)
+				break;
+			probe = true, probed_ = t;
+		}
+
+		Packet p;
+		p.fin_ = unsent_.empty ();
+		if (! p.fin_)
+			unsent_.moveout (&p.data_, (unsent_.length () > DATAGRAM_PAYLOAD ? DATAGRAM_PAYLOAD : unsent_.length ()));
+		p.sent_ = t;
+		p.order_ = ++order_;
+		p.sends_ = 1;
+		p.acked_ = p.lost_ = false;
+		out.push_back (Datagram ());
+		header (out.back ().data_, (p.fin_ ? DATAGRAM_OP_FIN : DATAGRAM_OP_DATA));
+		BigEndian::append (&out.back ().data_, send_next_);
+		out.back ().data_.append (p.data_);
+		out_bytes_ += p.data_.length ();
+		fin_sent_ = p.fin_;
+		flight_.push_back (p);
+		++send_next_;
+		++in_flight_;
+		if (probe)
+			break;
+	}
+
+	if (out.empty () && (ack_now_ || ack_due_ >= 2))
+	{
+		out.resize (1);
+		header (out[0].data_, DATAGRAM_OP_ACK);
+	}
+	if (! out.empty ())
+		ack_due_ = 0, ack_now_ = false;
+
+	transmit (out);
+
+	if (throttled_ && out_bytes_ + (long) unsent_.length () < DATAGRAM_SEND_LIMIT / 2 && resume_)
+	{
+		throttled_ = false;
+		resume_->execute ();
+	}
+
+	arm ();
+}
+
+void DatagramLink::header (Buffer& out, uint8_t op)
+{
+	std::map<uint32_t, Buffer>::const_iterator it;
+	uint64_t sack = 0;
+	int32_t d;
+
+	for (it = unordered_.begin (); it != unordered_.end (); ++it)
+		if ((d = (int32_t) (it->first - recv_next_)) > 0 && d <= 64)
+			sack |= (uint64_t) 1 << (d - 1);
+
+	BigEndian::append (&out, id_);
+	out.append (op);
+	BigEndian::append (&out, recv_next_);
+	BigEndian::append (&out, window ());
+	BigEndian::append (&out, sack);
+}
+
+/*
+ * What is ready but not yet read closes the window, so a slow reader
+ * throttles the sender instead of piling data up here.
+ */
+uint16_t DatagramLink::window () const
+{
+	long n = (ready_.length () < DATAGRAM_READY_LIMIT ? (DATAGRAM_READY_LIMIT - ready_.length ()) / DATAGRAM_PAYLOAD : 0);
+
+	if (n > DATAGRAM_WINDOW - (long) unordered_.size ())
+		n = DATAGRAM_WINDOW - (long) unordered_.size ();
+	return (uint16_t) (n > 0 ? n : 0);
+}
+
+/*
+ * Datagrams the socket could not take are simply lost, and recovered as
+ * any other.
+ */
+void DatagramLink::transmit (std::vector<Datagram>& out)
+{
+	ssize_t n = 0;
+
+	if (out.empty ())
+		return;
+
+	if (client_ && socket_)
+		n = socket_->send_batch (out);
+	else if (service_)
+		n = service_->transmit (out, address_);
+	if (n > 0)
+		spoken_ = now ();
+
+	if (n < (ssize_t) out.size ())
+		DEBUG(log_) << "Sent " << (n > 0 ? n : 0) << " of " << out.size () << " datagrams.";
+}
+
+/*
+ * An open link is checked on even when idle, only less often, so that
+ * silence from the other end is noticed whatever the state of the streams.
+ */
+void DatagramLink::arm ()
+{
+	bool busy = (! open_ || ! flight_.empty () || ack_due_ > 0 || ! unsent_.empty () || (draining_ && ! fin_acked_));
+
+	if (failed_ || (tick_action_ && ! (idling_ && busy)))
+		return;
+	if (tick_action_)
+		tick_action_->cancel (), tick_action_ = 0;
+	if (! busy && fin_acked_ && eos_)
+		return;
+
+	idling_ = ! busy;
+	tick_action_ = EventSystem::current ().track ((busy ? DATAGRAM_TICK : DATAGRAM_IDLE_TICK), StreamModeWait, callback (this, &DatagramLink::tick));
+}
+
+void DatagramLink::tick (Event e)
+{
+	long t = now ();
+
+	if (tick_action_)
+		tick_action_->cancel (), tick_action_ = 0;
+
+	if (! open_ && t - opened_ >= DATAGRAM_OPEN_TIMEOUT)
+	{
+		fail ("No answer from " + address_);
+		return;
+	}
+	if (open_ && t - heard_ >= DATAGRAM_DEAD_TIMEOUT)
+	{
+		fail ("Lost contact with " + address_);
+		return;
+	}
+	if (open_ && client_ && t - spoken_ >= DATAGRAM_KEEPALIVE)
+	{
+		std::vector<Datagram> out (1);
+		header (out[0].data_, DATAGRAM_OP_KEEPALIVE);
+		transmit (out);
+	}
+
+	if (open_)
+		lose (t);
+	if (ack_due_ > 0)
+		ack_now_ = true;
+	pump ();
+}
+
+void DatagramLink::schedule ()
+{
+	if (deliver_action_)
+		return;
+
+	if ((read_request_ && (! ready_.empty () || eos_ || failed_)) || (connect_request_ && ! open_ && failed_))
+		deliver_action_ = EventSystem::current ().track (0, StreamModeWait, callback (this, &DatagramLink::deliver));
+}
+
+void DatagramLink::deliver (Event e)
+{
+	EventCallback* cb;
+
+	if (deliver_action_)
+		deliver_action_->cancel (), deliver_action_ = 0;
+
+	/*
+	 * A failed connect is reported from here too, as the connector may
+	 * go away with the link as soon as it learns about it.
+	 */
+	if (! open_ && connect_request_ && (cb = connect_request_->callback_))
+	{
+		cb->param (Event (Event::Error));
+		cb->execute ();
+		return;
+	}
+
+	if (! read_request_ || ! (cb = read_request_->callback_))
+		return;
+
+	if (! ready_.empty ())
+	{
+		if (window () < DATAGRAM_WINDOW / 4)
+			ack_now_ = true;
+		cb->param (Event (Event::Done, ready_));
+		ready_.clear ();
+		pump ();
+	}
+	else if (failed_)
+	{
+		cb->param (Event (Event::Error));
+	}
+	else if (eos_)
+	{
+		cb->param (Event (Event::EOS));
+	}
+	else
+	{
+		return;
+	}
+
+	cb->execute ();
+}
+
+void DatagramLink::fail (const std::string& why)
+{
+	if (failed_)
+		return;
+
+	INFO(log_) << why;
+	failed_ = true;
+	if (poll_action_)
+		poll_action_->cancel (), poll_action_ = 0;
+	if (tick_action_)
+		tick_action_->cancel (), tick_action_ = 0;
+
+	schedule ();
+}
+
+void DatagramLink::connect_cancel ()
+{
+	delete connect_request_;
+	connect_request_ = 0;
+}
+
+void DatagramLink::read_cancel ()
+{
+	delete read_request_;
+	read_request_ = 0;
+}
+
+long DatagramLink::now ()
+{
+	struct timeval tv;
+
+	gettimeofday (&tv, 0);
+	return (tv.tv_sec * 1000 + tv.tv_usec / 1000);
+}
+
+// Service
+
+DatagramService::DatagramService (const LinkService& svc, SocketAddressFamily family, const std::string& address)
+ : log_("/wanproxy/" + svc.name_ + "/datagrams"),
+   service_(svc),
+   socket_(0),
+   poll_action_(0),
+   cookie_mac_(0)
+{
+	const CryptoMAC::Method* method = CryptoMAC::Method::method (CryptoMAC::SHA256);
+	Buffer key;
+
+	if (! method || ! CryptoRandomMethod::default_method->generate (CryptoTypeRNG, 32, &key) ||
+		 ! (cookie_mac_ = method->instance (CryptoMAC::SHA256)) || ! cookie_mac_->initialize (&key))
+	{
+		ERROR(log_) << "Unable to set up the cookies of new links.";
+		delete cookie_mac_;
+		cookie_mac_ = 0;
+		return;
+	}
+
+	if (! (socket_ = Socket::create (family, SocketTypeDatagram, "udp", address)) || ! socket_->bind (address))
+	{
+		ERROR(log_) << "Unable to receive datagrams on " << address;
+		return;
+	}
+
+	poll_action_ = socket_->poll (callback (this, &DatagramService::on_readable));
+	INFO(log_) << "Receiving datagrams on: " << socket_->getsockname ();
+}
+
+DatagramService::~DatagramService ()
+{
+	std::map<std::pair<std::string, uint32_t>, DatagramLink*> links;
+	std::map<std::pair<std::string, uint32_t>, DatagramLink*>::iterator it;
+
+	if (poll_action_)
+		poll_action_->cancel ();
+	links.swap (links_);
+	for (it = links.begin (); it != links.end (); ++it)
+		it->second->detach ();
+	if (socket_)
+		socket_->close ();
+	delete socket_;
+	delete cookie_mac_;
+}
+
+ssize_t DatagramService::transmit (std::vector<Datagram>& out, const std::string& address)
+{
+	std::vector<Datagram>::iterator it;
+
+	for (it = out.begin (); it != out.end (); ++it)
+		it->address_ = address;
+	return (socket_ ? socket_->send_batch (out) : -1);
+}
+
+void DatagramService::forget (uint32_t id, const std::string& address)
+{
+	links_.erase (std::make_pair (address, id));
+}
+
+bool DatagramService::cookie (Buffer& out, uint32_t id, const std::string& address)
+{
+	Buffer in, mac;
+
+	BigEndian::append (&in, id);
+	in.append (address);
+	if (! cookie_mac_ || ! cookie_mac_->mac (&mac, &in) || mac.length () < DATAGRAM_COOKIE)
+		return false;
+	mac.moveout (&out, DATAGRAM_COOKIE);
+	return true;
+}
+
+/*
+ * Tells whether an <OPEN> brings back the cookie of its client.
+ */
+bool DatagramService::admit (const Buffer& dgm, uint32_t id, const std::string& address)
+{
+	uint8_t got[DATAGRAM_COOKIE], want[DATAGRAM_COOKIE];
+	uint8_t diff = 0;
+	Buffer expected;
+
+	if (dgm.length () < DATAGRAM_HEADER + DATAGRAM_COOKIE || ! cookie (expected, id, address))
+		return false;
+	dgm.copyout (got, DATAGRAM_HEADER, sizeof got);
+	expected.copyout (want, sizeof want);
+	for (unsigned i = 0; i < DATAGRAM_COOKIE; ++i)
+		diff |= got[i] ^ want[i];
+	return (diff == 0);
+}
+
+/*
+ * A datagram on behalf of a link the service does not hold.
+ */
+void DatagramService::answer (std::vector<Datagram>& out, uint32_t id, const std::string& address, uint8_t op)
+{
+	out.push_back (Datagram ());
+	out.back ().address_ = address;
+	BigEndian::append (&out.back ().data_, id);
+	out.back ().data_.append (op);
+	out.back ().data_.append ((const uint8_t*) "\0\0\0\0\0\0\0\0\0\0\0\0\0\0", DATAGRAM_HEADER - 5);
+}
+
+/*
+ * Datagrams are read in batches and handed to their links.  An <OPEN> not
+ * seen before is answered with an <ACCEPT> and a cookie, and a new link and
+ * its connector are set up only when it comes back with that cookie.  The
+ * links answer once the whole batch has been taken in.  Anything for a
+ * link that is gone is answered with a <RESET>.
+ */
+void DatagramService::on_readable (Event e)
+{
+	std::map<std::pair<std::string, uint32_t>, DatagramLink*>::iterator lnk;
+	std::vector<DatagramLink*> touched;
+	std::vector<Datagram> in, out;
+	std::vector<Datagram>::iterator it;
+	uint32_t id;
+	uint8_t op;
+
+	if (poll_action_)
+		poll_action_->cancel (), poll_action_ = 0;
+
+	if (e.type_ != Event::Done)
+	{
+		ERROR(log_) << "Error reading datagrams: " << e;
+		return;
+	}
+
+	while (socket_->receive_batch (in, DATAGRAM_BATCH) > 0)
+	{
+		for (it = in.begin (); it != in.end (); ++it)
+		{
+			if (it->data_.length () < DATAGRAM_HEADER)
+				continue;
+			it->data_.extract (&id);
+			it->data_.extract (&op, sizeof id);
+			id = BigEndian::decode (id);
+
+			lnk = links_.find (std::make_pair (it->address_, id));
+			if (lnk == links_.end () && op == DATAGRAM_OP_OPEN && ! admit (it->data_, id, it->address_))
+			{
+				if (it->data_.length () < DATAGRAM_HEADER + DATAGRAM_COOKIE)
+					continue;
+				answer (out, id, it->address_, DATAGRAM_OP_ACCEPT);
+				if (! cookie (out.back ().data_, id, it->address_))
+					out.pop_back ();
+				continue;
+			}
+			if (lnk == links_.end () && op == DATAGRAM_OP_OPEN)
+			{
+				DatagramLink* link = new DatagramLink (service_.name_, this, id, it->address_);
+				lnk = links_.insert (std::make_pair (std::make_pair (it->address_, id), link)).first;
+				new ProxyConnector (service_.name_, service_.local_codec_, service_.remote_codec_, link,
+										  service_.remote_family_, service_.remote_address_, service_.workers_);
+			}
+			if (lnk != links_.end ())
+			{
+				lnk->second->receive (it->data_);
+				if (touched.empty () || touched.back () != lnk->second)
+					touched.push_back (lnk->second);
+			}
+			else if (op != DATAGRAM_OP_RESET)
+			{
+				answer (out, id, it->address_, DATAGRAM_OP_RESET);
+			}
+		}
+		in.clear ();
+	}
+
+	poll_action_ = socket_->poll (callback (this, &DatagramService::on_readable));
+
+	std::sort (touched.begin (), touched.end ());
+	touched.erase (std::unique (touched.begin (), touched.end ()), touched.end ());
+	for (std::vector<DatagramLink*>::iterator t = touched.begin (); t != touched.end (); ++t)
+		(*t)->pump ();
+	if (! out.empty ())
+		socket_->send_batch (out);
+}
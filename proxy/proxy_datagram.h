@@ -0,0 +1,222 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+// File:           proxy_datagram.h                                           //
+// Description:    reliable encoded stream between proxies carried over UDP   //
+// Project:        WANProxy XTech                                             //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef	PROGRAMS_WANPROXY_PROXY_DATAGRAM_H
+#define	PROGRAMS_WANPROXY_PROXY_DATAGRAM_H
+
+#include <deque>
+#include <map>
+#include <vector>
+#include <common/filter.h>
+#include <event/action.h>
+#include <event/event.h>
+#include <event/event_callback.h>
+#include <crypto/crypto_mac.h>
+#include <io/socket/socket.h>
+#include "proxy_link.h"
+
+/*
+ * Every datagram of a link starts with:
+ * 	link[uint32_t] op[uint8_t] ack[uint32_t] window[uint16_t] sack[uint64_t]
+ * where ack is the next packet expected in order, bit i of sack tells that
+ * packet ack + 1 + i has been received as well, and window is how many more
+ * packets the receiver is ready to take.  <DATA> and <FIN> go on with:
+ * 	seq[uint32_t] data[uint8_t x up to DATAGRAM_PAYLOAD]
+ * <FIN> takes a sequence number of its own and ends the stream.  <OPEN> is
+ * repeated by the client until the server answers <ACCEPT>, followed by:
+ * 	cookie[uint8_t x DATAGRAM_COOKIE]
+ * which the client sends back at the end of its next <OPEN>.  The server
+ * keeps nothing until a valid cookie comes back, proof that the client can
+ * receive at its address, and then answers with an <ACK>.  An idle client
+ * sends a <KEEPALIVE>, answered with an <ACK> as well.  <RESET> drops the
+ * link at once.  All the fields are big endian.
+ */
+#define DATAGRAM_OP_OPEN			((uint8_t) 0x01)
+#define DATAGRAM_OP_ACCEPT			((uint8_t) 0x02)
+#define DATAGRAM_OP_DATA			((uint8_t) 0x03)
+#define DATAGRAM_OP_ACK				((uint8_t) 0x04)
+#define DATAGRAM_OP_FIN				((uint8_t) 0x05)
+#define DATAGRAM_OP_RESET			((uint8_t) 0x06)
+#define DATAGRAM_OP_KEEPALIVE		((uint8_t) 0x07)
+
+#define DATAGRAM_HEADER				19
+#define DATAGRAM_DATA_HEADER		(DATAGRAM_HEADER + 4)
+#define DATAGRAM_COOKIE				8
+#define DATAGRAM_PAYLOAD			1200			// stream bytes in a packet, clear of most path MTUs
+#define DATAGRAM_WINDOW				4096			// packets held out of order by the receiver
+#define DATAGRAM_READY_LIMIT		0x400000		// bytes in order not yet read, before the window closes
+#define DATAGRAM_SEND_LIMIT		0x400000		// bytes waiting to be acknowledged before the chain is paused
+#define DATAGRAM_INITIAL_WINDOW	32				// congestion window, in packets, of a new link
+#define DATAGRAM_MINIMUM_WINDOW	4
+#define DATAGRAM_REORDERING		3				// later packets acknowledged before one is taken as lost
+#define DATAGRAM_TICK				10				// milliseconds between checks for timeouts
+#define DATAGRAM_IDLE_TICK			1000			// the same while there is nothing to send or acknowledge
+#define DATAGRAM_INITIAL_RTO		1000
+#define DATAGRAM_MINIMUM_RTO		50
+#define DATAGRAM_MAXIMUM_RTO		5000
+#define DATAGRAM_OPEN_TIMEOUT		10000			// milliseconds to get an <ACCEPT>
+#define DATAGRAM_DEAD_TIMEOUT		30000			// milliseconds without news from the other end
+#define DATAGRAM_KEEPALIVE			10000			// milliseconds of silence before the client checks on the server
+#define DATAGRAM_BATCH				256			// datagrams read from the socket at once
+
+class DatagramService;
+
+/*
+ * One encoded stream carried over UDP with its own reliability: packets
+ * are numbered and acknowledged selectively, those reported missing after
+ * later ones arrived are sent again at once and the rest when the
+ * retransmission timer expires.  The amount in flight is kept within a
+ * congestion window that grows by one packet per round trip, or doubles
+ * while starting, and is cut back by 30% at most once per round trip
+ * when packets are lost, never below a few packets: a loss on a noisy
+ * link does not throw the stream back into a slow start.  All the
+ * datagrams due at once go out with a single system call.
+ */
+class DatagramLink : public PeerLink
+{
+	typedef CallbackAction<DatagramLink, EventCallback> LinkAction;
+
+	struct Packet
+	{
+		Buffer data_;
+		long sent_;
+		uint64_t order_;
+		int sends_;
+		bool acked_, lost_, fin_;
+	};
+
+	/*
+	 * The filter put at the end of a chain, flushed once everything it
+	 * has received has been acknowledged.
+	 */
+	class Sink : public Filter
+	{
+		DatagramLink& link_;
+
+	public:
+		Sink (DatagramLink& link) : link_(link)		{ }
+
+		virtual bool consume (Buffer& buf, int flg = 0)		{ return link_.send (buf); }
+		virtual void flush (int flg)								{ link_.drain (flg); }
+		void drained (int flg)										{ Filter::flush (flg); }
+	};
+
+	LogHandle log_;
+	uint32_t id_;
+	Socket* socket_;
+	DatagramService* service_;
+	std::string address_;
+	Sink* sink_;
+	bool client_, open_, failed_;
+	long opened_, heard_, probed_, spoken_;
+	Buffer cookie_;
+
+	Buffer unsent_;
+	std::deque<Packet> flight_;
+	uint32_t send_base_, send_next_;
+	long in_flight_;
+	long out_bytes_;
+	uint64_t order_, rack_;
+	double cwnd_, ssthresh_;
+	uint32_t recovery_;
+	long srtt_, rttvar_, rto_;
+	uint32_t peer_window_;
+	bool draining_, fin_sent_, fin_acked_;
+	int drain_flags_;
+
+	uint32_t recv_next_;
+	std::map<uint32_t, Buffer> unordered_;
+	Buffer ready_;
+	uint32_t fin_seq_;
+	bool got_fin_, eos_;
+	int ack_due_;
+	bool ack_now_;
+
+	LinkAction* connect_request_;
+	LinkAction* read_request_;
+	Action* connect_action_;
+	Action* poll_action_;
+	Action* tick_action_;
+	Action* deliver_action_;
+	Callback* pause_;
+	Callback* resume_;
+	bool throttled_;
+	bool idling_;
+
+public:
+	DatagramLink (const std::string& name);
+	DatagramLink (const std::string& name, DatagramService* svc, uint32_t id, const std::string& address);
+	virtual ~DatagramLink ();
+
+	virtual Action* connect (SocketAddressFamily family, const std::string& address, EventCallback* cb);
+	virtual void start ();
+	virtual Filter* sink ();
+	virtual void set_throttle (Callback* pause, Callback* resume);
+	virtual Action* read (EventCallback* cb);
+
+	void receive (Buffer& dgm);
+	void pump ();
+	void detach ();
+
+	void on_readable (Event e);
+	void tick (Event e);
+	void deliver (Event e);
+	void connect_cancel ();
+	void read_cancel ();
+
+private:
+	bool send (Buffer& buf);
+	void drain (int flg);
+	void acknowledge (uint32_t ack, uint64_t sack, uint16_t window);
+	void sample (long rtt);
+	void lose (long now);
+	void accept_data (uint32_t seq, Buffer& dgm, bool fin);
+	void header (Buffer& out, uint8_t op);
+	uint16_t window () const;
+	void transmit (std::vector<Datagram>& out);
+	void arm ();
+	void schedule ();
+	void fail (const std::string& why);
+	void opened (Event e);
+
+	static long now ();
+};
+
+/*
+ * Receives the datagrams of every link opened to one interface of the
+ * proxy, and starts a connector for each new one once the client has
+ * returned its cookie: a MAC of its address and link under a key drawn
+ * when the service starts.  It runs on the main event system, where
+ * those connectors live too.
+ */
+class DatagramService
+{
+	LogHandle log_;
+	LinkService service_;
+	Socket* socket_;
+	Action* poll_action_;
+	CryptoMAC::Instance* cookie_mac_;
+	std::map<std::pair<std::string, uint32_t>, DatagramLink*> links_;
+
+public:
+	DatagramService (const LinkService& svc, SocketAddressFamily family, const std::string& address);
+	~DatagramService ();
+
+	void set_service (const LinkService& svc)		{ service_ = svc; }
+	ssize_t transmit (std::vector<Datagram>& out, const std::string& address);
+	void forget (uint32_t id, const std::string& address);
+
+	void on_readable (Event e);
+
+private:
+	bool cookie (Buffer& out, uint32_t id, const std::string& address);
+	bool admit (const Buffer& dgm, uint32_t id, const std::string& address);
+	void answer (std::vector<Datagram>& out, uint32_t id, const std::string& address, uint8_t op);
+};
+
+#endif /* !PROGRAMS_WANPROXY_PROXY_DATAGRAM_H */
@@ -0,0 +1,74 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+// File:           proxy_link.h                                               //
+// Description:    transports carrying an encoded stream other than a socket  //
+// Project:        WANProxy XTech                                             //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef	PROGRAMS_WANPROXY_PROXY_LINK_H
+#define	PROGRAMS_WANPROXY_PROXY_LINK_H
+
+#include <common/filter.h>
+#include <event/action.h>
+#include <event/callback.h>
+#include <event/event_callback.h>
+#include <io/socket/socket_types.h>
+#include "wanproxy_codec.h"
+
+class PeerSelector;
+
+/*
+ * What a connector needs from the way it reaches the peer when that is
+ * not a single stream socket: a connect, a filter to end the outgoing
+ * chain with, flushed once everything has been delivered, and reads of
+ * the incoming stream in order.
+ */
+class PeerLink
+{
+public:
+	virtual ~PeerLink ()		{ }
+
+	virtual Action* connect (SocketAddressFamily family, const std::string& address, EventCallback* cb) = 0;
+	virtual void start () = 0;
+	virtual Filter* sink () = 0;
+	virtual void set_throttle (Callback* pause, Callback* resume) = 0;
+	virtual Action* read (EventCallback* cb) = 0;
+};
+
+/*
+ * What the receiving proxy needs to serve a stream that arrived over a
+ * link.
+ */
+struct LinkService
+{
+	std::string name_;
+	WANProxyCodec* local_codec_;
+	WANProxyCodec* remote_codec_;
+	SocketAddressFamily remote_family_;
+	std::string remote_address_;
+	int workers_;
+};
+
+/*
+ * How a proxy is run as configured: handed whole to its listener and from
+ * there to every connector it spawns.
+ */
+struct ProxySettings
+{
+	bool is_cln_, is_ssh_;
+	int shards_;
+	int workers_;
+	int tunnels_;
+	int pooled_;
+	bool fast_open_;
+	int stripes_;
+	PeerSelector* peers_;
+	bool local_udp_, remote_udp_;
+
+	ProxySettings ()
+	 : is_cln_ (false), is_ssh_ (false), shards_ (1), workers_ (0), tunnels_ (0), pooled_ (0),
+	   fast_open_ (false), stripes_ (0), peers_ (0), local_udp_ (false), remote_udp_ (false)	{ }
+};
+
+#endif /* !PROGRAMS_WANPROXY_PROXY_LINK_H */
@@ -23,9 +23,18 @@
  * SUCH DAMAGE.
  */
 
+#include <algorithm>
+
+#include <common/memory_budget.h>
 #include <event/event_system.h>
+#include <event/worker_pool.h>
 #include "proxy_connector.h"
+#include "proxy_datagram.h"
 #include "proxy_listener.h"
+#include "proxy_peers.h"
+#include "proxy_pool.h"
+#include "proxy_stripe.h"
+#include "proxy_tunnel.h"
 
 ////////////////////////////////////////////////////////////////////////////////
 //                                                                            //
@@ -37,6 +46,10 @@
 //                                                                            //
 ////////////////////////////////////////////////////////////////////////////////
 
+Mutex ProxyListener::deferred_lock_;
+std::list<ProxyListener*> ProxyListener::deferred_;
+std::list<ProxyListener*> ProxyListener::admitting_;
+
 ProxyListener::ProxyListener (const std::string& name,
 										WANProxyCodec* local_codec,
 										WANProxyCodec* remote_codec,
@@ -44,7 +57,7 @@ ProxyListener::ProxyListener (const std::string& name,
 										const std::string& local_address,
 										SocketAddressFamily remote_family,
 										const std::string& remote_address,
-										bool cln, bool ssh)
+										const ProxySettings& settings)
  : log_("/wanproxy/" + name + "/listener"),
    name_(name),
    local_codec_(local_codec),
@@ -53,29 +66,78 @@ ProxyListener::ProxyListener (const std::string& name,
    local_address_(local_address),
    remote_family_(remote_family),
    remote_address_(remote_address),
-	is_cln_(cln),
-	is_ssh_(ssh),
+	settings_(settings),
+	turn_(0),
+	connections_(0),
+	datagrams_(0),
+	system_(0),
    accept_action_(0),
-   stop_action_(0)
+   stop_action_(0),
+   retry_action_(0),
+	deferring_(false)
 {
+	if (settings_.workers_ > 0)
+		worker_pool.launch (settings_.workers_);
 	launch_service ();
+	launch_datagrams ();
+	launch_replicas ();
+}
+
+/*
+ * A replica shares the listening address of its master through SO_REUSEPORT
+ * and lives entirely on one event shard, so that every connection accepted
+ * by it is served by that shard alone.
+ */
+ProxyListener::ProxyListener (const ProxyListener& master, EventSystem& sys)
+ : log_(master.log_),
+   name_(master.name_),
+   local_codec_(master.local_codec_),
+   remote_codec_(master.remote_codec_),
+   local_family_(master.local_family_),
+   local_address_(master.local_address_),
+   remote_family_(master.remote_family_),
+   remote_address_(master.remote_address_),
+	settings_(master.settings_),
+	turn_(0),
+	connections_(0),
+	datagrams_(0),
+	system_(&sys),
+   accept_action_(0),
+   stop_action_(0),
+   retry_action_(0),
+	deferring_(false)
+{
 }
 
 ProxyListener::~ProxyListener ()
 { 
+	retire_replicas ();
+	release_tunnels ();
+	delete connections_;
+	delete datagrams_;
+	{
+		ScopedLock guard (deferred_lock_);
+		deferred_.remove (this);
+		admitting_.remove (this);
+	}
 	if (accept_action_)
 		accept_action_->cancel ();
 	if (stop_action_)
 		stop_action_->cancel ();
+	if (retry_action_)
+		retry_action_->cancel ();
 	close ();
 }
 
 void ProxyListener::launch_service ()
 {
-	if (listen (local_family_, local_address_))
+	if (listen (local_family_, local_address_, (settings_.shards_ > 1), settings_.fast_open_))
 	{
 		accept_action_ = accept (callback (this, &ProxyListener::accept_complete));
-		INFO(log_) << "Listening on: " << getsockname ();
+		if (! system_)
+			INFO(log_) << "Listening on: " << getsockname ();
+		if (settings_.pooled_ > 0 && settings_.tunnels_ <= 0 && settings_.stripes_ <= 1 && ! settings_.remote_udp_ && ! connections_)
+			connections_ = new ProxyPool (name_, remote_family_, remote_address_, settings_.pooled_);
 	}
 	else
 	{
@@ -90,10 +152,18 @@ void ProxyListener::refresh  (const std::string& name,
 										const std::string& local_address,
 										SocketAddressFamily remote_family,
 										const std::string& remote_address,
-										bool cln, bool ssh)
+										const ProxySettings& settings)
 {
-	bool relaunch = (local_address != local_address_);
+	bool relaunch = (local_address != local_address_ || settings.fast_open_ != settings_.fast_open_);
 	bool redirect = (remote_address != remote_address_);
+	bool replicate = (relaunch || redirect || name != name_ || local_codec != local_codec_ || remote_codec != remote_codec_ ||
+							local_family != local_family_ || remote_family != remote_family_ ||
+							settings.is_cln_ != settings_.is_cln_ || settings.is_ssh_ != settings_.is_ssh_ ||
+							settings.workers_ != settings_.workers_ || settings.tunnels_ != settings_.tunnels_ ||
+							settings.pooled_ != settings_.pooled_ || settings.stripes_ != settings_.stripes_ ||
+							settings.peers_ != settings_.peers_ || settings.remote_udp_ != settings_.remote_udp_);
+	bool relisten = (relaunch || settings.local_udp_ != settings_.local_udp_);
+	int shards = settings_.shards_;
 	
    name_ = name;
    local_codec_ = local_codec;
@@ -102,8 +172,20 @@ void ProxyListener::refresh  (const std::string& name,
    local_address_ = local_address;
    remote_family_ = remote_family;
    remote_address_ = remote_address;
-	is_cln_ = cln;
-	is_ssh_ = ssh;
+	settings_ = settings;
+	settings_.shards_ = shards;
+	
+	if (relisten)
+		delete datagrams_, datagrams_ = 0;
+	
+	if (settings_.workers_ > 0)
+		worker_pool.launch (settings_.workers_);
+	
+	if (replicate)
+	{
+		retire_replicas (), release_tunnels ();
+		delete connections_, connections_ = 0;
+	}
 	
 	if (relaunch)
 	{
@@ -111,6 +193,14 @@ void ProxyListener::refresh  (const std::string& name,
 			accept_action_->cancel (), accept_action_ = 0;
 		launch_service ();
 	}
+	launch_datagrams ();
+	
+	if (replicate)
+	{
+		if (settings_.pooled_ > 0 && settings_.tunnels_ <= 0 && settings_.stripes_ <= 1 && ! settings_.remote_udp_ && ! connections_)
+			connections_ = new ProxyPool (name_, remote_family_, remote_address_, settings_.pooled_);
+		launch_replicas ();
+	}
 	
 	if (redirect)
 	{
@@ -124,7 +214,25 @@ void ProxyListener::accept_complete (Event e, Socket* sck)
 	{
 	case Event::Done:
 		DEBUG(log_) << "Accepted client: " << sck->getpeername ();
-		new ProxyConnector (name_, local_codec_, remote_codec_, sck, remote_family_, remote_address_, is_cln_, is_ssh_);
+		if (settings_.tunnels_ > 0 && ! settings_.is_ssh_ && settings_.is_cln_)
+			tunnel ()->open (sck);
+		else if (settings_.tunnels_ > 0 && ! settings_.is_ssh_)
+			new ProxyTunnel (name_, local_codec_, sck, remote_family_, remote_address_);
+		else if (settings_.stripes_ > 1 && ! settings_.is_ssh_ && ! settings_.is_cln_)
+			greet (sck);
+		else
+		{
+			std::string key = (settings_.peers_ ? affinity (sck) : std::string ());
+			PeerAddress peer = { remote_family_, remote_address_ };
+			if (settings_.peers_)
+				settings_.peers_->select (key, peer, std::vector<std::string> ());
+			new ProxyConnector (name_, local_codec_, remote_codec_, sck, peer.family_, peer.address_, settings_, pooled (peer.address_), key);
+		}
+		if (! deferring_ && memory_budget.pressure () == MemoryPressureExhausted)
+		{
+			deferring_ = true;
+			EventSystem::current ().post (callback (this, &ProxyListener::defer));
+		}
 		break;
 	case Event::Error:
 		ERROR(log_) << "Accept error: " << e;
@@ -135,3 +243,244 @@ void ProxyListener::accept_complete (Event e, Socket* sck)
 	}
 }
 
+/*
+ * Client streams are spread over a pool of tunnels to the peer, each of
+ * them opened when first needed and again after it has been lost.
+ */
+ProxyTunnel* ProxyListener::tunnel ()
+{
+	ProxyTunnel* t;
+	unsigned n;
+	
+	if (pool_.size () != (unsigned) settings_.tunnels_)
+		pool_.resize (settings_.tunnels_, 0);
+	
+	n = turn_++ % pool_.size ();
+	if (! (t = pool_[n]))
+	{
+		PeerAddress peer = { remote_family_, remote_address_ };
+		if (settings_.peers_)
+			settings_.peers_->select (affinity (0), peer, std::vector<std::string> ());
+		pool_[n] = t = new ProxyTunnel (name_, remote_codec_, peer.family_, peer.address_, this);
+		t->launch ();
+	}
+	
+	return t;
+}
+
+/*
+ * With several peers, the streams of a branch go where its cache has been
+ * seen, and those of a proxy without cache keep to one peer per client.
+ */
+std::string ProxyListener::affinity (Socket* sck) const
+{
+	uint8_t str[UUID_STRING_SIZE + 1];
+	std::string address;
+	std::string::size_type n;
+	
+	if (remote_codec_ && remote_codec_->xcache_ && remote_codec_->cache_uuid_.to_string (str))
+		return std::string ((const char*) str, UUID_STRING_SIZE);
+	if (local_codec_ && local_codec_->xcache_ && local_codec_->cache_uuid_.to_string (str))
+		return std::string ((const char*) str, UUID_STRING_SIZE);
+	if (! sck)
+		return name_;
+	
+	address = sck->getpeername ();
+	if ((n = address.rfind (':')) != std::string::npos)
+		address.erase (n);
+	return address;
+}
+
+/*
+ * The pool keeps its connections to the first peer only.
+ */
+Socket* ProxyListener::pooled (const std::string& address)
+{
+	if (! connections_ || address != remote_address_)
+		return 0;
+	return connections_->take ();
+}
+
+void ProxyListener::forget (ProxyTunnel* tunnel)
+{
+	std::vector<ProxyTunnel*>::iterator it;
+	
+	for (it = pool_.begin (); it != pool_.end (); ++it)
+		if (*it == tunnel)
+			*it = 0;
+}
+
+/*
+ * Tunnels left without an owner close once their last stream is done.
+ */
+void ProxyListener::release_tunnels ()
+{
+	std::vector<ProxyTunnel*> pool;
+	std::vector<ProxyTunnel*>::iterator it;
+	
+	pool.swap (pool_);
+	for (it = pool.begin (); it != pool.end (); ++it)
+		if (*it)
+			(*it)->detach ();
+}
+
+LinkService ProxyListener::link_service () const
+{
+	LinkService svc;
+	
+	svc.name_ = name_;
+	svc.local_codec_ = local_codec_;
+	svc.remote_codec_ = remote_codec_;
+	svc.remote_family_ = remote_family_;
+	svc.remote_address_ = remote_address_;
+	svc.workers_ = settings_.workers_;
+	return svc;
+}
+
+void ProxyListener::greet (Socket* sck)
+{
+	new StripeGreeting (link_service (), sck);
+}
+
+/*
+ * Streams coming over UDP are received by the master alone, next to its
+ * listening socket, and served on the main event system.
+ */
+void ProxyListener::launch_datagrams ()
+{
+	if (! settings_.local_udp_ || system_)
+		return;
+	
+	if (datagrams_)
+		datagrams_->set_service (link_service ());
+	else
+		datagrams_ = new DatagramService (link_service (), local_family_, local_address_);
+}
+
+void ProxyListener::launch_replicas ()
+{
+	if (settings_.shards_ <= 1 || system_ || ! event_system.launch_shards (settings_.shards_))
+		return;
+	
+	for (int n = 1; n < settings_.shards_; ++n)
+	{
+		EventSystem& sys = event_system.shard (n);
+		ProxyListener* rpl = new ProxyListener (*this, sys);
+		replicas_.push_back (rpl);
+		sys.post (callback (rpl, &ProxyListener::launch_service));
+	}
+	
+	INFO(log_) << "Accepting on " << settings_.shards_ << " shards.";
+}
+
+void ProxyListener::retire_replicas ()
+{
+	std::vector<ProxyListener*>::iterator it;
+	
+	deferred_lock_.lock ();
+	for (it = replicas_.begin (); it != replicas_.end (); ++it)
+		deferred_.remove (*it);
+	deferred_lock_.unlock ();
+	
+	for (it = replicas_.begin (); it != replicas_.end (); ++it)
+		(*it)->system_->post (callback (*it, &ProxyListener::retire));
+	replicas_.clear ();
+}
+
+void ProxyListener::retire ()
+{
+	delete this;
+}
+
+/*
+ * While the memory budget is exhausted no more connections are accepted:
+ * they wait in the backlog of the listening socket until readmit () finds
+ * that memory has been given back, or until the retry timer sees pressure
+ * drop on its own, for memory may be freed by more than connector teardown.
+ * The accept is cancelled from a posted call because the socket still uses
+ * it right after accept_complete ().
+ */
+void ProxyListener::defer ()
+{
+	if (! deferring_)
+		return;
+	
+	if (accept_action_)
+		accept_action_->cancel (), accept_action_ = 0;
+	if (! retry_action_)
+		retry_action_ = EventSystem::current ().track (LISTENER_RETRY_INTERVAL, StreamModeWait, callback (this, &ProxyListener::retry));
+	
+	ScopedLock guard (deferred_lock_);
+	deferred_.push_back (this);
+	INFO(log_) << "Memory budget exhausted, deferring new connections.";
+}
+
+void ProxyListener::admit ()
+{
+	if (retry_action_)
+		retry_action_->cancel (), retry_action_ = 0;
+	if (! deferring_)
+		return;
+	
+	deferring_ = false;
+	if (! accept_action_)
+		accept_action_ = accept (callback (this, &ProxyListener::accept_complete));
+	INFO(log_) << "Accepting connections again.";
+}
+
+void ProxyListener::retry (Event)
+{
+	if (retry_action_)
+		retry_action_->cancel (), retry_action_ = 0;
+	
+	if (memory_budget.pressure () == MemoryPressureExhausted)
+	{
+		retry_action_ = EventSystem::current ().track (LISTENER_RETRY_INTERVAL, StreamModeWait, callback (this, &ProxyListener::retry));
+		return;
+	}
+	
+	{
+		ScopedLock guard (deferred_lock_);
+		deferred_.remove (this);
+	}
+	admit ();
+}
+
+/*
+ * Called from any event loop after memory has been released.  Listeners
+ * are let in again as soon as the budget is no longer exhausted, the same
+ * threshold at which they stopped accepting.  The admission runs later on
+ * the listener's own loop, which may have deleted it by then, so it only
+ * goes ahead while the listener is still in admitting_.
+ */
+void ProxyListener::readmit ()
+{
+	std::list<ProxyListener*>::iterator it;
+	
+	if (memory_budget.pressure () == MemoryPressureExhausted)
+		return;
+	
+	ScopedLock guard (deferred_lock_);
+	for (it = deferred_.begin (); it != deferred_.end (); ++it)
+	{
+		admitting_.push_back (*it);
+		((*it)->system_ ? *(*it)->system_ : event_system).post (callback (new Admission (*it), &Admission::run));
+	}
+	deferred_.clear ();
+}
+
+void ProxyListener::Admission::run ()
+{
+	std::list<ProxyListener*>::iterator it;
+	
+	{
+		ScopedLock guard (deferred_lock_);
+		it = std::find (admitting_.begin (), admitting_.end (), listener_);
+		if (it != admitting_.end ())
+		{
+			admitting_.erase (it);
+			listener_->admit ();
+		}
+	}
+	delete this;
+}
@@ -26,11 +26,22 @@
 #ifndef	PROGRAMS_WANPROXY_PROXY_LISTENER_H
 #define	PROGRAMS_WANPROXY_PROXY_LISTENER_H
 
+#include <list>
+#include <vector>
+#include <common/thread/mutex.h>
 #include <event/action.h>
 #include <event/event.h>
 #include <io/net/tcp_server.h>
+#include "proxy_link.h"
 #include "wanproxy_codec.h"
 
+#define LISTENER_RETRY_INTERVAL	1000		// milliseconds between checks of the memory budget while deferring
+
+class DatagramService;
+class EventSystem;
+class ProxyPool;
+class ProxyTunnel;
+
 ////////////////////////////////////////////////////////////////////////////////
 //                                                                            //
 // File:           proxy_listener.h                                           //
@@ -51,19 +62,61 @@ class ProxyListener : public TCPServer
 	std::string local_address_;
 	SocketAddressFamily remote_family_;
 	std::string remote_address_;
-	bool is_cln_, is_ssh_;
+	ProxySettings settings_;
+	std::vector<ProxyTunnel*> pool_;
+	unsigned turn_;
+	ProxyPool* connections_;
+	DatagramService* datagrams_;
+	EventSystem* system_;
+	std::vector<ProxyListener*> replicas_;
 	Action* accept_action_;
 	Action* stop_action_;
+	Action* retry_action_;
+	bool deferring_;
+	
+	static Mutex deferred_lock_;
+	static std::list<ProxyListener*> deferred_;
+	static std::list<ProxyListener*> admitting_;
+	
+	class Admission
+	{
+		ProxyListener* listener_;
+		
+	public:
+		Admission (ProxyListener* listener) : listener_(listener) { }
+		
+		void run ();
+	};
 	
 public:
 	ProxyListener (const std::string&, WANProxyCodec*, WANProxyCodec*, SocketAddressFamily, const std::string&,
-						SocketAddressFamily, const std::string&, bool cln, bool ssh);
+						SocketAddressFamily, const std::string&, const ProxySettings&);
 	~ProxyListener ();
 
 	void launch_service ();
 	void refresh (const std::string&, WANProxyCodec*, WANProxyCodec*, SocketAddressFamily, const std::string&,
-					  SocketAddressFamily, const std::string&, bool cln, bool ssh);
+					  SocketAddressFamily, const std::string&, const ProxySettings&);
 	void accept_complete (Event e, Socket* client);
+	void forget (ProxyTunnel* tunnel);
+	
+	static void readmit ();
+	
+private:
+	ProxyListener (const ProxyListener&, EventSystem&);
+	
+	void launch_datagrams ();
+	void launch_replicas ();
+	void retire_replicas ();
+	void retire ();
+	ProxyTunnel* tunnel ();
+	std::string affinity (Socket* sck) const;
+	Socket* pooled (const std::string& address);
+	LinkService link_service () const;
+	void greet (Socket* sck);
+	void release_tunnels ();
+	void defer ();
+	void admit ();
+	void retry (Event e);
 };
 
 #endif /* !PROGRAMS_WANPROXY_PROXY_LISTENER_H */
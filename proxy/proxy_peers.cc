@@ -0,0 +1,121 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+// File:           proxy_peers.cc                                             //
+// Description:    choice among several peers by consistent hashing           //
+// Project:        WANProxy XTech                                             //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <algorithm>
+#include "proxy_peers.h"
+
+/*
+ * The state of the peers that remain is kept across a reload.
+ */
+void PeerSelector::assign (const std::vector<PeerAddress>& peers)
+{
+	std::vector<Peer> next;
+	char point[16];
+
+	ScopedLock guard (lock_);
+
+	for (unsigned i = 0; i < peers.size (); ++i)
+	{
+		Peer p = { peers[i], 0, 0 };
+		for (unsigned j = 0; j < peers_.size (); ++j)
+			if (peers_[j].address_.address_ == peers[i].address_)
+				p = peers_[j];
+		next.push_back (p);
+	}
+
+	peers_.swap (next);
+	ring_.clear ();
+	for (unsigned i = 0; i < peers_.size (); ++i)
+	{
+		for (int n = 0; n < PEER_RING_POINTS; ++n)
+		{
+			snprintf (point, sizeof point, "#%d", n);
+			ring_[hash (peers_[i].address_.address_ + point)] = i;
+		}
+	}
+}
+
+/*
+ * Walks the ring from the point of the key and takes the first peer not
+ * tried yet by the caller and not waiting to be retried.  When every peer
+ * is waiting, the first one not tried is returned anyway.
+ */
+bool PeerSelector::select (const std::string& key, PeerAddress& peer, const std::vector<std::string>& tried)
+{
+	std::map<uint32_t, unsigned>::iterator it;
+	time_t now = ::time (0);
+	int fallback = -1;
+
+	ScopedLock guard (lock_);
+
+	if (ring_.empty ())
+		return false;
+
+	it = ring_.lower_bound (hash (key));
+	for (size_t n = 0; n < ring_.size (); ++n, ++it)
+	{
+		if (it == ring_.end ())
+			it = ring_.begin ();
+
+		Peer& p = peers_[it->second];
+		if (std::find (tried.begin (), tried.end (), p.address_.address_) != tried.end ())
+			continue;
+		if (p.retry_ <= now)
+		{
+			peer = p.address_;
+			return true;
+		}
+		if (fallback < 0)
+			fallback = it->second;
+	}
+
+	if (fallback < 0)
+		return false;
+
+	peer = peers_[fallback].address_;
+	return true;
+}
+
+void PeerSelector::report (const std::string& address, bool ok)
+{
+	ScopedLock guard (lock_);
+
+	for (unsigned i = 0; i < peers_.size (); ++i)
+	{
+		Peer& p = peers_[i];
+		if (p.address_.address_ != address)
+			continue;
+		if (ok)
+		{
+			if (p.failures_ > 0)
+				INFO(log_) << "Peer " << address << " is reachable again.";
+			p.failures_ = 0, p.retry_ = 0;
+		}
+		else
+		{
+			int delay = PEER_RETRY_DELAY << (p.failures_ < 6 ? p.failures_ : 6);
+			p.retry_ = ::time (0) + (delay < PEER_RETRY_LIMIT ? delay : PEER_RETRY_LIMIT);
+			if (p.failures_++ == 0)
+				INFO(log_) << "Peer " << address << " is unreachable, failing over.";
+		}
+	}
+}
+
+/*
+ * FNV-1a, which spreads short similar strings well enough for the ring.
+ */
+uint32_t PeerSelector::hash (const std::string& s)
+{
+	uint32_t h = 2166136261u;
+
+	for (std::string::const_iterator it = s.begin (); it != s.end (); ++it)
+		h = (h ^ (uint8_t) *it) * 16777619u;
+
+	return h;
+}
@@ -0,0 +1,65 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+// File:           proxy_peers.h                                              //
+// Description:    choice among several peers by consistent hashing           //
+// Project:        WANProxy XTech                                             //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef	PROGRAMS_WANPROXY_PROXY_PEERS_H
+#define	PROGRAMS_WANPROXY_PROXY_PEERS_H
+
+#include <time.h>
+#include <map>
+#include <vector>
+#include <common/thread/mutex.h>
+#include <io/socket/socket_types.h>
+
+#define PEER_RING_POINTS		64			// positions of each peer in the ring
+#define PEER_RETRY_DELAY		5			// seconds a failed peer is left aside, doubled on each failure
+#define PEER_RETRY_LIMIT		300
+
+struct PeerAddress
+{
+	SocketAddressFamily family_;
+	std::string address_;
+};
+
+/*
+ * Maps every key, the cache UUID of a branch or the address of a client,
+ * to the same peer for as long as that peer is reachable, so each hub node
+ * keeps seeing the data it already holds in its cache.  Adding or removing
+ * a peer only moves the keys that fall next to its points in the ring.  A
+ * peer whose connect fails is skipped for a while, its keys going to the
+ * next one, and is tried again once the delay has passed.  It is shared by
+ * all the shards of a proxy and by its connectors, and lives as long as
+ * the proxy definition.
+ */
+class PeerSelector
+{
+	struct Peer
+	{
+		PeerAddress address_;
+		time_t retry_;
+		int failures_;
+	};
+
+	LogHandle log_;
+	Mutex lock_;
+	std::vector<Peer> peers_;
+	std::map<uint32_t, unsigned> ring_;
+
+public:
+	PeerSelector (const std::string& name) : log_("/wanproxy/" + name + "/peers")		{ }
+
+	void assign (const std::vector<PeerAddress>& peers);
+	size_t size ()															{ ScopedLock guard (lock_); return peers_.size (); }
+
+	bool select (const std::string& key, PeerAddress& peer, const std::vector<std::string>& tried);
+	void report (const std::string& address, bool ok);
+
+private:
+	static uint32_t hash (const std::string& s);
+};
+
+#endif /* !PROGRAMS_WANPROXY_PROXY_PEERS_H */
@@ -0,0 +1,148 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+// File:           proxy_pool.cc                                              //
+// Description:    idle connections to the peer kept ready for new clients    //
+// Project:        WANProxy XTech                                             //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+#include <event/event_callback.h>
+#include <event/event_system.h>
+#include <io/socket/socket.h>
+#include "proxy_pool.h"
+
+ProxyPool::ProxyPool (const std::string& name, SocketAddressFamily family, const std::string& address, int size)
+ : log_("/wanproxy/" + name + "/pool"),
+   family_(family),
+   address_(address),
+   size_(size),
+   check_action_(0),
+   failing_(false)
+{
+	fill ();
+	check_action_ = EventSystem::current ().track (POOL_CHECK_INTERVAL, StreamModeWait, callback (this, &ProxyPool::on_check));
+}
+
+ProxyPool::~ProxyPool ()
+{
+	if (check_action_)
+		check_action_->cancel ();
+	while (! dialers_.empty ())
+		delete dialers_.front (), dialers_.pop_front ();
+	while (! idle_.empty ())
+		discard (idle_.front ().socket_), idle_.pop_front ();
+}
+
+/*
+ * Returns a connected socket, or null when none is ready and the caller
+ * has to connect by itself.
+ */
+Socket* ProxyPool::take ()
+{
+	Socket* sck;
+
+	while (! idle_.empty ())
+	{
+		sck = idle_.front ().socket_;
+		idle_.pop_front ();
+		if (sck->alive ())
+		{
+			fill ();
+			return sck;
+		}
+		discard (sck);
+	}
+
+	fill ();
+	return 0;
+}
+
+void ProxyPool::on_check (Event e)
+{
+	std::list<Idle>::iterator it;
+
+	if (check_action_)
+		check_action_->cancel (), check_action_ = 0;
+
+	for (it = idle_.begin (); it != idle_.end (); )
+	{
+		if (++it->checks_ > POOL_IDLE_CHECKS || ! it->socket_->alive ())
+			discard (it->socket_), it = idle_.erase (it);
+		else
+			++it;
+	}
+
+	failing_ = false;
+	fill ();
+	check_action_ = EventSystem::current ().track (POOL_CHECK_INTERVAL, StreamModeWait, callback (this, &ProxyPool::on_check));
+}
+
+void ProxyPool::fill ()
+{
+	Socket* sck;
+
+	while (! failing_ && (int) (idle_.size () + dialers_.size ()) < size_)
+	{
+		if ((sck = Socket::create (family_, SocketTypeStream, "tcp", address_)))
+			dialers_.push_back (new Dialer (*this, sck, address_));
+		else
+			failing_ = true;
+	}
+}
+
+void ProxyPool::settle (Dialer* d, Socket* sck)
+{
+	dialers_.remove (d);
+	delete d;
+
+	if (sck)
+	{
+		Idle i = { sck, 0 };
+		idle_.push_back (i);
+		failing_ = false;
+		fill ();
+	}
+	else
+	{
+		if (! failing_)
+			INFO(log_) << "Could not connect to peer " << address_ << ", retrying later.";
+		failing_ = true;
+	}
+}
+
+void ProxyPool::discard (Socket* sck)
+{
+	sck->close ();
+	delete sck;
+}
+
+// Dialer
+
+ProxyPool::Dialer::Dialer (ProxyPool& pool, Socket* sck, const std::string& address)
+ : pool_(pool),
+   socket_(sck),
+   action_(0)
+{
+	action_ = socket_->connect (address, callback (this, &ProxyPool::Dialer::connect_complete));
+}
+
+ProxyPool::Dialer::~Dialer ()
+{
+	if (action_)
+		action_->cancel ();
+	if (socket_)
+		pool_.discard (socket_);
+}
+
+void ProxyPool::Dialer::connect_complete (Event e)
+{
+	Socket* sck = 0;
+
+	if (action_)
+		action_->cancel (), action_ = 0;
+
+	if (e.type_ == Event::Done)
+		sck = socket_, socket_ = 0;
+
+	pool_.settle (this, sck);
+}
@@ -0,0 +1,73 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+// File:           proxy_pool.h                                               //
+// Description:    idle connections to the peer kept ready for new clients    //
+// Project:        WANProxy XTech                                             //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef	PROGRAMS_WANPROXY_PROXY_POOL_H
+#define	PROGRAMS_WANPROXY_PROXY_POOL_H
+
+#include <list>
+#include <event/action.h>
+#include <event/event.h>
+#include <io/socket/socket_types.h>
+
+#define POOL_CHECK_INTERVAL		10000		// milliseconds between checks of the idle connections
+#define POOL_IDLE_CHECKS			6			// checks an idle connection lives through before it is renewed
+
+class Socket;
+
+/*
+ * Keeps a number of connections to the peer established in advance, so
+ * that an accepted client does not wait a round trip before its first byte
+ * can be sent.  Idle connections are checked periodically, replaced when
+ * the peer has closed them or after a while, and the pool is filled again
+ * as they are taken.  After a failed connect nothing more is attempted
+ * until the next check, so an unreachable peer is not flooded.
+ */
+class ProxyPool
+{
+	class Dialer
+	{
+		ProxyPool& pool_;
+		Socket* socket_;
+		Action* action_;
+
+	public:
+		Dialer (ProxyPool& pool, Socket* sck, const std::string& address);
+		~Dialer ();
+
+		void connect_complete (Event e);
+	};
+
+	struct Idle
+	{
+		Socket* socket_;
+		int checks_;
+	};
+
+	LogHandle log_;
+	SocketAddressFamily family_;
+	std::string address_;
+	int size_;
+	std::list<Dialer*> dialers_;
+	std::list<Idle> idle_;
+	Action* check_action_;
+	bool failing_;
+
+public:
+	ProxyPool (const std::string& name, SocketAddressFamily family, const std::string& address, int size);
+	~ProxyPool ();
+
+	Socket* take ();
+	void on_check (Event e);
+
+private:
+	void fill ();
+	void settle (Dialer* d, Socket* sck);
+	void discard (Socket* sck);
+};
+
+#endif /* !PROGRAMS_WANPROXY_PROXY_POOL_H */
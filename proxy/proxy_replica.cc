@@ -0,0 +1,491 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+// File:           proxy_replica.cc                                           //
+// Description:    replication of the disk caches to a standby node           //
+// Project:        WANProxy XTech                                             //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+#include <event/event_callback.h>
+#include <event/event_system.h>
+#include <io/socket/socket.h>
+#include "proxy_replica.h"
+#include "wanproxy.h"
+
+#define REPLICA_MAX_MESSAGE		(sizeof (COSSStripe) + sizeof (uint64_t))
+
+static void put_message (Buffer& out, uint8_t op, const UUID& uuid, const uint8_t* data, uint32_t len)
+{
+	out.append (op);
+	out.append (&len);
+	uuid.encode (out);
+	if (len)
+		out.append (data, len);
+}
+
+/*
+ * Tells whether a whole message is waiting at the start of the buffer,
+ * and removes its header in that case.
+ */
+static bool get_message (Buffer& in, uint8_t& op, UUID& uuid, uint32_t& len, bool& bad)
+{
+	bad = false;
+	if (in.length () < REPLICA_HEADER_SIZE)
+		return false;
+	in.extract (&len, 1);
+	if (len > REPLICA_MAX_MESSAGE)
+	{
+		bad = true;
+		return false;
+	}
+	if (in.length () < REPLICA_HEADER_SIZE + len)
+		return false;
+	op = in.peek ();
+	in.skip (1 + sizeof len);
+	if (! uuid.decode (in))
+	{
+		bad = true;
+		return false;
+	}
+	return true;
+}
+
+// Replica
+
+CacheReplica::CacheReplica (SocketAddressFamily family, const std::string& address)
+ : log_("/wanproxy/replica"),
+   system_(EventSystem::current ()),
+   family_(family),
+   address_(address),
+   socket_(0),
+   connect_action_(0),
+   read_action_(0),
+   write_action_(0),
+   retry_action_(0),
+   waking_(0),
+   connected_(false),
+   turn_(0)
+{
+	scratch_ = new COSSStripe;
+}
+
+CacheReplica::~CacheReplica ()
+{
+	std::vector<Target>::iterator it;
+
+	for (it = targets_.begin (); it != targets_.end (); ++it)
+		it->cache_->set_replica (0);
+	if (retry_action_)
+		retry_action_->cancel ();
+	reset ();
+	delete scratch_;
+}
+
+/*
+ * Called from any thread as caches are opened.
+ */
+void CacheReplica::attach (XCodecCacheCOSS* cache)
+{
+	std::vector<Target>::iterator it;
+
+	{
+		ScopedLock guard (lock_);
+		for (it = targets_.begin (); it != targets_.end (); ++it)
+			if (it->cache_ == cache)
+				return;
+		Target t = { cache, false, false, 0 };
+		targets_.push_back (t);
+	}
+
+	cache->set_replica (this);
+	stored (cache);
+}
+
+void CacheReplica::stored (XCodecCacheCOSS* cache)
+{
+	if (waking_.cmpset (0, 1))
+		system_.post (callback (this, &CacheReplica::wake));
+}
+
+void CacheReplica::wake ()
+{
+	waking_.cmpset (1, 0);
+
+	if (connected_)
+	{
+		if (! write_action_)
+			pump ();
+	}
+	else if (! socket_ && ! retry_action_)
+	{
+		if ((socket_ = Socket::create (family_, SocketTypeStream, "tcp", address_)))
+			connect_action_ = socket_->connect (address_, callback (this, &CacheReplica::connect_complete));
+		if (! connect_action_)
+		{
+			reset ();
+			retry_action_ = system_.track (REPLICA_RETRY_INTERVAL, StreamModeWait, callback (this, &CacheReplica::retry));
+		}
+	}
+}
+
+void CacheReplica::connect_complete (Event e)
+{
+	if (connect_action_)
+		connect_action_->cancel (), connect_action_ = 0;
+
+	if (e.type_ != Event::Done)
+	{
+		DEBUG(log_) << "Could not connect to standby " << address_ << ": " << e;
+		reset ();
+		retry_action_ = system_.track (REPLICA_RETRY_INTERVAL, StreamModeWait, callback (this, &CacheReplica::retry));
+		return;
+	}
+
+	INFO(log_) << "Replicating caches to " << address_;
+	connected_ = true;
+	read_action_ = socket_->read (callback (this, &CacheReplica::read_complete));
+	pump ();
+}
+
+void CacheReplica::read_complete (Event e)
+{
+	if (read_action_)
+		read_action_->cancel (), read_action_ = 0;
+
+	if (e.type_ == Event::Done)
+	{
+		inbound_.append (e.buffer_);
+		if (receive ())
+		{
+			read_action_ = socket_->read (callback (this, &CacheReplica::read_complete));
+			if (! write_action_)
+				pump ();
+			return;
+		}
+	}
+
+	INFO(log_) << "Lost the connection to standby " << address_;
+	reset ();
+	retry_action_ = system_.track (REPLICA_RETRY_INTERVAL, StreamModeWait, callback (this, &CacheReplica::retry));
+}
+
+void CacheReplica::write_complete (Event e)
+{
+	if (write_action_)
+		write_action_->cancel (), write_action_ = 0;
+
+	if (e.type_ == Event::Done)
+	{
+		pump ();
+		return;
+	}
+
+	INFO(log_) << "Could not write to standby " << address_ << ": " << e;
+	reset ();
+	retry_action_ = system_.track (REPLICA_RETRY_INTERVAL, StreamModeWait, callback (this, &CacheReplica::retry));
+}
+
+void CacheReplica::retry (Event e)
+{
+	if (retry_action_)
+		retry_action_->cancel (), retry_action_ = 0;
+	wake ();
+}
+
+/*
+ * Offers first any cache the standby has not heard of, then sends the
+ * next stripe of the caches whose position is known, taking them in turn.
+ */
+void CacheReplica::pump ()
+{
+	std::vector<Target> targets;
+	Buffer out;
+
+	if (! connected_ || write_action_)
+		return;
+
+	{
+		ScopedLock guard (lock_);
+		for (unsigned i = 0; i < targets_.size (); ++i)
+		{
+			Target& t = targets_[i];
+			if (! t.offered_)
+			{
+				uint64_t size = t.cache_->nominal_size ();
+				put_message (out, REPLICA_OP_OFFER, t.cache_->identifier (), (const uint8_t*) &size, sizeof size);
+				t.offered_ = true;
+			}
+		}
+		targets = targets_;
+	}
+
+	for (unsigned n = 0; out.empty () && n < targets.size (); ++n)
+	{
+		Target& t = targets[turn_++ % targets.size ()];
+		if (t.known_ && t.cache_->copy_stripe (t.serial_, *scratch_))
+		{
+			put_message (out, REPLICA_OP_STRIPE, t.cache_->identifier (), (const uint8_t*) scratch_, sizeof (COSSStripe));
+			ScopedLock guard (lock_);
+			for (unsigned i = 0; i < targets_.size (); ++i)
+				if (targets_[i].cache_ == t.cache_)
+					targets_[i].serial_ = scratch_->header.metadata.serial_number;
+		}
+	}
+
+	if (! out.empty ())
+		write_action_ = socket_->write (out, callback (this, &CacheReplica::write_complete));
+}
+
+bool CacheReplica::receive ()
+{
+	uint8_t op;
+	UUID uuid;
+	uint32_t len;
+	uint64_t serial;
+	bool bad;
+
+	while (get_message (inbound_, op, uuid, len, bad))
+	{
+		if (op != REPLICA_OP_HAVE || len != sizeof serial)
+		{
+			ERROR(log_) << "Unexpected message from standby: " << (unsigned) op;
+			return false;
+		}
+		inbound_.moveout ((uint8_t*) &serial, sizeof serial);
+
+		ScopedLock guard (lock_);
+		for (unsigned i = 0; i < targets_.size (); ++i)
+		{
+			Target& t = targets_[i];
+			if (! (t.cache_->identifier () < uuid) && ! (uuid < t.cache_->identifier ()))
+			{
+				t.known_ = true, t.serial_ = serial;
+				DEBUG(log_) << "Standby holds " << uuid << " up to stripe " << serial;
+			}
+		}
+	}
+
+	return (! bad);
+}
+
+/*
+ * Everything not confirmed by the standby is offered again on the next
+ * connection.
+ */
+void CacheReplica::reset ()
+{
+	std::vector<Target>::iterator it;
+
+	if (connect_action_)
+		connect_action_->cancel (), connect_action_ = 0;
+	if (read_action_)
+		read_action_->cancel (), read_action_ = 0;
+	if (write_action_)
+		write_action_->cancel (), write_action_ = 0;
+	if (socket_)
+	{
+		socket_->close ();
+		delete socket_;
+		socket_ = 0;
+	}
+	connected_ = false;
+	inbound_.clear ();
+
+	ScopedLock guard (lock_);
+	for (it = targets_.begin (); it != targets_.end (); ++it)
+		it->offered_ = it->known_ = false;
+}
+
+// Standby
+
+CacheStandby::CacheStandby (SocketAddressFamily family, const std::string& address, const std::string& path, size_t size)
+ : log_("/wanproxy/standby"),
+   path_(path),
+   size_(size ? size : CACHE_BASIC_SIZE),
+   accept_action_(0)
+{
+	if (listen (family, address))
+	{
+		accept_action_ = accept (callback (this, &CacheStandby::accept_complete));
+		INFO(log_) << "Accepting cache replicas on: " << getsockname ();
+	}
+	else
+	{
+		ERROR(log_) << "Unable to listen for cache replicas on: " << address;
+	}
+}
+
+CacheStandby::~CacheStandby ()
+{
+	if (accept_action_)
+		accept_action_->cancel ();
+	close ();
+}
+
+void CacheStandby::accept_complete (Event e, Socket* sck)
+{
+	std::string host;
+
+	switch (e.type_)
+	{
+	case Event::Done:
+		host = sck->getpeername ();
+		host.erase (host.rfind (':') == std::string::npos ? host.length () : host.rfind (':'));
+		if (primaries_.find (host) == primaries_.end ())
+		{
+			ERROR(log_) << "Refused replica from unknown host: " << sck->getpeername ();
+			sck->close ();
+			delete sck;
+			break;
+		}
+		INFO(log_) << "Primary connected: " << sck->getpeername ();
+		new StandbySession (path_, size_, sck);
+		break;
+	case Event::Error:
+		ERROR(log_) << "Accept error: " << e;
+		break;
+	default:
+		ERROR(log_) << "Unexpected event: " << e;
+		break;
+	}
+}
+
+// Session
+
+StandbySession::StandbySession (const std::string& path, size_t size, Socket* sck)
+ : log_("/wanproxy/standby"),
+   system_(EventSystem::current ()),
+   path_(path),
+   size_(size),
+   socket_(sck),
+   read_action_(0),
+   write_action_(0),
+   stop_action_(0)
+{
+	scratch_ = new COSSStripe;
+	stop_action_ = system_.register_interest (EventInterestStop, callback (this, &StandbySession::stop));
+	read_action_ = socket_->read (callback (this, &StandbySession::read_complete));
+}
+
+StandbySession::~StandbySession ()
+{
+	if (read_action_)
+		read_action_->cancel ();
+	if (write_action_)
+		write_action_->cancel ();
+	if (stop_action_)
+		stop_action_->cancel ();
+	socket_->close ();
+	delete socket_;
+	delete scratch_;
+}
+
+void StandbySession::read_complete (Event e)
+{
+	if (read_action_)
+		read_action_->cancel (), read_action_ = 0;
+
+	if (e.type_ == Event::Done)
+	{
+		inbound_.append (e.buffer_);
+		if (receive ())
+		{
+			read_action_ = socket_->read (callback (this, &StandbySession::read_complete));
+			return;
+		}
+	}
+	else if (e.type_ == Event::EOS)
+	{
+		INFO(log_) << "Primary disconnected.";
+	}
+
+	delete this;
+}
+
+void StandbySession::write_complete (Event e)
+{
+	if (write_action_)
+		write_action_->cancel (), write_action_ = 0;
+
+	if (e.type_ == Event::Done)
+		send ();
+}
+
+void StandbySession::stop ()
+{
+	delete this;
+}
+
+bool StandbySession::receive ()
+{
+	XCodecCacheCOSS* cache;
+	uint8_t op;
+	UUID uuid;
+	uint32_t len;
+	uint64_t value;
+	bool bad;
+
+	while (get_message (inbound_, op, uuid, len, bad))
+	{
+		switch (op)
+		{
+		case REPLICA_OP_OFFER:
+			if (len != sizeof value)
+				return false;
+			inbound_.moveout ((uint8_t*) &value, sizeof value);
+			if (! (cache = cache_for (uuid, value)))
+				return false;
+			value = cache->replicated_serial ();
+			put_message (outbound_, REPLICA_OP_HAVE, uuid, (const uint8_t*) &value, sizeof value);
+			DEBUG(log_) << "Holding " << uuid << " up to stripe " << value;
+			break;
+		case REPLICA_OP_STRIPE:
+			if (len != sizeof (COSSStripe))
+				return false;
+			inbound_.moveout ((uint8_t*) scratch_, sizeof (COSSStripe));
+			if (! (cache = cache_for (uuid, 0)))
+				return false;
+			if (! cache->install_stripe (*scratch_))
+				DEBUG(log_) << "Stripe " << scratch_->header.metadata.serial_number << " of " << uuid << " not installed.";
+			break;
+		default:
+			ERROR(log_) << "Unexpected message from primary: " << (unsigned) op;
+			return false;
+		}
+	}
+
+	send ();
+	return (! bad);
+}
+
+/*
+ * The caches of the primary are opened here as they would be when the
+ * branches connect, with the size the primary gives for them up to the
+ * one configured for the standby.
+ */
+XCodecCacheCOSS* StandbySession::cache_for (const UUID& uuid, uint64_t size)
+{
+	UUID id = uuid;
+	XCodecCache* cache;
+	XCodecCacheCOSS* coss;
+
+	if (size > size_)
+	{
+		INFO(log_) << "Cache " << uuid << " offered with " << size << " MB, kept to " << size_ << " MB.";
+		size = size_;
+	}
+	if (! (cache = wanproxy.find_cache (id)) && size)
+		cache = wanproxy.add_cache (WANProxyConfigCacheCOSS, path_, size, id);
+	if (! (coss = dynamic_cast<XCodecCacheCOSS*> (cache)))
+		ERROR(log_) << "No disk cache for " << uuid;
+	return coss;
+}
+
+void StandbySession::send ()
+{
+	if (! write_action_ && ! outbound_.empty ())
+	{
+		write_action_ = socket_->write (outbound_, callback (this, &StandbySession::write_complete));
+		outbound_.clear ();
+	}
+}
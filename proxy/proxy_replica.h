@@ -0,0 +1,143 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+// File:           proxy_replica.h                                            //
+// Description:    replication of the disk caches to a standby node           //
+// Project:        WANProxy XTech                                             //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef	PROGRAMS_WANPROXY_PROXY_REPLICA_H
+#define	PROGRAMS_WANPROXY_PROXY_REPLICA_H
+
+#include <set>
+#include <vector>
+#include <common/buffer.h>
+#include <common/thread/atomic.h>
+#include <common/thread/mutex.h>
+#include <event/action.h>
+#include <event/event.h>
+#include <io/net/tcp_server.h>
+#include <xcodec/cache/coss/xcodec_cache_coss.h>
+
+/*
+ * Messages on a replication connection:
+ * 	op[uint8_t] length[uint32_t] cache[UUID string] payload[uint8_t x length]
+ * OFFER carries the nominal size of the cache, HAVE the serial number the
+ * standby holds for it, and STRIPE a whole COSS stripe.
+ */
+#define REPLICA_OP_OFFER			1
+#define REPLICA_OP_HAVE				2
+#define REPLICA_OP_STRIPE			3
+#define REPLICA_HEADER_SIZE		(1 + sizeof (uint32_t) + UUID_STRING_SIZE)
+#define REPLICA_RETRY_INTERVAL	5000			// milliseconds before the standby is dialed again
+
+class EventSystem;
+
+/*
+ * Sends every stripe written by the attached caches to a standby proxy,
+ * so that it can take over with the same cache contents.  The caches are
+ * not copied when written: the replica just wakes up and asks each cache
+ * for the next stored stripe above the serial number the standby has
+ * confirmed, one at a time as the previous one is sent.  After a lost
+ * connection the standby reports again where it stands and the transfer
+ * resumes from there.  It lives on the event system it was created on,
+ * which the caches of other loops wake it up through.
+ */
+class CacheReplica : public COSSReplica
+{
+	struct Target
+	{
+		XCodecCacheCOSS* cache_;
+		bool offered_, known_;
+		uint64_t serial_;
+	};
+
+	LogHandle log_;
+	EventSystem& system_;
+	SocketAddressFamily family_;
+	std::string address_;
+	Mutex lock_;
+	std::vector<Target> targets_;
+	Socket* socket_;
+	Action* connect_action_;
+	Action* read_action_;
+	Action* write_action_;
+	Action* retry_action_;
+	Atomic<int> waking_;
+	bool connected_;
+	unsigned turn_;
+	Buffer inbound_;
+	COSSStripe* scratch_;
+
+public:
+	CacheReplica (SocketAddressFamily family, const std::string& address);
+	virtual ~CacheReplica ();
+
+	const std::string& address () const		{ return address_; }
+	void attach (XCodecCacheCOSS* cache);
+	virtual void stored (XCodecCacheCOSS* cache);
+
+	void wake ();
+	void connect_complete (Event e);
+	void read_complete (Event e);
+	void write_complete (Event e);
+	void retry (Event e);
+
+private:
+	void pump ();
+	bool receive ();
+	void reset ();
+};
+
+/*
+ * Accepts the connections of primaries and stores the stripes they send
+ * into local caches of the same identity, created with the settings of
+ * the codec that enabled it.  Only the hosts of the configured primaries
+ * are served, and no cache they offer grows beyond the configured size.
+ */
+class CacheStandby : public TCPServer
+{
+	LogHandle log_;
+	std::string path_;
+	size_t size_;
+	std::set<std::string> primaries_;
+	Action* accept_action_;
+
+public:
+	CacheStandby (SocketAddressFamily family, const std::string& address, const std::string& path, size_t size);
+	~CacheStandby ();
+
+	void set_cache (const std::string& path, size_t size)		{ path_ = path, size_ = size; }
+	void allow (const std::string& host)								{ primaries_.insert ('[' + host + ']'); }
+	void accept_complete (Event e, Socket* sck);
+};
+
+class StandbySession
+{
+	LogHandle log_;
+	EventSystem& system_;
+	std::string path_;
+	size_t size_;
+	Socket* socket_;
+	Action* read_action_;
+	Action* write_action_;
+	Action* stop_action_;
+	Buffer inbound_;
+	Buffer outbound_;
+	COSSStripe* scratch_;
+
+public:
+	StandbySession (const std::string& path, size_t size, Socket* sck);
+	~StandbySession ();
+
+	void read_complete (Event e);
+	void write_complete (Event e);
+	void stop ();
+
+private:
+	bool receive ();
+	XCodecCacheCOSS* cache_for (const UUID& uuid, uint64_t size);
+	void send ();
+};
+
+#endif /* !PROGRAMS_WANPROXY_PROXY_REPLICA_H */
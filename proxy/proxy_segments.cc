@@ -0,0 +1,534 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+// File:           proxy_segments.cc                                          //
+// Description:    lookup of missing segments in caches of the local network  //
+// Project:        WANProxy XTech                                             //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+#include <event/event_callback.h>
+#include <event/event_system.h>
+#include <io/socket/socket.h>
+#include <xcodec/xcodec.h>
+#include "proxy_segments.h"
+#include "wanproxy.h"
+
+#define SEGMENT_REQUEST_HEADER	(sizeof (uint32_t) + UUID_STRING_SIZE)
+
+// Query
+
+SegmentQuery::SegmentQuery (const UUID& cache, Callback* done)
+ : refs_(1),
+   cancelled_(0),
+   system_(EventSystem::current ()),
+   done_(done),
+   cache_(cache)
+{
+}
+
+SegmentQuery::~SegmentQuery ()
+{
+	delete done_;
+}
+
+/*
+ * Called on the thread of the client, with a reference held for the
+ * delivery.
+ */
+void SegmentQuery::complete ()
+{
+	system_.post (callback (this, &SegmentQuery::deliver));
+}
+
+void SegmentQuery::deliver ()
+{
+	if (! cancelled ())
+		done_->execute ();
+	release ();
+}
+
+// Client
+
+SegmentClient::SegmentClient (SocketAddressFamily family, const std::string& address)
+ : log_("/wanproxy/segments"),
+   system_(EventSystem::current ()),
+   family_(family),
+   address_(address),
+   socket_(0),
+   connect_action_(0),
+   read_action_(0),
+   write_action_(0),
+   retry_action_(0),
+   tick_action_(0),
+   waking_(0),
+   connected_(false),
+   down_(false)
+{
+}
+
+SegmentClient::~SegmentClient ()
+{
+	if (retry_action_)
+		retry_action_->cancel ();
+	fail ();
+}
+
+/*
+ * Called from the thread of any decoder.
+ */
+void SegmentClient::query (SegmentQuery* q)
+{
+	q->hold ();
+
+	{
+		ScopedLock guard (lock_);
+		if (! down_)
+		{
+			queue_.push_back (q);
+			q = 0;
+		}
+	}
+
+	if (q)
+		q->complete ();
+	else if (waking_.cmpset (0, 1))
+		system_.post (callback (this, &SegmentClient::wake));
+}
+
+void SegmentClient::wake ()
+{
+	waking_.cmpset (1, 0);
+
+	if (connected_)
+	{
+		send ();
+	}
+	else if (! socket_ && ! retry_action_)
+	{
+		if ((socket_ = Socket::create (family_, SocketTypeStream, "tcp", address_)))
+			connect_action_ = socket_->connect (address_, callback (this, &SegmentClient::connect_complete));
+		if (! connect_action_)
+		{
+			fail ();
+			retry_action_ = system_.track (SEGMENT_RETRY_INTERVAL, StreamModeWait, callback (this, &SegmentClient::retry));
+		}
+	}
+}
+
+void SegmentClient::connect_complete (Event e)
+{
+	if (connect_action_)
+		connect_action_->cancel (), connect_action_ = 0;
+
+	if (e.type_ != Event::Done)
+	{
+		INFO(log_) << "Could not connect to segment service " << address_ << ": " << e;
+		fail ();
+		retry_action_ = system_.track (SEGMENT_RETRY_INTERVAL, StreamModeWait, callback (this, &SegmentClient::retry));
+		return;
+	}
+
+	INFO(log_) << "Connected to segment service " << address_;
+	connected_ = true;
+	read_action_ = socket_->read (callback (this, &SegmentClient::read_complete));
+	tick_action_ = system_.track (SEGMENT_QUERY_TICK, StreamModeWait, callback (this, &SegmentClient::tick));
+	send ();
+}
+
+void SegmentClient::read_complete (Event e)
+{
+	if (read_action_)
+		read_action_->cancel (), read_action_ = 0;
+
+	if (e.type_ == Event::Done)
+	{
+		inbound_.append (e.buffer_);
+		if (receive ())
+		{
+			read_action_ = socket_->read (callback (this, &SegmentClient::read_complete));
+			return;
+		}
+	}
+
+	INFO(log_) << "Lost the connection to segment service " << address_;
+	fail ();
+	retry_action_ = system_.track (SEGMENT_RETRY_INTERVAL, StreamModeWait, callback (this, &SegmentClient::retry));
+}
+
+void SegmentClient::write_complete (Event e)
+{
+	if (write_action_)
+		write_action_->cancel (), write_action_ = 0;
+
+	if (e.type_ == Event::Done)
+	{
+		send ();
+		return;
+	}
+
+	fail ();
+	retry_action_ = system_.track (SEGMENT_RETRY_INTERVAL, StreamModeWait, callback (this, &SegmentClient::retry));
+}
+
+void SegmentClient::retry (Event e)
+{
+	if (retry_action_)
+		retry_action_->cancel (), retry_action_ = 0;
+
+	{
+		ScopedLock guard (lock_);
+		down_ = false;
+	}
+	wake ();
+}
+
+/*
+ * A query left unanswered for too long is completed empty, and its
+ * answer skipped when it finally arrives.  It is held until then, as
+ * the answer is checked against it.
+ */
+void SegmentClient::tick (Event e)
+{
+	std::deque<Sent>::iterator it;
+
+	if (tick_action_)
+		tick_action_->cancel (), tick_action_ = 0;
+
+	for (it = sent_.begin (); it != sent_.end (); ++it)
+	{
+		if (! it->expired_ && ++it->ticks_ >= SEGMENT_QUERY_TICKS)
+		{
+			it->expired_ = true;
+			it->query_->hold ();
+			it->query_->complete ();
+		}
+	}
+
+	tick_action_ = system_.track (SEGMENT_QUERY_TICK, StreamModeWait, callback (this, &SegmentClient::tick));
+}
+
+void SegmentClient::send ()
+{
+	std::deque<SegmentQuery*> queue;
+	Buffer out;
+
+	if (! connected_ || write_action_)
+		return;
+
+	{
+		ScopedLock guard (lock_);
+		queue.swap (queue_);
+	}
+
+	while (! queue.empty ())
+	{
+		SegmentQuery* q = queue.front ();
+		queue.pop_front ();
+		if (q->cancelled ())
+		{
+			q->release ();
+			continue;
+		}
+
+		uint32_t n = (q->hashes_.size () < SEGMENT_QUERY_LIMIT ? q->hashes_.size () : SEGMENT_QUERY_LIMIT);
+		out.append (&n);
+		q->cache_.encode (out);
+		for (uint32_t i = 0; i < n; ++i)
+			out.append (&q->hashes_[i]);
+		q->hashes_.resize (n);
+
+		Sent s = { q, 0, false };
+		sent_.push_back (s);
+	}
+
+	if (! out.empty ())
+		write_action_ = socket_->write (out, callback (this, &SegmentClient::write_complete));
+}
+
+bool SegmentClient::receive ()
+{
+	uint32_t count;
+	uint8_t found;
+	unsigned len;
+
+	while (inbound_.length () >= sizeof count)
+	{
+		if (sent_.empty ())
+		{
+			ERROR(log_) << "Answer without a query from segment service.";
+			return false;
+		}
+
+		inbound_.extract (&count);
+		if (count != sent_.front ().query_->hashes_.size ())
+		{
+			ERROR(log_) << "Answer does not match its query.";
+			return false;
+		}
+
+		len = sizeof count;
+		for (uint32_t i = 0; i < count; ++i)
+		{
+			if (inbound_.length () < len + 1)
+				return true;
+			inbound_.extract (&found, len);
+			len += 1 + (found ? XCODEC_SEGMENT_LENGTH : 0);
+		}
+		if (inbound_.length () < len)
+			return true;
+
+		Sent s = sent_.front ();
+		sent_.pop_front ();
+		inbound_.skip (sizeof count);
+		for (uint32_t i = 0; i < count; ++i)
+		{
+			found = inbound_.peek ();
+			inbound_.skip (1);
+			if (found)
+			{
+				if (! s.expired_)
+					s.query_->segments_.append (inbound_, XCODEC_SEGMENT_LENGTH);
+				inbound_.skip (XCODEC_SEGMENT_LENGTH);
+			}
+		}
+
+		if (s.expired_)
+			s.query_->release ();
+		else
+			s.query_->complete ();
+	}
+
+	return true;
+}
+
+/*
+ * Completes everything pending with nothing found, and keeps completing
+ * new queries that way until the service is tried again.
+ */
+void SegmentClient::fail ()
+{
+	std::deque<SegmentQuery*> queue;
+
+	if (connect_action_)
+		connect_action_->cancel (), connect_action_ = 0;
+	if (read_action_)
+		read_action_->cancel (), read_action_ = 0;
+	if (write_action_)
+		write_action_->cancel (), write_action_ = 0;
+	if (tick_action_)
+		tick_action_->cancel (), tick_action_ = 0;
+	if (socket_)
+	{
+		socket_->close ();
+		delete socket_;
+		socket_ = 0;
+	}
+	connected_ = false;
+	inbound_.clear ();
+
+	{
+		ScopedLock guard (lock_);
+		queue.swap (queue_);
+		down_ = true;
+	}
+
+	for (; ! queue.empty (); queue.pop_front ())
+		queue.front ()->complete ();
+	for (; ! sent_.empty (); sent_.pop_front ())
+	{
+		if (sent_.front ().expired_)
+			sent_.front ().query_->release ();
+		else
+			sent_.front ().query_->complete ();
+	}
+}
+
+// Service
+
+SegmentService::SegmentService (SocketAddressFamily family, const std::string& address)
+ : log_("/wanproxy/segments"),
+   accept_action_(0)
+{
+	if (listen (family, address))
+	{
+		accept_action_ = accept (callback (this, &SegmentService::accept_complete));
+		INFO(log_) << "Serving segments on: " << getsockname ();
+	}
+	else
+	{
+		ERROR(log_) << "Unable to serve segments on: " << address;
+	}
+}
+
+SegmentService::~SegmentService ()
+{
+	if (accept_action_)
+		accept_action_->cancel ();
+	close ();
+}
+
+void SegmentService::accept_complete (Event e, Socket* sck)
+{
+	std::string host;
+
+	switch (e.type_)
+	{
+	case Event::Done:
+		host = sck->getpeername ();
+		host.erase (host.rfind (':') == std::string::npos ? host.length () : host.rfind (':'));
+		if (neighbours_.find (host) == neighbours_.end ())
+		{
+			ERROR(log_) << "Refused segment lookups from unknown host: " << sck->getpeername ();
+			sck->close ();
+			delete sck;
+			break;
+		}
+		DEBUG(log_) << "Neighbour connected: " << sck->getpeername ();
+		new SegmentSession (sck);
+		break;
+	case Event::Error:
+		ERROR(log_) << "Accept error: " << e;
+		break;
+	default:
+		ERROR(log_) << "Unexpected event: " << e;
+		break;
+	}
+}
+
+// Session
+
+SegmentSession::SegmentSession (Socket* sck)
+ : log_("/wanproxy/segments"),
+   system_(EventSystem::current ()),
+   socket_(sck),
+   read_action_(0),
+   write_action_(0),
+   stop_action_(0)
+{
+	stop_action_ = system_.register_interest (EventInterestStop, callback (this, &SegmentSession::stop));
+	poll ();
+}
+
+SegmentSession::~SegmentSession ()
+{
+	if (read_action_)
+		read_action_->cancel ();
+	if (write_action_)
+		write_action_->cancel ();
+	if (stop_action_)
+		stop_action_->cancel ();
+	socket_->close ();
+	delete socket_;
+}
+
+void SegmentSession::read_complete (Event e)
+{
+	if (read_action_)
+		read_action_->cancel (), read_action_ = 0;
+
+	if (e.type_ == Event::Done)
+	{
+		inbound_.append (e.buffer_);
+		if (receive ())
+		{
+			poll ();
+			return;
+		}
+	}
+
+	delete this;
+}
+
+/*
+ * Requests left unanswered while the limit was reached are taken up again
+ * as the answers go out.
+ */
+void SegmentSession::write_complete (Event e)
+{
+	if (write_action_)
+		write_action_->cancel (), write_action_ = 0;
+
+	if (e.type_ != Event::Done)
+	{
+		DEBUG(log_) << "Could not answer neighbour: " << e;
+		delete this;
+		return;
+	}
+
+	if (! receive ())
+	{
+		delete this;
+		return;
+	}
+	poll ();
+}
+
+void SegmentSession::poll ()
+{
+	if (! read_action_ && outbound_.length () < SEGMENT_OUTBOUND_LIMIT)
+		read_action_ = socket_->read (callback (this, &SegmentSession::read_complete));
+}
+
+void SegmentSession::stop ()
+{
+	delete this;
+}
+
+bool SegmentSession::receive ()
+{
+	XCodecCache* cache;
+	uint32_t count;
+	uint64_t hash;
+	unsigned hits;
+	UUID uuid;
+
+	while (outbound_.length () < SEGMENT_OUTBOUND_LIMIT && inbound_.length () >= SEGMENT_REQUEST_HEADER)
+	{
+		inbound_.extract (&count);
+		if (count > SEGMENT_QUERY_LIMIT)
+		{
+			ERROR(log_) << "Invalid segment request.";
+			return false;
+		}
+		if (inbound_.length () < SEGMENT_REQUEST_HEADER + count * sizeof hash)
+			break;
+
+		inbound_.skip (sizeof count);
+		if (! uuid.decode (inbound_))
+		{
+			ERROR(log_) << "Invalid cache in segment request.";
+			return false;
+		}
+
+		cache = wanproxy.find_cache (uuid);
+		outbound_.append (&count);
+		for (hits = 0; count > 0; --count)
+		{
+			Buffer seg;
+			inbound_.moveout (&hash);
+			if (cache && cache->lookup (hash, seg))
+			{
+				outbound_.append ((uint8_t) 1);
+				outbound_.append (seg);
+				hits++;
+			}
+			else
+			{
+				outbound_.append ((uint8_t) 0);
+			}
+		}
+		DEBUG(log_) << "Found " << hits << " segments of " << uuid;
+	}
+
+	send ();
+	return true;
+}
+
+void SegmentSession::send ()
+{
+	if (! write_action_ && ! outbound_.empty ())
+	{
+		write_action_ = socket_->write (outbound_, callback (this, &SegmentSession::write_complete));
+		outbound_.clear ();
+	}
+}
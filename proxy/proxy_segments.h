@@ -0,0 +1,169 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+// File:           proxy_segments.h                                           //
+// Description:    lookup of missing segments in caches of the local network  //
+// Project:        WANProxy XTech                                             //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef	PROGRAMS_WANPROXY_PROXY_SEGMENTS_H
+#define	PROGRAMS_WANPROXY_PROXY_SEGMENTS_H
+
+#include <deque>
+#include <set>
+#include <vector>
+#include <common/buffer.h>
+#include <common/thread/atomic.h>
+#include <common/thread/mutex.h>
+#include <common/uuid/uuid.h>
+#include <event/action.h>
+#include <event/callback.h>
+#include <event/event.h>
+#include <io/net/tcp_server.h>
+
+/*
+ * A request carries the hashes a decoder is missing:
+ * 	count[uint32_t] cache[UUID string] hash[uint64_t x count]
+ * and its answer the segments found, in the same order:
+ * 	count[uint32_t] { found[uint8_t] segment[XCODEC_SEGMENT_LENGTH if found] } x count
+ * Requests on a connection are answered in the order they were sent.
+ */
+#define SEGMENT_QUERY_LIMIT		4096			// hashes in a single request
+#define SEGMENT_QUERY_TICK			25				// milliseconds between checks for late answers
+#define SEGMENT_QUERY_TICKS		2				// checks a query survives before its hashes are asked over the WAN
+#define SEGMENT_RETRY_INTERVAL	5000			// milliseconds the service is left aside after a failure
+#define SEGMENT_OUTBOUND_LIMIT	0x400000		// answers waiting to be written before requests stop being read
+
+class EventSystem;
+
+/*
+ * Shared between a decoder and the client that looks up its hashes.  The
+ * answer is handed back on the event system of the decoder, and a decoder
+ * going away first only cancels it.
+ */
+class SegmentQuery
+{
+	Atomic<int> refs_;
+	Atomic<int> cancelled_;
+	EventSystem& system_;
+	Callback* done_;
+
+public:
+	UUID cache_;
+	std::vector<uint64_t> hashes_;
+	Buffer segments_;
+
+	SegmentQuery (const UUID& cache, Callback* done);
+	~SegmentQuery ();
+
+	void hold ()									{ refs_.add (1); }
+	void release ()								{ if (refs_.subtract (1) == 0) delete this; }
+	void cancel ()									{ cancelled_.set (1); release (); }
+	bool cancelled () const						{ return (cancelled_.val () != 0); }
+
+	void complete ();
+	void deliver ();
+};
+
+/*
+ * Keeps one connection to the segment service and sends it the queries of
+ * all the decoders of the process.  Queries not answered in time, or made
+ * while the service cannot be reached, complete with nothing found so the
+ * decoder asks the peer instead.  It lives on the event system it was
+ * created on, which decoders of other loops post their queries to.
+ */
+class SegmentClient
+{
+	struct Sent
+	{
+		SegmentQuery* query_;
+		int ticks_;
+		bool expired_;
+	};
+
+	LogHandle log_;
+	EventSystem& system_;
+	SocketAddressFamily family_;
+	std::string address_;
+	Mutex lock_;
+	std::deque<SegmentQuery*> queue_;
+	std::deque<Sent> sent_;
+	Socket* socket_;
+	Action* connect_action_;
+	Action* read_action_;
+	Action* write_action_;
+	Action* retry_action_;
+	Action* tick_action_;
+	Atomic<int> waking_;
+	bool connected_, down_;
+	Buffer inbound_;
+
+public:
+	SegmentClient (SocketAddressFamily family, const std::string& address);
+	~SegmentClient ();
+
+	void query (SegmentQuery* q);
+
+	void wake ();
+	void connect_complete (Event e);
+	void read_complete (Event e);
+	void write_complete (Event e);
+	void retry (Event e);
+	void tick (Event e);
+
+private:
+	void send ();
+	bool receive ();
+	void fail ();
+};
+
+/*
+ * Answers the queries of the neighbours from the caches of this process.
+ * Only the hosts of the configured neighbours are served.
+ */
+class SegmentService : public TCPServer
+{
+	LogHandle log_;
+	std::set<std::string> neighbours_;
+	Action* accept_action_;
+
+public:
+	SegmentService (SocketAddressFamily family, const std::string& address);
+	~SegmentService ();
+
+	void allow (const std::string& host)		{ neighbours_.insert ('[' + host + ']'); }
+	void accept_complete (Event e, Socket* sck);
+};
+
+/*
+ * Requests stop being read while the answers waiting to be written are
+ * over SEGMENT_OUTBOUND_LIMIT, so a neighbour that does not read them
+ * cannot make the session grow.
+ */
+
+class SegmentSession
+{
+	LogHandle log_;
+	EventSystem& system_;
+	Socket* socket_;
+	Action* read_action_;
+	Action* write_action_;
+	Action* stop_action_;
+	Buffer inbound_;
+	Buffer outbound_;
+
+public:
+	SegmentSession (Socket* sck);
+	~SegmentSession ();
+
+	void read_complete (Event e);
+	void write_complete (Event e);
+	void stop ();
+
+private:
+	bool receive ();
+	void send ();
+	void poll ();
+};
+
+#endif /* !PROGRAMS_WANPROXY_PROXY_SEGMENTS_H */
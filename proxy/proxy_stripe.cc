@@ -0,0 +1,605 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+// File:           proxy_stripe.cc                                            //
+// Description:    one encoded stream spread over parallel peer connections   //
+// Project:        WANProxy XTech                                             //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+#include <common/endian.h>
+#include <event/event_system.h>
+#include <io/socket/socket.h>
+#include <io/sink_filter.h>
+#include "proxy_connector.h"
+#include "proxy_stripe.h"
+
+// Set
+
+StripeSet::StripeSet (const std::string& name, int count)
+ : log_("/wanproxy/" + name + "/stripes"),
+   stripes_(count),
+   client_(true),
+   sink_(0),
+   send_seq_(0),
+   recv_seq_(0),
+   held_bytes_(0),
+   connect_request_(0),
+   read_request_(0),
+   deliver_action_(0),
+   pause_(0),
+   resume_(0),
+   throttled_(0),
+   drained_(0),
+   drain_flags_(0),
+   failed_(false)
+{
+	Stripe s = { 0, 0, 0, 0, Buffer (), 0, false, false };
+
+	for (int i = 0; i < count; ++i)
+		stripes_[i] = s;
+	session_.generate ();
+}
+
+StripeSet::StripeSet (const std::string& name, const UUID& session, int count)
+ : log_("/wanproxy/" + name + "/stripes"),
+   session_(session),
+   stripes_(count),
+   client_(false),
+   sink_(0),
+   send_seq_(0),
+   recv_seq_(0),
+   held_bytes_(0),
+   connect_request_(0),
+   read_request_(0),
+   deliver_action_(0),
+   pause_(0),
+   resume_(0),
+   throttled_(0),
+   drained_(0),
+   drain_flags_(0),
+   failed_(false)
+{
+	Stripe s = { 0, 0, 0, 0, Buffer (), 0, false, false };
+
+	for (int i = 0; i < count; ++i)
+		stripes_[i] = s;
+}
+
+StripeSet::~StripeSet ()
+{
+	std::vector<Stripe>::iterator it;
+
+	for (it = stripes_.begin (); it != stripes_.end (); ++it)
+	{
+		if (it->connect_action_)
+			it->connect_action_->cancel ();
+		if (it->read_action_)
+			it->read_action_->cancel ();
+		delete it->sink_;
+		if (it->socket_)
+			it->socket_->close ();
+		delete it->socket_;
+	}
+	if (deliver_action_)
+		deliver_action_->cancel ();
+	delete connect_request_;
+	delete read_request_;
+	delete pause_;
+	delete resume_;
+}
+
+/*
+ * Opens every stripe at once.  Whatever the chain sends before they are
+ * all connected waits in their sinks, right after the greeting.
+ */
+Action* StripeSet::connect (SocketAddressFamily family, const std::string& address, EventCallback* cb)
+{
+	Buffer greeting;
+	Socket* sck;
+
+	for (unsigned i = 0; i < stripes_.size (); ++i)
+	{
+		if (! (sck = Socket::create (family, SocketTypeStream, "tcp", address)))
+		{
+			delete cb;
+			return 0;
+		}
+		greeting.clear ();
+		session_.encode (greeting);
+		greeting.append ((uint8_t) i);
+		greeting.append ((uint8_t) stripes_.size ());
+		stripes_[i].socket_ = sck;
+		stripes_[i].sink_ = new SinkFilter (log_, sck);
+		stripes_[i].sink_->chain (this);
+		stripes_[i].sink_->set_throttle (callback (this, &StripeSet::pause, (int) i), callback (this, &StripeSet::resume, (int) i));
+		stripes_[i].sink_->hold ();
+		stripes_[i].sink_->consume (greeting);
+		stripes_[i].connect_action_ = sck->connect (address, callback (this, &StripeSet::connect_complete, (int) i));
+	}
+
+	return (connect_request_ = new StripeAction (this, &StripeSet::connect_cancel, cb));
+}
+
+void StripeSet::connect_complete (Event e, int index)
+{
+	Stripe& s = stripes_[index];
+	EventCallback* cb;
+
+	if (s.connect_action_)
+		s.connect_action_->cancel (), s.connect_action_ = 0;
+
+	if (e.type_ == Event::Done)
+	{
+		s.connected_ = true;
+		s.sink_->release ();
+		arm (index);
+		if (! complete ())
+			return;
+	}
+	else
+	{
+		INFO(log_) << "Connect failed on stripe " << index << ": " << e;
+	}
+
+	if (connect_request_ && (cb = connect_request_->callback_))
+	{
+		cb->param (e);
+		cb->execute ();
+	}
+}
+
+/*
+ * Takes a connection accepted by the receiving side, with any data that
+ * followed its greeting.
+ */
+bool StripeSet::adopt (int index, Socket* sck, Buffer& early)
+{
+	if (index < 0 || index >= (int) stripes_.size () || stripes_[index].socket_)
+		return false;
+
+	Stripe& s = stripes_[index];
+
+	s.socket_ = sck;
+	s.sink_ = new SinkFilter (log_, sck);
+	s.sink_->chain (this);
+	s.sink_->set_throttle (callback (this, &StripeSet::pause, index), callback (this, &StripeSet::resume, index));
+	s.inbound_.append (early);
+	s.connected_ = true;
+	return true;
+}
+
+bool StripeSet::complete () const
+{
+	std::vector<Stripe>::const_iterator it;
+
+	for (it = stripes_.begin (); it != stripes_.end (); ++it)
+		if (! it->connected_)
+			return false;
+
+	return true;
+}
+
+/*
+ * Called on the event system that serves the set once all the accepted
+ * stripes are there.
+ */
+void StripeSet::start ()
+{
+	for (unsigned i = 0; i < stripes_.size (); ++i)
+	{
+		if (! receive (i))
+			return;
+		arm (i);
+	}
+}
+
+Filter* StripeSet::sink ()
+{
+	return (sink_ = new Sink (*this));
+}
+
+void StripeSet::set_throttle (Callback* pause, Callback* resume)
+{
+	delete pause_;
+	delete resume_;
+	pause_ = pause, resume_ = resume;
+}
+
+/*
+ * Each frame goes to the stripe with the shortest backlog, so a stripe
+ * slowed down by losses takes less of the stream until it recovers.
+ */
+bool StripeSet::send (Buffer& buf)
+{
+	std::vector<Stripe>::iterator it, best;
+	Buffer frame;
+	uint32_t hdr[2];
+	size_t n;
+
+	while (! buf.empty ())
+	{
+		best = stripes_.begin ();
+		for (it = stripes_.begin (); it != stripes_.end (); ++it)
+			if (it->sink_->backlog () < best->sink_->backlog ())
+				best = it;
+
+		n = (buf.length () > STRIPE_FRAME_SIZE ? STRIPE_FRAME_SIZE : buf.length ());
+		hdr[0] = BigEndian::encode (send_seq_++);
+		hdr[1] = BigEndian::encode ((uint32_t) n);
+		frame.clear ();
+		frame.append ((const uint8_t*) hdr, sizeof hdr);
+		buf.moveout (&frame, n);
+		if (! best->sink_->consume (frame))
+			return false;
+	}
+
+	return true;
+}
+
+void StripeSet::drain (int flg)
+{
+	drain_flags_ |= flg;
+	for (unsigned i = 0; i < stripes_.size (); ++i)
+		stripes_[i].sink_->flush (STRIPE_DRAINED);
+}
+
+/*
+ * Reached by the sink of each stripe once it has written everything.
+ */
+void StripeSet::flush (int flg)
+{
+	if (++drained_ == (int) stripes_.size () && sink_)
+		sink_->drained (drain_flags_);
+}
+
+void StripeSet::pause (int index)
+{
+	if (++throttled_ == (int) stripes_.size () && pause_)
+		pause_->execute ();
+}
+
+void StripeSet::resume (int index)
+{
+	if (throttled_-- == (int) stripes_.size () && resume_)
+		resume_->execute ();
+}
+
+Action* StripeSet::read (EventCallback* cb)
+{
+	read_request_ = new StripeAction (this, &StripeSet::read_cancel, cb);
+	schedule ();
+	return read_request_;
+}
+
+/*
+ * Once the frames held aside fill the limit as well, only the stripes that
+ * hold none of them are read on: every frame still to come on the others
+ * lies further ahead, and the one that fills the gap must be on one of them.
+ */
+void StripeSet::arm (int index)
+{
+	Stripe& s = stripes_[index];
+
+	if (s.read_action_ || s.eos_ || failed_)
+		return;
+	if (ready_.length () >= STRIPE_READY_LIMIT || (ready_.length () + held_bytes_ >= STRIPE_READY_LIMIT && s.held_ > 0))
+		return;
+
+	s.read_action_ = s.socket_->read (callback (this, &StripeSet::on_data, index));
+}
+
+void StripeSet::on_data (Event e, int index)
+{
+	Stripe& s = stripes_[index];
+
+	if (s.read_action_)
+		s.read_action_->cancel (), s.read_action_ = 0;
+
+	switch (e.type_)
+	{
+	case Event::Done:
+		s.inbound_.append (e.buffer_);
+		if (receive (index))
+			arm (index);
+		break;
+	case Event::EOS:
+		s.eos_ = true;
+		if (! s.inbound_.empty ())
+		{
+			ERROR(log_) << "Stripe " << index << " ended within a frame.";
+			fail ();
+		}
+		break;
+	default:
+		DEBUG(log_) << "Unexpected event on stripe " << index << ": " << e;
+		fail ();
+		break;
+	}
+
+	schedule ();
+}
+
+/*
+ * Frames are put in order as they arrive: the ones ahead of the next
+ * expected wait aside until the gap has been filled by another stripe.
+ * A frame behind it, or one already waiting, can only come from a broken
+ * peer and fails the set.
+ */
+bool StripeSet::receive (int index)
+{
+	std::map<uint32_t, Held>::iterator it;
+	Stripe& s = stripes_[index];
+	uint32_t hdr[2];
+
+	while (s.inbound_.length () >= STRIPE_FRAME_HEADER)
+	{
+		s.inbound_.copyout ((uint8_t*) hdr, sizeof hdr);
+		hdr[0] = BigEndian::decode (hdr[0]);
+		hdr[1] = BigEndian::decode (hdr[1]);
+		if (hdr[1] > STRIPE_FRAME_SIZE)
+		{
+			ERROR(log_) << "Invalid frame length: " << hdr[1];
+			fail ();
+			return false;
+		}
+		if ((int32_t) (hdr[0] - recv_seq_) < 0 || unordered_.find (hdr[0]) != unordered_.end ())
+		{
+			ERROR(log_) << "Stale frame " << hdr[0] << " on stripe " << index << ", expecting " << recv_seq_;
+			fail ();
+			return false;
+		}
+		if (s.inbound_.length () < STRIPE_FRAME_HEADER + hdr[1])
+			break;
+		s.inbound_.skip (STRIPE_FRAME_HEADER);
+		if (hdr[0] == recv_seq_)
+		{
+			s.inbound_.moveout (&ready_, hdr[1]);
+			while ((it = unordered_.find (++recv_seq_)) != unordered_.end ())
+			{
+				ready_.append (it->second.data_);
+				held_bytes_ -= it->second.data_.length ();
+				stripes_[it->second.index_].held_--;
+				unordered_.erase (it);
+			}
+		}
+		else
+		{
+			Held& h = unordered_[hdr[0]];
+			h.index_ = index;
+			s.inbound_.moveout (&h.data_, hdr[1]);
+			held_bytes_ += hdr[1];
+			s.held_++;
+		}
+	}
+
+	return true;
+}
+
+void StripeSet::schedule ()
+{
+	if (read_request_ && ! deliver_action_)
+		deliver_action_ = EventSystem::current ().track (0, StreamModeWait, callback (this, &StripeSet::deliver));
+}
+
+void StripeSet::deliver (Event e)
+{
+	std::vector<Stripe>::iterator it;
+	EventCallback* cb;
+	bool ended = true;
+
+	if (deliver_action_)
+		deliver_action_->cancel (), deliver_action_ = 0;
+
+	for (it = stripes_.begin (); it != stripes_.end (); ++it)
+		ended = (ended && it->eos_);
+
+	if (! read_request_ || ! (cb = read_request_->callback_))
+		return;
+
+	if (! ready_.empty ())
+	{
+		cb->param (Event (Event::Done, ready_));
+		ready_.clear ();
+		for (unsigned i = 0; i < stripes_.size (); ++i)
+			arm (i);
+	}
+	else if (failed_ || (ended && ! unordered_.empty ()))
+	{
+		cb->param (Event (Event::Error));
+	}
+	else if (ended)
+	{
+		cb->param (Event (Event::EOS));
+	}
+	else
+	{
+		return;
+	}
+
+	cb->execute ();
+}
+
+void StripeSet::fail ()
+{
+	failed_ = true;
+	for (unsigned i = 0; i < stripes_.size (); ++i)
+		if (stripes_[i].read_action_)
+			stripes_[i].read_action_->cancel (), stripes_[i].read_action_ = 0;
+}
+
+void StripeSet::connect_cancel ()
+{
+	delete connect_request_;
+	connect_request_ = 0;
+}
+
+void StripeSet::read_cancel ()
+{
+	delete read_request_;
+	read_request_ = 0;
+}
+
+// Greeting
+
+StripeGreeting::StripeGreeting (const LinkService& svc, Socket* sck)
+ : log_("/wanproxy/" + svc.name_ + "/stripes"),
+   service_(svc),
+   socket_(sck),
+   read_action_(0)
+{
+	read_action_ = socket_->read (callback (this, &StripeGreeting::on_data));
+}
+
+StripeGreeting::~StripeGreeting ()
+{
+	if (read_action_)
+		read_action_->cancel ();
+	if (socket_)
+		socket_->close ();
+	delete socket_;
+}
+
+void StripeGreeting::on_data (Event e)
+{
+	StripeGatherer::Arrival* a;
+
+	if (read_action_)
+		read_action_->cancel (), read_action_ = 0;
+
+	if (e.type_ != Event::Done)
+	{
+		DEBUG(log_) << "Connection closed before its greeting: " << e;
+		delete this;
+		return;
+	}
+
+	pending_.append (e.buffer_);
+	if (pending_.length () < STRIPE_GREETING_SIZE)
+	{
+		read_action_ = socket_->read (callback (this, &StripeGreeting::on_data));
+		return;
+	}
+
+	a = new StripeGatherer::Arrival;
+	a->service_ = service_;
+	if (! a->session_.decode (pending_))
+	{
+		ERROR(log_) << "Invalid stripe greeting.";
+		delete a;
+		delete this;
+		return;
+	}
+	a->index_ = pending_.peek ();
+	pending_.skip (1);
+	a->count_ = pending_.peek ();
+	pending_.skip (1);
+	a->socket_ = socket_, socket_ = 0;
+	a->early_.append (pending_);
+	stripe_gatherer.system ().post (callback (&stripe_gatherer, &StripeGatherer::arrive, a));
+	delete this;
+}
+
+// Gatherer
+
+/*
+ * Built before main runs, so the main system is named rather than asked
+ * for.
+ */
+StripeGatherer::StripeGatherer ()
+ : log_("/wanproxy/stripes"),
+   system_(event_system),
+   check_action_(0),
+   stop_action_(0)
+{
+}
+
+void StripeGatherer::arrive (Arrival* a)
+{
+	std::map<UUID, Pending>::iterator it = pending_.find (a->session_);
+	StripeSet* set = 0;
+
+	if (! stop_action_)
+		stop_action_ = system_.register_interest (EventInterestStop, callback (this, &StripeGatherer::stop));
+	if (! check_action_)
+		check_action_ = system_.track (STRIPE_GATHER_TIMEOUT / 2, StreamModeWait, callback (this, &StripeGatherer::on_check));
+
+	if (a->count_ < 2 || a->count_ > STRIPE_MAX_COUNT || a->index_ >= a->count_)
+	{
+		ERROR(log_) << "Invalid stripe " << a->index_ << " of " << a->count_;
+	}
+	else if (it == pending_.end ())
+	{
+		Pending p = { (set = new StripeSet (a->service_.name_, a->session_, a->count_)), 0 };
+		it = pending_.insert (std::make_pair (a->session_, p)).first;
+	}
+	else if (it->second.set_->count () != a->count_)
+	{
+		ERROR(log_) << "Stripe " << a->index_ << " of " << a->count_ << " does not belong to a set of " << it->second.set_->count ();
+	}
+	else
+	{
+		set = it->second.set_;
+	}
+
+	if (set && set->adopt (a->index_, a->socket_, a->early_))
+		a->socket_ = 0;
+	else if (set)
+		ERROR(log_) << "Duplicate stripe " << a->index_;
+
+	if (set && set->complete ())
+	{
+		pending_.erase (it);
+		new ProxyConnector (a->service_.name_, a->service_.local_codec_, a->service_.remote_codec_, set,
+								  a->service_.remote_family_, a->service_.remote_address_, a->service_.workers_);
+	}
+
+	if (a->socket_)
+	{
+		a->socket_->close ();
+		delete a->socket_;
+	}
+	delete a;
+}
+
+/*
+ * A set whose stripes have not all arrived within the timeout is dropped.
+ */
+void StripeGatherer::on_check (Event e)
+{
+	std::map<UUID, Pending>::iterator it;
+
+	if (check_action_)
+		check_action_->cancel (), check_action_ = 0;
+
+	for (it = pending_.begin (); it != pending_.end (); )
+	{
+		if (++it->second.age_ > 2)
+		{
+			INFO(log_) << "Incomplete stripe set dropped.";
+			delete it->second.set_;
+			pending_.erase (it++);
+		}
+		else
+		{
+			++it;
+		}
+	}
+
+	if (! pending_.empty ())
+		check_action_ = system_.track (STRIPE_GATHER_TIMEOUT / 2, StreamModeWait, callback (this, &StripeGatherer::on_check));
+}
+
+void StripeGatherer::stop ()
+{
+	std::map<UUID, Pending>::iterator it;
+
+	if (check_action_)
+		check_action_->cancel (), check_action_ = 0;
+	if (stop_action_)
+		stop_action_->cancel (), stop_action_ = 0;
+	for (it = pending_.begin (); it != pending_.end (); ++it)
+		delete it->second.set_;
+	pending_.clear ();
+}
+
+StripeGatherer stripe_gatherer;
@@ -0,0 +1,196 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+// File:           proxy_stripe.h                                             //
+// Description:    one encoded stream spread over parallel peer connections   //
+// Project:        WANProxy XTech                                             //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef	PROGRAMS_WANPROXY_PROXY_STRIPE_H
+#define	PROGRAMS_WANPROXY_PROXY_STRIPE_H
+
+#include <map>
+#include <vector>
+#include <common/filter.h>
+#include <common/uuid/uuid.h>
+#include <event/action.h>
+#include <event/event.h>
+#include <event/event_callback.h>
+#include <io/socket/socket_types.h>
+#include "proxy_link.h"
+
+/*
+ * Every connection of a set starts with a greeting:
+ * 	session[UUID string] index[uint8_t] count[uint8_t]
+ * and carries then any number of frames of the stream:
+ * 	sequence[uint32_t] length[uint32_t] data[uint8_t x length]
+ * numbered across the whole set, so the receiver can put them back in order.
+ */
+#define STRIPE_GREETING_SIZE		(UUID_STRING_SIZE + 2)
+#define STRIPE_FRAME_HEADER		8
+#define STRIPE_FRAME_SIZE			0x10000		// largest payload of a frame
+#define STRIPE_READY_LIMIT			0x100000		// ordered and held data before reading is paused
+#define STRIPE_MAX_COUNT			64
+#define STRIPE_DRAINED				0x400000
+#define STRIPE_GATHER_TIMEOUT		10000			// milliseconds for the whole set to arrive
+
+class EventSystem;
+class Socket;
+class SinkFilter;
+
+class StripeSet : public Filter, public PeerLink
+{
+	typedef CallbackAction<StripeSet, EventCallback> StripeAction;
+
+	struct Stripe
+	{
+		Socket* socket_;
+		SinkFilter* sink_;
+		Action* connect_action_;
+		Action* read_action_;
+		Buffer inbound_;
+		int held_;
+		bool connected_, eos_;
+	};
+
+	/*
+	 * A frame received ahead of its turn, and the stripe it came from.
+	 */
+	struct Held
+	{
+		int index_;
+		Buffer data_;
+	};
+
+	/*
+	 * The filter put at the end of a chain: it spreads what it receives
+	 * over the stripes, and is flushed once all of them have been drained.
+	 */
+	class Sink : public Filter
+	{
+		StripeSet& set_;
+
+	public:
+		Sink (StripeSet& set) : set_(set)		{ }
+
+		virtual bool consume (Buffer& buf, int flg = 0)		{ return set_.send (buf); }
+		virtual void flush (int flg)								{ set_.drain (flg); }
+		void drained (int flg)										{ Filter::flush (flg); }
+	};
+
+	LogHandle log_;
+	UUID session_;
+	std::vector<Stripe> stripes_;
+	bool client_;
+	Sink* sink_;
+	uint32_t send_seq_;
+	uint32_t recv_seq_;
+	std::map<uint32_t, Held> unordered_;
+	size_t held_bytes_;
+	Buffer ready_;
+	StripeAction* connect_request_;
+	StripeAction* read_request_;
+	Action* deliver_action_;
+	Callback* pause_;
+	Callback* resume_;
+	int throttled_;
+	int drained_;
+	int drain_flags_;
+	bool failed_;
+
+public:
+	StripeSet (const std::string& name, int count);
+	StripeSet (const std::string& name, const UUID& session, int count);
+	virtual ~StripeSet ();
+
+	virtual Action* connect (SocketAddressFamily family, const std::string& address, EventCallback* cb);
+	bool adopt (int index, Socket* sck, Buffer& early);
+	bool complete () const;
+	int count () const			{ return (int) stripes_.size (); }
+	virtual void start ();
+
+	virtual Filter* sink ();
+	virtual void set_throttle (Callback* pause, Callback* resume);
+	virtual Action* read (EventCallback* cb);
+
+	virtual void flush (int flg);
+
+	void connect_complete (Event e, int index);
+	void on_data (Event e, int index);
+	void pause (int index);
+	void resume (int index);
+	void deliver (Event e);
+	void connect_cancel ();
+	void read_cancel ();
+
+private:
+	bool send (Buffer& buf);
+	void drain (int flg);
+	void arm (int index);
+	bool receive (int index);
+	void schedule ();
+	void fail ();
+};
+
+/*
+ * Reads the greeting of a connection just accepted and hands it over to
+ * the gatherer.
+ */
+class StripeGreeting
+{
+	LogHandle log_;
+	LinkService service_;
+	Socket* socket_;
+	Action* read_action_;
+	Buffer pending_;
+
+public:
+	StripeGreeting (const LinkService& svc, Socket* sck);
+	~StripeGreeting ();
+
+	void on_data (Event e);
+};
+
+/*
+ * Collects the connections of every set as they arrive, on whatever shard
+ * accepted them, and starts a connector for each set once complete.  It
+ * runs on the main event system, where the striped connectors live too.
+ */
+class StripeGatherer
+{
+public:
+	struct Arrival
+	{
+		LinkService service_;
+		UUID session_;
+		int index_, count_;
+		Socket* socket_;
+		Buffer early_;
+	};
+
+private:
+	struct Pending
+	{
+		StripeSet* set_;
+		int age_;
+	};
+
+	LogHandle log_;
+	EventSystem& system_;
+	std::map<UUID, Pending> pending_;
+	Action* check_action_;
+	Action* stop_action_;
+
+public:
+	StripeGatherer ();
+
+	EventSystem& system ()		{ return system_; }
+
+	void arrive (Arrival* a);
+	void on_check (Event e);
+	void stop ();
+};
+
+extern StripeGatherer stripe_gatherer;
+
+#endif /* !PROGRAMS_WANPROXY_PROXY_STRIPE_H */
@@ -0,0 +1,717 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+// File:           proxy_tunnel.cc                                            //
+// Description:    many client streams multiplexed over one peer connection   //
+// Project:        WANProxy XTech                                             //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+#include <common/endian.h>
+#include <common/count_filter.h>
+#include <event/event_callback.h>
+#include <event/event_system.h>
+#include <io/socket/socket.h>
+#include <io/sink_filter.h>
+#include <xcodec/xcodec_filter.h>
+#include <zlib/zlib_filter.h>
+#include "proxy_listener.h"
+#include "proxy_tunnel.h"
+
+// Tunnel
+
+ProxyTunnel::ProxyTunnel (const std::string& name, WANProxyCodec* cdc, SocketAddressFamily family, const std::string& address, ProxyListener* owner)
+ : log_("/wanproxy/" + name + "/tunnel"),
+   owner_(owner),
+   codec_(cdc),
+   socket_(0),
+   client_(true),
+   family_(family),
+   address_(address),
+   outbound_chain_(this),
+   inbound_chain_(this),
+   next_id_(1),
+   connect_action_(0),
+   read_action_(0),
+   stop_action_(0),
+   close_action_(0),
+   connected_(false),
+   held_(false),
+   flushing_(0)
+{
+	stop_action_ = EventSystem::current ().register_interest (EventInterestStop, callback (this, &ProxyTunnel::conclude));
+}
+
+ProxyTunnel::ProxyTunnel (const std::string& name, WANProxyCodec* cdc, Socket* sck, SocketAddressFamily family, const std::string& address)
+ : log_("/wanproxy/" + name + "/tunnel"),
+   owner_(0),
+   codec_(cdc),
+   socket_(sck),
+   client_(false),
+   family_(family),
+   address_(address),
+   outbound_chain_(this),
+   inbound_chain_(this),
+   next_id_(2),
+   connect_action_(0),
+   read_action_(0),
+   stop_action_(0),
+   close_action_(0),
+   connected_(false),
+   held_(false),
+   flushing_(0)
+{
+	stop_action_ = EventSystem::current ().register_interest (EventInterestStop, callback (this, &ProxyTunnel::conclude));
+	if (build_chains ())
+		read_action_ = socket_->read (callback (this, &ProxyTunnel::on_data));
+	else
+		shut ();
+}
+
+/*
+ * Kept apart from the constructor so that the owner has already stored
+ * the tunnel by the time a failure makes it forget it.
+ */
+void ProxyTunnel::launch ()
+{
+	if ((socket_ = Socket::create (family_, SocketTypeStream, "tcp", address_)))
+		connect_action_ = socket_->connect (address_, callback (this, &ProxyTunnel::connect_complete));
+	else
+		shut ();
+}
+
+ProxyTunnel::~ProxyTunnel ()
+{
+	std::map<uint32_t, TunnelStream*>::iterator it;
+
+	if (connect_action_)
+		connect_action_->cancel ();
+	if (read_action_)
+		read_action_->cancel ();
+	if (stop_action_)
+		stop_action_->cancel ();
+	if (close_action_)
+		close_action_->cancel ();
+	for (it = streams_.begin (); it != streams_.end (); ++it)
+		it->second->abandon ();
+	streams_.clear ();
+	if (socket_)
+		socket_->close ();
+	delete socket_;
+	if (owner_)
+		owner_->forget (this);
+}
+
+void ProxyTunnel::connect_complete (Event e)
+{
+	if (connect_action_)
+		connect_action_->cancel (), connect_action_ = 0;
+
+	switch (e.type_)
+	{
+	case Event::Done:
+		break;
+	case Event::Error:
+		INFO(log_) << "Tunnel connect failed: " << e;
+		shut ();
+		return;
+	default:
+		ERROR(log_) << "Unexpected event: " << e;
+		shut ();
+		return;
+	}
+
+	if (! build_chains ())
+	{
+		shut ();
+		return;
+	}
+
+	INFO(log_) << "Tunnel established with peer: " << address_;
+	read_action_ = socket_->read (callback (this, &ProxyTunnel::on_data));
+	if (! backlog_.empty ())
+	{
+		Buffer tmp;
+		tmp.append (backlog_);
+		backlog_.clear ();
+		send (tmp);
+	}
+}
+
+/*
+ * Only the peer side of the proxy is involved: the outbound chain encodes
+ * the frames of every stream and the inbound one decodes the frames sent
+ * by the peer, to be dispatched by consume ().
+ */
+bool ProxyTunnel::build_chains ()
+{
+	SinkFilter* sink;
+
+	if (! socket_)
+		return false;
+
+	if (codec_ && codec_->counting_)
+	{
+		outbound_chain_.append (new CountFilter (client_ ? codec_->request_input_bytes_ : codec_->response_output_bytes_));
+		inbound_chain_.append (new CountFilter (client_ ? codec_->response_input_bytes_ : codec_->request_input_bytes_));
+	}
+
+	if (codec_ && codec_->compressor_)
+		inbound_chain_.append (new InflateFilter ());
+
+	if (codec_ && codec_->xcache_)
+	{
+		EncodeFilter* enc; DecodeFilter* dec;
+		outbound_chain_.append ((enc = new EncodeFilter ("/wanproxy/" + codec_->name_ + "/enc", codec_)));
+		inbound_chain_.append ((dec = new DecodeFilter ("/wanproxy/" + codec_->name_ + "/dec", codec_)));
+		dec->set_upstream (enc);
+	}
+
+	if (codec_ && codec_->compressor_)
+		outbound_chain_.append (new DeflateFilter (codec_->compressor_level_, codec_->compressor_threads_));
+
+	if (codec_ && codec_->counting_)
+	{
+		outbound_chain_.append (new CountFilter (client_ ? codec_->request_output_bytes_ : codec_->response_input_bytes_, (client_ ? 0 : 1)));
+		inbound_chain_.append (new CountFilter (client_ ? codec_->response_output_bytes_ : codec_->request_output_bytes_));
+	}
+
+	outbound_chain_.append ((sink = new SinkFilter ("/wanproxy/tunnel", socket_)));
+	sink->set_throttle (callback (this, &ProxyTunnel::hold), callback (this, &ProxyTunnel::unhold));
+
+	connected_ = true;
+	return true;
+}
+
+/*
+ * Streams are numbered by the side that opens them, odd on the client,
+ * so an identifier is never taken by both ends.
+ */
+void ProxyTunnel::open (Socket* client)
+{
+	TunnelStream* s;
+	Buffer out;
+	uint32_t id = next_id_;
+
+	next_id_ += 2;
+	streams_[id] = (s = new TunnelStream (this, id, client));
+	frame (out, TUNNEL_OP_OPEN, id);
+	if (send (out))
+		s->start ();
+}
+
+void ProxyTunnel::detach ()
+{
+	owner_ = 0;
+	if (streams_.empty () && ! (flushing_ & TUNNEL_OUTBOUND))
+	{
+		if (connected_)
+			outbound_chain_.flush (TUNNEL_OUTBOUND);
+		else
+			shut ();
+	}
+}
+
+bool ProxyTunnel::send (Buffer& frames)
+{
+	if (flushing_ & TUNNEL_OUTBOUND)
+		return false;
+
+	if (! connected_)
+	{
+		backlog_.append (frames);
+		return true;
+	}
+
+	if (! outbound_chain_.consume (frames))
+	{
+		ERROR(log_) << "Could not send to peer.";
+		shut ();
+		return false;
+	}
+
+	return true;
+}
+
+void ProxyTunnel::release (uint32_t id)
+{
+	streams_.erase (id);
+	if (client_ && ! owner_ && streams_.empty ())
+		detach ();
+}
+
+bool ProxyTunnel::consume (Buffer& buf, int flg)
+{
+	uint8_t op;
+	uint32_t id;
+	int rv;
+
+	pending_.append (buf);
+
+	while (pending_.length () >= sizeof op + sizeof id)
+	{
+		op = pending_.peek ();
+		pending_.extract (&id, sizeof op);
+		id = BigEndian::decode (id);
+		if ((rv = dispatch (op, id)) <= 0)
+			return (rv == 0);
+	}
+
+	return true;
+}
+
+/*
+ * Returns 0 while the frame is not complete yet and -1 when it is not
+ * valid.
+ */
+int ProxyTunnel::dispatch (uint8_t op, uint32_t id)
+{
+	std::map<uint32_t, TunnelStream*>::iterator it = streams_.find (id);
+	TunnelStream* s = (it != streams_.end () ? it->second : 0);
+	const unsigned hdr = sizeof op + sizeof id;
+	uint16_t len;
+	uint32_t n;
+
+	switch (op)
+	{
+	case TUNNEL_OP_OPEN:
+		pending_.skip (hdr);
+		if (client_ || s || ! (id & 1))
+		{
+			ERROR(log_) << "Unexpected <OPEN> for stream " << id;
+			return -1;
+		}
+		streams_[id] = (s = new TunnelStream (this, id));
+		s->connect (family_, address_);
+		break;
+
+	case TUNNEL_OP_DATA:
+		if (pending_.length () < hdr + sizeof len)
+			return 0;
+		pending_.extract (&len, hdr);
+		len = BigEndian::decode (len);
+		if (pending_.length () < hdr + sizeof len + len)
+			return 0;
+		pending_.skip (hdr + sizeof len);
+		if (s)
+		{
+			Buffer data;
+			pending_.moveout (&data, len);
+			s->receive (data);
+		}
+		else
+		{
+			pending_.skip (len);
+		}
+		break;
+
+	case TUNNEL_OP_CLOSE:
+		pending_.skip (hdr);
+		if (s)
+			s->receive_close ();
+		break;
+
+	case TUNNEL_OP_RESET:
+		pending_.skip (hdr);
+		if (s)
+			s->reset (false);
+		break;
+
+	case TUNNEL_OP_WINDOW:
+		if (pending_.length () < hdr + sizeof n)
+			return 0;
+		pending_.extract (&n, hdr);
+		pending_.skip (hdr + sizeof n);
+		if (s)
+			s->grant (BigEndian::decode (n));
+		break;
+
+	default:
+		ERROR(log_) << "Unsupported operation in tunnel.";
+		return -1;
+	}
+
+	return 1;
+}
+
+void ProxyTunnel::on_data (Event e)
+{
+	if (read_action_)
+		read_action_->cancel (), read_action_ = 0;
+
+	switch (e.type_)
+	{
+	case Event::Done:
+		read_action_ = socket_->read (callback (this, &ProxyTunnel::on_data));
+		if (inbound_chain_.consume (e.buffer_))
+			break;
+		ERROR(log_) << "Invalid data from peer.";
+		shut ();
+		break;
+	case Event::EOS:
+		DEBUG(log_) << "Peer closed tunnel.";
+		inbound_chain_.flush (TUNNEL_INBOUND);
+		break;
+	default:
+		INFO(log_) << "Tunnel read failed: " << e;
+		shut ();
+		break;
+	}
+}
+
+void ProxyTunnel::hold ()
+{
+	held_ = true;
+}
+
+void ProxyTunnel::unhold ()
+{
+	std::map<uint32_t, TunnelStream*>::iterator it;
+
+	held_ = false;
+	for (it = streams_.begin (); it != streams_.end (); ++it)
+		it->second->poll ();
+}
+
+/*
+ * Reached by the end of either chain.  Once the peer has nothing more to
+ * send no stream can be completed, so they are all dropped and this end
+ * of the tunnel is closed as well.
+ */
+void ProxyTunnel::flush (int flg)
+{
+	std::map<uint32_t, TunnelStream*>::iterator it;
+
+	if (flg & TUNNEL_OUTBOUND)
+	{
+		flushing_ |= TUNNEL_OUTBOUND;
+	}
+	else if (! (flushing_ & TUNNEL_INBOUND))
+	{
+		flushing_ |= TUNNEL_INBOUND;
+		for (it = streams_.begin (); it != streams_.end (); ++it)
+			it->second->abandon ();
+		streams_.clear ();
+		if (owner_)
+			owner_->forget (this), owner_ = 0;
+		if (! (flushing_ & TUNNEL_OUTBOUND))
+			outbound_chain_.flush (TUNNEL_OUTBOUND);
+	}
+
+	if ((flushing_ & (TUNNEL_OUTBOUND | TUNNEL_INBOUND)) == (TUNNEL_OUTBOUND | TUNNEL_INBOUND) && ! close_action_)
+		close_action_ = EventSystem::current ().track (0, StreamModeWait, callback (this, &ProxyTunnel::conclude));
+}
+
+void ProxyTunnel::shut ()
+{
+	flushing_ |= (TUNNEL_OUTBOUND | TUNNEL_INBOUND);
+	if (owner_)
+		owner_->forget (this), owner_ = 0;
+	if (! close_action_)
+		close_action_ = EventSystem::current ().track (0, StreamModeWait, callback (this, &ProxyTunnel::conclude));
+}
+
+void ProxyTunnel::conclude (Event e)
+{
+	delete this;
+}
+
+void ProxyTunnel::frame (Buffer& out, uint8_t op, uint32_t id)
+{
+	id = BigEndian::encode (id);
+	out.append (op);
+	out.append (&id);
+}
+
+// Stream
+
+TunnelStream::TunnelStream (ProxyTunnel* tunnel, uint32_t id, Socket* sck)
+ : log_("/wanproxy/tunnel/stream"),
+   tunnel_(tunnel),
+   id_(id),
+   socket_(sck),
+   chain_(this),
+   connect_action_(0),
+   read_action_(0),
+   close_action_(0),
+   window_(TUNNEL_WINDOW),
+   credit_(0),
+   outstanding_(0),
+   client_(sck != 0),
+   connected_(false),
+   throttled_(false),
+   sent_close_(false),
+   got_close_(false),
+   flushed_(false),
+   closing_(false)
+{
+}
+
+TunnelStream::~TunnelStream ()
+{
+	if (connect_action_)
+		connect_action_->cancel ();
+	if (read_action_)
+		read_action_->cancel ();
+	if (close_action_)
+		close_action_->cancel ();
+	if (socket_)
+		socket_->close ();
+	delete socket_;
+}
+
+void TunnelStream::start ()
+{
+	if (build_chain ())
+		poll ();
+	else
+		reset (true);
+}
+
+void TunnelStream::connect (SocketAddressFamily family, const std::string& address)
+{
+	if ((socket_ = Socket::create (family, SocketTypeStream, "tcp", address)))
+		connect_action_ = socket_->connect (address, callback (this, &TunnelStream::connect_complete));
+	else
+		reset (true);
+}
+
+void TunnelStream::connect_complete (Event e)
+{
+	if (connect_action_)
+		connect_action_->cancel (), connect_action_ = 0;
+
+	if (e.type_ != Event::Done)
+	{
+		INFO(log_) << "Connect failed: " << e;
+		reset (true);
+		return;
+	}
+
+	if (! build_chain ())
+	{
+		reset (true);
+		return;
+	}
+
+	if (! pending_.empty ())
+	{
+		Buffer tmp;
+		tmp.append (pending_);
+		pending_.clear ();
+		deliver (tmp);
+	}
+	if (got_close_ && ! closing_)
+		chain_.flush (0);
+	poll ();
+}
+
+bool TunnelStream::build_chain ()
+{
+	SinkFilter* sink;
+
+	if (! socket_)
+		return false;
+
+	chain_.append ((sink = new SinkFilter ("/wanproxy/tunnel/stream", socket_, client_)));
+	sink->set_throttle (callback (this, &TunnelStream::pause), callback (this, &TunnelStream::resume));
+	connected_ = true;
+	return true;
+}
+
+/*
+ * The peer may only have as much data on its way as the window it was
+ * given, counted from what has not been acknowledged yet, whether it is
+ * still waiting for the connection or sitting in a throttled sink.  A
+ * stream whose peer sends more is reset, which also bounds pending_.
+ */
+void TunnelStream::receive (Buffer& data)
+{
+	long n = data.length ();
+
+	if (closing_)
+		return;
+
+	if ((outstanding_ += n) > TUNNEL_WINDOW)
+	{
+		INFO(log_) << "Peer exceeded the window of stream " << id_;
+		reset (true);
+		return;
+	}
+
+	if (! connected_)
+		pending_.append (data);
+	else
+		deliver (data);
+}
+
+void TunnelStream::deliver (Buffer& data)
+{
+	long n = data.length ();
+
+	if (! chain_.consume (data))
+	{
+		reset (true);
+		return;
+	}
+
+	credit_ += n;
+	offer_credit (TUNNEL_WINDOW / 4);
+}
+
+void TunnelStream::receive_close ()
+{
+	got_close_ = true;
+	if (connected_ && ! closing_)
+		chain_.flush (0);
+}
+
+void TunnelStream::grant (uint32_t n)
+{
+	window_ += n;
+	if (! unsent_.empty () && tunnel_ && ! closing_)
+		transmit ();
+	else
+		poll ();
+}
+
+/*
+ * The data written into the sink is acknowledged in batches, and not at
+ * all while the sink is throttled, so a slow client holds back its own
+ * stream only.
+ */
+void TunnelStream::offer_credit (long minimum)
+{
+	Buffer out;
+	uint32_t n;
+
+	if (! tunnel_ || throttled_ || got_close_ || credit_ <= 0 || credit_ < minimum)
+		return;
+
+	n = BigEndian::encode ((uint32_t) credit_);
+	ProxyTunnel::frame (out, TUNNEL_OP_WINDOW, id_);
+	out.append (&n);
+	outstanding_ -= credit_;
+	credit_ = 0;
+	tunnel_->send (out);
+}
+
+void TunnelStream::poll ()
+{
+	if (! read_action_ && connected_ && ! sent_close_ && ! closing_ && window_ > 0 && unsent_.empty () && tunnel_ && ! tunnel_->held ())
+		read_action_ = socket_->read (callback (this, &TunnelStream::on_data));
+}
+
+void TunnelStream::on_data (Event e)
+{
+	Buffer out;
+
+	if (read_action_)
+		read_action_->cancel (), read_action_ = 0;
+	if (closing_ || ! tunnel_)
+		return;
+
+	switch (e.type_)
+	{
+	case Event::Done:
+		unsent_.append (e.buffer_);
+		transmit ();
+		break;
+	case Event::EOS:
+		ProxyTunnel::frame (out, TUNNEL_OP_CLOSE, id_);
+		sent_close_ = true;
+		tunnel_->send (out);
+		finish ();
+		break;
+	default:
+		DEBUG(log_) << "Unexpected event: " << e;
+		reset (true);
+		break;
+	}
+}
+
+/*
+ * A read may return more than the window left, so what does not fit is
+ * kept until the peer grants more, and no more is read meanwhile.
+ */
+void TunnelStream::transmit ()
+{
+	Buffer out;
+	unsigned n;
+	uint16_t len;
+	long left = window_;
+
+	while (! unsent_.empty () && left > 0)
+	{
+		n = (unsent_.length () > TUNNEL_MAX_DATA ? TUNNEL_MAX_DATA : unsent_.length ());
+		if (n > left)
+			n = left;
+		len = BigEndian::encode ((uint16_t) n);
+		ProxyTunnel::frame (out, TUNNEL_OP_DATA, id_);
+		out.append (&len);
+		out.append (unsent_, n);
+		unsent_.skip (n);
+		left -= n;
+	}
+	window_ = left;
+	if (out.empty () || tunnel_->send (out))
+		poll ();
+}
+
+void TunnelStream::pause ()
+{
+	throttled_ = true;
+}
+
+void TunnelStream::resume ()
+{
+	throttled_ = false;
+	offer_credit (0);
+}
+
+void TunnelStream::flush (int flg)
+{
+	flushed_ = true;
+	finish ();
+}
+
+void TunnelStream::finish ()
+{
+	if (sent_close_ && flushed_ && ! closing_)
+	{
+		closing_ = true;
+		if (tunnel_)
+			tunnel_->release (id_), tunnel_ = 0;
+		close_action_ = EventSystem::current ().track (0, StreamModeWait, callback (this, &TunnelStream::conclude));
+	}
+}
+
+void TunnelStream::reset (bool notify)
+{
+	Buffer out;
+
+	if (closing_)
+		return;
+
+	if (notify && tunnel_)
+	{
+		ProxyTunnel::frame (out, TUNNEL_OP_RESET, id_);
+		tunnel_->send (out);
+	}
+	if (tunnel_)
+		tunnel_->release (id_);
+	abandon ();
+}
+
+void TunnelStream::abandon ()
+{
+	tunnel_ = 0;
+	if (closing_)
+		return;
+	closing_ = true;
+	close_action_ = EventSystem::current ().track (0, StreamModeWait, callback (this, &TunnelStream::conclude));
+}
+
+void TunnelStream::conclude (Event e)
+{
+	delete this;
+}
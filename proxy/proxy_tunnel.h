@@ -0,0 +1,148 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+// File:           proxy_tunnel.h                                             //
+// Description:    many client streams multiplexed over one peer connection   //
+// Project:        WANProxy XTech                                             //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef	PROGRAMS_WANPROXY_PROXY_TUNNEL_H
+#define	PROGRAMS_WANPROXY_PROXY_TUNNEL_H
+
+#include <map>
+#include <common/filter.h>
+#include <event/action.h>
+#include <event/event.h>
+#include <io/socket/socket_types.h>
+#include "wanproxy_codec.h"
+
+/*
+ * Frames carried inside the tunnel, before encoding:
+ * 	<OPEN> id[uint32_t]
+ * 	<DATA> id[uint32_t] length[uint16_t] data[uint8_t x length]
+ * 	<CLOSE> id[uint32_t]					no more data will follow
+ * 	<RESET> id[uint32_t]					the stream is gone
+ * 	<WINDOW> id[uint32_t] bytes[uint32_t]	the peer may send that much more
+ */
+#define TUNNEL_OP_OPEN			((uint8_t) 0x01)
+#define TUNNEL_OP_DATA			((uint8_t) 0x02)
+#define TUNNEL_OP_CLOSE			((uint8_t) 0x03)
+#define TUNNEL_OP_RESET			((uint8_t) 0x04)
+#define TUNNEL_OP_WINDOW		((uint8_t) 0x05)
+
+#define TUNNEL_MAX_DATA			0x8000		// largest payload of a <DATA> frame
+#define TUNNEL_WINDOW			0x40000		// bytes a stream may send ahead of the receiver
+
+#define TUNNEL_OUTBOUND			0x100000
+#define TUNNEL_INBOUND			0x200000
+
+class ProxyListener;
+class ProxyTunnel;
+class SinkFilter;
+
+class TunnelStream : public Filter
+{
+	LogHandle log_;
+	ProxyTunnel* tunnel_;
+	uint32_t id_;
+	Socket* socket_;
+	FilterChain chain_;
+	Buffer pending_;
+	Buffer unsent_;
+	Action* connect_action_;
+	Action* read_action_;
+	Action* close_action_;
+	long window_;
+	long credit_;
+	long outstanding_;
+	bool client_, connected_, throttled_, sent_close_, got_close_, flushed_, closing_;
+
+public:
+	TunnelStream (ProxyTunnel* tunnel, uint32_t id, Socket* sck = 0);
+	virtual ~TunnelStream ();
+
+	void start ();
+	void connect (SocketAddressFamily family, const std::string& address);
+	void receive (Buffer& data);
+	void receive_close ();
+	void grant (uint32_t n);
+	void reset (bool notify);
+	void abandon ();
+	void poll ();
+
+	virtual void flush (int flg);
+
+	void connect_complete (Event e);
+	void on_data (Event e);
+	void pause ();
+	void resume ();
+	void conclude (Event e);
+
+private:
+	bool build_chain ();
+	void deliver (Buffer& data);
+	void transmit ();
+	void offer_credit (long minimum);
+	void finish ();
+};
+
+/*
+ * A long-lived connection to the peer proxy carrying any number of client
+ * streams.  All of them share one encoder, decoder and compressor, which
+ * stay warm from one stream to the next, and open without a handshake of
+ * their own.  The client side keeps a small pool of these per listener;
+ * the server side creates one for every tunnel it accepts and connects a
+ * socket to its peer address for each stream opened through it.
+ */
+class ProxyTunnel : public Filter
+{
+	LogHandle log_;
+	ProxyListener* owner_;
+	WANProxyCodec* codec_;
+	Socket* socket_;
+	bool client_;
+	SocketAddressFamily family_;
+	std::string address_;
+	FilterChain outbound_chain_;
+	FilterChain inbound_chain_;
+	std::map<uint32_t, TunnelStream*> streams_;
+	uint32_t next_id_;
+	Buffer backlog_;
+	Buffer pending_;
+	Action* connect_action_;
+	Action* read_action_;
+	Action* stop_action_;
+	Action* close_action_;
+	bool connected_, held_;
+	int flushing_;
+
+public:
+	ProxyTunnel (const std::string& name, WANProxyCodec* cdc, SocketAddressFamily family, const std::string& address, ProxyListener* owner);
+	ProxyTunnel (const std::string& name, WANProxyCodec* cdc, Socket* sck, SocketAddressFamily family, const std::string& address);
+	virtual ~ProxyTunnel ();
+
+	void launch ();
+	void open (Socket* client);
+	void detach ();
+	bool send (Buffer& frames);
+	void release (uint32_t id);
+	bool held () const		{ return held_; }
+
+	virtual bool consume (Buffer& buf, int flg = 0);
+	virtual void flush (int flg);
+
+	void connect_complete (Event e);
+	void on_data (Event e);
+	void hold ();
+	void unhold ();
+	void conclude (Event e);
+
+	static void frame (Buffer& out, uint8_t op, uint32_t id);
+
+private:
+	bool build_chains ();
+	int dispatch (uint8_t op, uint32_t id);
+	void shut ();
+};
+
+#endif /* !PROGRAMS_WANPROXY_PROXY_TUNNEL_H */
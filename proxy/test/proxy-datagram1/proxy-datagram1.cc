@@ -0,0 +1,367 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+// File:           proxy-datagram1.cc                                         //
+// Description:    a stream over a datagram link survives packet loss         //
+// Project:        WANProxy XTech                                             //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <sstream>
+
+#include <common/buffer.h>
+#include <common/test.h>
+
+#include <event/event_callback.h>
+#include <event/event_system.h>
+
+#include <io/net/tcp_server.h>
+#include <io/socket/socket.h>
+
+#include <proxy/proxy_datagram.h>
+#include <proxy/wanproxy.h>
+
+#define	TEST_STREAM_SIZE	0x100000
+#define	TEST_LOSS_PERIOD	7				// one datagram in so many is dropped, each way
+#define	TEST_TIMEOUT		60000
+
+/*
+ * Forwards datagrams between the client of a link and the service, and
+ * drops some of them in both directions.
+ */
+class Relay
+{
+	LogHandle log_;
+	Socket* socket_;
+	Action* poll_action_;
+	std::string client_;
+	std::string service_;
+	unsigned count_[2];
+
+public:
+	unsigned dropped_[2];
+
+	Relay(const std::string& service)
+	: log_("/test/proxy/datagram/relay"),
+	  socket_(NULL),
+	  poll_action_(NULL),
+	  service_(service)
+	{
+		count_[0] = count_[1] = dropped_[0] = dropped_[1] = 0;
+	}
+
+	~Relay()
+	{
+		if (poll_action_ != NULL)
+			poll_action_->cancel();
+		if (socket_ != NULL) {
+			socket_->close();
+			delete socket_;
+		}
+	}
+
+	bool start(void)
+	{
+		if ((socket_ = Socket::create(SocketAddressFamilyIPv4, SocketTypeDatagram, "udp", "[127.0.0.1]:0")) == NULL ||
+		    !socket_->bind("[127.0.0.1]:0"))
+			return (false);
+		poll_action_ = socket_->poll(callback(this, &Relay::on_readable));
+		return (true);
+	}
+
+	std::string address(void) const
+	{
+		return (socket_->getsockname());
+	}
+
+	void on_readable(Event e)
+	{
+		std::vector<Datagram> in, out;
+		unsigned dir;
+
+		if (poll_action_ != NULL)
+			poll_action_->cancel(), poll_action_ = NULL;
+
+		if (e.type_ == Event::Error) {
+			ERROR(log_) << "Could not poll: " << e;
+			return;
+		}
+
+		while (socket_->receive_batch(in, DATAGRAM_BATCH) > 0) {
+			for (unsigned i = 0; i < in.size(); i++) {
+				if (in[i].address_ == service_) {
+					dir = 1;
+				} else {
+					client_ = in[i].address_;
+					dir = 0;
+				}
+				if (++count_[dir] % TEST_LOSS_PERIOD == 3) {
+					dropped_[dir]++;
+					continue;
+				}
+				out.push_back(in[i]);
+				out.back().address_ = (dir == 0 ? service_ : client_);
+			}
+			in.clear();
+		}
+		if (!out.empty())
+			socket_->send_batch(out);
+
+		poll_action_ = socket_->poll(callback(this, &Relay::on_readable));
+	}
+};
+
+/*
+ * The end of the proxy: keeps what the connector of the link writes to it,
+ * until it is closed.
+ */
+class Collector : public TCPServer
+{
+	TestGroup& group_;
+	const Buffer& expected_;
+	Action* accept_action_;
+	Action* read_action_;
+	Socket* socket_;
+	Buffer received_;
+
+public:
+	bool finished_;
+
+	Collector(TestGroup& group, const Buffer& expected)
+	: group_(group),
+	  expected_(expected),
+	  accept_action_(NULL),
+	  read_action_(NULL),
+	  socket_(NULL),
+	  finished_(false)
+	{ }
+
+	~Collector()
+	{
+		if (accept_action_ != NULL)
+			accept_action_->cancel();
+		if (read_action_ != NULL)
+			read_action_->cancel();
+		if (socket_ != NULL) {
+			socket_->close();
+			delete socket_;
+		}
+	}
+
+	bool start(void)
+	{
+		if (!listen(SocketAddressFamilyIPv4, "[127.0.0.1]:0"))
+			return (false);
+		accept_action_ = accept(callback(this, &Collector::accept_complete));
+		return (true);
+	}
+
+	void accept_complete(Event e, Socket *sck)
+	{
+		if (accept_action_ != NULL)
+			accept_action_->cancel(), accept_action_ = NULL;
+
+		{
+			Test _(group_, "Connector reaches the end.", e.type_ == Event::Done);
+		}
+		if (e.type_ != Event::Done) {
+			EventSystem::current().stop();
+			return;
+		}
+		socket_ = sck;
+		read_action_ = socket_->read(callback(this, &Collector::on_data));
+	}
+
+	void on_data(Event e)
+	{
+		if (read_action_ != NULL)
+			read_action_->cancel(), read_action_ = NULL;
+
+		if (e.type_ == Event::Done) {
+			received_.append(e.buffer_);
+			read_action_ = socket_->read(callback(this, &Collector::on_data));
+			return;
+		}
+
+		{
+			Test _(group_, "Stream ends cleanly.", e.type_ == Event::EOS);
+		}
+		{
+			Test _(group_, "All of the stream arrives.", received_.length() == expected_.length());
+			Test __(group_, "Stream arrives intact.", received_.equal(&expected_));
+		}
+		finished_ = true;
+		EventSystem::current().stop();
+	}
+};
+
+/*
+ * The sending end: a client link opened through the relay, given the
+ * whole stream at once and then flushed.
+ */
+class Sender
+{
+	TestGroup& group_;
+	DatagramLink link_;
+	Filter* sink_;
+	Buffer data_;
+	Action* connect_action_;
+	Action* timeout_action_;
+
+public:
+	Sender(TestGroup& group, const Buffer& data)
+	: group_(group),
+	  link_("test"),
+	  sink_(NULL),
+	  data_(data),
+	  connect_action_(NULL),
+	  timeout_action_(NULL)
+	{ }
+
+	~Sender()
+	{
+		if (connect_action_ != NULL)
+			connect_action_->cancel();
+		if (timeout_action_ != NULL)
+			timeout_action_->cancel();
+		delete sink_;
+	}
+
+	bool start(const std::string& address)
+	{
+		connect_action_ = link_.connect(SocketAddressFamilyIPv4, address, callback(this, &Sender::connect_complete));
+		timeout_action_ = EventSystem::current().track(TEST_TIMEOUT, StreamModeWait, callback(this, &Sender::on_timeout));
+		return (connect_action_ != NULL);
+	}
+
+	void connect_complete(Event e)
+	{
+		if (connect_action_ != NULL)
+			connect_action_->cancel(), connect_action_ = NULL;
+
+		{
+			Test _(group_, "Link opened.", e.type_ == Event::Done);
+		}
+		if (e.type_ != Event::Done) {
+			EventSystem::current().stop();
+			return;
+		}
+		link_.start();
+		sink_ = link_.sink();
+		{
+			Test _(group_, "Stream taken.", sink_->consume(data_));
+		}
+		sink_->flush(0);
+	}
+
+	void on_timeout(Event)
+	{
+		if (timeout_action_ != NULL)
+			timeout_action_->cancel(), timeout_action_ = NULL;
+		ERROR("/test/proxy/datagram") << "Timed out.";
+		EventSystem::current().stop();
+	}
+};
+
+/*
+ * Defined next to main in wanproxy.cc, which is not part of the test.
+ */
+WanProxyCore wanproxy;
+
+/*
+ * A free port for the service, which does not tell which one it took.
+ */
+static std::string
+free_port(void)
+{
+	struct sockaddr_in sin;
+	socklen_t len = sizeof sin;
+	std::ostringstream str;
+	int fd;
+
+	memset(&sin, 0, sizeof sin);
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if ((fd = ::socket(AF_INET, SOCK_DGRAM, 0)) == -1)
+		return (std::string());
+	if (::bind(fd, (struct sockaddr *)&sin, sizeof sin) == -1 ||
+	    ::getsockname(fd, (struct sockaddr *)&sin, &len) == -1) {
+		::close(fd);
+		return (std::string());
+	}
+	::close(fd);
+	str << "[127.0.0.1]:" << ntohs(sin.sin_port);
+	return (str.str());
+}
+
+/*
+ * The raw address of the service, as datagrams from it are received.
+ */
+static std::string
+raw_address(const std::string& name)
+{
+	struct sockaddr_in sin;
+
+	memset(&sin, 0, sizeof sin);
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(atoi(name.substr(name.rfind(':') + 1).c_str()));
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	return (std::string((const char *)&sin, sizeof sin));
+}
+
+int
+main(void)
+{
+	TestGroup g("/test/proxy/datagram/1", "DatagramLink over a lossy path #1");
+
+	Buffer stream;
+	uint32_t seed = 1;
+	while (stream.length() < TEST_STREAM_SIZE) {
+		seed = seed * 1103515245 + 12345;
+		stream.append((uint8_t)(seed >> 16));
+	}
+
+	Collector collector(g, stream);
+	std::string service_address = free_port();
+	{
+		Test _(g, "Collector listening.", collector.start());
+		Test __(g, "Free port found.", !service_address.empty());
+	}
+
+	LinkService svc;
+	svc.name_ = "test";
+	svc.local_codec_ = NULL;
+	svc.remote_codec_ = NULL;
+	svc.remote_family_ = SocketAddressFamilyIPv4;
+	svc.remote_address_ = collector.getsockname();
+	svc.workers_ = 0;
+	DatagramService *service = new DatagramService(svc, SocketAddressFamilyIPv4, service_address);
+
+	Relay relay(raw_address(service_address));
+	{
+		Test _(g, "Relay bound.", relay.start());
+	}
+
+	Sender *sender = new Sender(g, stream);
+	{
+		Test _(g, "Link connecting.", sender->start(relay.address()));
+	}
+
+	event_system.run();
+
+	{
+		Test _(g, "Stream collected.", collector.finished_);
+		Test __(g, "Datagrams dropped each way.", relay.dropped_[0] > 0 && relay.dropped_[1] > 0);
+	}
+	INFO("/test/proxy/datagram") << "Dropped " << relay.dropped_[0] << " datagrams to the service and " << relay.dropped_[1] << " back.";
+
+	delete sender;
+	delete service;
+
+	return (0);
+}
@@ -0,0 +1,261 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+// File:           proxy-stripe1.cc                                           //
+// Description:    frames of a stripe set are put back in order over loopback //
+// Project:        WANProxy XTech                                             //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <map>
+
+#include <common/buffer.h>
+#include <common/endian.h>
+#include <common/test.h>
+#include <common/uuid/uuid.h>
+
+#include <event/event_callback.h>
+#include <event/event_system.h>
+
+#include <io/net/tcp_server.h>
+#include <io/socket/socket.h>
+
+#include <proxy/proxy_stripe.h>
+#include <proxy/wanproxy.h>
+
+#define	TEST_STRIPES	2
+#define	TEST_TIMEOUT	10000
+
+/*
+ * One set of two stripes received from plain sockets, which send the
+ * frames given to them.  Frames may also be handed over with a stripe as
+ * if they had come along with its greeting, which lets a test decide what
+ * the set sees first.
+ */
+class Scenario : public TCPServer
+{
+	TestGroup group_;
+	int fds_[TEST_STRIPES];
+	std::vector<Socket*> accepted_;
+	Buffer early_[TEST_STRIPES];
+	Buffer wire_[TEST_STRIPES];
+	std::map<uint32_t, Buffer> expected_;
+	Event::Type outcome_;
+	StripeSet* set_;
+	Action* accept_action_;
+	Action* read_action_;
+	Action* timeout_action_;
+	Buffer received_;
+	bool finished_;
+
+public:
+	static int running_;
+
+	Scenario(const std::string& log, const std::string& description, Event::Type outcome)
+	: group_(log, description),
+	  outcome_(outcome),
+	  set_(NULL),
+	  accept_action_(NULL),
+	  read_action_(NULL),
+	  timeout_action_(NULL),
+	  finished_(false)
+	{
+		for (unsigned i = 0; i < TEST_STRIPES; i++)
+			fds_[i] = -1;
+	}
+
+	~Scenario()
+	{
+		{
+			Test _(group_, "Scenario finished.", finished_);
+		}
+		for (unsigned i = 0; i < TEST_STRIPES; i++)
+			if (fds_[i] != -1)
+				::close(fds_[i]);
+		if (set_ != NULL)
+			delete set_;
+		else
+			for (unsigned i = 0; i < accepted_.size(); i++)
+				delete accepted_[i];
+	}
+
+	/*
+	 * Frame seq of the set, sent on the given stripe or, if early, handed
+	 * over with it.  Unless told otherwise, its payload is expected to be
+	 * delivered, even when the set fails afterwards.
+	 */
+	void frame(unsigned stripe, uint32_t seq, bool early, bool expected = true)
+	{
+		Buffer payload;
+		for (unsigned i = 0; i < 100 + seq * 37; i++)
+			payload.append((uint8_t)(seq + i));
+
+		Buffer& out = early ? early_[stripe] : wire_[stripe];
+		BigEndian::append(&out, seq);
+		BigEndian::append(&out, (uint32_t)payload.length());
+		out.append(payload);
+		if (expected)
+			expected_[seq] = payload;
+	}
+
+	bool start(void)
+	{
+		struct sockaddr_in sin;
+		std::string name;
+		int port;
+
+		if (!listen(SocketAddressFamilyIPv4, "[127.0.0.1]:0"))
+			return (false);
+		name = getsockname();
+		port = atoi(name.substr(name.rfind(':') + 1).c_str());
+
+		memset(&sin, 0, sizeof sin);
+		sin.sin_family = AF_INET;
+		sin.sin_port = htons(port);
+		sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		for (unsigned i = 0; i < TEST_STRIPES; i++) {
+			fds_[i] = ::socket(AF_INET, SOCK_STREAM, 0);
+			if (fds_[i] == -1 || ::connect(fds_[i], (struct sockaddr *)&sin, sizeof sin) == -1)
+				return (false);
+		}
+
+		running_++;
+		accept_action_ = accept(callback(this, &Scenario::accept_complete));
+		timeout_action_ = EventSystem::current().track(TEST_TIMEOUT, StreamModeWait, callback(this, &Scenario::on_timeout));
+		return (true);
+	}
+
+	/*
+	 * Connections are accepted in the order they were made, so the index
+	 * of a stripe is its place in the backlog.
+	 */
+	void accept_complete(Event e, Socket *sck)
+	{
+		if (e.type_ != Event::Done) {
+			if (accept_action_ != NULL)
+				accept_action_->cancel(), accept_action_ = NULL;
+			finish(Event::Invalid);
+			return;
+		}
+		accepted_.push_back(sck);
+		if (accepted_.size() < TEST_STRIPES)
+			return;
+
+		if (accept_action_ != NULL)
+			accept_action_->cancel(), accept_action_ = NULL;
+
+		UUID session;
+		session.generate();
+		set_ = new StripeSet("test", session, TEST_STRIPES);
+		for (unsigned i = 0; i < TEST_STRIPES; i++) {
+			Test _(group_, "Adopt stripe.", set_->adopt(i, accepted_[i], early_[i]));
+		}
+		set_->start();
+		read_action_ = set_->read(callback(this, &Scenario::on_read));
+
+		for (unsigned i = 0; i < TEST_STRIPES; i++) {
+			uint8_t data[0x10000];
+			size_t len = wire_[i].length();
+			if (len > 0) {
+				wire_[i].moveout(data, len);
+				Test _(group_, "Send frames.", ::write(fds_[i], data, len) == (ssize_t)len);
+			}
+			::close(fds_[i]);
+			fds_[i] = -1;
+		}
+	}
+
+	void on_read(Event e)
+	{
+		if (read_action_ != NULL)
+			read_action_->cancel(), read_action_ = NULL;
+
+		if (e.type_ == Event::Done) {
+			received_.append(e.buffer_);
+			read_action_ = set_->read(callback(this, &Scenario::on_read));
+			return;
+		}
+		finish(e.type_);
+	}
+
+	void on_timeout(Event)
+	{
+		if (timeout_action_ != NULL)
+			timeout_action_->cancel(), timeout_action_ = NULL;
+		if (accept_action_ != NULL)
+			accept_action_->cancel(), accept_action_ = NULL;
+		if (read_action_ != NULL)
+			read_action_->cancel(), read_action_ = NULL;
+		ERROR("/test/proxy/stripe") << "Timed out.";
+		finish(Event::Invalid);
+	}
+
+	void finish(Event::Type type)
+	{
+		if (timeout_action_ != NULL)
+			timeout_action_->cancel(), timeout_action_ = NULL;
+		{
+			Test _(group_, "Expected outcome.", type == outcome_);
+		}
+		Buffer expected;
+		std::map<uint32_t, Buffer>::const_iterator it;
+		for (it = expected_.begin(); it != expected_.end(); ++it)
+			expected.append(it->second);
+		{
+			Test _(group_, "Frames delivered in order.", received_.equal(&expected));
+		}
+		finished_ = true;
+		if (--running_ == 0)
+			EventSystem::current().stop();
+	}
+};
+
+int Scenario::running_;
+
+/*
+ * Defined next to main in wanproxy.cc, which is not part of the test.
+ */
+WanProxyCore wanproxy;
+
+int
+main(void)
+{
+	/*
+	 * Every other frame comes first with the second stripe and has to be
+	 * held until those of the first one fill the gaps.
+	 */
+	Scenario reorder("/test/proxy/stripe/reorder", "StripeSet puts frames back in order", Event::EOS);
+	reorder.frame(0, 0, false);
+	reorder.frame(1, 1, true);
+	reorder.frame(0, 2, false);
+	reorder.frame(1, 3, true);
+	reorder.frame(0, 4, false);
+	reorder.frame(1, 5, true);
+	reorder.frame(1, 6, false);
+	reorder.frame(0, 7, false);
+
+	/*
+	 * A frame already released arrives again on another stripe.
+	 */
+	Scenario stale("/test/proxy/stripe/stale", "StripeSet fails on a stale frame", Event::Error);
+	stale.frame(1, 1, true);
+	stale.frame(0, 0, false);
+	stale.frame(0, 1, false, false);
+
+	/*
+	 * Both stripes end while a frame is still held for one never sent.
+	 */
+	Scenario gap("/test/proxy/stripe/gap", "StripeSet fails on a missing frame", Event::Error);
+	gap.frame(1, 2, true, false);
+	gap.frame(0, 0, false);
+
+	if (reorder.start() && stale.start() && gap.start())
+		event_system.run();
+
+	return (0);
+}
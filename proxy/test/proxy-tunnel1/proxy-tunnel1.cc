@@ -0,0 +1,292 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+// File:           proxy-tunnel1.cc                                           //
+// Description:    a tunnel stream is reset when its peer overruns the window //
+// Project:        WANProxy XTech                                             //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+#include <common/buffer.h>
+#include <common/endian.h>
+#include <common/test.h>
+
+#include <event/event_callback.h>
+#include <event/event_system.h>
+
+#include <io/net/tcp_server.h>
+#include <io/socket/socket.h>
+
+#include <proxy/proxy_tunnel.h>
+#include <proxy/wanproxy.h>
+
+#define	TEST_OVERRUN_STREAM	1
+#define	TEST_FITTING_STREAM	3
+#define	TEST_TIMEOUT		10000
+
+/*
+ * Where the server end of the tunnel connects its streams; it only counts
+ * what they write, and tells the scenario each time.
+ */
+class Target : public TCPServer
+{
+	Callback* progress_;
+	Action* accept_action_;
+	std::vector<Socket*> accepted_;
+	std::vector<Action*> reads_;
+
+public:
+	size_t received_;
+
+	Target(void)
+	: progress_(NULL),
+	  accept_action_(NULL),
+	  received_(0)
+	{ }
+
+	~Target()
+	{
+		delete progress_;
+		if (accept_action_ != NULL)
+			accept_action_->cancel();
+		for (unsigned i = 0; i < accepted_.size(); i++) {
+			if (reads_[i] != NULL)
+				reads_[i]->cancel();
+			accepted_[i]->close();
+			delete accepted_[i];
+		}
+	}
+
+	bool start(Callback *progress)
+	{
+		progress_ = progress;
+		if (!listen(SocketAddressFamilyIPv4, "[127.0.0.1]:0"))
+			return (false);
+		accept_action_ = accept(callback(this, &Target::accept_complete));
+		return (true);
+	}
+
+	void accept_complete(Event e, Socket *sck)
+	{
+		if (e.type_ != Event::Done)
+			return;
+		accepted_.push_back(sck);
+		reads_.push_back(sck->read(callback(this, &Target::on_read, (unsigned)reads_.size())));
+	}
+
+	void on_read(Event e, unsigned n)
+	{
+		if (reads_[n] != NULL)
+			reads_[n]->cancel(), reads_[n] = NULL;
+		if (e.type_ != Event::Done)
+			return;
+		received_ += e.buffer_.length();
+		reads_[n] = accepted_[n]->read(callback(this, &Target::on_read, n));
+		progress_->execute();
+	}
+};
+
+/*
+ * The server end of a tunnel is given, at once and before either of its
+ * streams could connect, one stream that sends a byte more than its window
+ * and one that sends its window exactly.  The first one has to be reset
+ * and the second one delivered and granted more.
+ */
+class Scenario : public TCPServer
+{
+	TestGroup group_;
+	Target target_;
+	Socket* client_;
+	Action* accept_action_;
+	Action* connect_action_;
+	Action* read_action_;
+	Action* timeout_action_;
+	Buffer frames_;
+	bool reset_[2];
+	uint32_t granted_[2];
+	bool finished_;
+
+public:
+	Scenario(void)
+	: group_("/test/proxy/tunnel", "ProxyTunnel enforces the stream window"),
+	  client_(NULL),
+	  accept_action_(NULL),
+	  connect_action_(NULL),
+	  read_action_(NULL),
+	  timeout_action_(NULL),
+	  finished_(false)
+	{
+		reset_[0] = reset_[1] = false;
+		granted_[0] = granted_[1] = 0;
+	}
+
+	~Scenario()
+	{
+		{
+			Test _(group_, "Scenario finished.", finished_);
+		}
+		if (client_ != NULL) {
+			client_->close();
+			delete client_;
+		}
+	}
+
+	bool start(void)
+	{
+		std::string name;
+
+		if (!target_.start(callback(this, &Scenario::check)) || !listen(SocketAddressFamilyIPv4, "[127.0.0.1]:0"))
+			return (false);
+		name = getsockname();
+		if ((client_ = Socket::create(SocketAddressFamilyIPv4, SocketTypeStream, "tcp", name)) == NULL)
+			return (false);
+		accept_action_ = accept(callback(this, &Scenario::accept_complete));
+		connect_action_ = client_->connect(name, callback(this, &Scenario::connect_complete));
+		timeout_action_ = event_system.track(TEST_TIMEOUT, StreamModeWait, callback(this, &Scenario::on_timeout));
+		return (true);
+	}
+
+	void connect_complete(Event e)
+	{
+		if (connect_action_ != NULL)
+			connect_action_->cancel(), connect_action_ = NULL;
+		if (e.type_ != Event::Done) {
+			finish();
+			return;
+		}
+		read_action_ = client_->read(callback(this, &Scenario::on_read));
+	}
+
+	void accept_complete(Event e, Socket *sck)
+	{
+		ProxyTunnel *tunnel;
+		Buffer frames;
+
+		if (accept_action_ != NULL)
+			accept_action_->cancel(), accept_action_ = NULL;
+		if (e.type_ != Event::Done) {
+			finish();
+			return;
+		}
+
+		stream(frames, TEST_OVERRUN_STREAM, TUNNEL_WINDOW + 1);
+		stream(frames, TEST_FITTING_STREAM, TUNNEL_WINDOW);
+		tunnel = new ProxyTunnel("test", NULL, sck, SocketAddressFamilyIPv4, target_.getsockname());
+		{
+			Test _(group_, "Frames accepted.", tunnel->consume(frames));
+		}
+	}
+
+	/*
+	 * Frames the tunnel sends back: a <RESET> or a <WINDOW> are all that
+	 * either stream may get.
+	 */
+	void on_read(Event e)
+	{
+		uint8_t op;
+		uint32_t id, n;
+
+		if (read_action_ != NULL)
+			read_action_->cancel(), read_action_ = NULL;
+		if (e.type_ != Event::Done) {
+			finish();
+			return;
+		}
+
+		frames_.append(e.buffer_);
+		while (frames_.length() >= sizeof op + sizeof id) {
+			op = frames_.peek();
+			frames_.extract(&id, sizeof op);
+			id = BigEndian::decode(id);
+			if (op == TUNNEL_OP_WINDOW) {
+				if (frames_.length() < sizeof op + sizeof id + sizeof n)
+					break;
+				frames_.extract(&n, sizeof op + sizeof id);
+				frames_.skip(sizeof op + sizeof id + sizeof n);
+				granted_[id == TEST_FITTING_STREAM] += BigEndian::decode(n);
+			} else {
+				frames_.skip(sizeof op + sizeof id);
+				if (op == TUNNEL_OP_RESET)
+					reset_[id == TEST_FITTING_STREAM] = true;
+			}
+		}
+
+		read_action_ = client_->read(callback(this, &Scenario::on_read));
+		check();
+	}
+
+	void check(void)
+	{
+		if (!finished_ && reset_[0] && granted_[1] == TUNNEL_WINDOW && target_.received_ == TUNNEL_WINDOW)
+			finish();
+	}
+
+	void on_timeout(Event)
+	{
+		if (timeout_action_ != NULL)
+			timeout_action_->cancel(), timeout_action_ = NULL;
+		ERROR("/test/proxy/tunnel") << "Timed out.";
+		finish();
+	}
+
+	void finish(void)
+	{
+		if (timeout_action_ != NULL)
+			timeout_action_->cancel(), timeout_action_ = NULL;
+		if (accept_action_ != NULL)
+			accept_action_->cancel(), accept_action_ = NULL;
+		if (connect_action_ != NULL)
+			connect_action_->cancel(), connect_action_ = NULL;
+		if (read_action_ != NULL)
+			read_action_->cancel(), read_action_ = NULL;
+		{
+			Test _(group_, "Overrunning stream reset.", reset_[0]);
+		}
+		{
+			Test _(group_, "Overrunning stream granted nothing.", granted_[0] == 0);
+		}
+		{
+			Test _(group_, "Fitting stream not reset.", !reset_[1]);
+		}
+		{
+			Test _(group_, "Fitting stream granted its window again.", granted_[1] == TUNNEL_WINDOW);
+		}
+		{
+			Test _(group_, "Fitting stream delivered.", target_.received_ == TUNNEL_WINDOW);
+		}
+		finished_ = true;
+		event_system.stop();
+	}
+
+private:
+	static void stream(Buffer& out, uint32_t id, size_t size)
+	{
+		uint16_t len;
+		size_t n;
+
+		ProxyTunnel::frame(out, TUNNEL_OP_OPEN, id);
+		for (; size > 0; size -= n) {
+			n = size > TUNNEL_MAX_DATA ? TUNNEL_MAX_DATA : size;
+			ProxyTunnel::frame(out, TUNNEL_OP_DATA, id);
+			len = BigEndian::encode((uint16_t)n);
+			out.append(&len);
+			for (size_t i = 0; i < n; i++)
+				out.append((uint8_t)(id + i));
+		}
+	}
+};
+
+/*
+ * Defined next to main in wanproxy.cc, which is not part of the test.
+ */
+WanProxyCore wanproxy;
+
+int
+main(void)
+{
+	Scenario scenario;
+
+	if (scenario.start())
+		event_system.run();
+
+	return (0);
+}
@@ -24,7 +24,9 @@
  */
 
 #include <unistd.h>
+#include <stdlib.h>
 #include <common/log.h>
+#include <common/memory_budget.h>
 #include <event/event_system.h>
 #include "wanproxy.h"
 
@@ -48,26 +50,36 @@ static void usage(void);
 int main (int argc, char *argv[])
 {
 	std::string configfile;
-	bool quiet, verbose;
+	bool quiet, verbose, direct;
+	long limit;
 	int ch;
 
-	quiet = verbose = false;
+	quiet = verbose = direct = false;
+	limit = 0;
 
 	INFO("/wanproxy") << "WANProxy MT " << PROGRAM_VERSION;
 	INFO("/wanproxy") << "Copyright (c) 2008-2013 WANProxy.org";
 	INFO("/wanproxy") << "Copyright (c) 2013-2018 Bramfeld-Software";
 	INFO("/wanproxy") << "All rights reserved.";
 
-	while ((ch = getopt(argc, argv, "c:qv")) != -1) 
+	while ((ch = getopt(argc, argv, "c:m:qsv")) != -1) 
 	{
 		switch (ch) 
 		{
 		case 'c':
 			configfile = optarg;
 			break;
+		case 'm':
+			limit = atol (optarg);
+			if (limit <= 0)
+				usage();
+			break;
 		case 'q':
 			quiet = true;
 			break;
+		case 's':
+			direct = true;
+			break;
 		case 'v':
 			verbose = true;
 			break;
@@ -89,6 +101,14 @@ int main (int argc, char *argv[])
 	else
 		Log::mask (".?", Log::Info);
 
+	event_system.set_direct (direct);
+
+	if (limit > 0)
+	{
+		memory_budget.set_limit ((size_t) limit << 20);
+		INFO("/wanproxy") << "Memory budget: " << limit << " MB";
+	}
+
 	if (! wanproxy.configure (configfile)) 
 	{
 		ERROR("/wanproxy") << "Could not configure proxies.";
@@ -105,7 +125,7 @@ int main (int argc, char *argv[])
 
 static void usage(void)
 {
-	INFO("/wanproxy/usage") << "wanproxy [-q | -v] -c configfile";
+	INFO("/wanproxy/usage") << "wanproxy [-q | -v] [-s] [-m megabytes] -c configfile";
 	exit(1);
 }
 
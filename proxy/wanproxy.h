@@ -12,6 +12,11 @@
 #define	PROGRAMS_WANPROXY_WANPROXY_CORE_H
 
 #include <event/event_system.h>
+#include <event/worker_pool.h>
+#include <xcodec/xcodec_scanner.h>
+#include <zlib/zlib_pool.h>
+#include <common/memory_budget.h>
+#include <common/thread/mutex.h>
 #include <common/uuid/uuid.h>
 #include <xcodec/xcodec.h>
 #include <xcodec/xcodec_cache.h>
@@ -20,6 +25,9 @@
 #include "wanproxy_config.h"
 #include "wanproxy_config_type_codec.h"
 #include "proxy_listener.h"
+#include "proxy_peers.h"
+#include "proxy_replica.h"
+#include "proxy_segments.h"
 
 struct WanProxyInstance
 {
@@ -31,19 +39,38 @@ struct WanProxyInstance
 	WANProxyCodec local_codec_;
 	SocketAddressFamily remote_protocol_;
 	std::string remote_address_;
+	std::vector<PeerAddress> peer_list_;
 	WANProxyCodec remote_codec_;
+	int shards_;
+	int workers_;
+	int tunnels_;
+	int pool_;
+	bool fast_open_;
+	int stripes_;
+	bool local_udp_;
+	bool remote_udp_;
+	PeerSelector* selector_;
 	ProxyListener* listener_;
 	
 	WanProxyInstance ()
 	{
 		proxy_client_ = proxy_secure_ = false; 
 		local_protocol_ = remote_protocol_ = SocketAddressFamilyIP;
+		shards_ = 1;
+		workers_ = 0;
+		tunnels_ = 0;
+		pool_ = 0;
+		fast_open_ = false;
+		stripes_ = 0;
+		local_udp_ = remote_udp_ = false;
+		selector_ = 0;
 		listener_ = 0;
 	}
 	
 	~WanProxyInstance ()
 	{
 		delete listener_;
+		delete selector_;
 	}
 };
 
@@ -52,13 +79,19 @@ struct WanProxyCore
 private:
 	std::string config_file_;
 	Action* reload_action_;
+	Action* stop_action_;
+	Mutex cache_lock_;
 	std::map<UUID, XCodecCache*> caches_;
 	std::map<std::string, WanProxyInstance> proxies_;
+	std::map<std::string, CacheReplica*> replicas_;
+	std::map<std::string, CacheStandby*> standbys_;
+	std::map<std::string, SegmentClient*> segment_clients_;
+	std::map<std::string, SegmentService*> segment_services_;
 
 public:
 	WanProxyCore ()
 	{
-		reload_action_ = 0;
+		reload_action_ = stop_action_ = 0;
 	}
 	
 	bool configure (const std::string& file)
@@ -68,6 +101,8 @@ public:
 		if (reload_action_)
 			reload_action_->cancel ();
 		reload_action_ = event_system.register_interest (EventInterestReload, callback (this, &WanProxyCore::reload));
+		if (! stop_action_)
+			stop_action_ = event_system.register_interest (EventInterestStop, callback (this, &WanProxyCore::halt));
 		return config.read_file (config_file_); 
 	}
 	
@@ -79,6 +114,13 @@ public:
 			INFO("wanproxy/core") << "Could not reconfigure proxies.";
 	}	
 	
+	void halt ()
+	{
+		worker_pool.stop ();
+		xcodec_scanner.stop ();
+		deflate_pool.stop ();
+	}
+	
 	void add_proxy (std::string& name, WanProxyInstance& data)
 	{
 	   WanProxyInstance& prx = proxies_[name];
@@ -92,19 +134,54 @@ public:
 	   prx.remote_protocol_ = data.remote_protocol_;
 	   prx.remote_address_ = data.remote_address_;
 	   prx.remote_codec_ = data.remote_codec_;
+	   prx.workers_ = data.workers_;
+	   prx.tunnels_ = data.tunnels_;
+	   prx.pool_ = data.pool_;
+	   prx.fast_open_ = data.fast_open_;
+	   prx.stripes_ = data.stripes_;
+	   prx.local_udp_ = data.local_udp_;
+	   prx.remote_udp_ = data.remote_udp_;
+	   prx.peer_list_ = data.peer_list_;
+	   
+	   if (! prx.selector_)
+			prx.selector_ = new PeerSelector (prx.proxy_name_);
+	   prx.selector_->assign (prx.peer_list_);
+	   
+	   ProxySettings settings;
+	   settings.is_cln_ = prx.proxy_client_;
+	   settings.is_ssh_ = prx.proxy_secure_;
+	   settings.shards_ = data.shards_;
+	   settings.workers_ = prx.workers_;
+	   settings.tunnels_ = prx.tunnels_;
+	   settings.pooled_ = prx.pool_;
+	   settings.fast_open_ = prx.fast_open_;
+	   settings.stripes_ = prx.stripes_;
+	   settings.peers_ = (prx.peer_list_.size () > 1 ? prx.selector_ : 0);
+	   settings.local_udp_ = prx.local_udp_;
+	   settings.remote_udp_ = prx.remote_udp_;
 	   
 	   if (! prx.listener_)
+	   {
+			prx.shards_ = data.shards_;
 			prx.listener_ = new ProxyListener (prx.proxy_name_, &prx.local_codec_, &prx.remote_codec_, 
-														  prx.local_protocol_, prx.local_address_, prx.remote_protocol_, prx.remote_address_,
-														  prx.proxy_client_, prx.proxy_secure_);
+														  prx.local_protocol_, prx.local_address_, prx.remote_protocol_, prx.remote_address_, settings);
+	   }
 	   else
+	   {
+			if (data.shards_ != prx.shards_)
+				INFO("wanproxy/core") << "Shard count for proxy " << prx.proxy_name_ << " will change on restart.";
 			prx.listener_->refresh (prx.proxy_name_, &prx.local_codec_, &prx.remote_codec_, 
-											prx.local_protocol_, prx.local_address_, prx.remote_protocol_, prx.remote_address_, 
-											prx.proxy_client_, prx.proxy_secure_);
+											prx.local_protocol_, prx.local_address_, prx.remote_protocol_, prx.remote_address_, settings);
+	   }
 	}
 	
-	XCodecCache* add_cache (WANProxyConfigCache type, std::string& path, size_t size, UUID& uuid)
+	XCodecCache* add_cache (WANProxyConfigCache type, std::string& path, size_t size, UUID& uuid, CacheReplica* rpl = 0)
 	{
+		ScopedLock guard (cache_lock_);
+		std::map<UUID, XCodecCache*>::const_iterator it = caches_.find (uuid);
+		if (it != caches_.end ())
+			return it->second;
+		
 		XCodecCache* cache = 0;
 		switch (type)
 		{
@@ -115,14 +192,64 @@ public:
 			cache = new XCodecCacheCOSS (uuid, path, size);
 			break;
 		}
-		ASSERT("/xcodec/cache", caches_.find(uuid) == caches_.end());
 		if (cache)
 			caches_[uuid] = cache;
+		if (cache && rpl)
+			replicate (cache, rpl);
+		if (memory_budget.limit () && memory_budget.used (MemoryUseCaches) > memory_budget.limit () / 2)
+			WARNING("wanproxy/core") << "Caches take " << (memory_budget.used (MemoryUseCaches) >> 20) << " MB of the memory budget.";
 		return cache;
 	}
 	
+	/*
+	 * Only disk caches are replicated: a memory cache would not survive
+	 * the failure that makes the standby necessary.
+	 */
+	void replicate (XCodecCache* cache, CacheReplica* rpl)
+	{
+		XCodecCacheCOSS* coss = dynamic_cast<XCodecCacheCOSS*> (cache);
+		if (coss)
+			rpl->attach (coss);
+	}
+	
+	CacheReplica* add_replica (SocketAddressFamily family, const std::string& address)
+	{
+		CacheReplica*& rpl = replicas_[address];
+		if (! rpl)
+			rpl = new CacheReplica (family, address);
+		return rpl;
+	}
+	
+	void add_standby (SocketAddressFamily family, const std::string& address, const std::string& path, size_t size, const std::string& primary)
+	{
+		CacheStandby*& stb = standbys_[address];
+		if (! stb)
+			stb = new CacheStandby (family, address, path, size);
+		else
+			stb->set_cache (path, size);
+		stb->allow (primary);
+	}
+	
+	SegmentClient* add_segment_client (SocketAddressFamily family, const std::string& address)
+	{
+		SegmentClient*& clt = segment_clients_[address];
+		if (! clt)
+			clt = new SegmentClient (family, address);
+		return clt;
+	}
+	
+	void add_segment_service (SocketAddressFamily family, const std::string& address, const std::vector<std::string>& neighbours)
+	{
+		SegmentService*& svc = segment_services_[address];
+		if (! svc)
+			svc = new SegmentService (family, address);
+		for (unsigned i = 0; i < neighbours.size (); ++i)
+			svc->allow (neighbours[i]);
+	}
+	
 	XCodecCache* find_cache (UUID uuid)
 	{
+		ScopedLock guard (cache_lock_);
 		std::map<UUID, XCodecCache*>::const_iterator it = caches_.find (uuid);
 		if (it != caches_.end ())
 			return it->second;
@@ -133,11 +260,36 @@ public:
 	{
 		if (reload_action_)
 			reload_action_->cancel (), reload_action_ = 0;
+		if (stop_action_)
+			stop_action_->cancel (), stop_action_ = 0;
+		worker_pool.stop ();
+		xcodec_scanner.stop ();
+		deflate_pool.stop ();
 			
 		std::map<std::string, WanProxyInstance>::iterator prx;
 		for (prx = proxies_.begin(); prx != proxies_.end(); prx++)
 		   print_stream_counts (prx->second);
 		proxies_.clear ();
+		
+		std::map<std::string, SegmentService*>::iterator svc;
+		for (svc = segment_services_.begin(); svc != segment_services_.end(); svc++)
+			delete svc->second;
+		segment_services_.clear ();
+		
+		std::map<std::string, SegmentClient*>::iterator clt;
+		for (clt = segment_clients_.begin(); clt != segment_clients_.end(); clt++)
+			delete clt->second;
+		segment_clients_.clear ();
+		
+		std::map<std::string, CacheStandby*>::iterator stb;
+		for (stb = standbys_.begin(); stb != standbys_.end(); stb++)
+			delete stb->second;
+		standbys_.clear ();
+		
+		std::map<std::string, CacheReplica*>::iterator rpl;
+		for (rpl = replicas_.begin(); rpl != replicas_.end(); rpl++)
+			delete rpl->second;
+		replicas_.clear ();
 		   
 		std::map<UUID, XCodecCache*>::iterator it;
 		for (it = caches_.begin(); it != caches_.end(); it++)
@@ -30,6 +30,9 @@
 #include "wanproxy_config_type_compressor.h"
 #include <xcodec/xcodec_cache.h>
 
+class CacheReplica;
+class SegmentClient;
+
 ////////////////////////////////////////////////////////////////////////////////
 //                                                                            //
 // File:           wanproxy_codec.h                                           //
@@ -47,8 +50,12 @@ struct WANProxyCodec {
 	size_t cache_size_;
 	UUID cache_uuid_;
 	XCodecCache* xcache_;
+	CacheReplica* replica_;
+	SegmentClient* segments_;
+	int encoder_threads_;
 	bool compressor_;
 	char compressor_level_;
+	int compressor_threads_;
    bool counting_;
 	intmax_t request_input_bytes_;
 	intmax_t request_output_bytes_;
@@ -60,8 +67,12 @@ struct WANProxyCodec {
 	  cache_type_(WANProxyConfigCacheMemory),
 	  cache_size_(0),
 	  xcache_(NULL),
+	  replica_(NULL),
+	  segments_(NULL),
+	  encoder_threads_(0),
 	  compressor_(false),
 	  compressor_level_(0),
+	  compressor_threads_(0),
      counting_(false),
 	  request_input_bytes_(0),
 	  request_output_bytes_(0),
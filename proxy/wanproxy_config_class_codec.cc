@@ -29,8 +29,12 @@
 #include <config/config_object.h>
 #include <xcodec/xcodec.h>
 #include <xcodec/xcodec_cache.h>
+#include <xcodec/xcodec_scanner.h>
 #include <xcodec/cache/coss/xcodec_cache_coss.h>
+#include <zlib/zlib_pool.h>
 #include "wanproxy_config_class_codec.h"
+#include "wanproxy_config_class_interface.h"
+#include "wanproxy_config_class_peer.h"
 #include "wanproxy.h"
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -81,6 +85,75 @@ WANProxyConfigClassCodec::Instance::activate(const ConfigObject *co)
 		if (! (cache = wanproxy.find_cache (uuid)))
 			cache = wanproxy.add_cache (cache_type_, cache_path_, local_size_, uuid);
 		codec_.xcache_ = cache;
+
+		if (encoder_threads_ < 0 || encoder_threads_ > 64) {
+			ERROR("/wanproxy/config/codec") << "Encoder threads must be in range 0..64 (inclusive.)";
+			return (false);
+		}
+		codec_.encoder_threads_ = (int) encoder_threads_;
+		if (encoder_threads_ > 1)
+			xcodec_scanner.launch (encoder_threads_ - 1);
+
+		if ((replicate_to_ || replicate_from_) && (cache_type_ != WANProxyConfigCacheCOSS || cache_path_.empty())) {
+			ERROR("/wanproxy/config/codec") << "Cache replication needs a COSS cache with a path.";
+			return (false);
+		}
+
+		codec_.replica_ = NULL;
+		if (replicate_to_ != NULL) {
+			WANProxyConfigClassPeer::Instance *peer =
+				dynamic_cast<WANProxyConfigClassPeer::Instance *>(replicate_to_->instance_);
+			if (peer == NULL || peer->address() == "")
+				return (false);
+			codec_.replica_ = wanproxy.add_replica (peer->family_, peer->address());
+			if (cache)
+				wanproxy.replicate (cache, codec_.replica_);
+		}
+
+		if (replicate_from_ != NULL) {
+			WANProxyConfigClassInterface::Instance *interface =
+				dynamic_cast<WANProxyConfigClassInterface::Instance *>(replicate_from_->instance_);
+			if (interface == NULL || interface->address() == "")
+				return (false);
+			WANProxyConfigClassPeer::Instance *primary = NULL;
+			if (replicate_primary_ != NULL)
+				primary = dynamic_cast<WANProxyConfigClassPeer::Instance *>(replicate_primary_->instance_);
+			if (primary == NULL || primary->host_ == "") {
+				ERROR("/wanproxy/config/codec") << "A standby needs the peer of the primary it takes replicas from.";
+				return (false);
+			}
+			wanproxy.add_standby (interface->family_, interface->address(), cache_path_, local_size_, primary->host_);
+		}
+
+		codec_.segments_ = NULL;
+		if (segment_service_ != NULL) {
+			WANProxyConfigClassPeer::Instance *peer =
+				dynamic_cast<WANProxyConfigClassPeer::Instance *>(segment_service_->instance_);
+			if (peer == NULL || peer->address() == "")
+				return (false);
+			codec_.segments_ = wanproxy.add_segment_client (peer->family_, peer->address());
+		}
+
+		if (segment_interface_ != NULL) {
+			WANProxyConfigClassInterface::Instance *interface =
+				dynamic_cast<WANProxyConfigClassInterface::Instance *>(segment_interface_->instance_);
+			if (interface == NULL || interface->address() == "")
+				return (false);
+			std::vector<std::string> hosts;
+			std::vector<ConfigObject *>::const_iterator it;
+			for (it = segment_neighbours_.begin(); it != segment_neighbours_.end(); ++it) {
+				WANProxyConfigClassPeer::Instance *neighbour =
+					dynamic_cast<WANProxyConfigClassPeer::Instance *>((*it)->instance_);
+				if (neighbour == NULL || neighbour->host_ == "")
+					return (false);
+				hosts.push_back(neighbour->host_);
+			}
+			if (hosts.empty()) {
+				ERROR("/wanproxy/config/codec") << "A segment service needs the peers of the neighbours it answers.";
+				return (false);
+			}
+			wanproxy.add_segment_service (interface->family_, interface->address(), hosts);
+		}
 		break;
 	case WANProxyConfigCodecNone:
 		codec_.xcache_ = 0;
@@ -102,17 +175,30 @@ WANProxyConfigClassCodec::Instance::activate(const ConfigObject *co)
 			return (false);
 		}
 
+		if (compressor_threads_ < 0 || compressor_threads_ > 64) {
+			ERROR("/wanproxy/config/codec") << "Compressor threads must be in range 0..64 (inclusive.)";
+			return (false);
+		}
+
 		codec_.compressor_ = true;
 		codec_.compressor_level_ = (char) compressor_level_;
+		codec_.compressor_threads_ = (int) compressor_threads_;
+		if (compressor_threads_ > 1)
+			deflate_pool.launch (compressor_threads_ - 1);
 		break;
 	case WANProxyConfigCompressorNone:
 		if (compressor_level_ > 0) {
 			ERROR("/wanproxy/config/codec") << "Compressor level set but no compressor.";
 			return (false);
 		}
+		if (compressor_threads_ > 0) {
+			ERROR("/wanproxy/config/codec") << "Compressor threads set but no compressor.";
+			return (false);
+		}
 
 		codec_.compressor_ = false;
 		codec_.compressor_level_ = 0;
+		codec_.compressor_threads_ = 0;
 		break;
 	default:
 		ERROR("/wanproxy/config/codec") << "Invalid compressor type.";
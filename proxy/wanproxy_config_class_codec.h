@@ -27,6 +27,8 @@
 #define	PROGRAMS_WANPROXY_WANPROXY_CONFIG_CLASS_CODEC_H
 
 #include <config/config_type_int.h>
+#include <config/config_type_pointer.h>
+#include <config/config_type_pointer_list.h>
 #include <config/config_type_string.h>
 #include "wanproxy_codec.h"
 #include "wanproxy_config_type_codec.h"
@@ -51,20 +53,35 @@ public:
 		WANProxyConfigCodec codec_type_;
 		WANProxyConfigCompressor compressor_;
 		intmax_t compressor_level_;
+		intmax_t compressor_threads_;
 		intmax_t byte_counts_;
 		WANProxyConfigCache cache_type_;
 		std::string cache_path_;
 		intmax_t local_size_;
 		intmax_t remote_size_;
+		intmax_t encoder_threads_;
+		ConfigObject *replicate_to_;
+		ConfigObject *replicate_from_;
+		ConfigObject *replicate_primary_;
+		ConfigObject *segment_service_;
+		ConfigObject *segment_interface_;
+		std::vector<ConfigObject *> segment_neighbours_;
 
 		Instance(void)
 		: codec_type_(WANProxyConfigCodecNone),
 		  compressor_(WANProxyConfigCompressorNone),
 		  compressor_level_(0),
+		  compressor_threads_(0),
 		  byte_counts_(0),
 		  cache_type_(WANProxyConfigCacheMemory),
 		  local_size_(0),
-		  remote_size_(0)
+		  remote_size_(0),
+		  encoder_threads_(0),
+		  replicate_to_(NULL),
+		  replicate_from_(NULL),
+		  replicate_primary_(NULL),
+		  segment_service_(NULL),
+		  segment_interface_(NULL)
 		{
 		}
 
@@ -77,12 +94,20 @@ public:
 		add_member("codec", &wanproxy_config_type_codec, &Instance::codec_type_);
 		add_member("compressor", &wanproxy_config_type_compressor, &Instance::compressor_);
 		add_member("compressor_level", &config_type_int, &Instance::compressor_level_);
+		add_member("compressor_threads", &config_type_int, &Instance::compressor_threads_);
 		add_member("byte_counts", &config_type_int, &Instance::byte_counts_);
 
 		add_member("cache", &wanproxy_config_type_cache, &Instance::cache_type_);
 		add_member("cache_path", &config_type_string, &Instance::cache_path_);
 		add_member("local_size", &config_type_int, &Instance::local_size_);
 		add_member("remote_size", &config_type_int, &Instance::remote_size_);
+		add_member("encoder_threads", &config_type_int, &Instance::encoder_threads_);
+		add_member("replicate_to", &config_type_pointer, &Instance::replicate_to_);
+		add_member("replicate_from", &config_type_pointer, &Instance::replicate_from_);
+		add_member("replicate_primary", &config_type_pointer, &Instance::replicate_primary_);
+		add_member("segment_service", &config_type_pointer, &Instance::segment_service_);
+		add_member("segment_interface", &config_type_pointer, &Instance::segment_interface_);
+		add_member("segment_neighbours", &config_type_pointer_list, &Instance::segment_neighbours_);
 	}
 
 	~WANProxyConfigClassCodec()
@@ -59,7 +59,7 @@ WANProxyConfigClassProxy::Instance::activate(const ConfigObject *co)
 	if (interface == NULL)
 		return (false);
 
-	if (interface->host_ == "" || interface->port_ == "")
+	if (interface->address() == "")
 		return (false);
 
 	WANProxyCodec *interface_codec;
@@ -73,13 +73,38 @@ WANProxyConfigClassProxy::Instance::activate(const ConfigObject *co)
 		interface_codec = NULL;
 	}
 
-	WANProxyConfigClassPeer::Instance *peer =
-		dynamic_cast<WANProxyConfigClassPeer::Instance *>(peer_->instance_);
-	if (peer == NULL)
+	std::vector<ConfigObject *> peers;
+	if (peer_ != NULL)
+		peers.push_back(peer_);
+	peers.insert(peers.end(), peers_.begin(), peers_.end());
+	if (peers.empty())
 		return (false);
 
-	if (peer->host_ == "" || peer->port_ == "")
+	std::vector<PeerAddress> peer_list;
+	std::vector<ConfigObject *>::const_iterator it;
+	size_t udp_peers = 0;
+	bool udp_unix = false;
+	for (it = peers.begin(); it != peers.end(); ++it) {
+		WANProxyConfigClassPeer::Instance *peer =
+			dynamic_cast<WANProxyConfigClassPeer::Instance *>((*it)->instance_);
+		if (peer == NULL)
+			return (false);
+
+		if (peer->address() == "")
+			return (false);
+
+		PeerAddress address = { peer->family_, peer->address() };
+		peer_list.push_back(address);
+		if (peer->proto_ == ConfigProtoUDP)
+			udp_peers++;
+		if (peer->proto_ == ConfigProtoUDP && peer->family_ == SocketAddressFamilyUnix)
+			udp_unix = true;
+	}
+
+	if (udp_peers != 0 && udp_peers != peer_list.size()) {
+		ERROR("/wanproxy/config/proxy") << "Peers of a proxy must all use UDP or none.";
 		return (false);
+	}
 
 	WANProxyCodec *peer_codec;
 	if (peer_codec_ != NULL) {
@@ -92,6 +117,48 @@ WANProxyConfigClassProxy::Instance::activate(const ConfigObject *co)
 		peer_codec = NULL;
 	}
 	
+	if (shards_ < 1 || shards_ > 64) {
+		ERROR("/wanproxy/config/proxy") << "Shard count must be in range 1..64 (inclusive.)";
+		return (false);
+	}
+
+	if (workers_ < 0 || workers_ > 64) {
+		ERROR("/wanproxy/config/proxy") << "Worker count must be in range 0..64 (inclusive.)";
+		return (false);
+	}
+
+	if (tunnels_ < 0 || tunnels_ > 64) {
+		ERROR("/wanproxy/config/proxy") << "Tunnel count must be in range 0..64 (inclusive.)";
+		return (false);
+	}
+
+	if (pool_ < 0 || pool_ > 1024) {
+		ERROR("/wanproxy/config/proxy") << "Pool size must be in range 0..1024 (inclusive.)";
+		return (false);
+	}
+
+	if (stripes_ < 0 || stripes_ > 64) {
+		ERROR("/wanproxy/config/proxy") << "Stripe count must be in range 0..64 (inclusive.)";
+		return (false);
+	}
+
+	bool local_udp = (interface->proto_ == ConfigProtoUDP);
+	bool remote_udp = (udp_peers != 0);
+	if ((local_udp || remote_udp) && (type_ == WANProxyConfigProxyTypeSSHSSH || tunnels_ > 0 || stripes_ > 1)) {
+		ERROR("/wanproxy/config/proxy") << "UDP cannot be used by SSH proxies nor together with tunnels or stripes.";
+		return (false);
+	}
+
+	if (interface->family_ == SocketAddressFamilyUnix && shards_ > 1) {
+		ERROR("/wanproxy/config/proxy") << "A Unix domain interface cannot be shared by several shards.";
+		return (false);
+	}
+
+	if ((local_udp && interface->family_ == SocketAddressFamilyUnix) || udp_unix) {
+		ERROR("/wanproxy/config/proxy") << "UDP needs IP addresses.";
+		return (false);
+	}
+
 	if (role_ == WANProxyConfigProxyRoleUndefined && ! interface_codec && peer_codec)
 		role_ = WANProxyConfigProxyRoleClient;
 		
@@ -100,11 +167,20 @@ WANProxyConfigClassProxy::Instance::activate(const ConfigObject *co)
 	ins.proxy_client_ = (role_ == WANProxyConfigProxyRoleClient);
 	ins.proxy_secure_ = (type_ == WANProxyConfigProxyTypeSSHSSH);
 	ins.local_protocol_ = interface->family_;
-	ins.local_address_ = '[' + interface->host_ + ']' + ':' + interface->port_;
+	ins.local_address_ = interface->address();
 	ins.local_codec_ = (interface_codec ? *interface_codec : WANProxyCodec ());
-	ins.remote_protocol_ = peer->family_;
-	ins.remote_address_ = '[' + peer->host_ + ']' + ':' + peer->port_;
+	ins.remote_protocol_ = peer_list.front().family_;
+	ins.remote_address_ = peer_list.front().address_;
+	ins.peer_list_ = peer_list;
 	ins.remote_codec_ = (peer_codec ? *peer_codec : WANProxyCodec ());
+	ins.shards_ = (int) shards_;
+	ins.workers_ = (int) workers_;
+	ins.tunnels_ = (int) tunnels_;
+	ins.pool_ = (int) pool_;
+	ins.fast_open_ = (fast_open_ != 0);
+	ins.stripes_ = (int) stripes_;
+	ins.local_udp_ = local_udp;
+	ins.remote_udp_ = remote_udp;
 	wanproxy.add_proxy (ins.proxy_name_, ins);
 	
 	return (true);
@@ -26,7 +26,9 @@
 #ifndef	PROGRAMS_WANPROXY_WANPROXY_CONFIG_CLASS_PROXY_H
 #define	PROGRAMS_WANPROXY_WANPROXY_CONFIG_CLASS_PROXY_H
 
+#include <config/config_type_int.h>
 #include <config/config_type_pointer.h>
+#include <config/config_type_pointer_list.h>
 
 #include "wanproxy_config_type_proxy_type.h"
 #include "wanproxy_config_type_proxy_role.h"
@@ -48,7 +50,14 @@ class WANProxyConfigClassProxy : public ConfigClass {
 		ConfigObject *interface_;
 		ConfigObject *interface_codec_;
 		ConfigObject *peer_;
+		std::vector<ConfigObject *> peers_;
 		ConfigObject *peer_codec_;
+		intmax_t shards_;
+		intmax_t workers_;
+		intmax_t tunnels_;
+		intmax_t pool_;
+		intmax_t fast_open_;
+		intmax_t stripes_;
 
 		Instance(void)
 		: type_(WANProxyConfigProxyTypeTCPTCP),
@@ -56,7 +65,13 @@ class WANProxyConfigClassProxy : public ConfigClass {
 		  interface_(NULL),
 		  interface_codec_(NULL),
 		  peer_(NULL),
-		  peer_codec_(NULL)
+		  peer_codec_(NULL),
+		  shards_(1),
+		  workers_(0),
+		  tunnels_(0),
+		  pool_(0),
+		  fast_open_(0),
+		  stripes_(0)
 		{ }
 
 		bool activate(const ConfigObject *);
@@ -70,7 +85,14 @@ public:
 		add_member("interface", &config_type_pointer, &Instance::interface_);
 		add_member("interface_codec", &config_type_pointer, &Instance::interface_codec_);
 		add_member("peer", &config_type_pointer, &Instance::peer_);
+		add_member("peers", &config_type_pointer_list, &Instance::peers_);
 		add_member("peer_codec", &config_type_pointer, &Instance::peer_codec_);
+		add_member("shards", &config_type_int, &Instance::shards_);
+		add_member("workers", &config_type_int, &Instance::workers_);
+		add_member("tunnels", &config_type_int, &Instance::tunnels_);
+		add_member("pool", &config_type_int, &Instance::pool_);
+		add_member("fast_open", &config_type_int, &Instance::fast_open_);
+		add_member("stripes", &config_type_int, &Instance::stripes_);
 	}
 
 	/* XXX So wrong.  */
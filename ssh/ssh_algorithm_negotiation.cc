@@ -139,8 +139,6 @@ SSH::AlgorithmNegotiation::add_algorithms(void)
 bool
 SSH::AlgorithmNegotiation::input(Filter* sender, Buffer *in)
 {
-	Buffer packet;
-
 	switch (in->peek()) {
 	case SSH::Message::KeyExchangeInitializationMessage:
 		session_->remote_kexinit(*in);
@@ -161,11 +159,8 @@ SSH::AlgorithmNegotiation::input(Filter* sender, Buffer *in)
 		}
 		return (true);
 	case SSH::Message::NewKeysMessage:
-		packet.append(SSH::Message::NewKeysMessage);
-		sender->produce(packet);
-
-		session_->activate_chosen();
-		DEBUG(log_) << "Switched to new keys.";
+		session_->activate_remote();
+		DEBUG(log_) << "Switched to new keys for input.";
 		return (true);
 	default:
 		DEBUG(log_) << "Unsupported algorithm negotiation message:" << std::endl << in->hexdump();
@@ -24,6 +24,9 @@
  */
 
 #include <common/buffer.h>
+#include <common/endian.h>
+
+#include <crypto/crypto_mac.h>
 
 #include <ssh/ssh_algorithm_negotiation.h>
 #include <ssh/ssh_encryption.h>
@@ -37,6 +40,9 @@ namespace {
 	};
 
 	static const struct ssh_encryption_algorithm ssh_encryption_algorithms[] = {
+		{ "aes128-gcm@openssh.com",		CryptoEncryption::AES128,	CryptoEncryption::GCM	},
+		{ "aes256-gcm@openssh.com",		CryptoEncryption::AES256,	CryptoEncryption::GCM	},
+		{ "chacha20-poly1305@openssh.com",	CryptoEncryption::ChaCha20,	CryptoEncryption::Stream},
 		{ "aes128-ctr",		CryptoEncryption::AES128,	CryptoEncryption::CTR	},
 		{ "aes128-cbc",		CryptoEncryption::AES128,	CryptoEncryption::CBC	},
 		{ "aes192-ctr",		CryptoEncryption::AES192,	CryptoEncryption::CTR	},
@@ -78,13 +84,246 @@ namespace {
 
 		bool cipher(Buffer *out, Buffer *in)
 		{
-			if (!session_->cipher(out, in)) {
+			if (!session_->cipher(in)) {
 				in->clear();
 				return (false);
 			}
-			in->clear();
+			in->moveout(out);
+			return (true);
+		}
+
+		bool cipher(Buffer *data)
+		{
+			return (session_->cipher(data));
+		}
+	};
+
+	/*
+	 * AES-GCM as used by OpenSSH: the packet length goes in the clear as
+	 * additional data, and the last 8 bytes of the IV count the packets.
+	 */
+	class CryptoSSHGCM : public SSH::Encryption {
+		LogHandle log_;
+		CryptoEncryption::Session *session_;
+		uint8_t iv_[12];
+	public:
+		CryptoSSHGCM(const std::string& xname, CryptoEncryption::Session *session)
+		: SSH::Encryption(xname, session->block_size(), session->key_size(), sizeof iv_, session->tag_size()),
+		  log_("/ssh/encryption/crypto/" + xname),
+		  session_(session),
+		  iv_()
+		{ }
+
+		~CryptoSSHGCM()
+		{
+			delete session_;
+		}
+
+		Encryption *clone(void) const
+		{
+			return (new CryptoSSHGCM(name_, session_->clone()));
+		}
+
+		bool initialize(CryptoEncryption::Operation operation, const Buffer *key, const Buffer *iv)
+		{
+			if (iv->length() != sizeof iv_)
+				return (false);
+			iv->copyout(iv_, sizeof iv_);
+			return (session_->initialize(operation, key, iv));
+		}
+
+		bool cipher(Buffer *, Buffer *)
+		{
+			return (false);
+		}
+
+		bool cipher(Buffer *)
+		{
+			return (false);
+		}
+
+		bool length(uint32_t *lenp, const Buffer *in, uint32_t)
+		{
+			if (in->length() < sizeof *lenp)
+				return (false);
+			in->copyout((uint8_t *)lenp, sizeof *lenp);
+			*lenp = BigEndian::decode(*lenp);
+			return (true);
+		}
+
+		bool seal(Buffer *packet, uint32_t)
+		{
+			Buffer aad, tag;
+
+			packet->moveout(&aad, sizeof (uint32_t));
+			if (!session_->restart(iv_) || !session_->cipher(packet, &aad, &tag))
+				return (false);
+			next();
+			packet->moveout(&aad);
+			tag.moveout(&aad);
+			aad.moveout(packet);
+			return (true);
+		}
+
+		bool open(Buffer *packet, uint32_t)
+		{
+			Buffer aad, data;
+
+			packet->moveout(&aad, sizeof (uint32_t));
+			packet->moveout(&data, packet->length() - tag_size_);
+			if (!session_->restart(iv_) || !session_->cipher(&data, &aad, packet))
+				return (false);
+			next();
+			packet->clear();
+			aad.moveout(packet);
+			data.moveout(packet);
 			return (true);
 		}
+
+	private:
+		void next(void)
+		{
+			unsigned i;
+
+			for (i = sizeof iv_; i-- > 4; )
+				if (++iv_[i] != 0)
+					break;
+		}
+	};
+
+	/*
+	 * ChaCha20-Poly1305 as used by OpenSSH: the second half of the key
+	 * encrypts the packet length and the first half the rest, with the
+	 * sequence number as nonce.  The Poly1305 key of a packet is the
+	 * start of the keystream, and the payload takes it from block 1.
+	 */
+	class CryptoSSHChaCha20Poly1305 : public SSH::Encryption {
+		LogHandle log_;
+		CryptoEncryption::Session *main_;
+		CryptoEncryption::Session *header_;
+		CryptoMAC::Instance *poly1305_;
+	public:
+		CryptoSSHChaCha20Poly1305(const std::string& xname, CryptoEncryption::Session *main, CryptoEncryption::Session *header, CryptoMAC::Instance *poly1305)
+		: SSH::Encryption(xname, 8, 2 * main->key_size(), 0, poly1305->size()),
+		  log_("/ssh/encryption/crypto/" + xname),
+		  main_(main),
+		  header_(header),
+		  poly1305_(poly1305)
+		{ }
+
+		~CryptoSSHChaCha20Poly1305()
+		{
+			delete main_;
+			delete header_;
+			delete poly1305_;
+		}
+
+		Encryption *clone(void) const
+		{
+			return (new CryptoSSHChaCha20Poly1305(name_, main_->clone(), header_->clone(), poly1305_->clone()));
+		}
+
+		bool initialize(CryptoEncryption::Operation operation, const Buffer *key, const Buffer *)
+		{
+			uint8_t zero[16] = { 0 };
+			Buffer main_key, header_key(*key), iv;
+
+			if (key->length() != key_size_ || main_->iv_size() != sizeof zero)
+				return (false);
+			header_key.moveout(&main_key, key_size_ / 2);
+			iv.append(zero, sizeof zero);
+			return (main_->initialize(operation, &main_key, &iv) &&
+				header_->initialize(operation, &header_key, &iv));
+		}
+
+		bool cipher(Buffer *, Buffer *)
+		{
+			return (false);
+		}
+
+		bool cipher(Buffer *)
+		{
+			return (false);
+		}
+
+		bool length(uint32_t *lenp, const Buffer *in, uint32_t seq)
+		{
+			Buffer header;
+
+			if (in->length() < sizeof *lenp)
+				return (false);
+			header.append(in, sizeof *lenp);
+			if (!restart(header_, 0, seq) || !header_->cipher(&header))
+				return (false);
+			header.copyout((uint8_t *)lenp, sizeof *lenp);
+			*lenp = BigEndian::decode(*lenp);
+			return (true);
+		}
+
+		bool seal(Buffer *packet, uint32_t seq)
+		{
+			Buffer header, tag;
+
+			packet->moveout(&header, sizeof (uint32_t));
+			if (!restart(header_, 0, seq) || !header_->cipher(&header))
+				return (false);
+			if (!authenticator(seq) || !restart(main_, 1, seq) || !main_->cipher(packet))
+				return (false);
+			packet->moveout(&header);
+			if (!poly1305_->mac(&tag, &header))
+				return (false);
+			tag.moveout(&header);
+			header.moveout(packet);
+			return (true);
+		}
+
+		bool open(Buffer *packet, uint32_t seq)
+		{
+			Buffer header, data, tag;
+
+			packet->moveout(&data, packet->length() - tag_size_);
+			if (!authenticator(seq) || !poly1305_->mac(&tag, &data))
+				return (false);
+			if (!CryptoMAC::verify(&tag, packet)) {
+				DEBUG(log_) << "Received tag does not match expected tag.";
+				return (false);
+			}
+			data.moveout(&header, sizeof (uint32_t));
+			if (!restart(header_, 0, seq) || !header_->cipher(&header))
+				return (false);
+			if (!restart(main_, 1, seq) || !main_->cipher(&data))
+				return (false);
+			packet->clear();
+			header.moveout(packet);
+			data.moveout(packet);
+			return (true);
+		}
+
+	private:
+		/*
+		 * The 64-bit block counter and nonce of the original ChaCha20
+		 * laid out as the 32-bit counter and 96-bit nonce of OpenSSL.
+		 */
+		static bool restart(CryptoEncryption::Session *session, uint8_t counter, uint32_t seq)
+		{
+			uint8_t iv[16] = { 0 };
+
+			iv[0] = counter;
+			seq = BigEndian::encode(seq);
+			memcpy(&iv[12], &seq, sizeof seq);
+			return (session->restart(iv));
+		}
+
+		bool authenticator(uint32_t seq)
+		{
+			uint8_t zero[32] = { 0 };
+			Buffer key;
+
+			key.append(zero, sizeof zero);
+			if (!restart(main_, 0, seq) || !main_->cipher(&key))
+				return (false);
+			return (poly1305_->initialize(&key));
+		}
 	};
 }
 
@@ -121,6 +360,17 @@ SSH::Encryption::cipher(CryptoEncryption::Cipher cipher)
 			ERROR("/ssh/encryption") << "Could not get session for cipher: " << cipher;
 			return (NULL);
 		}
+		if (session->tag_size() != 0)
+			return (new CryptoSSHGCM(alg->rfc4250_name_, session));
+		if (cipher.first == CryptoEncryption::ChaCha20) {
+			const CryptoMAC::Method *mac_method = CryptoMAC::Method::method(CryptoMAC::Poly1305);
+			if (mac_method == NULL) {
+				DEBUG("/ssh/encryption") << "Could not get method for Poly1305.";
+				delete session;
+				return (NULL);
+			}
+			return (new CryptoSSHChaCha20Poly1305(alg->rfc4250_name_, session, session->clone(), mac_method->instance(CryptoMAC::Poly1305)));
+		}
 		return (new CryptoSSHEncryption(alg->rfc4250_name_, session));
 	}
 	DEBUG("/ssh/encryption") << "No SSH encryption support is available for cipher: " << cipher;
@@ -37,12 +37,14 @@ namespace SSH {
 		const unsigned block_size_;
 		const unsigned key_size_;
 		const unsigned iv_size_;
+		const unsigned tag_size_;
 
-		Encryption(const std::string& xname, unsigned xblock_size, unsigned xkey_size, unsigned xiv_size)
+		Encryption(const std::string& xname, unsigned xblock_size, unsigned xkey_size, unsigned xiv_size, unsigned xtag_size = 0)
 		: name_(xname),
 		  block_size_(xblock_size),
 		  key_size_(xkey_size),
-		  iv_size_(xiv_size)
+		  iv_size_(xiv_size),
+		  tag_size_(xtag_size)
 		{ }
 
 	public:
@@ -64,6 +66,16 @@ namespace SSH {
 			return (iv_size_);
 		}
 
+		/*
+		 * Non-zero for authenticated ciphers, which take the place of the
+		 * MAC: whole packets are sealed and opened with their sequence
+		 * numbers, and the tag follows each of them.
+		 */
+		unsigned tag_size(void) const
+		{
+			return (tag_size_);
+		}
+
 		std::string name(void) const
 		{
 			return (name_);
@@ -73,6 +85,22 @@ namespace SSH {
 
 		virtual bool initialize(CryptoEncryption::Operation, const Buffer *, const Buffer *) = 0;
 		virtual bool cipher(Buffer *, Buffer *) = 0;
+		virtual bool cipher(Buffer *) = 0;	/* In place.  */
+
+		virtual bool length(uint32_t *, const Buffer *, uint32_t)	/* Of the packet at the start of a Buffer.  */
+		{
+			return (false);
+		}
+
+		virtual bool seal(Buffer *, uint32_t)
+		{
+			return (false);
+		}
+
+		virtual bool open(Buffer *, uint32_t)
+		{
+			return (false);
+		}
 
 		static void add_algorithms(Session *);
 		static Encryption *cipher(CryptoEncryption::Cipher);
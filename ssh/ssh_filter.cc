@@ -62,7 +62,14 @@ SSH::EncryptFilter::EncryptFilter (SSH::Role role, int flg) : BufferedFilter ("/
 	if (session_.role_ == SSH::ServerRole) 
 		session_.algorithm_negotiation_->add_algorithm (SSH::ServerHostKey::server (&session_, "ssh-server1.pem"));
 	session_.algorithm_negotiation_->add_algorithms ();
-	
+}
+
+/*
+ * The identification string can only be sent once the filter has been
+ * linked to the rest of its chain.
+ */
+void SSH::EncryptFilter::identify ()
+{
 	Buffer str ("SSH-2.0-WANProxy " + (std::string) log_);
 	session_.local_version (str);
 	str.append ("\r\n");
@@ -117,6 +124,8 @@ bool SSH::EncryptFilter::produce (Buffer& buf, int flg)
 	uint8_t padding_len;
 	uint32_t packet_len;
 	unsigned block_size;
+	unsigned tag_size;
+	bool etm;
 	Buffer mac;
 
 	encryption_algorithm = session_.active_algorithms_.local_to_remote_->encryption_;
@@ -125,13 +134,25 @@ bool SSH::EncryptFilter::produce (Buffer& buf, int flg)
 		block_size = encryption_algorithm->block_size();
 		if (block_size < 8)
 			block_size = 8;
+		tag_size = encryption_algorithm->tag_size();
 	} 
 	else 
+	{
 		block_size = 8;
+		tag_size = 0;
+	}
 	mac_algorithm = session_.active_algorithms_.local_to_remote_->mac_;
 
+	/*
+	 * Authenticated ciphers and encrypt-then-MAC leave the length out of
+	 * the blocks to be padded, as it is not encrypted along with the rest.
+	 */
+	etm = (tag_size || (mac_algorithm && mac_algorithm->etm ()));
 	packet_len = sizeof padding_len + buf.length();
-	padding_len = 4 + (block_size - ((sizeof packet_len + packet_len + 4) % block_size));
+	if (etm)
+		padding_len = 4 + (block_size - ((packet_len + 4) % block_size));
+	else
+		padding_len = 4 + (block_size - ((sizeof packet_len + packet_len + 4) % block_size));
 	packet_len += padding_len;
 
 	BigEndian::append (&packet, packet_len);
@@ -139,29 +160,59 @@ bool SSH::EncryptFilter::produce (Buffer& buf, int flg)
 	buf.moveout (&packet);
 	packet.append (zero_padding, padding_len);
 
-	if (mac_algorithm) 
+	if (tag_size)
 	{
-		Buffer mac_input;
-
-		SSH::UInt32::encode (&mac_input, session_.local_sequence_number_);
-		mac_input.append (&packet);
-
-		if (! mac_algorithm->mac (&mac, &mac_input)) 
+		if (! encryption_algorithm->seal (&packet, session_.local_sequence_number_))
 		{
-			ERROR(log_) << "Could not compute outgoing MAC.";
+			ERROR(log_) << "Could not seal outgoing packet.";
 			return false;
 		}
 	}
-
-	if (encryption_algorithm) 
+	else if (etm)
 	{
-		Buffer ciphertext;
-		if (! encryption_algorithm->cipher (&ciphertext, &packet)) 
+		/*
+		 * All but the length is encrypted in place, and the MAC is then
+		 * taken over the packet as it is sent.
+		 */
+		Buffer length;
+
+		packet.moveout (&length, sizeof packet_len);
+		if (encryption_algorithm && ! encryption_algorithm->cipher (&packet))
 		{
 			ERROR(log_) << "Could not encrypt outgoing packet.";
 			return false;
 		}
-		packet = ciphertext;
+		packet.moveout (&length);
+		length.moveout (&packet);
+		if (! mac_algorithm->mac (&mac, session_.local_sequence_number_, &packet)) 
+		{
+			ERROR(log_) << "Could not compute outgoing MAC.";
+			return false;
+		}
+	}
+	else
+	{
+		/*
+		 * The MAC is taken over the segments of the packet as they are,
+		 * and then they are encrypted in place.
+		 */
+		if (mac_algorithm) 
+		{
+			if (! mac_algorithm->mac (&mac, session_.local_sequence_number_, &packet)) 
+			{
+				ERROR(log_) << "Could not compute outgoing MAC.";
+				return false;
+			}
+		}
+
+		if (encryption_algorithm) 
+		{
+			if (! encryption_algorithm->cipher (&packet)) 
+			{
+				ERROR(log_) << "Could not encrypt outgoing packet.";
+				return false;
+			}
+		}
 	}
 	if (! mac.empty ())
 		packet.append (mac);
@@ -255,255 +306,400 @@ bool SSH::DecryptFilter::consume (Buffer& buf, int flg)
 	{
 		Encryption *encryption_algorithm;
 		MAC *mac_algorithm;
+		UnidirectionalAlgorithms *algorithms;
+		std::deque<Buffer> packets;
 		Buffer packet;
 		Buffer mac;
 		unsigned block_size;
 		unsigned mac_size;
+		unsigned tag_size;
 		uint32_t packet_len;
-		uint8_t padding_len;
-		uint8_t msg;
 
-		encryption_algorithm = session_->active_algorithms_.remote_to_local_->encryption_;
+		algorithms = session_->active_algorithms_.remote_to_local_;
+		encryption_algorithm = algorithms->encryption_;
 		if (encryption_algorithm) 
 		{
 			block_size = encryption_algorithm->block_size();
 			if (block_size < 8)
 				block_size = 8;
+			tag_size = encryption_algorithm->tag_size();
 		} 
 		else 
+		{
 			block_size = 8;
-		mac_algorithm = session_->active_algorithms_.remote_to_local_->mac_;
+			tag_size = 0;
+		}
+		mac_algorithm = algorithms->mac_;
 		if (mac_algorithm)
 			mac_size = mac_algorithm->size();
 		else
 			mac_size = 0;
 
-		if (pending_.length() <= block_size) 
+		if (tag_size)
 		{
-			DEBUG(log_) << "Waiting for first block of packet.";
-			return true;
-		}
+			if (pending_.length () < sizeof packet_len)
+			{
+				DEBUG(log_) << "Waiting for packet length.";
+				return true;
+			}
+			if (! encryption_algorithm->length (&packet_len, &pending_, session_->remote_sequence_number_))
+			{
+				ERROR(log_) << "Could not get length of packet.";
+				return false;
+			}
+			if (packet_len < block_size || packet_len % block_size != 0 || packet_len > MAXIMUM_PACKET_LENGTH)
+			{
+				ERROR(log_) << "Invalid packet length.";
+				return false;
+			}
+			if (pending_.length () < sizeof packet_len + packet_len + tag_size)
+			{
+				DEBUG(log_) << "Need " << sizeof packet_len + packet_len + tag_size << " bytes to open sealed packet; have " << pending_.length () << ".";
+				return true;
+			}
 
-		if (encryption_algorithm) 
-		{
-			if (first_block_.empty ()) 
+			pending_.moveout (&packet, sizeof packet_len + packet_len + tag_size);
+			if (! encryption_algorithm->open (&packet, session_->remote_sequence_number_))
 			{
-				Buffer block;
-				pending_.moveout (&block, block_size);
-				if (! encryption_algorithm->cipher (&first_block_, &block)) 
-				{
-					ERROR(log_) << "Decryption of first block failed.";
-					return false;
-				}
+				ERROR(log_) << "Authentication of sealed packet failed.";
+				return false;
 			}
-			BigEndian::extract (&packet_len, &first_block_);
-		} 
-		else 
-		{
-			BigEndian::extract (&packet_len, &pending_);
 		}
-
-		if (packet_len == 0) 
+		else if (mac_algorithm && mac_algorithm->etm ())
 		{
-			ERROR(log_) << "Need to handle 0-length packet.";
-			return false;
+			if (! open_batch (encryption_algorithm, mac_algorithm, block_size, packets))
+				return false;
+			if (packets.empty ())
+				return true;
 		}
-
-		if (encryption_algorithm) 
+		else
 		{
-			ASSERT(log_, !first_block_.empty());
-			if (block_size + pending_.length() < sizeof packet_len + packet_len + mac_size) 
+			if (first_block_.empty () && pending_.length() <= block_size) 
 			{
-				DEBUG(log_) << "Need " << sizeof packet_len + packet_len + mac_size << " bytes to decrypt encrypted packet; have " << (block_size + pending_.length()) << ".";
+				DEBUG(log_) << "Waiting for first block of packet.";
 				return true;
 			}
 
-			first_block_.moveout (&packet);
-
-			if (sizeof packet_len + packet_len > block_size) 
+			if (encryption_algorithm) 
 			{
-				Buffer ciphertext;
-				pending_.moveout (&ciphertext, sizeof packet_len + packet_len - block_size);
-				if (! encryption_algorithm->cipher (&packet, &ciphertext)) 
+				if (first_block_.empty ()) 
 				{
-					ERROR(log_) << "Decryption of packet failed.";
-					return false;
+					Buffer block;
+					pending_.moveout (&block, block_size);
+					if (! encryption_algorithm->cipher (&first_block_, &block)) 
+					{
+						ERROR(log_) << "Decryption of first block failed.";
+						return false;
+					}
 				}
+				BigEndian::extract (&packet_len, &first_block_);
 			} 
 			else 
 			{
-				DEBUG(log_) << "Packet of exactly one block.";
-			}
-			ASSERT(log_, packet.length() == sizeof packet_len + packet_len);
-		} 
-		else 
-		{
-			if (pending_.length() < sizeof packet_len + packet_len + mac_size) 
-			{
-				DEBUG(log_) << "Need " << sizeof packet_len + packet_len + mac_size << " bytes; have " << pending_.length() << ".";
-				return true;
+				BigEndian::extract (&packet_len, &pending_);
 			}
 
-			pending_.moveout (&packet, sizeof packet_len + packet_len);
-		}
-
-		if (mac_algorithm) 
-		{
-			Buffer expected_mac;
-			Buffer mac_input;
-
-			pending_.moveout (&mac, 0, mac_size);
-			SSH::UInt32::encode (&mac_input, session_->remote_sequence_number_);
-			mac_input.append (packet);
-			if (! mac_algorithm->mac (&expected_mac, &mac_input)) 
+			if (packet_len == 0) 
 			{
-				ERROR(log_) << "Could not compute expected MAC.";
+				ERROR(log_) << "Need to handle 0-length packet.";
 				return false;
 			}
-			if (! expected_mac.equal (&mac)) 
+			if (packet_len > MAXIMUM_PACKET_LENGTH)
 			{
-				ERROR(log_) << "Received MAC does not match expected MAC.";
+				ERROR(log_) << "Invalid packet length.";
 				return false;
 			}
-		}
-		packet.skip (sizeof packet_len);
 
-		session_->remote_sequence_number_++;
+			if (encryption_algorithm) 
+			{
+				ASSERT(log_, !first_block_.empty());
+				if (block_size + pending_.length() < sizeof packet_len + packet_len + mac_size) 
+				{
+					DEBUG(log_) << "Need " << sizeof packet_len + packet_len + mac_size << " bytes to decrypt encrypted packet; have " << (block_size + pending_.length()) << ".";
+					return true;
+				}
 
-		padding_len = packet.pop();
-		if (padding_len != 0) 
-		{
-			if (packet.length() < padding_len) 
+				first_block_.moveout (&packet);
+
+				if (sizeof packet_len + packet_len > block_size) 
+				{
+					Buffer ciphertext;
+					pending_.moveout (&ciphertext, sizeof packet_len + packet_len - block_size);
+					if (! encryption_algorithm->cipher (&packet, &ciphertext)) 
+					{
+						ERROR(log_) << "Decryption of packet failed.";
+						return false;
+					}
+				} 
+				else 
+				{
+					DEBUG(log_) << "Packet of exactly one block.";
+				}
+				ASSERT(log_, packet.length() == sizeof packet_len + packet_len);
+			} 
+			else 
 			{
-				ERROR(log_) << "Padding too large for packet.";
-				return false;
+				if (pending_.length() < sizeof packet_len + packet_len + mac_size) 
+				{
+					DEBUG(log_) << "Need " << sizeof packet_len + packet_len + mac_size << " bytes; have " << pending_.length() << ".";
+					return true;
+				}
+
+				pending_.moveout (&packet, sizeof packet_len + packet_len);
+			}
+
+			if (mac_algorithm) 
+			{
+				Buffer expected_mac;
+
+				pending_.moveout (&mac, 0, mac_size);
+				if (! mac_algorithm->mac (&expected_mac, session_->remote_sequence_number_, &packet)) 
+				{
+					ERROR(log_) << "Could not compute expected MAC.";
+					return false;
+				}
+				if (! CryptoMAC::verify (&expected_mac, &mac)) 
+				{
+					ERROR(log_) << "Received MAC does not match expected MAC.";
+					return false;
+				}
 			}
-			packet.trim (padding_len);
 		}
 
-		if (packet.empty()) 
+		if (packets.empty ())
 		{
-			ERROR(log_) << "Need to handle empty packet.";
-			return false;
+			packet.skip (sizeof packet_len);
+			session_->remote_sequence_number_++;
+			packets.push_back (packet);
 		}
 
 		/*
-		 * Pass by range to registered handlers for each range.
-		 * Unhandled messages go to the receive_callback_, and
-		 * the caller can register key exchange mechanisms,
-		 * and handle (or discard) whatever they don't handle.
-		 *
-		 * NB: The caller could do all this, but it's assumed
-		 *     that they usually have better things to do.  If
-		 *     they register no handlers, they can certainly do
-		 *     so by hand.
-		 *
-		 * XXX It seems like having a separate class which handles
-		 *     all these details and algorithm negotiation would be
-		 *     nice, and to have this one be a bit more oriented
-		 *     towards managing just the transport layer.
-		 *
-		 *     At the very least, it needs to take responsibility
-		 *     for its failures and allow the handler functions
-		 *     here to mangle the packet buffer rather than trying
-		 *     to send it on to the receiver if decoding fails.
-		 *     A decoding failure should result in a disconnect,
-		 *     an error.
+		 * Keys only change on a message taken by itself, as none are used
+		 * before and rekeying is not supported.
 		 */
-		msg = packet.peek();
-		if (msg >= SSH::Message::TransportRangeBegin &&
-		    msg <= SSH::Message::TransportRangeEnd) 
+		while (! packets.empty ())
 		{
-			DEBUG(log_) << "Using default handler for transport message.";
-		} 
-		else if (msg >= SSH::Message::AlgorithmNegotiationRangeBegin &&
-			      msg <= SSH::Message::AlgorithmNegotiationRangeEnd) 
-		{
-			if (session_->algorithm_negotiation_) 
-			{
-				if (session_->algorithm_negotiation_->input (upstream_, &packet))
-					continue;
-				ERROR(log_) << "Algorithm negotiation message failed.";
+			if (! deliver (packets.front (), flg))
 				return false;
-			}
-			DEBUG(log_) << "Using default handler for algorithm negotiation message.";
-		} 
-		else if (msg >= SSH::Message::KeyExchangeMethodRangeBegin &&
-			      msg <= SSH::Message::KeyExchangeMethodRangeEnd) 
-		{
-			if (session_->chosen_algorithms_.key_exchange_) 
+			packets.pop_front ();
+			if (! packets.empty () && session_->active_algorithms_.remote_to_local_ != algorithms)
 			{
-				if (session_->chosen_algorithms_.key_exchange_->input (upstream_, &packet))
-					continue;
-				ERROR(log_) << "Key exchange message failed.";
+				ERROR(log_) << "Keys changed within a batch of packets.";
 				return false;
 			}
-			DEBUG(log_) << "Using default handler for key exchange method message.";
-		} 
-		else if (msg >= SSH::Message::UserAuthenticationGenericRangeBegin &&
-			      msg <= SSH::Message::UserAuthenticationGenericRangeEnd) 
-		{
-			DEBUG(log_) << "Using default handler for generic user authentication message.";
-		} 
-		else if (msg >= SSH::Message::UserAuthenticationMethodRangeBegin &&
-			      msg <= SSH::Message::UserAuthenticationMethodRangeEnd) 
-		{
-			DEBUG(log_) << "Using default handler for user authentication method message.";
-		} 
-		else if (msg >= SSH::Message::ConnectionProtocolGlobalRangeBegin &&
-			      msg <= SSH::Message::ConnectionProtocolGlobalRangeEnd) 
+		}
+	}
+	
+	return true;
+}
+
+/*
+ * With encrypt-then-MAC the lengths are in the clear, so the MAC of every
+ * packet complete in the pending data is checked before anything is
+ * decrypted, and then the contents of all of them are decrypted at once:
+ * the cipher carries on from a packet to the next just the same.
+ */
+bool SSH::DecryptFilter::open_batch (Encryption* encryption_algorithm, MAC* mac_algorithm, unsigned block_size, std::deque<Buffer>& packets)
+{
+	std::vector<uint32_t> lengths;
+	unsigned mac_size;
+	uint32_t packet_len;
+	Buffer batch;
+
+	mac_size = mac_algorithm->size ();
+	while (pending_.length () >= sizeof packet_len)
+	{
+		Buffer packet, mac, expected_mac;
+
+		BigEndian::extract (&packet_len, &pending_);
+		if (packet_len == 0 || packet_len > MAXIMUM_PACKET_LENGTH || (encryption_algorithm && packet_len % block_size != 0))
 		{
-			DEBUG(log_) << "Using default handler for generic connection protocol message.";
-		} 
-		else if (msg >= SSH::Message::ConnectionChannelRangeBegin &&
-			      msg <= SSH::Message::ConnectionChannelRangeEnd) 
+			ERROR(log_) << "Invalid packet length.";
+			return false;
+		}
+		if (pending_.length () < sizeof packet_len + packet_len + mac_size)
 		{
-			DEBUG(log_) << "Using default handler for connection channel message.";
-		} 
-		else if (msg >= SSH::Message::ClientProtocolReservedRangeBegin &&
-			      msg <= SSH::Message::ClientProtocolReservedRangeEnd) 
+			DEBUG(log_) << "Need " << sizeof packet_len + packet_len + mac_size << " bytes; have " << pending_.length () << ".";
+			break;
+		}
+
+		pending_.moveout (&packet, sizeof packet_len + packet_len);
+		pending_.moveout (&mac, mac_size);
+		if (! mac_algorithm->mac (&expected_mac, session_->remote_sequence_number_, &packet)) 
 		{
-			DEBUG(log_) << "Using default handler for client protocol message.";
-		} 
-		else if (msg >= SSH::Message::LocalExtensionRangeBegin) 
+			ERROR(log_) << "Could not compute expected MAC.";
+			return false;
+		}
+		if (! CryptoMAC::verify (&expected_mac, &mac)) 
 		{
-			/* Because msg is a uint8_t, it will always be <= SSH::Message::LocalExtensionRangeEnd.  */
-			DEBUG(log_) << "Using default handler for local extension message.";
-		} 
-		else 
+			ERROR(log_) << "Received MAC does not match expected MAC.";
+			return false;
+		}
+		session_->remote_sequence_number_++;
+
+		packet.skip (sizeof packet_len);
+		packet.moveout (&batch);
+		lengths.push_back (packet_len);
+	}
+
+	if (lengths.empty ())
+		return true;
+
+	if (encryption_algorithm && ! encryption_algorithm->cipher (&batch))
+	{
+		ERROR(log_) << "Decryption of packets failed.";
+		return false;
+	}
+
+	for (size_t i = 0; i < lengths.size (); ++i)
+	{
+		Buffer packet;
+		batch.moveout (&packet, lengths[i]);
+		packets.push_back (packet);
+	}
+	return true;
+}
+
+/*
+ * Takes a decrypted packet, without its length, through the handlers and
+ * on to the next filter.
+ */
+bool SSH::DecryptFilter::deliver (Buffer& packet, int flg)
+{
+	uint8_t padding_len;
+	uint8_t msg;
+
+	padding_len = packet.pop();
+	if (padding_len != 0) 
+	{
+		if (packet.length() < padding_len) 
 		{
-			ASSERT(log_, msg == 0);
-			ERROR(log_) << "Message outside of protocol range received.  Passing to default handler, but not expecting much.";
+			ERROR(log_) << "Padding too large for packet.";
+			return false;
 		}
+		packet.trim (padding_len);
+	}
 
-		/*
-		 * If we're reading data that has been encoded, we need to untag it.
-		 * Otherwise we need to frame it.
-		 */
-		if (encoded_) 
+	if (packet.empty()) 
+	{
+		ERROR(log_) << "Need to handle empty packet.";
+		return false;
+	}
+
+	/*
+	 * Pass by range to registered handlers for each range.
+	 * Unhandled messages go to the receive_callback_, and
+	 * the caller can register key exchange mechanisms,
+	 * and handle (or discard) whatever they don't handle.
+	 *
+	 * NB: The caller could do all this, but it's assumed
+	 *     that they usually have better things to do.  If
+	 *     they register no handlers, they can certainly do
+	 *     so by hand.
+	 *
+	 * XXX It seems like having a separate class which handles
+	 *     all these details and algorithm negotiation would be
+	 *     nice, and to have this one be a bit more oriented
+	 *     towards managing just the transport layer.
+	 *
+	 *     At the very least, it needs to take responsibility
+	 *     for its failures and allow the handler functions
+	 *     here to mangle the packet buffer rather than trying
+	 *     to send it on to the receiver if decoding fails.
+	 *     A decoding failure should result in a disconnect,
+	 *     an error.
+	 */
+	msg = packet.peek();
+	if (msg >= SSH::Message::TransportRangeBegin &&
+	    msg <= SSH::Message::TransportRangeEnd) 
+	{
+		DEBUG(log_) << "Using default handler for transport message.";
+	} 
+	else if (msg >= SSH::Message::AlgorithmNegotiationRangeBegin &&
+		      msg <= SSH::Message::AlgorithmNegotiationRangeEnd) 
+	{
+		if (session_->algorithm_negotiation_) 
 		{
-			if (packet.peek () != SSHStreamPacket || packet.length() == 1) 
-			{
-				ERROR(log_) << "Got encoded packet with wrong message.";
-				return false;
-			}
-			packet.skip (1);
-		} 
-		else 
+			if (session_->algorithm_negotiation_->input (upstream_, &packet))
+				return true;
+			ERROR(log_) << "Algorithm negotiation message failed.";
+			return false;
+		}
+		DEBUG(log_) << "Using default handler for algorithm negotiation message.";
+	} 
+	else if (msg >= SSH::Message::KeyExchangeMethodRangeBegin &&
+		      msg <= SSH::Message::KeyExchangeMethodRangeEnd) 
+	{
+		if (session_->chosen_algorithms_.key_exchange_) 
 		{
-			uint32_t length = packet.length ();
-			length = BigEndian::encode (length);
+			if (session_->chosen_algorithms_.key_exchange_->input (upstream_, &packet))
+				return true;
+			ERROR(log_) << "Key exchange message failed.";
+			return false;
+		}
+		DEBUG(log_) << "Using default handler for key exchange method message.";
+	} 
+	else if (msg >= SSH::Message::UserAuthenticationGenericRangeBegin &&
+		      msg <= SSH::Message::UserAuthenticationGenericRangeEnd) 
+	{
+		DEBUG(log_) << "Using default handler for generic user authentication message.";
+	} 
+	else if (msg >= SSH::Message::UserAuthenticationMethodRangeBegin &&
+		      msg <= SSH::Message::UserAuthenticationMethodRangeEnd) 
+	{
+		DEBUG(log_) << "Using default handler for user authentication method message.";
+	} 
+	else if (msg >= SSH::Message::ConnectionProtocolGlobalRangeBegin &&
+		      msg <= SSH::Message::ConnectionProtocolGlobalRangeEnd) 
+	{
+		DEBUG(log_) << "Using default handler for generic connection protocol message.";
+	} 
+	else if (msg >= SSH::Message::ConnectionChannelRangeBegin &&
+		      msg <= SSH::Message::ConnectionChannelRangeEnd) 
+	{
+		DEBUG(log_) << "Using default handler for connection channel message.";
+	} 
+	else if (msg >= SSH::Message::ClientProtocolReservedRangeBegin &&
+		      msg <= SSH::Message::ClientProtocolReservedRangeEnd) 
+	{
+		DEBUG(log_) << "Using default handler for client protocol message.";
+	} 
+	else if (msg >= SSH::Message::LocalExtensionRangeBegin) 
+	{
+		/* Because msg is a uint8_t, it will always be <= SSH::Message::LocalExtensionRangeEnd.  */
+		DEBUG(log_) << "Using default handler for local extension message.";
+	} 
+	else 
+	{
+		ASSERT(log_, msg == 0);
+		ERROR(log_) << "Message outside of protocol range received.  Passing to default handler, but not expecting much.";
+	}
 
-			Buffer b;
-			b.append (&length);
-			packet.moveout (&b);
-			packet = b;
+	/*
+	 * If we're reading data that has been encoded, we need to untag it.
+	 * Otherwise we need to frame it.
+	 */
+	if (encoded_) 
+	{
+		if (packet.peek () != SSHStreamPacket || packet.length() == 1) 
+		{
+			ERROR(log_) << "Got encoded packet with wrong message.";
+			return false;
 		}
-		
-		return produce (packet, flg);
+		packet.skip (1);
+	} 
+	else 
+	{
+		uint32_t length = packet.length ();
+		length = BigEndian::encode (length);
+
+		Buffer b;
+		b.append (&length);
+		packet.moveout (&b);
+		packet = b;
 	}
 	
-	return true;
+	return produce (packet, flg);
 }
 
 void SSH::DecryptFilter::flush (int flg)
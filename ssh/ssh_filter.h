@@ -11,6 +11,8 @@
 #ifndef	SSH_ENCRYPT_FILTER_H
 #define	SSH_ENCRYPT_FILTER_H
 
+#include <deque>
+#include <vector>
 #include <common/filter.h>
 #include <ssh/ssh_session.h>
 
@@ -18,6 +20,7 @@ namespace SSH
 {
 	const int SOURCE_ENCODED = 0x01;
 	const int ALGORITHM_NEGOTIATED = 0x2C;
+	const uint32_t MAXIMUM_PACKET_LENGTH = 35000;		// RFC 4253, section 6.1
 	
 	class EncryptFilter : public BufferedFilter
 	{
@@ -32,6 +35,7 @@ namespace SSH
 		virtual bool produce (Buffer& buf, int flg = 0);
 		virtual void flush (int flg);
 		
+		void identify ();
 		Session* current_session ()   { return &session_; }
 	};
 
@@ -49,6 +53,10 @@ namespace SSH
 		virtual void flush (int flg);
 		
 		void set_encrypter (EncryptFilter* f)   { session_ = (f ? f->current_session () : 0); set_upstream (f); }
+
+	private:
+		bool open_batch (Encryption* encryption_algorithm, MAC* mac_algorithm, unsigned block_size, std::deque<Buffer>& packets);
+		bool deliver (Buffer& packet, int flg);
 	};
 }
 
@@ -25,6 +25,10 @@
 
 #include <openssl/bn.h>
 #include <openssl/dh.h>
+#include <openssl/evp.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#endif
 
 #include <common/buffer.h>
 
@@ -52,6 +56,9 @@
 #define	DH_GROUP_MIN	1024
 #define	DH_GROUP_MAX	8192
 
+#define	ECDH_X25519_KEY_SIZE	32	/* RFC 8731 */
+#define	ECDH_P256_KEY_SIZE		65	/* Uncompressed point, RFC 5656 */
+
 #define	USE_TEST_GROUP
 
 namespace {
@@ -75,6 +82,26 @@ namespace {
 		DiffieHellmanGroupExchangeInitialize = 32,
 		DiffieHellmanGroupExchangeReply = 33;
 
+	static const uint8_t
+		EllipticCurveDiffieHellmanInitialize = 30,
+		EllipticCurveDiffieHellmanReply = 31;
+
+	/*
+	 * Once the exchange is over, each side sends NEWKEYS and its later
+	 * packets go out under the new keys, data held until then included.
+	 */
+	static bool send_new_keys(SSH::Session *session, Filter *sender)
+	{
+		Buffer packet;
+
+		packet.append(SSH::Message::NewKeysMessage);
+		if (!sender->produce(packet))
+			return (false);
+		session->activate_local();
+		sender->flush(SSH::ALGORITHM_NEGOTIATED);
+		return (true);
+	}
+
 	/*
 	 * XXX
 	 * Like a non-trivial amount of other code, this has been
@@ -270,16 +297,11 @@ namespace {
 
 				packet.append(DiffieHellmanGroupExchangeReply);
 				SSH::String::encode(&packet, server_public_key);
-				SSH::MPInt::encode(&packet, f);
+				SSH::MPInt::encode(&packet, fr);
 				SSH::String::encode(&packet, &signature);
 				sender->produce(packet);
 
-				sender->flush(SSH::ALGORITHM_NEGOTIATED);
-				/*
-				 * XXX
-				 * Should send NEWKEYS.
-				 */
-				return (true);
+				return (send_new_keys(session_, sender));
 			case DiffieHellmanGroupExchangeReply:
 				if (session_->role_ != SSH::ClientRole) {
 					ERROR(log_) << "Received group exchange reply as client.";
@@ -310,14 +332,7 @@ namespace {
 					return (false);
 				}
 
-				sender->flush(SSH::ALGORITHM_NEGOTIATED);
-				/*
-				 * XXX
-				 * Should send NEWKEYS, but we're not ready for that yet.
-				 * For now we just assume the peer will do it.  How lazy,
-				 * no?
-				 */
-				return (true);
+				return (send_new_keys(session_, sender));
 			default:
 				ERROR(log_) << "Not yet implemented.";
 				return (false);
@@ -382,11 +397,276 @@ namespace {
 			return (true);
 		}
 	};
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	/*
+	 * Elliptic curve Diffie-Hellman, as in RFC 5656 and RFC 8731: the
+	 * client sends its ephemeral public key as soon as the algorithms
+	 * are chosen, and the server answers with its own and the signed
+	 * exchange hash, a round trip less than the group exchange.  The
+	 * keys go as strings, and the shared secret as an mpint.
+	 */
+	template<CryptoHash::Algorithm hash_algorithm>
+	class EllipticCurveDiffieHellman : public SSH::KeyExchange {
+		LogHandle log_;
+		SSH::Session *session_;
+		const char *type_;
+		const char *group_;
+		EVP_PKEY *key_;
+		Buffer key_exchange_;
+	public:
+		EllipticCurveDiffieHellman(SSH::Session *session, const std::string& key_exchange_name, const char *type, const char *group)
+		: SSH::KeyExchange(key_exchange_name),
+		  log_("/ssh/key_exchange/" + key_exchange_name),
+		  session_(session),
+		  type_(type),
+		  group_(group),
+		  key_(NULL),
+		  key_exchange_()
+		{ }
+
+		~EllipticCurveDiffieHellman()
+		{
+			EVP_PKEY_free(key_);
+		}
+
+		KeyExchange *clone(void) const
+		{
+			return (new EllipticCurveDiffieHellman(session_, name_, type_, group_));
+		}
+
+		bool hash(Buffer *out, const Buffer *in) const
+		{
+			return (CryptoHash::hash(hash_algorithm, out, in));
+		}
+
+		bool input(Filter* sender, Buffer *in)
+		{
+			SSH::ServerHostKey *key;
+			Buffer server_public_key;
+			Buffer client_ephemeral;
+			Buffer server_ephemeral;
+			Buffer signature;
+			Buffer packet;
+
+			switch (in->peek()) {
+			case EllipticCurveDiffieHellmanInitialize:
+				if (session_->role_ != SSH::ServerRole) {
+					ERROR(log_) << "Received ECDH initialization as client.";
+					return (false);
+				}
+				in->skip(1);
+				if (!SSH::String::decode(&client_ephemeral, in))
+					return (false);
+				if (!generate(&server_ephemeral))
+					return (false);
+
+				SSH::String::encode(&key_exchange_, client_ephemeral);
+				SSH::String::encode(&key_exchange_, server_ephemeral);
+				if (!exchange_finish(&client_ephemeral)) {
+					ERROR(log_) << "Server key exchange finish failed.";
+					return (false);
+				}
+
+				key = session_->chosen_algorithms_.server_host_key_;
+				if (!key->sign(&signature, &session_->exchange_hash_))
+					return (false);
+				key->encode_public_key(&server_public_key);
+
+				packet.append(EllipticCurveDiffieHellmanReply);
+				SSH::String::encode(&packet, server_public_key);
+				SSH::String::encode(&packet, server_ephemeral);
+				SSH::String::encode(&packet, &signature);
+				sender->produce(packet);
+
+				return (send_new_keys(session_, sender));
+			case EllipticCurveDiffieHellmanReply:
+				if (session_->role_ != SSH::ClientRole) {
+					ERROR(log_) << "Received ECDH reply as server.";
+					return (false);
+				}
+				if (key_ == NULL) {
+					ERROR(log_) << "Received ECDH reply before initialization.";
+					return (false);
+				}
+				in->skip(1);
+				if (!SSH::String::decode(&server_public_key, in))
+					return (false);
+				if (!SSH::String::decode(&server_ephemeral, in))
+					return (false);
+				if (!SSH::String::decode(&signature, in))
+					return (false);
+
+				key = session_->chosen_algorithms_.server_host_key_;
+				if (!key->decode_public_key(&server_public_key)) {
+					ERROR(log_) << "Could not decode server public key:" << std::endl << server_public_key.hexdump();
+					return (false);
+				}
+
+				SSH::String::encode(&key_exchange_, server_ephemeral);
+				if (!exchange_finish(&server_ephemeral)) {
+					ERROR(log_) << "Client key exchange finish failed.";
+					return (false);
+				}
+
+				if (!key->verify(&signature, &session_->exchange_hash_)) {
+					ERROR(log_) << "Failed to verify exchange hash.";
+					return (false);
+				}
+
+				return (send_new_keys(session_, sender));
+			default:
+				ERROR(log_) << "Not yet implemented.";
+				return (false);
+			}
+		}
+
+		bool init(Buffer *out)
+		{
+			ASSERT(log_, out->empty());
+			ASSERT(log_, session_->role_ == SSH::ClientRole);
+
+			Buffer client_ephemeral;
+			if (!generate(&client_ephemeral))
+				return (false);
+
+			key_exchange_.clear();
+			SSH::String::encode(&key_exchange_, client_ephemeral);
+
+			out->append(EllipticCurveDiffieHellmanInitialize);
+			SSH::String::encode(out, client_ephemeral);
+
+			return (true);
+		}
+
+	private:
+		/*
+		 * Makes a new ephemeral key pair and gives out its public key.
+		 */
+		bool generate(Buffer *out)
+		{
+			unsigned char *pub;
+			size_t len;
+
+			EVP_PKEY_free(key_);
+			if (group_ != NULL)
+				key_ = EVP_PKEY_Q_keygen(NULL, NULL, type_, group_);
+			else
+				key_ = EVP_PKEY_Q_keygen(NULL, NULL, type_);
+			if (key_ == NULL) {
+				ERROR(log_) << "Could not generate ephemeral key.";
+				return (false);
+			}
+
+			len = EVP_PKEY_get1_encoded_public_key(key_, &pub);
+			if (len == 0)
+				return (false);
+			out->append(pub, len);
+			OPENSSL_free(pub);
+			return (true);
+		}
+
+		bool exchange_finish(const Buffer *remote_public)
+		{
+			SSH::ServerHostKey *key;
+			Buffer server_public_key;
+			Buffer exchange_hash;
+			Buffer data;
+			EVP_PKEY_CTX *ctx;
+			EVP_PKEY *peer;
+			OSSL_PARAM params[3], *param;
+			uint8_t pub[ECDH_P256_KEY_SIZE];
+			size_t publen;
+			uint8_t secret[EVP_MAX_MD_SIZE];
+			size_t secretlen;
+			char group[32];
+			BIGNUM *k;
+
+			ASSERT(log_, key_ != NULL);
+
+			publen = remote_public->length();
+			if (publen != (group_ == NULL ? ECDH_X25519_KEY_SIZE : ECDH_P256_KEY_SIZE)) {
+				ERROR(log_) << "Remote public key has wrong length.";
+				return (false);
+			}
+			remote_public->copyout(pub, publen);
+
+			param = params;
+			if (group_ != NULL) {
+				snprintf(group, sizeof group, "%s", group_);
+				*param++ = OSSL_PARAM_construct_utf8_string(OSSL_PKEY_PARAM_GROUP_NAME, group, 0);
+			}
+			*param++ = OSSL_PARAM_construct_octet_string(OSSL_PKEY_PARAM_PUB_KEY, pub, publen);
+			*param = OSSL_PARAM_construct_end();
+
+			peer = NULL;
+			ctx = EVP_PKEY_CTX_new_from_name(NULL, type_, NULL);
+			if (ctx == NULL || EVP_PKEY_fromdata_init(ctx) <= 0 ||
+			    EVP_PKEY_fromdata(ctx, &peer, EVP_PKEY_PUBLIC_KEY, params) <= 0) {
+				ERROR(log_) << "Invalid remote public key.";
+				EVP_PKEY_CTX_free(ctx);
+				return (false);
+			}
+			EVP_PKEY_CTX_free(ctx);
+
+			secretlen = sizeof secret;
+			ctx = EVP_PKEY_CTX_new(key_, NULL);
+			if (ctx == NULL || EVP_PKEY_derive_init(ctx) <= 0 ||
+			    EVP_PKEY_derive_set_peer(ctx, peer) <= 0 ||
+			    EVP_PKEY_derive(ctx, secret, &secretlen) <= 0) {
+				ERROR(log_) << "Could not derive shared secret.";
+				EVP_PKEY_CTX_free(ctx);
+				EVP_PKEY_free(peer);
+				return (false);
+			}
+			EVP_PKEY_CTX_free(ctx);
+			EVP_PKEY_free(peer);
+
+			EVP_PKEY_free(key_);
+			key_ = NULL;
+
+			k = BN_bin2bn(secret, secretlen, NULL);
+			OPENSSL_cleanse(secret, sizeof secret);
+			if (k == NULL)
+				return (false);
+
+			key = session_->chosen_algorithms_.server_host_key_;
+			key->encode_public_key(&server_public_key);
+
+			SSH::String::encode(&data, session_->client_version_);
+			SSH::String::encode(&data, session_->server_version_);
+			SSH::String::encode(&data, session_->client_kexinit_);
+			SSH::String::encode(&data, session_->server_kexinit_);
+			SSH::String::encode(&data, server_public_key);
+			data.append(key_exchange_);
+			SSH::MPInt::encode(&data, k);
+
+			if (!CryptoHash::hash(hash_algorithm, &exchange_hash, &data)) {
+				BN_clear_free(k);
+				return (false);
+			}
+
+			session_->exchange_hash_ = exchange_hash;
+			session_->shared_secret_.clear();
+			SSH::MPInt::encode(&session_->shared_secret_, k);
+			if (session_->session_id_.empty())
+				session_->session_id_ = exchange_hash;
+			BN_clear_free(k);
+
+			return (true);
+		}
+	};
+#endif
 }
 
 void
 SSH::KeyExchange::add_algorithms(SSH::Session *session)
 {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	session->algorithm_negotiation_->add_algorithm(new EllipticCurveDiffieHellman<CryptoHash::SHA256>(session, "curve25519-sha256", "X25519", NULL));
+	session->algorithm_negotiation_->add_algorithm(new EllipticCurveDiffieHellman<CryptoHash::SHA256>(session, "curve25519-sha256@libssh.org", "X25519", NULL));
+	session->algorithm_negotiation_->add_algorithm(new EllipticCurveDiffieHellman<CryptoHash::SHA256>(session, "ecdh-sha2-nistp256", "EC", "P-256"));
+#endif
 	session->algorithm_negotiation_->add_algorithm(new DiffieHellmanGroupExchange<CryptoHash::SHA256>(session, "diffie-hellman-group-exchange-sha256"));
 	session->algorithm_negotiation_->add_algorithm(new DiffieHellmanGroupExchange<CryptoHash::SHA1>(session, "diffie-hellman-group-exchange-sha1"));
 }
@@ -24,6 +24,7 @@
  */
 
 #include <common/buffer.h>
+#include <common/endian.h>
 
 #include <ssh/ssh_algorithm_negotiation.h>
 #include <ssh/ssh_mac.h>
@@ -34,25 +35,29 @@ namespace {
 		const char *rfc4250_name_;
 		CryptoMAC::Algorithm crypto_algorithm_;
 		unsigned size_;
+		bool etm_;
 	};
 
 	static const struct ssh_mac_algorithm ssh_mac_algorithms[] = {
-		{ "hmac-sha1",		CryptoMAC::SHA1,	0 },
-		{ "hmac-sha2-256",	CryptoMAC::SHA256,	0 },
-		{ "hmac-sha2-512",	CryptoMAC::SHA512,	0 },
-		{ "hmac-ripemd160",	CryptoMAC::RIPEMD160,	0 },
-		{ "hmac-md5",		CryptoMAC::MD5,		0 },
-		{ "hmac-sha1-96",	CryptoMAC::SHA1,	12 },
-		{ "hmac-md5-96",	CryptoMAC::MD5,		12 },
-		{ NULL,			CryptoMAC::MD5,		0 }
+		{ "hmac-sha2-256-etm@openssh.com",	CryptoMAC::SHA256,	0,	true },
+		{ "hmac-sha2-512-etm@openssh.com",	CryptoMAC::SHA512,	0,	true },
+		{ "hmac-sha1-etm@openssh.com",		CryptoMAC::SHA1,	0,	true },
+		{ "hmac-sha1",		CryptoMAC::SHA1,	0,	false },
+		{ "hmac-sha2-256",	CryptoMAC::SHA256,	0,	false },
+		{ "hmac-sha2-512",	CryptoMAC::SHA512,	0,	false },
+		{ "hmac-ripemd160",	CryptoMAC::RIPEMD160,	0,	false },
+		{ "hmac-md5",		CryptoMAC::MD5,		0,	false },
+		{ "hmac-sha1-96",	CryptoMAC::SHA1,	12,	false },
+		{ "hmac-md5-96",	CryptoMAC::MD5,		12,	false },
+		{ NULL,			CryptoMAC::MD5,		0,	false }
 	};
 
 	class CryptoSSHMAC : public SSH::MAC {
 		LogHandle log_;
 		CryptoMAC::Instance *instance_;
 	public:
-		CryptoSSHMAC(const std::string& xname, CryptoMAC::Instance *instance, unsigned xsize)
-		: SSH::MAC(xname, xsize == 0 ? instance->size() : xsize, instance->size()),
+		CryptoSSHMAC(const std::string& xname, CryptoMAC::Instance *instance, unsigned xsize, bool xetm)
+		: SSH::MAC(xname, xsize == 0 ? instance->size() : xsize, instance->size(), xetm),
 		  log_("/ssh/mac/crypto/" + xname),
 		  instance_(instance)
 		{ }
@@ -62,7 +67,7 @@ namespace {
 
 		MAC *clone(void) const
 		{
-			return (new CryptoSSHMAC(name_, instance_->clone(), key_size_));
+			return (new CryptoSSHMAC(name_, instance_->clone(), size_, etm_));
 		}
 
 		bool initialize(const Buffer *key)
@@ -74,6 +79,22 @@ namespace {
 		{
 			return (instance_->mac(out, in));
 		}
+
+		bool mac(Buffer *out, uint32_t sequence_number, const Buffer *packet)
+		{
+			uint8_t seq[sizeof sequence_number];
+
+			sequence_number = BigEndian::encode(sequence_number);
+			memcpy(seq, &sequence_number, sizeof seq);
+			if (size_ == instance_->size())
+				return (instance_->mac(out, seq, sizeof seq, packet));
+
+			Buffer full;
+			if (!instance_->mac(&full, seq, sizeof seq, packet))
+				return (false);
+			out->append(full, size_);
+			return (true);
+		}
 	};
 }
 
@@ -93,17 +114,17 @@ SSH::MAC::add_algorithms(Session *session)
 			DEBUG("/ssh/mac") << "Could not get instance for algorithm: " << alg->crypto_algorithm_;
 			continue;
 		}
-		session->algorithm_negotiation_->add_algorithm(new CryptoSSHMAC(alg->rfc4250_name_, instance, alg->size_));
+		session->algorithm_negotiation_->add_algorithm(new CryptoSSHMAC(alg->rfc4250_name_, instance, alg->size_, alg->etm_));
 	}
 }
 
 SSH::MAC *
-SSH::MAC::algorithm(CryptoMAC::Algorithm xalgorithm)
+SSH::MAC::algorithm(CryptoMAC::Algorithm xalgorithm, bool etm)
 {
 	const struct ssh_mac_algorithm *alg;
 
 	for (alg = ssh_mac_algorithms; alg->rfc4250_name_ != NULL; alg++) {
-		if (xalgorithm != alg->crypto_algorithm_)
+		if (xalgorithm != alg->crypto_algorithm_ || alg->etm_ != etm)
 			continue;
 		const CryptoMAC::Method *method = CryptoMAC::Method::method(xalgorithm);
 		if (method == NULL) {
@@ -115,7 +136,7 @@ SSH::MAC::algorithm(CryptoMAC::Algorithm xalgorithm)
 			ERROR("/ssh/mac") << "Could not get instance for algorithm: " << xalgorithm;
 			return (NULL);
 		}
-		return (new CryptoSSHMAC(alg->rfc4250_name_, instance, alg->size_));
+		return (new CryptoSSHMAC(alg->rfc4250_name_, instance, alg->size_, alg->etm_));
 	}
 	ERROR("/ssh/mac") << "No SSH MAC support is available for algorithm: " << xalgorithm;
 	return (NULL);
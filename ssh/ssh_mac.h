@@ -36,11 +36,13 @@ namespace SSH {
 		const std::string name_;
 		const unsigned size_;
 		const unsigned key_size_;
+		const bool etm_;
 
-		MAC(const std::string& xname, unsigned xsize, unsigned xkey_size)
+		MAC(const std::string& xname, unsigned xsize, unsigned xkey_size, bool xetm = false)
 		: name_(xname),
 		  size_(xsize),
-		  key_size_(xkey_size)
+		  key_size_(xkey_size),
+		  etm_(xetm)
 		{ }
 
 	public:
@@ -62,13 +64,23 @@ namespace SSH {
 			return (key_size_);
 		}
 
+		/*
+		 * Encrypt-then-MAC: the packet length is sent in the clear and
+		 * the MAC is taken over the encrypted packet.
+		 */
+		bool etm(void) const
+		{
+			return (etm_);
+		}
+
 		virtual MAC *clone(void) const = 0;
 
 		virtual bool initialize(const Buffer *) = 0;
 		virtual bool mac(Buffer *, const Buffer *) = 0;
+		virtual bool mac(Buffer *, uint32_t, const Buffer *) = 0;	/* Of a packet and its sequence number.  */
 
 		static void add_algorithms(Session *);
-		static MAC *algorithm(CryptoMAC::Algorithm);
+		static MAC *algorithm(CryptoMAC::Algorithm, bool = false);
 	};
 }
 
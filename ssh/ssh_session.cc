@@ -30,63 +30,58 @@
 #include <ssh/ssh_mac.h>
 #include <ssh/ssh_session.h>
 
+/*
+ * Each direction switches to the keys of the last exchange on its own:
+ * ours once we have sent our NEWKEYS, and the other end's once its
+ * NEWKEYS has been received.
+ */
 void
-SSH::Session::activate_chosen(void)
+SSH::Session::activate_local(void)
 {
-	const Buffer *local_to_remote_iv_;
-	const Buffer *remote_to_local_iv_;
-	const Buffer *local_to_remote_key_;
-	const Buffer *remote_to_local_key_;
+	UnidirectionalAlgorithms *algorithms = chosen_algorithms_.local_to_remote_;
+	Buffer iv, key, integrity_key;
 
 	/*
 	 * XXX
 	 * Need to free instances in active_algorithms_.
 	 */
 
-	active_algorithms_ = chosen_algorithms_;
-
-	if (active_algorithms_.client_to_server_.encryption_ != NULL) {
-		client_to_server_iv_ = generate_key("A", active_algorithms_.client_to_server_.encryption_->iv_size());
-		client_to_server_key_ = generate_key("C", active_algorithms_.client_to_server_.encryption_->key_size());
-	}
-	if (active_algorithms_.server_to_client_.encryption_ != NULL) {
-		server_to_client_iv_ = generate_key("B", active_algorithms_.server_to_client_.encryption_->iv_size());
-		server_to_client_key_ = generate_key("D", active_algorithms_.server_to_client_.encryption_->key_size());
-	}
-	if (active_algorithms_.client_to_server_.mac_ != NULL) {
-		client_to_server_integrity_key_ = generate_key("E", active_algorithms_.client_to_server_.mac_->key_size());
-		if (!active_algorithms_.client_to_server_.mac_->initialize(&client_to_server_integrity_key_))
-			HALT("/ssh/session") << "Failed to activate client-to-server MAC.";
+	if (algorithms->encryption_ != NULL) {
+		iv = generate_key(role_ == ClientRole ? "A" : "B", algorithms->encryption_->iv_size());
+		key = generate_key(role_ == ClientRole ? "C" : "D", algorithms->encryption_->key_size());
+		if (!algorithms->encryption_->initialize(CryptoEncryption::Encrypt, &key, &iv))
+			HALT("/ssh/session") << "Failed to initialize local-to-remote encryption.";
 	}
-	if (active_algorithms_.server_to_client_.mac_ != NULL) {
-		server_to_client_integrity_key_ = generate_key("F", active_algorithms_.server_to_client_.mac_->key_size());
-		if (!active_algorithms_.server_to_client_.mac_->initialize(&server_to_client_integrity_key_))
-			HALT("/ssh/session") << "Failed to activate server-to-client MAC.";
+	if (algorithms->mac_ != NULL) {
+		integrity_key = generate_key(role_ == ClientRole ? "E" : "F", algorithms->mac_->key_size());
+		if (!algorithms->mac_->initialize(&integrity_key))
+			HALT("/ssh/session") << "Failed to activate local-to-remote MAC.";
 	}
 
-	if (active_algorithms_.local_to_remote_->encryption_ != NULL) {
-		if (role_ == ClientRole) {
-			local_to_remote_iv_ = &client_to_server_iv_;
-			local_to_remote_key_ = &client_to_server_key_;
-		} else {
-			local_to_remote_iv_ = &server_to_client_iv_;
-			local_to_remote_key_ = &server_to_client_key_;
-		}
-		if (!active_algorithms_.local_to_remote_->encryption_->initialize(CryptoEncryption::Encrypt, local_to_remote_key_, local_to_remote_iv_))
-			HALT("/ssh/session") << "Failed to initialize local-to-remote encryption.";
-	}
+	active_algorithms_.key_exchange_ = chosen_algorithms_.key_exchange_;
+	active_algorithms_.server_host_key_ = chosen_algorithms_.server_host_key_;
+	active_algorithms_.local_to_remote_ = algorithms;
+}
 
-	if (active_algorithms_.remote_to_local_->encryption_ != NULL) {
-		if (role_ == ClientRole) {
-			remote_to_local_iv_ = &server_to_client_iv_;
-			remote_to_local_key_ = &server_to_client_key_;
-		} else {
-			remote_to_local_iv_ = &client_to_server_iv_;
-			remote_to_local_key_ = &client_to_server_key_;
-		}
-		if (!active_algorithms_.remote_to_local_->encryption_->initialize(CryptoEncryption::Decrypt, remote_to_local_key_, remote_to_local_iv_))
-			HALT("/ssh/session") << "Failed to initialize local-to-remote encryption.";
+void
+SSH::Session::activate_remote(void)
+{
+	UnidirectionalAlgorithms *algorithms = chosen_algorithms_.remote_to_local_;
+	Buffer iv, key, integrity_key;
+
+	if (algorithms->encryption_ != NULL) {
+		iv = generate_key(role_ == ClientRole ? "B" : "A", algorithms->encryption_->iv_size());
+		key = generate_key(role_ == ClientRole ? "D" : "C", algorithms->encryption_->key_size());
+		if (!algorithms->encryption_->initialize(CryptoEncryption::Decrypt, &key, &iv))
+			HALT("/ssh/session") << "Failed to initialize remote-to-local encryption.";
 	}
+	if (algorithms->mac_ != NULL) {
+		integrity_key = generate_key(role_ == ClientRole ? "F" : "E", algorithms->mac_->key_size());
+		if (!algorithms->mac_->initialize(&integrity_key))
+			HALT("/ssh/session") << "Failed to activate remote-to-local MAC.";
+	}
+
+	active_algorithms_.remote_to_local_ = algorithms;
 }
 
 Buffer
@@ -103,7 +98,7 @@ SSH::Session::generate_key(const std::string& x, unsigned key_size)
 		} else {
 			input.append(key);
 		}
-		if (!active_algorithms_.key_exchange_->hash(&key, &input))
+		if (!chosen_algorithms_.key_exchange_->hash(&key, &input))
 			HALT("/ssh/session") << "Hash failed in generating key.";
 	}
 	if (key.length() > key_size)
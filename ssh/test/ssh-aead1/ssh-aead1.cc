@@ -0,0 +1,251 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+// File:           ssh-aead1.cc                                               //
+// Description:    SSH authenticated ciphers and encrypt-then-MAC vectors     //
+// Project:        WANProxy XTech                                             //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+#include <common/buffer.h>
+#include <common/endian.h>
+#include <common/test.h>
+
+#include <crypto/crypto_encryption.h>
+#include <crypto/crypto_mac.h>
+
+#include <ssh/ssh_encryption.h>
+#include <ssh/ssh_mac.h>
+
+/*
+ * A packet of 16 bytes after its length: padding length, payload and
+ * padding.  The expected outputs were computed with an independent
+ * implementation of each construction as OpenSSH defines it.
+ */
+static const uint8_t packet[] = {
+	0x00, 0x00, 0x00, 0x10,
+	0x06, 'w', 'a', 'n', ' ', 'p', 'r', 'o', 'x', 'y', 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+};
+
+/*
+ * aes128-gcm@openssh.com, key 00..0f and IV 10..1b, for the first two
+ * packets: the invocation counter moves on after each.
+ */
+static const uint8_t gcm_sealed[2][sizeof packet + 16] = {
+	{
+		0x00, 0x00, 0x00, 0x10, 0xc2, 0x59, 0x62, 0xc1, 0x2f, 0x3f, 0xc4, 0x80, 0x6f, 0xa4, 0x5d, 0xf5,
+		0xc7, 0x27, 0xeb, 0x3e, 0x4f, 0xd0, 0x83, 0x2c, 0x55, 0x52, 0xa9, 0x1a, 0xb0, 0x8a, 0xef, 0x4d,
+		0x03, 0x1d, 0x95, 0xca
+	},
+	{
+		0x00, 0x00, 0x00, 0x10, 0xf3, 0x37, 0x09, 0xbc, 0x63, 0x7d, 0x4a, 0x17, 0xfc, 0x8f, 0xd2, 0x9e,
+		0x01, 0xd8, 0x46, 0xfd, 0xbb, 0x99, 0x85, 0x1d, 0x7e, 0x29, 0x01, 0x2f, 0x2c, 0x5b, 0x4e, 0x5d,
+		0x7c, 0x3c, 0x93, 0x05
+	}
+};
+
+/*
+ * chacha20-poly1305@openssh.com, key 20..5f, sequence number 7.
+ */
+static const uint8_t chacha_sealed[sizeof packet + 16] = {
+	0x98, 0x9a, 0xf4, 0xc5, 0x50, 0x99, 0x68, 0x96, 0x1f, 0xc2, 0x48, 0xce, 0xa5, 0x73, 0xe2, 0xdf,
+	0xa0, 0xec, 0x5d, 0xc2, 0xe5, 0x01, 0xb0, 0xae, 0xc1, 0xbc, 0x8b, 0x6a, 0xe9, 0x03, 0x6a, 0xcd,
+	0x8e, 0x3b, 0x93, 0x49
+};
+
+/*
+ * aes128-ctr with key 60..6f and IV 70..7f, then hmac-sha2-256-etm with
+ * key 80..9f over the clear length and the ciphertext, sequence number 3.
+ */
+static const uint8_t etm_sealed[sizeof packet + 32] = {
+	0x00, 0x00, 0x00, 0x10, 0xf6, 0x20, 0xd6, 0x1f, 0xa6, 0x36, 0x16, 0x20, 0xe2, 0xb5, 0x5c, 0x60,
+	0x80, 0xb8, 0x72, 0xd3, 0x7e, 0xb5, 0x74, 0x2c, 0x2e, 0x12, 0xb0, 0x37, 0xad, 0x99, 0x33, 0x4a,
+	0x21, 0x79, 0x10, 0x2d, 0x6a, 0xf0, 0x07, 0xf2, 0x29, 0xad, 0xb8, 0x2b, 0x8e, 0x5e, 0x98, 0x57,
+	0x88, 0x57, 0x10, 0x0b
+};
+
+static void
+sequence(Buffer *out, uint8_t first, unsigned length)
+{
+	while (length-- > 0)
+		out->append(first++);
+}
+
+static bool
+same(const Buffer *buf, const uint8_t *data, size_t length)
+{
+	return (buf->equal(data, length));
+}
+
+/*
+ * Flips a bit of a sealed packet at the given offset.
+ */
+static Buffer
+tampered(const uint8_t *data, size_t length, size_t offset)
+{
+	uint8_t copy[64];
+	Buffer out;
+
+	memcpy(copy, data, length);
+	copy[offset] ^= 0x01;
+	out.append(copy, length);
+	return (out);
+}
+
+static void
+test_gcm(void)
+{
+	TestGroup g("/test/ssh/aead/gcm", "aes128-gcm@openssh.com");
+
+	SSH::Encryption *sealer = SSH::Encryption::cipher(CryptoEncryption::Cipher(CryptoEncryption::AES128, CryptoEncryption::GCM));
+	{
+		Test _(g, "Cipher available.", sealer != NULL && sealer->tag_size() == 16);
+	}
+	if (sealer == NULL)
+		return;
+	SSH::Encryption *opener = sealer->clone();
+
+	Buffer key, iv;
+	sequence(&key, 0x00, 16);
+	sequence(&iv, 0x10, 12);
+	{
+		Test _(g, "Initialize for sealing.", sealer->initialize(CryptoEncryption::Encrypt, &key, &iv));
+		Test __(g, "Initialize for opening.", opener->initialize(CryptoEncryption::Decrypt, &key, &iv));
+	}
+
+	for (unsigned i = 0; i < 2; i++) {
+		Buffer buf(packet, sizeof packet);
+		Test _(g, "Seal packet.", sealer->seal(&buf, i));
+		Test __(g, "Sealed packet matches vector.", same(&buf, gcm_sealed[i], sizeof gcm_sealed[i]));
+
+		uint32_t len;
+		Test ___(g, "Length in the clear.", opener->length(&len, &buf, i) && len == 16);
+		Test ____(g, "Open packet.", opener->open(&buf, i) && same(&buf, packet, sizeof packet));
+	}
+
+	SSH::Encryption *rejecter = sealer->clone();
+	rejecter->initialize(CryptoEncryption::Decrypt, &key, &iv);
+	{
+		Buffer buf = tampered(gcm_sealed[0], sizeof gcm_sealed[0], 2);
+		Test _(g, "Reject altered length.", !rejecter->open(&buf, 0));
+	}
+	{
+		Buffer buf = tampered(gcm_sealed[0], sizeof gcm_sealed[0], sizeof gcm_sealed[0] - 1);
+		Test _(g, "Reject altered tag.", !rejecter->open(&buf, 0));
+	}
+
+	delete rejecter;
+	delete opener;
+	delete sealer;
+}
+
+static void
+test_chacha20_poly1305(void)
+{
+	TestGroup g("/test/ssh/aead/chacha20-poly1305", "chacha20-poly1305@openssh.com");
+
+	SSH::Encryption *sealer = SSH::Encryption::cipher(CryptoEncryption::Cipher(CryptoEncryption::ChaCha20, CryptoEncryption::Stream));
+	{
+		Test _(g, "Cipher available.", sealer != NULL && sealer->tag_size() == 16);
+	}
+	if (sealer == NULL)
+		return;
+	SSH::Encryption *opener = sealer->clone();
+
+	Buffer key;
+	sequence(&key, 0x20, 64);
+	{
+		Test _(g, "Initialize for sealing.", sealer->initialize(CryptoEncryption::Encrypt, &key, NULL));
+		Test __(g, "Initialize for opening.", opener->initialize(CryptoEncryption::Decrypt, &key, NULL));
+	}
+
+	Buffer buf(packet, sizeof packet);
+	{
+		Test _(g, "Seal packet.", sealer->seal(&buf, 7));
+		Test __(g, "Sealed packet matches vector.", same(&buf, chacha_sealed, sizeof chacha_sealed));
+	}
+	{
+		uint32_t len;
+		Test _(g, "Decrypt length.", opener->length(&len, &buf, 7) && len == 16);
+		Test __(g, "Open packet.", opener->open(&buf, 7) && same(&buf, packet, sizeof packet));
+	}
+	{
+		Buffer copy(chacha_sealed, sizeof chacha_sealed);
+		Test _(g, "Reject wrong sequence number.", !opener->open(&copy, 8));
+	}
+	{
+		Buffer copy = tampered(chacha_sealed, sizeof chacha_sealed, 0);
+		Test _(g, "Reject altered length.", !opener->open(&copy, 7));
+	}
+	{
+		Buffer copy = tampered(chacha_sealed, sizeof chacha_sealed, 10);
+		Test _(g, "Reject altered payload.", !opener->open(&copy, 7));
+	}
+
+	delete opener;
+	delete sealer;
+}
+
+/*
+ * Encrypt-then-MAC leaves the length in the clear, encrypts the rest and
+ * takes the MAC of the sequence number and everything that is sent.
+ */
+static void
+test_etm(void)
+{
+	TestGroup g("/test/ssh/aead/etm", "aes128-ctr with hmac-sha2-256-etm@openssh.com");
+
+	SSH::Encryption *cipher = SSH::Encryption::cipher(CryptoEncryption::Cipher(CryptoEncryption::AES128, CryptoEncryption::CTR));
+	SSH::MAC *mac = SSH::MAC::algorithm(CryptoMAC::SHA256);
+	{
+		Test _(g, "Algorithms available.", cipher != NULL && mac != NULL);
+	}
+	if (cipher == NULL || mac == NULL)
+		return;
+
+	Buffer key, iv, mac_key;
+	sequence(&key, 0x60, 16);
+	sequence(&iv, 0x70, 16);
+	sequence(&mac_key, 0x80, 32);
+	{
+		Test _(g, "Initialize.", cipher->initialize(CryptoEncryption::Encrypt, &key, &iv) && mac->initialize(&mac_key));
+	}
+
+	Buffer sent, body(packet, sizeof packet), tag;
+	body.moveout(&sent, sizeof (uint32_t));
+	{
+		Test _(g, "Encrypt packet.", cipher->cipher(&body));
+	}
+	body.moveout(&sent);
+	{
+		Test _(g, "MAC encrypted packet.", mac->mac(&tag, 3, &sent));
+	}
+	{
+		Buffer expected(etm_sealed + sizeof packet, 32);
+		Test _(g, "MAC verifies.", CryptoMAC::verify(&expected, &tag));
+	}
+	tag.moveout(&sent);
+	{
+		Test _(g, "Sent packet matches vector.", same(&sent, etm_sealed, sizeof etm_sealed));
+	}
+	{
+		Buffer other;
+		Test _(g, "MAC of another sequence number.", mac->mac(&other, 4, &sent));
+		Buffer expected(etm_sealed + sizeof packet, 32);
+		Test __(g, "Does not verify.", !CryptoMAC::verify(&expected, &other));
+		Buffer shorter(etm_sealed + sizeof packet, 16);
+		Test ___(g, "Truncated MAC does not verify.", !CryptoMAC::verify(&expected, &shorter));
+	}
+
+	delete mac;
+	delete cipher;
+}
+
+int
+main(void)
+{
+	test_gcm();
+	test_chacha20_poly1305();
+	test_etm();
+
+	return (0);
+}
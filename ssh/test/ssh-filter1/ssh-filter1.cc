@@ -0,0 +1,269 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+// File:           ssh-filter1.cc                                             //
+// Description:    encrypt-then-MAC packets through the SSH filter pair       //
+// Project:        WANProxy XTech                                             //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+#include <vector>
+
+#include <common/buffer.h>
+#include <common/endian.h>
+#include <common/filter.h>
+#include <common/test.h>
+
+#include <crypto/crypto_encryption.h>
+#include <crypto/crypto_mac.h>
+
+#include <ssh/ssh_encryption.h>
+#include <ssh/ssh_filter.h>
+#include <ssh/ssh_mac.h>
+#include <ssh/ssh_protocol.h>
+
+/*
+ * Keeps whatever reaches it.
+ */
+class Capture : public Filter
+{
+public:
+	Buffer data_;
+
+	bool consume(Buffer& buf, int)
+	{
+		data_.append(buf);
+		buf.clear();
+		return (true);
+	}
+};
+
+static void
+sequence(Buffer *out, uint8_t first, unsigned length)
+{
+	while (length-- > 0)
+		out->append(first++);
+}
+
+/*
+ * An EncryptFilter sealing packets with aes128-ctr and
+ * hmac-sha2-256-etm@openssh.com, and a DecryptFilter with the same keys
+ * for the other direction, already past the identification string.  The
+ * payloads are channel data, which the DecryptFilter passes on framed
+ * with their length.
+ */
+class Link
+{
+	TestGroup& group_;
+	SSH::EncryptFilter sender_;
+	SSH::EncryptFilter receiver_;
+	SSH::DecryptFilter decrypter_;
+	std::vector<SSH::Encryption *> ciphers_;
+	std::vector<SSH::MAC *> macs_;
+
+public:
+	Capture wire_;
+	Capture reply_;
+	Capture output_;
+	Buffer expected_;
+	std::vector<size_t> ends_;
+
+	Link(TestGroup& group)
+	: group_(group),
+	  sender_(SSH::ClientRole),
+	  receiver_(SSH::ClientRole),
+	  decrypter_()
+	{
+		Buffer key, iv, mac_key;
+
+		sequence(&key, 0x60, 16);
+		sequence(&iv, 0x70, 16);
+		sequence(&mac_key, 0x80, 32);
+		for (unsigned i = 0; i < 2; i++) {
+			ciphers_.push_back(SSH::Encryption::cipher(CryptoEncryption::Cipher(CryptoEncryption::AES128, CryptoEncryption::CTR)));
+			macs_.push_back(SSH::MAC::algorithm(CryptoMAC::SHA256, true));
+		}
+		{
+			Test _(group_, "Algorithms available.", ciphers_[0] != NULL && ciphers_[1] != NULL &&
+							      macs_[0] != NULL && macs_[1] != NULL && macs_[0]->etm());
+		}
+		{
+			Test _(group_, "Initialize.", ciphers_[0]->initialize(CryptoEncryption::Encrypt, &key, &iv) &&
+						      ciphers_[1]->initialize(CryptoEncryption::Decrypt, &key, &iv) &&
+						      macs_[0]->initialize(&mac_key) && macs_[1]->initialize(&mac_key));
+		}
+
+		sender_.chain(&wire_);
+		sender_.current_session()->active_algorithms_.local_to_remote_->encryption_ = ciphers_[0];
+		sender_.current_session()->active_algorithms_.local_to_remote_->mac_ = macs_[0];
+
+		receiver_.chain(&reply_);
+		decrypter_.set_encrypter(&receiver_);
+		decrypter_.chain(&output_);
+		receiver_.current_session()->active_algorithms_.remote_to_local_->encryption_ = ciphers_[1];
+		receiver_.current_session()->active_algorithms_.remote_to_local_->mac_ = macs_[1];
+
+		Buffer identification("SSH-2.0-test\r\n");
+		{
+			Test _(group_, "Identification accepted.", decrypter_.consume(identification) && output_.data_.empty());
+		}
+	}
+
+	~Link()
+	{
+		for (unsigned i = 0; i < ciphers_.size(); i++) {
+			delete ciphers_[i];
+			delete macs_[i];
+		}
+	}
+
+	/*
+	 * Seals a packet of channel data of the given size and notes where it
+	 * ends on the wire, and what the DecryptFilter should pass on for it.
+	 */
+	void send(size_t size)
+	{
+		Buffer payload;
+
+		payload.append((uint8_t)SSH::Message::ConnectionChannelData);
+		for (size_t i = 1; i < size; i++)
+			payload.append((uint8_t)(ends_.size() * 7 + i));
+		BigEndian::append(&expected_, (uint32_t)payload.length());
+		expected_.append(payload);
+		{
+			Test _(group_, "Seal packet.", sender_.produce(payload));
+		}
+		ends_.push_back(wire_.data_.length());
+	}
+
+	bool receive(size_t length)
+	{
+		Buffer part;
+
+		wire_.data_.moveout(&part, length);
+		return (decrypter_.consume(part));
+	}
+};
+
+/*
+ * Everything sent at once is opened as one batch.
+ */
+static void
+test_batch(void)
+{
+	TestGroup g("/test/ssh/filter/batch", "SSH DecryptFilter opens several packets from one buffer");
+	Link link(g);
+
+	link.send(10);
+	link.send(100);
+	link.send(1000);
+	link.send(20000);
+	{
+		Test _(g, "Open batch.", link.receive(link.wire_.data_.length()));
+	}
+	{
+		Test _(g, "All packets delivered in order.", link.output_.data_.equal(&link.expected_));
+	}
+}
+
+/*
+ * Packets that straddle the buffers given to the filter are held until
+ * complete, whether it is their length, contents or MAC that is cut.
+ */
+static void
+test_split(void)
+{
+	TestGroup g("/test/ssh/filter/split", "SSH DecryptFilter holds packets split across buffers");
+	Link link(g);
+	Buffer first;
+
+	link.send(50);
+	link.send(3000);
+	link.send(70);
+
+	{
+		Test _(g, "Length cut.", link.receive(2) && link.output_.data_.empty());
+	}
+	{
+		Test _(g, "MAC of the first packet cut.", link.receive(link.ends_[0] - 2 - 10) && link.output_.data_.empty());
+	}
+	{
+		Test _(g, "First packet completed with the second cut.", link.receive(10 + 100));
+	}
+	link.expected_.moveout(&first, sizeof (uint32_t) + 50);
+	{
+		Test _(g, "Only the first packet delivered.", link.output_.data_.equal(&first));
+	}
+	link.output_.data_.clear();
+	{
+		Test _(g, "Rest of the packets.", link.receive(link.wire_.data_.length()));
+	}
+	{
+		Test _(g, "Remaining packets delivered in order.", link.output_.data_.equal(&link.expected_));
+	}
+}
+
+/*
+ * A bad MAC anywhere in a batch fails it before anything is decrypted or
+ * delivered, including the packets ahead of it.
+ */
+static void
+test_bad_mac(void)
+{
+	TestGroup g("/test/ssh/filter/bad-mac", "SSH DecryptFilter rejects a batch with a bad MAC in the middle");
+	Link link(g);
+	uint8_t last;
+
+	link.send(40);
+	link.send(400);
+	link.send(4000);
+
+	Buffer wire;
+	link.wire_.data_.moveout(&wire, link.ends_[1] - 1);
+	link.wire_.data_.moveout(&last, 1);
+	wire.append((uint8_t)(last ^ 0x80));
+	wire.append(link.wire_.data_);
+	link.wire_.data_ = wire;
+	{
+		Test _(g, "Batch rejected.", !link.receive(link.wire_.data_.length()));
+	}
+	{
+		Test _(g, "Nothing delivered.", link.output_.data_.empty());
+	}
+}
+
+/*
+ * Lengths are in the clear with encrypt-then-MAC, so they are checked
+ * before anything else.
+ */
+static void
+test_bad_length(void)
+{
+	TestGroup g("/test/ssh/filter/bad-length", "SSH DecryptFilter rejects invalid packet lengths");
+	{
+		Link link(g);
+		Buffer wire;
+
+		BigEndian::append(&wire, (uint32_t)0x10000);
+		link.wire_.data_ = wire;
+		Test _(g, "Oversized packet rejected.", !link.receive(wire.length()) && link.output_.data_.empty());
+	}
+	{
+		Link link(g);
+		Buffer wire;
+
+		BigEndian::append(&wire, (uint32_t)33);
+		link.wire_.data_ = wire;
+		Test _(g, "Packet not made of whole blocks rejected.", !link.receive(wire.length()) && link.output_.data_.empty());
+	}
+}
+
+int
+main(void)
+{
+	test_batch();
+	test_split();
+	test_bad_mac();
+	test_bad_length();
+
+	return (0);
+}
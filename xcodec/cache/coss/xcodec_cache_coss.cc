@@ -30,6 +30,7 @@
 
 XCodecCacheCOSS::XCodecCacheCOSS (const UUID& uuid, const std::string& cache_dir, size_t cache_size)
 	: XCodecCache(uuid, cache_size), 
+     replica_(0),
      log_("xcodec/cache/coss")
 {
 	uint8_t str[UUID_STRING_SIZE + 1];
@@ -60,6 +61,7 @@ XCodecCacheCOSS::XCodecCacheCOSS (const UUID& uuid, const std::string& cache_dir
 	
 	directory_ = new COSSMetadata[stripe_limit_];
 	memset (directory_, 0, sizeof (COSSMetadata) * stripe_limit_);
+	memory_budget.charge (MemoryUseCaches, sizeof stripe_ + sizeof (COSSMetadata) * stripe_limit_);
 	
 	if (stream_.rdbuf())
 		stream_.rdbuf()->pubsetbuf (0, 0);
@@ -90,10 +92,11 @@ XCodecCacheCOSS::~XCodecCacheCOSS()
    stream_.close();
 
 	delete[] directory_;
+	memory_budget.release (MemoryUseCaches, sizeof stripe_ + sizeof (COSSMetadata) * stripe_limit_);
 
 	INFO(log_) << "Cache statistics: ";
-	INFO(log_) << "Lookups: " << stats_.lookups;
-	INFO(log_) << "Matches: " << (stats_.found_1 + stats_.found_2) << " (" << stats_.found_1 << " + " << stats_.found_2 << ")";
+	INFO(log_) << "Lookups: " << stats_.lookups.val ();
+	INFO(log_) << "Matches: " << (stats_.found_1.val () + stats_.found_2.val ()) << " (" << stats_.found_1.val () << " + " << stats_.found_2.val () << ")";
 	INFO(log_) << "File: " << file_path_;
 
 	DEBUG(log_) << "Closing coss file: " << file_path_;
@@ -164,12 +167,14 @@ bool XCodecCacheCOSS::read_file ()
 
 void XCodecCacheCOSS::enter (const uint64_t& hash, const Buffer& buf, unsigned off)
 {
+	ScopedLock guard (lock_);
 	COSSIndexEntry entry;
 	
 	while (stripe_[active_].header.metadata.segment_index >= STRIPE_SEGMENT_COUNT)
 		new_active ();
 
 	COSSStripe& act = stripe_[active_];
+	slot_lock_[active_].write_lock ();
 	act.header.hash_array[act.header.metadata.segment_index] = hash;
 	buf.copyout (act.segment_array[act.header.metadata.segment_index].bytes, off, XCODEC_SEGMENT_LENGTH);
 	entry.stripe_range = act.header.metadata.stripe_range;
@@ -180,60 +185,94 @@ void XCodecCacheCOSS::enter (const uint64_t& hash, const Buffer& buf, unsigned o
 			 act.header.hash_array[act.header.metadata.segment_index])
 		act.header.metadata.segment_index++;
 	act.header.metadata.segment_count++;
-	act.header.metadata.freshness = ++freshness_level_;
+	act.header.metadata.freshness = __sync_add_and_fetch (&freshness_level_, 1);
+	slot_lock_[active_].unlock ();
 	
 	cache_index_.insert (hash, entry);
 }
 
+/*
+ * Lookups only take the structural lock when the stripe they need is not
+ * loaded yet.  Otherwise they hold a read lock on the slot while copying
+ * the segment out, and the usage counters are bumped atomically.
+ */
 bool XCodecCacheCOSS::lookup (const uint64_t& hash, Buffer& buf)
 {
-	const COSSIndexEntry* entry;
+	COSSIndexEntry entry;
 	const uint8_t* data;
 	int slot;
 
-	stats_.lookups++;
+	stats_.lookups.add (1);
 
 #ifdef USING_XCODEC_CACHE_RECENT_WINDOW
-	if ((data = find_recent (hash)))
+	if (recall (hash, buf))
 	{
-		buf.append (data, XCODEC_SEGMENT_LENGTH);
-		stats_.found_1++;
+		stats_.found_1.add (1);
 		return true;
 	}
 #endif
 		
-	if (! (entry = cache_index_.lookup (hash)))
+	if (! cache_index_.lookup (hash, entry))
 		return false;
 	
-	for (slot = 0; slot < LOADED_STRIPE_COUNT; ++slot)
-		if (stripe_[slot].header.metadata.stripe_range == entry->stripe_range)
-			break;
-			
-	if (slot >= LOADED_STRIPE_COUNT)
+	if ((slot = find_slot (entry.stripe_range)) < 0)
 	{
-		slot = best_unloadable_slot ();
-		detach_stripe (slot);
-		load_stripe (entry->stripe_range, slot);
+		ScopedLock guard (lock_);
+		if ((slot = find_slot (entry.stripe_range)) < 0)
+		{
+			slot = best_unloadable_slot ();
+			slot_lock_[slot].write_lock ();
+			detach_stripe (slot);
+			load_stripe (entry.stripe_range, slot);
+			slot_lock_[slot].unlock ();
+			if ((slot = find_slot (entry.stripe_range)) < 0)
+				return false;
+		}
 	}
 	
-	if (stripe_[slot].header.hash_array[entry->position] != hash)
+	COSSStripe& s = stripe_[slot];
+	if (s.header.hash_array[entry.position] != hash)
+	{
+		slot_lock_[slot].unlock ();
 		return false;
+	}
 		
-	stripe_[slot].header.metadata.freshness = ++freshness_level_;
-	stripe_[slot].header.metadata.uses++;
-	stripe_[slot].header.metadata.credits++;
-	stripe_[slot].header.metadata.load_uses++;
-	stripe_[slot].header.flags[entry->position] |= 3;
+	s.header.metadata.freshness = __sync_add_and_fetch (&freshness_level_, 1);
+	__sync_add_and_fetch (&s.header.metadata.uses, 1);
+	__sync_add_and_fetch (&s.header.metadata.credits, 1);
+	__sync_add_and_fetch (&s.header.metadata.load_uses, 1);
+	__sync_or_and_fetch (&s.header.flags[entry.position], 3);
 
-	data = stripe_[slot].segment_array[entry->position].bytes;
+	data = s.segment_array[entry.position].bytes;
 #ifdef USING_XCODEC_CACHE_RECENT_WINDOW
 	remember (hash, data);
 #endif
 	buf.append (data, XCODEC_SEGMENT_LENGTH);
-	stats_.found_2++;
+	slot_lock_[slot].unlock ();
+	stats_.found_2.add (1);
 	return true;
 }
 
+bool XCodecCacheCOSS::contains (const uint64_t& hash)
+{
+	COSSIndexEntry entry;
+	return cache_index_.lookup (hash, entry);
+}
+
+int XCodecCacheCOSS::find_slot (uint64_t range)
+{
+	for (int slot = 0; slot < LOADED_STRIPE_COUNT; ++slot)
+	{
+		slot_lock_[slot].read_lock ();
+		if (stripe_[slot].header.metadata.state == 1 && 
+			 stripe_[slot].header.metadata.stripe_range == range)
+			return slot;
+		slot_lock_[slot].unlock ();
+	}
+	
+	return -1;
+}
+
 void XCodecCacheCOSS::initialize_stripe (uint64_t range, int slot)
 {
 	memset (&stripe_[slot].header, 0, sizeof (COSSStripeHeader));
@@ -280,13 +319,17 @@ void XCodecCacheCOSS::store_stripe (int slot, size_t size)
 void XCodecCacheCOSS::new_active ()
 {
 	store_stripe (active_, sizeof (COSSStripe));
+	if (replica_)
+		replica_->stored (this);
 	active_ = best_unloadable_slot ();
+	slot_lock_[active_].write_lock ();
 	detach_stripe (active_);
 	stripe_range_ = best_erasable_stripe ();
 	if (load_stripe (stripe_range_, active_))
 		purge_stripe (active_);
 	else
 		initialize_stripe (stripe_range_, active_);
+	slot_lock_[active_].unlock ();
 }
 
 int XCodecCacheCOSS::best_unloadable_slot ()
@@ -375,3 +418,168 @@ void XCodecCacheCOSS::purge_stripe (int slot)
 	if (stripe_[slot].header.metadata.segment_count >= STRIPE_SEGMENT_COUNT)
 		INFO(log_) << "No more space available in cache";
 }
+
+void XCodecCacheCOSS::set_replica (COSSReplica* rpl)
+{
+	ScopedLock guard (lock_);
+	replica_ = rpl;
+}
+
+/*
+ * Copies out the stored stripe with the lowest serial number above the
+ * given one, so that a replica can be brought up to date stripe by stripe
+ * in the order they were filled.  The active stripe is left out until it
+ * is complete.
+ */
+bool XCodecCacheCOSS::copy_stripe (uint64_t after, COSSStripe& s)
+{
+	ScopedLock guard (lock_);
+	uint64_t serial, best = 0, range = 0;
+	int slot;
+	
+	for (uint64_t i = 0; i < stripe_limit_; ++i)
+	{
+		if (i == stripe_[active_].header.metadata.stripe_range)
+			continue;
+		if ((serial = stored_serial (i)) > after && (! best || serial < best))
+			best = serial, range = i;
+	}
+	
+	if (! best)
+		return false;
+	
+	if ((slot = find_slot (range)) >= 0)
+	{
+		memcpy (&s, &stripe_[slot], sizeof s);
+		slot_lock_[slot].unlock ();
+	}
+	else
+	{
+		stream_.seekg (range * sizeof (COSSStripe));
+		stream_.read ((char*) &s, sizeof s);
+		if (stream_.gcount () != sizeof s)
+		{
+			stream_.clear ();
+			return false;
+		}
+	}
+	
+	s.header.metadata.stripe_range = range;
+	s.header.metadata.serial_number = best;
+	s.header.metadata.state = 0;
+	return true;
+}
+
+/*
+ * Writes a stripe received from the primary in the same place it has
+ * there.  The active stripe is only replaced while nothing has been
+ * entered into it locally.
+ */
+bool XCodecCacheCOSS::install_stripe (const COSSStripe& s)
+{
+	ScopedLock guard (lock_);
+	uint64_t range = s.header.metadata.stripe_range;
+	COSSStripeHeader old;
+	COSSIndexEntry entry;
+	uint64_t pos;
+	int slot;
+	
+	if (range >= stripe_limit_ || s.header.metadata.signature != CACHE_SIGNATURE || 
+		 s.header.metadata.segment_count > STRIPE_SEGMENT_COUNT)
+		return false;
+	
+	if ((slot = find_slot (range)) >= 0)
+	{
+		slot_lock_[slot].unlock ();
+		if (slot == active_ && stripe_[slot].header.metadata.segment_count > 0)
+			return false;
+		
+		slot_lock_[slot].write_lock ();
+		for (int i = 0; i < STRIPE_SEGMENT_COUNT; ++i)
+		{
+#ifdef USING_XCODEC_CACHE_RECENT_WINDOW
+			if (stripe_[slot].header.flags[i] & 1)
+				forget (stripe_[slot].header.hash_array[i]);
+#endif
+			if (stripe_[slot].header.hash_array[i])
+				cache_index_.erase (stripe_[slot].header.hash_array[i]);
+		}
+		memcpy (&stripe_[slot], &s, sizeof s);
+		stripe_[slot].header.metadata.load_uses = 0;
+		stripe_[slot].header.metadata.state = 1;
+		store_stripe (slot, sizeof (COSSStripe));
+		slot_lock_[slot].unlock ();
+	}
+	else
+	{
+		pos = range * sizeof (COSSStripe);
+		if (pos < file_size_)
+		{
+			stream_.seekg (pos);
+			stream_.read ((char*) &old, sizeof old);
+			if (stream_.gcount () == sizeof old)
+			{
+				for (int i = 0; i < STRIPE_SEGMENT_COUNT; ++i)
+					if (old.hash_array[i])
+						cache_index_.erase (old.hash_array[i]);
+			}
+			stream_.clear ();
+		}
+		stream_.seekp (pos);
+		stream_.write ((const char*) &s, sizeof s);
+		if (stream_.good () && pos + sizeof (COSSStripe) > file_size_)
+			file_size_ = pos + sizeof (COSSStripe);
+		stream_.clear ();
+	}
+	
+	directory_[range] = s.header.metadata;
+	directory_[range].state = (slot >= 0 ? 1 : 0);
+	
+	for (int i = 0; i < STRIPE_SEGMENT_COUNT; ++i)
+	{
+		if (s.header.hash_array[i])
+		{
+			entry.stripe_range = range;
+			entry.position = i;
+			cache_index_.insert (s.header.hash_array[i], entry);
+		}
+	}
+	
+	if (s.header.metadata.serial_number > serial_number_)
+		serial_number_ = s.header.metadata.serial_number;
+	if (s.header.metadata.freshness > freshness_level_)
+		freshness_level_ = s.header.metadata.freshness;
+	return true;
+}
+
+/*
+ * The highest serial number among the stored stripes, which is where the
+ * primary has to resume sending.
+ */
+uint64_t XCodecCacheCOSS::replicated_serial ()
+{
+	ScopedLock guard (lock_);
+	uint64_t serial, best = 0;
+	
+	for (uint64_t i = 0; i < stripe_limit_; ++i)
+	{
+		if (i == stripe_[active_].header.metadata.stripe_range)
+			continue;
+		if ((serial = stored_serial (i)) > best)
+			best = serial;
+	}
+	
+	return best;
+}
+
+uint64_t XCodecCacheCOSS::stored_serial (uint64_t range)
+{
+	if (directory_[range].state == 1)
+	{
+		for (int slot = 0; slot < LOADED_STRIPE_COUNT; ++slot)
+			if (stripe_[slot].header.metadata.state == 1 && stripe_[slot].header.metadata.stripe_range == range)
+				return stripe_[slot].header.metadata.serial_number;
+	}
+	
+	return directory_[range].serial_number;
+}
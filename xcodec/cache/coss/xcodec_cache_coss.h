@@ -19,6 +19,7 @@
 #include <fstream>
 
 #include <common/buffer.h>
+#include <common/thread/atomic.h>
 #include <xcodec/xcodec.h>
 #include <xcodec/xcodec_cache.h>
 
@@ -95,31 +96,58 @@ struct COSSIndexEntry
 	uint64_t position : 16;
 };
 
+#define COSS_INDEX_SHARDS			16			// independently locked parts of the index (must be binary)
+
 class COSSIndex 
 {
 	typedef __gnu_cxx::hash_map<Hash64, COSSIndexEntry> index_t;
-	index_t index;
+	struct Shard
+	{
+		index_t index;
+		RWLock lock;
+	};
+	Shard shards[COSS_INDEX_SHARDS];
+
+	Shard& shard_of (const uint64_t& hash)
+	{
+		return shards[(hash ^ (hash >> 32)) & (COSS_INDEX_SHARDS - 1)];
+	}
 
 public:
 	void insert (const uint64_t& hash, const COSSIndexEntry& entry)
 	{
-		index[hash] = entry;
+		Shard& s = shard_of (hash);
+		ScopedWriteLock guard (s.lock);
+		s.index[hash] = entry;
 	}
 
-	const COSSIndexEntry* lookup (const uint64_t& hash)
+	bool lookup (const uint64_t& hash, COSSIndexEntry& entry)
 	{
-		index_t::iterator it = index.find (hash);
-		return (it != index.end () ? &it->second : 0);
+		Shard& s = shard_of (hash);
+		ScopedReadLock guard (s.lock);
+		index_t::iterator it = s.index.find (hash);
+		if (it == s.index.end ())
+			return false;
+		entry = it->second;
+		return true;
 	}
 	
 	void erase (const uint64_t& hash)
 	{
-		index.erase (hash);
+		Shard& s = shard_of (hash);
+		ScopedWriteLock guard (s.lock);
+		s.index.erase (hash);
 	}
 
 	size_t size()
 	{
-		return index.size();
+		size_t n = 0;
+		for (int i = 0; i < COSS_INDEX_SHARDS; ++i)
+		{
+			ScopedReadLock guard (shards[i].lock);
+			n += shards[i].index.size();
+		}
+		return n;
 	}
 };
 
@@ -172,15 +200,28 @@ public:
 
 struct COSSStats 
 {
-	uint64_t lookups;
-	uint64_t found_1;
-	uint64_t found_2;
-	
-public:
-	COSSStats()  { lookups = found_1 = found_2 = 0; }
+	Atomic<uint64_t> lookups;
+	Atomic<uint64_t> found_1;
+	Atomic<uint64_t> found_2;
 };
 
 
+class XCodecCacheCOSS;
+
+/*
+ * Told whenever a complete stripe has been written to the file, from
+ * whatever thread filled it and with the cache lock held, so it must only
+ * take note and come back later for the data.
+ */
+class COSSReplica
+{
+public:
+	virtual ~COSSReplica ()
+	{ }
+
+	virtual void stored (XCodecCacheCOSS* cache) = 0;
+};
+
 class XCodecCacheCOSS : public XCodecCache 
 {
 	std::string file_path_;
@@ -193,11 +234,13 @@ class XCodecCacheCOSS : public XCodecCache
 	uint64_t freshness_level_;
 
 	COSSStripe stripe_[LOADED_STRIPE_COUNT];
+	RWLock slot_lock_[LOADED_STRIPE_COUNT];
 	int active_;
 	
 	COSSMetadata* directory_;
 	COSSIndex cache_index_;
 	COSSStats stats_;
+	COSSReplica* replica_;
 	LogHandle log_;
 
 public:
@@ -206,9 +249,16 @@ public:
 
 	virtual void enter (const uint64_t& hash, const Buffer& buf, unsigned off);
 	virtual bool lookup (const uint64_t& hash, Buffer& buf);
+	virtual bool contains (const uint64_t& hash);
+
+	void set_replica (COSSReplica* rpl);
+	bool copy_stripe (uint64_t after, COSSStripe& s);
+	bool install_stripe (const COSSStripe& s);
+	uint64_t replicated_serial ();
 
 private:	
 	bool read_file ();
+	int find_slot (uint64_t range);
 	void initialize_stripe (uint64_t range, int slot);
 	bool load_stripe (uint64_t range, int slot);
 	void store_stripe (int slot, size_t size);
@@ -217,6 +267,7 @@ private:
 	uint64_t best_erasable_stripe ();
 	void detach_stripe (int slot);
 	void purge_stripe (int slot);
+	uint64_t stored_serial (uint64_t range);
 };
 
 #endif /* !XCODEC_XCODEC_CACHE_COSS_H */
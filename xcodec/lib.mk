@@ -3,3 +3,4 @@ VPATH+=	${TOPDIR}/xcodec
 SRCS+=	xcodec_encoder.cc
 SRCS+=	xcodec_decoder.cc
 SRCS+=	xcodec_filter.cc
+SRCS+=	xcodec_scanner.cc
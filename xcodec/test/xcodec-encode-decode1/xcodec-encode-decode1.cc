@@ -56,14 +56,14 @@ main(void)
 			UUID uuid;
 			uuid.generate();
 
-			XCodecCache *cache = new XCodecMemoryCache(uuid);
+			XCodecCache *cache = new XCodecMemoryCache(uuid, 0);
 			XCodecEncoder encoder(cache);
 
 			Buffer out;
-			encoder.encode(&out, &in);
+			encoder.encode(out, in);
 
 			{
-				Test _(g, "Empty input buffer after encode.", in.empty());
+				Test _(g, "Input buffer left to the caller after encode.", in.equal(&original));
 			}
 
 			{
@@ -74,12 +74,13 @@ main(void)
 				Test _(g, "Reduction in size.", out.length() < original.length());
 			}
 
+			in.clear();
 			out.moveout(&in);
 
 			XCodecDecoder decoder(cache);
 			std::set<uint64_t> unknown_hashes;
 
-			bool ok = decoder.decode(&out, &in, unknown_hashes);
+			bool ok = decoder.decode(out, in, unknown_hashes);
 			{
 				Test _(g, "Decoder success.", ok);
 			}
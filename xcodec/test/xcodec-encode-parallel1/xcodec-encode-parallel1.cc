@@ -0,0 +1,130 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+// File:           xcodec-encode-parallel1.cc                                 //
+// Description:    parallel and sequential encoders give the same output      //
+// Project:        WANProxy XTech                                             //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+#include <set>
+#include <sstream>
+
+#include <common/buffer.h>
+#include <common/test.h>
+#include <common/uuid/uuid.h>
+
+#include <xcodec/xcodec.h>
+#include <xcodec/xcodec_cache.h>
+#include <xcodec/xcodec_decoder.h>
+#include <xcodec/xcodec_encoder.h>
+#include <xcodec/xcodec_scanner.h>
+
+/*
+ * Input sizes fed to both encoders in turn: small ones are always encoded
+ * sequentially, the others are scanned in chunks, some of them not ending
+ * on a chunk boundary.
+ */
+static const unsigned input_sizes[] = {
+	1000, 0x8000, 0x20000, 77777, 300, 0x40001, 5000, 0x10000, 123456, 0x8000
+};
+
+/*
+ * Pseudo-random blocks of a small alphabet, repeated from time to time at
+ * an arbitrary offset, so that the stream has both declarations and
+ * references.
+ */
+static void
+generate(Buffer *out, unsigned length, uint32_t *seed)
+{
+	uint8_t block[4096];
+	unsigned i, n;
+
+	while (length > 0) {
+		*seed = *seed * 1103515245 + 12345;
+		if ((*seed >> 16) % 3 == 0 && out->length() > sizeof block) {
+			n = (*seed >> 8) % (out->length() - sizeof block);
+			out->copyout(block, n, sizeof block);
+		} else {
+			for (i = 0; i < sizeof block; i++) {
+				*seed = *seed * 1103515245 + 12345;
+				block[i] = "wanproxy"[(*seed >> 16) % 8];
+			}
+		}
+		n = (length < sizeof block ? length : sizeof block);
+		out->append(block, n);
+		length -= n;
+	}
+}
+
+int
+main(void)
+{
+	xcodec_scanner.launch(3);
+
+	{
+		TestGroup g("/test/xcodec/encode-parallel/1", "XCodecEncoder::encode with scanner threads #1");
+
+		UUID uuid;
+		uuid.generate();
+
+		XCodecCache *serial_cache = new XCodecMemoryCache(uuid, 0);
+		XCodecCache *parallel_cache = new XCodecMemoryCache(uuid, 0);
+		XCodecCache *decoder_cache = new XCodecMemoryCache(uuid, 0);
+		XCodecEncoder serial(serial_cache);
+		XCodecEncoder parallel(parallel_cache, 4);
+		XCodecDecoder decoder(decoder_cache);
+
+		Buffer stream, rest, encoded;
+		uint32_t seed = 1;
+		unsigned i;
+		for (i = 0; i < sizeof input_sizes / sizeof input_sizes[0]; i++)
+			generate(&stream, input_sizes[i], &seed);
+		rest = stream;
+
+		for (i = 0; i < sizeof input_sizes / sizeof input_sizes[0]; i++) {
+			Buffer in;
+			in.append(rest, input_sizes[i]);
+			rest.skip(input_sizes[i]);
+
+			Buffer serial_in(in), serial_out;
+			Buffer parallel_in(in), parallel_out;
+			serial.encode(serial_out, serial_in);
+			parallel.encode(parallel_out, parallel_in);
+
+			std::ostringstream os;
+			os << "Same output for input #" << i << " of " << input_sizes[i] << " bytes.";
+			Test _(g, os.str(), parallel_out.equal(&serial_out));
+
+			encoded.append(parallel_out);
+		}
+
+		Buffer serial_out, parallel_out;
+		serial.flush(serial_out);
+		parallel.flush(parallel_out);
+		{
+			Test _(g, "Same output after flush.", parallel_out.equal(&serial_out));
+		}
+
+		encoded.append(parallel_out);
+
+		{
+			Test _(g, "Reduction in size.", encoded.length() < stream.length());
+		}
+
+		{
+			Buffer decoded;
+			std::set<uint64_t> unknown_hashes;
+			bool ok = decoder.decode(decoded, encoded, unknown_hashes);
+			Test _(g, "Decoder success.", ok && unknown_hashes.empty() && encoded.empty());
+			Test __(g, "Expected data.", decoded.equal(&stream));
+		}
+
+		delete serial_cache;
+		delete parallel_cache;
+		delete decoder_cache;
+	}
+
+	xcodec_scanner.stop();
+
+	return (0);
+}
@@ -30,6 +30,7 @@
 #include <map>
 
 #include <common/buffer.h>
+#include <common/thread/mutex.h>
 #include <common/uuid/uuid.h>
 #include <xcodec/xcodec.h>
 
@@ -86,6 +87,11 @@ namespace __gnu_cxx
 }
 
 
+/*
+ * Caches are shared by every connection using the same codec or peer UUID,
+ * possibly from several event shards and workers at once, so all the
+ * public entry points must be safe to call concurrently.
+ */
 class XCodecCache 
 {
 private:
@@ -95,9 +101,12 @@ private:
 	struct WindowItem {uint64_t hash; const uint8_t* data;};
 	WindowItem window_[XCODEC_WINDOW_COUNT];
 	unsigned cursor_;
+	Mutex window_lock_;
 #endif
 
 protected:
+	Mutex lock_;
+	
 	XCodecCache (const UUID& uuid, size_t size)
 	: uuid_(uuid),
 	  size_(size)
@@ -124,26 +133,39 @@ public:
 
 	virtual void enter (const uint64_t& hash, const Buffer& buf, unsigned off) = 0;
 	virtual bool lookup (const uint64_t& hash, Buffer& buf) = 0;
+	virtual bool contains (const uint64_t& hash) = 0;
 
 #ifdef USING_XCODEC_CACHE_RECENT_WINDOW
 protected:	
+	/*
+	 * The window keeps raw pointers into the cache storage.  Readers copy
+	 * the data out while holding the window lock, and any storage about to
+	 * be reused is first forgotten under that same lock.
+	 */
 	void remember (const uint64_t& hash, const uint8_t* data)
 	{
+		ScopedLock guard (window_lock_);
 		window_[cursor_].hash = hash;
 		window_[cursor_].data = data;
 		cursor_ = (cursor_ + 1) & (XCODEC_WINDOW_COUNT - 1);
 	}
 	
-	const uint8_t* find_recent (const uint64_t& hash)
+	bool recall (const uint64_t& hash, Buffer& buf)
 	{
 		WindowItem* w;
 		int n;
 		
+		ScopedLock guard (window_lock_);
 		for (w = window_, n = XCODEC_WINDOW_COUNT; n > 0; --n, ++w)
+		{
 			if (w->hash == hash)
-				return w->data;
+			{
+				buf.append (w->data, XCODEC_SEGMENT_LENGTH);
+				return true;
+			}
+		}
 				
-		return 0;
+		return false;
 	}
 	
 	void forget (const uint64_t& hash)
@@ -151,6 +173,7 @@ protected:
 		WindowItem* w;
 		int n;
 		
+		ScopedLock guard (window_lock_);
 		for (w = window_, n = XCODEC_WINDOW_COUNT; n > 0; --n, ++w)
 			if (w->hash == hash)
 				w->hash = 0;
@@ -159,10 +182,17 @@ protected:
 };
 
 
+#define XCODEC_CACHE_SHARDS  16  // must be binary
+
 class XCodecMemoryCache : public XCodecCache 
 {
 	typedef __gnu_cxx::hash_map<Hash64, const uint8_t*> segment_hash_map_t;
-	segment_hash_map_t segment_hash_map_;
+	struct Shard 
+	{
+		segment_hash_map_t map_;
+		RWLock lock_;
+	};
+	Shard shards_[XCODEC_CACHE_SHARDS];
 	LogHandle log_;
 	
 public:
@@ -174,31 +204,37 @@ public:
 	~XCodecMemoryCache()
 	{
 		segment_hash_map_t::const_iterator it;
-		for (it = segment_hash_map_.begin(); it != segment_hash_map_.end(); ++it)
-			delete[] it->second;
-		segment_hash_map_.clear();
+		for (int n = 0; n < XCODEC_CACHE_SHARDS; ++n)
+		{
+			for (it = shards_[n].map_.begin(); it != shards_[n].map_.end(); ++it)
+				delete[] it->second;
+			memory_budget.release (MemoryUseCaches, shards_[n].map_.size () * XCODEC_SEGMENT_LENGTH);
+			shards_[n].map_.clear();
+		}
 	}
 
 	void enter (const uint64_t& hash, const Buffer& buf, unsigned off)
 	{
-		ASSERT(log_, segment_hash_map_.find(hash) == segment_hash_map_.end());
+		Shard& shard = shard_of (hash);
+		ScopedWriteLock guard (shard.lock_);
+		if (shard.map_.find (hash) != shard.map_.end ())
+			return;
 		uint8_t* data = new uint8_t[XCODEC_SEGMENT_LENGTH];
 		buf.copyout (data, off, XCODEC_SEGMENT_LENGTH);
-		segment_hash_map_[hash] = data;
+		shard.map_[hash] = data;
+		memory_budget.charge (MemoryUseCaches, XCODEC_SEGMENT_LENGTH);
 	}
 
 	bool lookup (const uint64_t& hash, Buffer& buf)
 	{
 #ifdef USING_XCODEC_CACHE_RECENT_WINDOW
-		const uint8_t* data;
-		if ((data = find_recent (hash)))
-		{
-			buf.append (data, XCODEC_SEGMENT_LENGTH);
+		if (recall (hash, buf))
 			return true;
-		}
 #endif
-		segment_hash_map_t::const_iterator it = segment_hash_map_.find (hash);
-		if (it != segment_hash_map_.end ())
+		Shard& shard = shard_of (hash);
+		ScopedReadLock guard (shard.lock_);
+		segment_hash_map_t::const_iterator it = shard.map_.find (hash);
+		if (it != shard.map_.end ())
 		{
 			buf.append (it->second, XCODEC_SEGMENT_LENGTH);
 #ifdef USING_XCODEC_CACHE_RECENT_WINDOW
@@ -208,6 +244,19 @@ public:
 		}
 		return false;
 	}
+
+	bool contains (const uint64_t& hash)
+	{
+		Shard& shard = shard_of (hash);
+		ScopedReadLock guard (shard.lock_);
+		return (shard.map_.find (hash) != shard.map_.end ());
+	}
+
+private:
+	Shard& shard_of (const uint64_t& hash)
+	{
+		return shards_[(hash ^ (hash >> 32)) & (XCODEC_CACHE_SHARDS - 1)];
+	}
 };
 
 #endif /* !XCODEC_XCODEC_CACHE_H */
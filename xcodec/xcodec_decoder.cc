@@ -45,10 +45,14 @@
 XCodecDecoder::XCodecDecoder(XCodecCache* cache)
 : log_("/xcodec/decoder"),
   cache_(cache)
-{ }
+{
+	memory_budget.charge (MemoryUseCodecs, sizeof *this);
+}
 
 XCodecDecoder::~XCodecDecoder()
-{ }
+{
+	memory_budget.release (MemoryUseCodecs, sizeof *this);
+}
 
 /*
  * XXX These comments are out-of-date.
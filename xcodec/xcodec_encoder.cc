@@ -29,6 +29,7 @@
 #include <xcodec/xcodec.h>
 #include <xcodec/xcodec_cache.h>
 #include <xcodec/xcodec_encoder.h>
+#include <xcodec/xcodec_scanner.h>
 
 ////////////////////////////////////////////////////////////////////////////////
 //                                                                            //
@@ -40,16 +41,21 @@
 //                                                                            //
 ////////////////////////////////////////////////////////////////////////////////
 
-XCodecEncoder::XCodecEncoder(XCodecCache *cache)
+XCodecEncoder::XCodecEncoder(XCodecCache *cache, int threads)
 : log_("/xcodec/encoder"),
-  cache_(cache)
+  cache_(cache),
+  threads_(threads)
 {
 	  candidate_start_ = -1;
 	  candidate_symbol_ = 0;
+	  input_bytes_ = matched_bytes_ = 0;
+	  memory_budget.charge (MemoryUseCodecs, sizeof *this);
 }
 
 XCodecEncoder::~XCodecEncoder()
-{ }
+{
+	memory_budget.release (MemoryUseCodecs, sizeof *this);
+}
 
 /*
  * This takes a view of a data stream and turns it into a series of references
@@ -60,16 +66,52 @@ XCodecEncoder::~XCodecEncoder()
 void XCodecEncoder::encode (Buffer& output, Buffer& input)
 {
 	int off = source_.length ();
-	Buffer old;
+	unsigned pos = off, first = 0, bit;
+	std::vector<uint8_t> hits;
+	std::set<uint64_t> declared;
+	bool parallel, probe;
+	uint64_t hash;
+	
+	input_bytes_ += input.length ();
+	
+	/*
+	 * While memory is short the data is sent escaped, which any decoder
+	 * accepts, so it neither stays in source_ nor enters the cache.
+	 */
+	if (shedding ())
+	{
+		Buffer raw (input);
+		flush (output);
+		encode_escape (output, raw, raw.length ());
+		return;
+	}
 	
 	source_.append (input);
 
+	/*
+	 * Large inputs are hashed and probed beforehand by the scanner threads,
+	 * which leave one bit per position telling whether its hash may be in
+	 * the cache.  Only those positions, and hashes declared earlier in this
+	 * same walk, are looked up, so the decisions and the output are those of
+	 * the sequential walk.
+	 */
+	parallel = (threads_ > 1 && input.length () >= XCODEC_SCAN_MINIMUM && xcodec_scanner.running ());
+	if (parallel)
+	{
+		first = (pos > XCODEC_SEGMENT_LENGTH - 1 ? pos : XCODEC_SEGMENT_LENGTH - 1);
+		if (first < source_.length ())
+		{
+			hits.resize ((source_.length () - first + 7) / 8);
+			xcodec_scanner.scan (source_, first, source_.length (), &hits[0], cache_);
+		}
+	}
+
 	for (Buffer::SegmentIterator it = input.segments (); ! it.end (); it.next ()) 
 	{
 		const BufferSegment* seg = *it;
 		const uint8_t *p, *q = seg->end ();
 		
-		for (p = seg->data (); p < q; ++p) 
+		for (p = seg->data (); p < q; ++p, ++pos) 
 		{
 			/*
 			 * Add bytes to the hash until we have a complete hash.
@@ -89,87 +131,111 @@ void XCodecEncoder::encode (Buffer& output, Buffer& input)
 				 * and to look up possible past occurances of that
 				 * data in the XCodecCache.
 				 */
-				uint64_t hash = xcodec_hash_.mix ();
-
-				/*
-				 * If there is a pending candidate hash that wouldn't
-				 * overlap with the data that the rolling hash presently
-				 * covers, declare it now.
-				 */
-				if (candidate_start_ >= 0 && candidate_start_ + (XCODEC_SEGMENT_LENGTH * 2) <= off) 
+				hash = xcodec_hash_.mix ();
+				probe = true;
+				if (parallel)
 				{
-					encode_declaration (output, source_, candidate_start_, candidate_symbol_);
-					off -= (candidate_start_ + XCODEC_SEGMENT_LENGTH);
-					candidate_start_ = -1;
+					bit = pos - first;
+					probe = ((hits[bit / 8] & (1 << (bit % 8))) || declared.count (hash));
 				}
+				if (consider (output, off, hash, probe, (parallel ? &declared : 0)))
+					xcodec_hash_.reset();
+			}
+		}
+	}
+}
+
+/*
+ * Decides what to do with the segment ending at the current position,
+ * given its hash and whether it may be in the cache.  Returns true when a
+ * reference was emitted and the rolling hash has to start over.
+ */
+bool XCodecEncoder::consider (Buffer& output, int& off, uint64_t hash, bool probe, std::set<uint64_t>* declared)
+{
+	bool known = false;
+	
+	/*
+	 * If there is a pending candidate hash that wouldn't
+	 * overlap with the data that the rolling hash presently
+	 * covers, declare it now.
+	 */
+	if (candidate_start_ >= 0 && candidate_start_ + (XCODEC_SEGMENT_LENGTH * 2) <= off) 
+	{
+		encode_declaration (output, source_, candidate_start_, candidate_symbol_);
+		if (declared)
+			declared->insert (candidate_symbol_);
+		off -= (candidate_start_ + XCODEC_SEGMENT_LENGTH);
+		candidate_start_ = -1;
+	}
 
+	/*
+	 * Now attempt to encode this hash as a reference if it
+	 * has been defined before.
+	 */
+	
+	if (probe)
+	{
+		if ((known = cache_->lookup (hash, old_)))
+		{
+			/*
+			 * This segment already exists.  If it's
+			 * identical to this chunk of data, then that's
+			 * positively fantastic.
+			 */
+			bool ok = encode_reference (output, source_, off - XCODEC_SEGMENT_LENGTH, hash, old_);
+			old_.clear ();
+			if (ok) 
+			{
 				/*
-				 * Now attempt to encode this hash as a reference if it
-				 * has been defined before.
+				 * We have output any data before this hash
+				 * in escaped form, so any candidate hash
+				 * before it is invalid now.
 				 */
-				
-				if (cache_->lookup (hash, old))
-				{
-					/*
-					 * This segment already exists.  If it's
-					 * identical to this chunk of data, then that's
-					 * positively fantastic.
-					 */
-					if (encode_reference (output, source_, off - XCODEC_SEGMENT_LENGTH, hash, old)) 
-					{
-						/*
-						 * We have output any data before this hash
-						 * in escaped form, so any candidate hash
-						 * before it is invalid now.
-						 */
-						off = 0;
-						xcodec_hash_.reset();
-						candidate_start_ = -1;
-					}
-					else
-					{
-						/*
-						 * This hash isn't usable because it collides
-						 * with another, so keep looking for something
-						 * viable.
-						 */
-						DEBUG(log_) << "Collision in first pass.";
-					}
-					
-					old.clear ();
-				}
-				else
-				{
-					/*
-					 * Not defined before, it's a candidate for declaration
-					 * if we don't already have one.
-					 */
-					if (candidate_start_ >= 0) 
-					{
-						/*
-						 * We already have a hash that occurs earlier,
-						 * isn't a collision and includes data that's
-						 * covered by this hash, so don't remember it
-						 * and keep going.
-						 */
-						ASSERT(log_, candidate_start_ + (XCODEC_SEGMENT_LENGTH * 2) > off);
-					}
-					else
-					{
-						/*
-						 * The hash at this offset doesn't collide with any
-						 * other and is the first viable hash we've seen so far
-						 * in the stream, so remember it so that if we don't
-						 * find something to reference we can declare this one
-						 * for future use.
-						 */
-						candidate_start_ = off - XCODEC_SEGMENT_LENGTH;
-						candidate_symbol_ = hash;
-					}
-				}
+				off = 0;
+				candidate_start_ = -1;
+				return true;
 			}
+			
+			/*
+			 * This hash isn't usable because it collides
+			 * with another, so keep looking for something
+			 * viable.
+			 */
+			DEBUG(log_) << "Collision in first pass.";
 		}
 	}
+	
+	if (! known)
+	{
+		/*
+		 * Not defined before, it's a candidate for declaration
+		 * if we don't already have one.
+		 */
+		if (candidate_start_ >= 0) 
+		{
+			/*
+			 * We already have a hash that occurs earlier,
+			 * isn't a collision and includes data that's
+			 * covered by this hash, so don't remember it
+			 * and keep going.
+			 */
+			ASSERT(log_, candidate_start_ + (XCODEC_SEGMENT_LENGTH * 2) > off);
+		}
+		else
+		{
+			/*
+			 * The hash at this offset doesn't collide with any
+			 * other and is the first viable hash we've seen so far
+			 * in the stream, so remember it so that if we don't
+			 * find something to reference we can declare this one
+			 * for future use.
+			 */
+			candidate_start_ = off - XCODEC_SEGMENT_LENGTH;
+			candidate_symbol_ = hash;
+		}
+	}
+	
+	return false;
 }
 
 bool XCodecEncoder::flush (Buffer& output)
@@ -253,8 +319,30 @@ bool XCodecEncoder::encode_reference (Buffer& output, Buffer& input, unsigned st
 		uint64_t behash = BigEndian::encode (hash);
 		output.append (&behash);
 		input.skip (XCODEC_SEGMENT_LENGTH);
+		matched_bytes_ += XCODEC_SEGMENT_LENGTH;
 		return true;
 	}
 	
 	return false;
 }
+
+/*
+ * The streams that gain least from deduplication are the first to give it
+ * up: those under 1/8 of their input sent as references when the budget
+ * gets tight, and all but those over one half once it is exhausted.
+ */
+bool XCodecEncoder::shedding () const
+{
+	if (input_bytes_ < XCODEC_SHED_WARMUP)
+		return false;
+	
+	switch (memory_budget.pressure ())
+	{
+	case MemoryPressureTight:
+		return (matched_bytes_ * 8 < input_bytes_);
+	case MemoryPressureExhausted:
+		return (matched_bytes_ * 2 < input_bytes_);
+	default:
+		return false;
+	}
+}
@@ -26,6 +26,9 @@
 #ifndef	XCODEC_XCODEC_ENCODER_H
 #define	XCODEC_XCODEC_ENCODER_H
 
+#include <set>
+#include <vector>
+#include <common/memory_budget.h>
 #include <xcodec/xcodec_hash.h>
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -38,6 +41,8 @@
 //                                                                            //
 ////////////////////////////////////////////////////////////////////////////////
 
+#define XCODEC_SHED_WARMUP		0x40000		// input seen before the yield of a stream is judged
+
 class XCodecCache;
 
 class XCodecEncoder 
@@ -45,18 +50,24 @@ class XCodecEncoder
 	LogHandle log_;
 	XCodecCache* cache_;
 	Buffer source_;
+	Buffer old_;
 	XCodecHash xcodec_hash_;
 	int candidate_start_;
 	uint64_t candidate_symbol_;
+	int threads_;
+	uint64_t input_bytes_;
+	uint64_t matched_bytes_;
 
 public:
-	XCodecEncoder(XCodecCache*);
+	XCodecEncoder(XCodecCache*, int threads = 0);
 	~XCodecEncoder();
 
 	void encode (Buffer&, Buffer&);
 	bool flush (Buffer&);
 	
 private:
+	bool shedding () const;
+	bool consider (Buffer&, int&, uint64_t, bool, std::set<uint64_t>*);
 	void encode_declaration (Buffer&, Buffer&, unsigned, uint64_t);
 	void encode_escape (Buffer&, Buffer&, unsigned);
 	bool encode_reference (Buffer&, Buffer&, unsigned, uint64_t, Buffer&);
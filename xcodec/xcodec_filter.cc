@@ -27,6 +27,7 @@
 #include <common/endian.h>
 #include <common/count_filter.h>
 #include <event/event_system.h>
+#include <event/worker_pool.h>
 #include "xcodec_filter.h"
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -139,7 +140,7 @@ bool EncodeFilter::consume (Buffer& buf, int flg)
 		cache_->identifier().encode (output);
 		output.append (&mb);
 
-		if (! (encoder_ = new XCodecEncoder (cache_)))
+		if (! (encoder_ = new XCodecEncoder (cache_, (codec_ ? codec_->encoder_threads_ : 0))))
 			return false;
 	}
 
@@ -151,7 +152,7 @@ bool EncodeFilter::consume (Buffer& buf, int flg)
 		{
 			if (wait_action_)
 				wait_action_->cancel ();
-			wait_action_ = event_system.track (150, StreamModeWait, callback (this, &EncodeFilter::on_read_timeout));
+			wait_action_ = EventSystem::current ().track (150, StreamModeWait, callback (this, &EncodeFilter::on_read_timeout));
 		}
 		else
 			encoder_->flush (enc);
@@ -265,7 +266,7 @@ bool DecodeFilter::consume (Buffer& buf, int flg)
 		      pending_.skip (sizeof mb);
 
 				if (! (decoder_cache_ = wanproxy.find_cache (uuid)))
-					decoder_cache_ = wanproxy.add_cache (codec_->cache_type_, codec_->cache_path_, mb, uuid);
+					decoder_cache_ = wanproxy.add_cache (codec_->cache_type_, codec_->cache_path_, mb, uuid, codec_->replica_);
 
 		      ASSERT(log_, decoder_ == NULL);
 				if (decoder_cache_)
@@ -401,58 +402,8 @@ bool DecodeFilter::consume (Buffer& buf, int flg)
 			return false;
 		}
 
-		if (frame_buffer_.empty ()) 
-			continue;
-
-		if (! unknown_hashes_.empty ()) 
-      {
-			DEBUG(log_) << "Waiting for unknown hashes to continue processing data.";
-			continue;
-		}
-
-		Buffer output;
-		if (! decoder_->decode (output, frame_buffer_, unknown_hashes_)) 
-      {
-			ERROR(log_) << "Decoder exiting with error.";
+		if (! advance (flg))
 			return false;
-		}
-
-		if (! output.empty ()) 
-      {
-			ASSERT(log_, ! flushing_);
-			if (! produce (output, flg))
-				return false;
-		} 
-      else 
-      {
-			/*
-			 * We should only get no output from the decoder if
-			 * we're waiting on the next frame or we need an
-			 * unknown hash.  It would be nice to make the
-			 * encoder framing aware so that it would not end
-			 * up with encoded data that straddles a frame
-			 * boundary.  (Fixing that would also allow us to
-			 * simplify length checking within the decoder
-			 * considerably.)
-			 */
-			ASSERT(log_, !frame_buffer_.empty() || !unknown_hashes_.empty());
-		}
-
-		Buffer ask;
-		std::set<uint64_t>::const_iterator it;
-		for (it = unknown_hashes_.begin(); it != unknown_hashes_.end(); ++it) 
-      {
-			uint64_t hash = *it;
-			hash = BigEndian::encode (hash);
-			ask.append (XCODEC_PIPE_OP_ASK);
-			ask.append (&hash);
-		}
-		if (! ask.empty ()) 
-      {
-			DEBUG(log_) << "Sending <ASK>s.";
-			if (! upstream_->produce (ask))
-				return false;
-		}
 	}
 
    if (received_eos_ && ! sent_eos_ack_ && frame_buffer_.empty ()) 
@@ -511,6 +462,131 @@ bool DecodeFilter::consume (Buffer& buf, int flg)
 	return true;
 }
 
+/*
+ * Decodes what the frames received allow.  Hashes still unknown are looked
+ * up first in the segment service of the local network, if there is one,
+ * and asked to the peer only when not found there.  Chains run by workers
+ * always ask the peer, as the answer has to come back to the thread the
+ * filter lives on.
+ */
+bool DecodeFilter::advance (int flg)
+{
+	if (frame_buffer_.empty () || query_) 
+		return true;
+
+	if (! unknown_hashes_.empty ()) 
+	{
+		DEBUG(log_) << "Waiting for unknown hashes to continue processing data.";
+		return true;
+	}
+
+	Buffer output;
+	if (! decoder_->decode (output, frame_buffer_, unknown_hashes_)) 
+	{
+		ERROR(log_) << "Decoder exiting with error.";
+		return false;
+	}
+
+	if (! output.empty ()) 
+	{
+		ASSERT(log_, ! flushing_);
+		if (! produce (output, flg))
+			return false;
+	} 
+	else
+	{
+		/*
+		 * We should only get no output from the decoder if
+		 * we're waiting on the next frame or we need an
+		 * unknown hash.  It would be nice to make the
+		 * encoder framing aware so that it would not end
+		 * up with encoded data that straddles a frame
+		 * boundary.  (Fixing that would also allow us to
+		 * simplify length checking within the decoder
+		 * considerably.)
+		 */
+		ASSERT(log_, !frame_buffer_.empty() || !unknown_hashes_.empty());
+	}
+
+	if (unknown_hashes_.empty ())
+		return true;
+
+	if (codec_ && codec_->segments_ && ! Worker::current ())
+	{
+		query_ = new SegmentQuery (decoder_cache_->identifier (), callback (this, &DecodeFilter::resume));
+		query_->hashes_.assign (unknown_hashes_.begin (), unknown_hashes_.end ());
+		DEBUG(log_) << "Looking up unknown hashes in the segment service.";
+		codec_->segments_->query (query_);
+		return true;
+	}
+
+	return ask ();
+}
+
+bool DecodeFilter::ask ()
+{
+	Buffer ask;
+	std::set<uint64_t>::const_iterator it;
+	for (it = unknown_hashes_.begin(); it != unknown_hashes_.end(); ++it) 
+	{
+		uint64_t hash = *it;
+		hash = BigEndian::encode (hash);
+		ask.append (XCODEC_PIPE_OP_ASK);
+		ask.append (&hash);
+	}
+	if (! ask.empty ()) 
+	{
+		DEBUG(log_) << "Sending <ASK>s.";
+		if (! upstream_->produce (ask))
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Takes what the segment service found, asks the peer for the rest and
+ * goes on decoding if nothing is missing any more.
+ */
+void DecodeFilter::resume ()
+{
+	SegmentQuery* q = query_;
+	Buffer& found = q->segments_;
+	bool ok = true;
+
+	query_ = 0;
+	while (ok && found.length () >= XCODEC_SEGMENT_LENGTH)
+	{
+		uint8_t data[XCODEC_SEGMENT_LENGTH];
+		found.copyout (data, XCODEC_SEGMENT_LENGTH);
+		uint64_t hash = XCodecHash::hash (data);
+		if (unknown_hashes_.erase (hash))
+		{
+			Buffer old;
+			if (! decoder_cache_->lookup (hash, old))
+				decoder_cache_->enter (hash, found, 0);
+			else if (! old.equal (data, sizeof data))
+				ERROR(log_) << "Collision in segment from the segment service.", ok = false;
+		}
+		found.skip (XCODEC_SEGMENT_LENGTH);
+	}
+	q->release ();
+
+	if (ok)
+	{
+		if (! unknown_hashes_.empty ())
+			ok = ask ();
+		else
+		{
+			Buffer none;
+			ok = (advance (0) && consume (none));
+		}
+	}
+	
+	if (! ok && ! flushing_)
+		flush (0);
+}
+
 void DecodeFilter::flush (int flg)
 {
 	flushing_ = true;
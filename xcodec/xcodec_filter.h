@@ -68,21 +68,30 @@ private:
 	bool sent_eos_ack_;
 	bool received_eos_ack_;
 	bool upflushed_;
+	SegmentQuery* query_;
    
 public:
 	DecodeFilter (const LogHandle& log, WANProxyCodec* cdc) : LogisticFilter (log) 
    { 
       codec_ = cdc; encoder_cache_ = (cdc ? cdc->xcache_ : 0); decoder_ = 0; decoder_cache_ = 0;   
       received_eos_ = sent_eos_ack_ = received_eos_ack_ = upflushed_ = false; 
+      query_ = 0;
    }
 	
 	~DecodeFilter ()  
 	{ 
+		if (query_)
+			query_->cancel ();
 		delete decoder_; 
 	}
   
    virtual bool consume (Buffer& buf, int flg = 0);
    virtual void flush (int flg);
+	void resume ();
+
+private:
+	bool advance (int flg);
+	bool ask ();
 };
 
 #endif /* !XCODEC_FILTER_H */
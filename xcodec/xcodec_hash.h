@@ -28,22 +28,23 @@
 
 #include <strings.h>
 
+/*
+ * The outgoing byte of each roll is taken from a ring of the raw bytes
+ * in the window, and its two derived values are recomputed from it, so
+ * the whole state of a hash is a little over one segment in size.
+ */
 class XCodecHash {
 	struct RollingHash {
 		uint32_t sum1_;					/* Really <16-bit.  */
 		uint32_t sum2_;					/* Really <32-bit.  */
-		uint32_t buffer_[XCODEC_SEGMENT_LENGTH];	/* Really >8-bit.  */
 
 		RollingHash(void)
 		: sum1_(0),
-		  sum2_(0),
-		  buffer_()
+		  sum2_(0)
 		{ }
 
-		void add(uint32_t ch, unsigned start)
+		void add(uint32_t ch)
 		{
-			buffer_[start] = ch;
-
 			sum1_ += ch;
 			sum2_ += sum1_;
 		}
@@ -54,17 +55,11 @@ class XCodecHash {
 			sum2_ = 0;
 		}
 
-		void roll(uint32_t ch, unsigned start)
+		void roll(uint32_t ch, uint32_t dead)
 		{
-			uint32_t dead;
-
-			dead = buffer_[start];
-
 			sum1_ -= dead;
 			sum2_ -= dead * XCODEC_SEGMENT_LENGTH;
 
-			buffer_[start] = ch;
-
 			sum1_ += ch;
 			sum2_ += sum1_;
 		}
@@ -72,6 +67,7 @@ class XCodecHash {
 
 	RollingHash bytes_;
 	RollingHash bits_;
+	uint8_t window_[XCODEC_SEGMENT_LENGTH];
 	unsigned start_;
 #ifndef NDEBUG
 	unsigned length_;
@@ -92,15 +88,13 @@ public:
 
 	void add(uint8_t ch)
 	{
-		unsigned bit = ffs(ch);
-		unsigned word = (unsigned)ch + 1;
-
 #ifndef NDEBUG
 		ASSERT("/xcodec/hash", length_ < XCODEC_SEGMENT_LENGTH);
 #endif
 
-		bytes_.add(word, start_);
-		bits_.add(bit, start_);
+		window_[start_] = ch;
+		bytes_.add((unsigned)ch + 1);
+		bits_.add(ffs(ch));
 
 #ifndef NDEBUG
 		length_++;
@@ -121,15 +115,15 @@ public:
 
 	void roll(uint8_t ch)
 	{
-		unsigned bit = ffs(ch);
-		unsigned word = (unsigned)ch + 1;
+		uint8_t dead = window_[start_];
 
 #ifndef NDEBUG
 		ASSERT("/xcodec/hash", length_ == XCODEC_SEGMENT_LENGTH);
 #endif
 
-		bytes_.roll(word, start_);
-		bits_.roll(bit, start_);
+		window_[start_] = ch;
+		bytes_.roll((unsigned)ch + 1, (unsigned)dead + 1);
+		bits_.roll(ffs(ch), ffs(dead));
 
 		start_ = (start_ + 1) % XCODEC_SEGMENT_LENGTH;
 	}
@@ -0,0 +1,194 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+// File:           xcodec_scanner.cc                                          //
+// Description:    parallel hashing and cache probing for the xcodec encoder  //
+// Project:        WANProxy XTech                                             //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+#include <string.h>
+#include <common/buffer.h>
+#include <xcodec/xcodec.h>
+#include <xcodec/xcodec_cache.h>
+#include <xcodec/xcodec_hash.h>
+#include <xcodec/xcodec_scanner.h>
+
+XCodecScanner::XCodecScanner () : log_ ("/xcodec/scanner"), stopping_ (false)
+{
+	pthread_mutex_init (&mutex_, 0);
+	pthread_cond_init (&ready_, 0);
+}
+
+XCodecScanner::~XCodecScanner ()
+{
+	stop ();
+	pthread_mutex_destroy (&mutex_);
+	pthread_cond_destroy (&ready_);
+}
+
+bool XCodecScanner::launch (int count)
+{
+	ScopedLock guard (lock_);
+
+	while ((int) helpers_.size () < count)
+	{
+		Helper* h = new Helper (*this);
+		if (! h->start ())
+		{
+			ERROR(log_) << "Unable to start hashing thread.";
+			delete h;
+			break;
+		}
+		helpers_.push_back (h);
+	}
+
+	return (! helpers_.empty ());
+}
+
+void XCodecScanner::stop ()
+{
+	ScopedLock guard (lock_);
+
+	if (helpers_.empty ())
+		return;
+
+	pthread_mutex_lock (&mutex_);
+	stopping_ = true;
+	pthread_cond_broadcast (&ready_);
+	pthread_mutex_unlock (&mutex_);
+
+	for (unsigned n = 0; n < helpers_.size (); ++n)
+	{
+		helpers_[n]->stop ();
+		delete helpers_[n];
+	}
+	helpers_.clear ();
+	stopping_ = false;
+}
+
+/*
+ * The caller takes part in the work, so a scan always progresses even if
+ * every helper is busy with the chunks of other connections.  Bit n of
+ * hits stands for position from + n; chunks start on a byte of it, so no
+ * two tasks write the same byte.
+ */
+void XCodecScanner::scan (const Buffer& data, unsigned from, unsigned to, uint8_t* hits, XCodecCache* cache)
+{
+	Batch batch;
+	Task task;
+	unsigned pos;
+
+	batch.pending_ = 0;
+	pthread_cond_init (&batch.done_, 0);
+	memset (hits, 0, (to - from + 7) / 8);
+	task.data_ = &data, task.base_ = from, task.hits_ = hits;
+	task.cache_ = cache, task.batch_ = &batch;
+
+	pthread_mutex_lock (&mutex_);
+	for (pos = from; to - pos > XCODEC_SCAN_CHUNK && ! helpers_.empty (); pos += XCODEC_SCAN_CHUNK)
+	{
+		task.from_ = pos, task.to_ = pos + XCODEC_SCAN_CHUNK;
+		queue_.push_back (task);
+		batch.pending_++;
+	}
+	if (batch.pending_ > 0)
+		pthread_cond_broadcast (&ready_);
+	pthread_mutex_unlock (&mutex_);
+
+	task.from_ = pos, task.to_ = to;
+	run (task);
+
+	pthread_mutex_lock (&mutex_);
+	while (batch.pending_ > 0)
+	{
+		if (! queue_.empty ())
+		{
+			task = queue_.front ();
+			queue_.pop_front ();
+			pthread_mutex_unlock (&mutex_);
+			run (task);
+			pthread_mutex_lock (&mutex_);
+			if (--task.batch_->pending_ == 0 && task.batch_ != &batch)
+				pthread_cond_signal (&task.batch_->done_);
+			continue;
+		}
+		pthread_cond_wait (&batch.done_, &mutex_);
+	}
+	pthread_mutex_unlock (&mutex_);
+
+	pthread_cond_destroy (&batch.done_);
+}
+
+void XCodecScanner::serve ()
+{
+	Task task;
+
+	pthread_mutex_lock (&mutex_);
+	while (1)
+	{
+		while (queue_.empty () && ! stopping_)
+			pthread_cond_wait (&ready_, &mutex_);
+		if (stopping_)
+			break;
+		task = queue_.front ();
+		queue_.pop_front ();
+		pthread_mutex_unlock (&mutex_);
+
+		run (task);
+
+		pthread_mutex_lock (&mutex_);
+		if (--task.batch_->pending_ == 0)
+			pthread_cond_signal (&task.batch_->done_);
+	}
+	pthread_mutex_unlock (&mutex_);
+}
+
+void XCodecScanner::run (const Task& task)
+{
+	XCodecHash xcodec_hash;
+	Buffer::SegmentIterator it = task.data_->segments ();
+	const BufferSegment* seg = 0;
+	const uint8_t *p = 0, *q = 0;
+	unsigned n, start, bit;
+
+	if (task.from_ >= task.to_)
+		return;
+
+	/*
+	 * Find the segment holding the first byte of the window that ends at
+	 * the start of the chunk.
+	 */
+	start = task.from_ + 1 - XCODEC_SEGMENT_LENGTH;
+	for (n = 0; ! it.end (); it.next (), n += seg->length ())
+	{
+		seg = *it;
+		if (n + seg->length () > start)
+		{
+			p = seg->data () + (start - n), q = seg->end ();
+			break;
+		}
+	}
+
+	for (n = 0; n < XCODEC_SEGMENT_LENGTH; ++n)
+	{
+		if (p == q)
+			it.next (), seg = *it, p = seg->data (), q = seg->end ();
+		xcodec_hash.add (*p++);
+	}
+
+	for (n = task.from_; ; )
+	{
+		if (task.cache_->contains (xcodec_hash.mix ()))
+		{
+			bit = n - task.base_;
+			task.hits_[bit / 8] |= (1 << (bit % 8));
+		}
+		if (++n >= task.to_)
+			break;
+		if (p == q)
+			it.next (), seg = *it, p = seg->data (), q = seg->end ();
+		xcodec_hash.roll (*p++);
+	}
+}
+
+XCodecScanner xcodec_scanner;
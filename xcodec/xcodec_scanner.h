@@ -0,0 +1,87 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+// File:           xcodec_scanner.h                                           //
+// Description:    parallel hashing and cache probing for the xcodec encoder  //
+// Project:        WANProxy XTech                                             //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef	XCODEC_XCODEC_SCANNER_H
+#define	XCODEC_XCODEC_SCANNER_H
+
+#include <pthread.h>
+#include <deque>
+#include <vector>
+#include <common/thread/mutex.h>
+#include <common/thread/thread.h>
+
+#define XCODEC_SCAN_CHUNK		0x4000		// bytes of input hashed by each task, a multiple of 8
+#define XCODEC_SCAN_MINIMUM	0x8000		// smaller inputs are hashed inline
+
+class Buffer;
+class XCodecCache;
+
+/*
+ * Computes the rolling hash that ends at every position of a range of a
+ * buffer and probes the cache for it, reading the segments in place.  The
+ * range is cut into chunks that are spread over helper threads; each chunk
+ * starts its own hash from the XCODEC_SEGMENT_LENGTH bytes preceding it, so
+ * the result is the same as a single sequential pass.  Only a bit per
+ * position is kept, set when the hash is in the cache.  Probing is only a
+ * hint: the encoder still does the real lookup, in stream order, for the
+ * positions found here.
+ */
+class XCodecScanner
+{
+	struct Batch
+	{
+		int pending_;
+		pthread_cond_t done_;
+	};
+
+	struct Task
+	{
+		const Buffer* data_;
+		unsigned base_, from_, to_;
+		uint8_t* hits_;
+		XCodecCache* cache_;
+		Batch* batch_;
+	};
+
+	class Helper : public Thread
+	{
+		XCodecScanner& owner_;
+
+	public:
+		Helper (XCodecScanner& owner) : Thread ("XCodecScanner"), owner_ (owner)	{ }
+
+		virtual void main ()		{ owner_.serve (); }
+	};
+
+	LogHandle log_;
+	Mutex lock_;
+	pthread_mutex_t mutex_;
+	pthread_cond_t ready_;
+	std::deque<Task> queue_;
+	std::vector<Helper*> helpers_;
+	bool stopping_;
+
+public:
+	XCodecScanner ();
+	~XCodecScanner ();
+
+	bool launch (int count);
+	void stop ();
+	bool running () const		{ return (! helpers_.empty ()); }
+
+	void scan (const Buffer& data, unsigned from, unsigned to, uint8_t* hits, XCodecCache* cache);
+
+private:
+	void serve ();
+	void complete (Batch* batch);
+	static void run (const Task& task);
+};
+
+extern XCodecScanner xcodec_scanner;
+
+#endif /* !XCODEC_XCODEC_SCANNER_H */
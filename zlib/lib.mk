@@ -1,5 +1,6 @@
 VPATH+=	${TOPDIR}/zlib
 
 SRCS+=	zlib_filter.cc
+SRCS+=	zlib_pool.cc
 
 LDADD+=	-lz
@@ -0,0 +1,153 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+// File:           zlib-deflate-parallel1.cc                                  //
+// Description:    blocks compressed in parallel make a valid zlib stream     //
+// Project:        WANProxy XTech                                             //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+#include <sstream>
+#include <vector>
+
+#include <common/buffer.h>
+#include <common/test.h>
+
+#include <zlib/zlib_filter.h>
+#include <zlib/zlib_pool.h>
+
+/*
+ * Input sizes fed to the filter in turn: small ones are compressed inline,
+ * the others in blocks, some of them not ending on a block boundary.
+ */
+static const unsigned input_sizes[] = {
+	1000, 0x8000, 0x20000, 77777, 300, 0x40001, 5000, 0x10000, 123456, 0x8000
+};
+
+/*
+ * Keeps whatever reaches the end of a chain of filters.
+ */
+class Collector : public Filter
+{
+public:
+	Buffer data_;
+	bool flushed_;
+
+	Collector () : flushed_ (false)						{ }
+
+	virtual bool consume (Buffer& buf, int)			{ data_.append (buf); buf.clear (); return true; }
+	virtual void flush (int)								{ flushed_ = true; }
+};
+
+/*
+ * Pseudo-random text of a small alphabet, repeated from time to time at an
+ * arbitrary offset, so that blocks refer to the window before them.
+ */
+static void
+generate(Buffer *out, unsigned length, uint32_t *seed)
+{
+	uint8_t block[4096];
+	unsigned i, n;
+
+	while (length > 0) {
+		*seed = *seed * 1103515245 + 12345;
+		if ((*seed >> 16) % 3 == 0 && out->length() > sizeof block) {
+			n = (*seed >> 8) % (out->length() - sizeof block);
+			out->copyout(block, n, sizeof block);
+		} else {
+			for (i = 0; i < sizeof block; i++) {
+				*seed = *seed * 1103515245 + 12345;
+				block[i] = "wanproxy"[(*seed >> 16) % 8];
+			}
+		}
+		n = (length < sizeof block ? length : sizeof block);
+		out->append(block, n);
+		length -= n;
+	}
+}
+
+/*
+ * Inflates a whole zlib stream with zlib itself, which also checks the
+ * Adler-32 of the trailer.
+ */
+static bool
+inflate_all(const Buffer *in, size_t expected, Buffer *out)
+{
+	std::vector<uint8_t> src(in->length()), dst(expected + 1);
+	uLongf len = dst.size();
+
+	in->copyout(&src[0], src.size());
+	if (uncompress(&dst[0], &len, &src[0], src.size()) != Z_OK)
+		return (false);
+	out->append(&dst[0], len);
+	return (true);
+}
+
+int
+main(void)
+{
+	deflate_pool.launch(3);
+
+	{
+		TestGroup g("/test/zlib/deflate-parallel/1", "DeflateFilter with compression threads #1");
+
+		Buffer stream;
+		uint32_t seed = 1;
+		unsigned i;
+		for (i = 0; i < sizeof input_sizes / sizeof input_sizes[0]; i++)
+			generate(&stream, input_sizes[i], &seed);
+
+		for (int level = 1; level <= 9; level += 5) {
+			DeflateFilter deflater(level, 4);
+			Collector compressed;
+			deflater.chain(&compressed);
+
+			InflateFilter inflater;
+			Collector inflated;
+			inflater.chain(&inflated);
+
+			Buffer rest(stream);
+			for (i = 0; i < sizeof input_sizes / sizeof input_sizes[0]; i++) {
+				Buffer in;
+				in.append(rest, input_sizes[i]);
+				rest.skip(input_sizes[i]);
+
+				size_t before = compressed.data_.length();
+				std::ostringstream os;
+				os << "Level " << level << ", input #" << i << " of " << input_sizes[i] << " bytes compressed.";
+				Test _(g, os.str(), deflater.consume(in) && compressed.data_.length() > before);
+
+				/*
+				 * Every input ends on a sync flush, so all of it can be
+				 * inflated before the next one is given.
+				 */
+				Buffer part(compressed.data_);
+				if (before > 0)
+					part.skip(before);
+				size_t had = inflated.data_.length();
+				std::ostringstream is;
+				is << "Level " << level << ", input #" << i << " inflated as it comes.";
+				Test __(g, is.str(), inflater.consume(part) && inflated.data_.length() == had + input_sizes[i]);
+			}
+
+			deflater.flush(0);
+			{
+				Test _(g, "Flush reaches the end of the chain.", compressed.flushed_);
+			}
+			{
+				Test _(g, "Reduction in size.", compressed.data_.length() < stream.length());
+			}
+			{
+				Test _(g, "Inflated as it came.", inflated.data_.equal(&stream));
+			}
+			{
+				Buffer out;
+				Test _(g, "Whole stream inflates with a valid checksum.", inflate_all(&compressed.data_, stream.length(), &out));
+				Test __(g, "Expected data.", out.equal(&stream));
+			}
+		}
+	}
+
+	deflate_pool.stop();
+
+	return (0);
+}
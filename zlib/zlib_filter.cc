@@ -8,11 +8,12 @@
 //                                                                            //
 ////////////////////////////////////////////////////////////////////////////////
 
+#include <common/endian.h>
 #include "zlib_filter.h"
 
 // Deflate
 
-DeflateFilter::DeflateFilter (int level) : BufferedFilter ("/zlib/deflate")
+DeflateFilter::DeflateFilter (int level, int threads) : BufferedFilter ("/zlib/deflate")
 {
 	stream_.zalloc = Z_NULL;
 	stream_.zfree = Z_NULL;
@@ -21,15 +22,21 @@ DeflateFilter::DeflateFilter (int level) : BufferedFilter ("/zlib/deflate")
 	stream_.avail_in = 0;
 	stream_.next_out = outbuf;
 	stream_.avail_out = sizeof outbuf;
+	level_ = level;
+	parallel_ = (threads > 1);
+	started_ = false;
+	adler_ = adler32 (0L, Z_NULL, 0);
 
-	if (deflateInit (&stream_, level) != Z_OK)
+	if ((parallel_ ? deflateInit2 (&stream_, level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) : deflateInit (&stream_, level)) != Z_OK)
 		CRITICAL(log_) << "Could not initialize deflate stream.";
+	memory_budget.charge (MemoryUseCodecs, state_size ());
 }
 
 DeflateFilter::~DeflateFilter ()
 {
 	if (deflateEnd (&stream_) != Z_OK)
 		ERROR(log_) << "Deflate stream did not end cleanly.";
+	memory_budget.release (MemoryUseCodecs, state_size ());
 }
 
 bool DeflateFilter::consume (Buffer& buf, int flg)
@@ -37,6 +44,9 @@ bool DeflateFilter::consume (Buffer& buf, int flg)
 	const BufferSegment* seg;
 	int cnt = 0, i = 0, rv;
 	
+	if (parallel_)
+		return (consume_blocks (buf) && produce (pending_, flg));
+
 	for (Buffer::SegmentIterator it = buf.segments (); ! it.end (); it.next (), ++cnt);
 	pending_.clear ();
 
@@ -73,11 +83,22 @@ void DeflateFilter::flush (int flg)
 	stream_.next_in = Z_NULL;
 	stream_.avail_in = 0;
 	
-	while (deflate (&stream_, Z_FINISH) == Z_OK && stream_.avail_out < sizeof outbuf)
-	{	
-		pending_.append (outbuf, sizeof outbuf - stream_.avail_out);
-		stream_.next_out = outbuf;
-		stream_.avail_out = sizeof outbuf;
+	if (parallel_)
+	{
+		Buffer empty;
+		if (! started_)
+			consume_blocks (empty);
+		if (deflate_pending (Z_FINISH))
+			BigEndian::append (&pending_, (uint32_t) adler_);
+	}
+	else
+	{
+		while (deflate (&stream_, Z_FINISH) == Z_OK && stream_.avail_out < sizeof outbuf)
+		{	
+			pending_.append (outbuf, sizeof outbuf - stream_.avail_out);
+			stream_.next_out = outbuf;
+			stream_.avail_out = sizeof outbuf;
+		}
 	}
 	
 	if (! pending_.empty ())
@@ -86,6 +107,105 @@ void DeflateFilter::flush (int flg)
 	Filter::flush (flg);
 }
 
+/*
+ * Inputs large enough are compressed by the deflate pool, the blocks primed
+ * with what precedes them, after which the dictionary of the stream is set
+ * to the end of the input so that small ones that follow still refer to
+ * it.  Every input ends with a sync flush, which is what makes the stream
+ * accept a new dictionary between them.
+ */
+bool DeflateFilter::consume_blocks (Buffer& buf)
+{
+	unsigned history = history_.length (), length = buf.length (), n;
+	uint16_t header;
+
+	pending_.clear ();
+	if (! started_)
+	{
+		header = (Z_DEFLATED + ((MAX_WBITS - 8) << 4)) << 8;
+		header |= (level_ == Z_DEFAULT_COMPRESSION || level_ == 6 ? 2 : level_ < 2 ? 0 : level_ < 6 ? 1 : 3) << 6;
+		header += 31 - header % 31;
+		BigEndian::append (&pending_, header);
+		started_ = true;
+	}
+
+	if (length >= DEFLATE_PARALLEL_MINIMUM && deflate_pool.running ())
+	{
+		std::vector<uint8_t> data (history + length);
+		history_.copyout (&data[0], history);
+		buf.copyout (&data[history], length);
+
+		if (! deflate_pool.compress (&data[history], history, length, level_, &pending_, &adler_))
+		{
+			ERROR(log_) << "Could not compress blocks in parallel.";
+			return false;
+		}
+
+		n = (data.size () < DEFLATE_WINDOW ? data.size () : DEFLATE_WINDOW);
+		if (deflateSetDictionary (&stream_, &data[data.size () - n], n) != Z_OK)
+		{
+			ERROR(log_) << "Could not carry the dictionary over.";
+			return false;
+		}
+	}
+	else if (length > 0)
+	{
+		for (Buffer::SegmentIterator it = buf.segments (); ! it.end (); it.next ()) 
+		{
+			const BufferSegment* seg = *it;
+			adler_ = adler32 (adler_, seg->data (), seg->length ());
+			stream_.next_in = (Bytef*) (uintptr_t) seg->data ();
+			stream_.avail_in = seg->length ();
+			if (! deflate_pending (Z_NO_FLUSH))
+				return false;
+		}
+		if (! deflate_pending (Z_SYNC_FLUSH))
+			return false;
+	}
+
+	history_.append (buf);
+	if (history_.length () > DEFLATE_WINDOW)
+		history_.skip (history_.length () - DEFLATE_WINDOW);
+
+	return true;
+}
+
+/*
+ * Runs the stream until it has taken all the input and, unless more is to
+ * come, given out all it has.
+ */
+bool DeflateFilter::deflate_pending (int mode)
+{
+	bool full;
+	int rv;
+
+	do
+	{
+		rv = deflate (&stream_, mode);
+		if (rv == Z_STREAM_ERROR || rv == Z_DATA_ERROR || rv == Z_MEM_ERROR) 
+		{
+			ERROR(log_) << "deflate(): " << zError(rv);
+			return false;
+		}
+
+		full = (stream_.avail_out == 0);
+		if (stream_.avail_out < sizeof outbuf)
+		{
+			pending_.append (outbuf, sizeof outbuf - stream_.avail_out);
+			stream_.next_out = outbuf;
+			stream_.avail_out = sizeof outbuf;
+		}
+	}
+	while (stream_.avail_in > 0 || (full && mode != Z_NO_FLUSH));
+
+	return true;
+}
+
+size_t DeflateFilter::state_size () const
+{
+	return (sizeof *this + DEFLATE_STATE_SIZE + (parallel_ ? DEFLATE_WINDOW : 0));
+}
+
 // Inflate
 
 InflateFilter::InflateFilter () : BufferedFilter ("/zlib/inflate")
@@ -100,12 +220,14 @@ InflateFilter::InflateFilter () : BufferedFilter ("/zlib/inflate")
 
 	if (inflateInit (&stream_) != Z_OK)
 		CRITICAL(log_) << "Could not initialize inflate stream.";
+	memory_budget.charge (MemoryUseCodecs, sizeof *this + INFLATE_STATE_SIZE);
 }
 
 InflateFilter::~InflateFilter()
 {
 	if (inflateEnd (&stream_) != Z_OK)
 		ERROR(log_) << "Inflate stream did not end cleanly.";
+	memory_budget.release (MemoryUseCodecs, sizeof *this + INFLATE_STATE_SIZE);
 }
 
 bool InflateFilter::consume (Buffer& buf, int flg)
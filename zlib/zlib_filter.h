@@ -13,22 +13,41 @@
 
 #include <common/filter.h>
 #include <zlib.h>
+#include <zlib/zlib_pool.h>
 
 #define	DEFLATE_CHUNK_SIZE	0x10000
 #define	INFLATE_CHUNK_SIZE	0x10000
 
+#define	DEFLATE_STATE_SIZE	0x42000		// allocated by zlib for the default window and memory level
+#define	INFLATE_STATE_SIZE	0xA000
+
+/*
+ * With more than one thread, the stream is a raw deflate framed by hand as
+ * zlib, so that large inputs can be compressed in blocks by the deflate
+ * pool and the output still read by a plain InflateFilter.
+ */
 class DeflateFilter : public BufferedFilter
 {
 private:
 	z_stream stream_;
 	uint8_t outbuf[DEFLATE_CHUNK_SIZE];
+	int level_;
+	bool parallel_;
+	bool started_;
+	uLong adler_;
+	Buffer history_;
 	
 public:
-   DeflateFilter (int level = 0);
+   DeflateFilter (int level = 0, int threads = 1);
    virtual ~DeflateFilter ();
 
    virtual bool consume (Buffer& buf, int flg = 0);
    virtual void flush (int flg);
+
+private:
+   bool consume_blocks (Buffer& buf);
+   bool deflate_pending (int mode);
+   size_t state_size () const;
 };
 
 class InflateFilter : public BufferedFilter 
@@ -0,0 +1,246 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+// File:           zlib_pool.cc                                               //
+// Description:    parallel compression of large inputs of a deflate stream   //
+// Project:        WANProxy XTech                                             //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+#include <string.h>
+#include <common/memory_budget.h>
+#include <zlib/zlib_filter.h>
+#include <zlib/zlib_pool.h>
+
+DeflatePool::DeflatePool () : log_ ("/zlib/pool"), stopping_ (false)
+{
+	pthread_mutex_init (&mutex_, 0);
+	pthread_cond_init (&ready_, 0);
+}
+
+DeflatePool::~DeflatePool ()
+{
+	stop ();
+	for (unsigned n = 0; n < streams_.size (); ++n)
+	{
+		deflateEnd (&streams_[n]->stream_);
+		delete streams_[n];
+		memory_budget.release (MemoryUseCodecs, sizeof (Stream) + DEFLATE_STATE_SIZE);
+	}
+	pthread_mutex_destroy (&mutex_);
+	pthread_cond_destroy (&ready_);
+}
+
+bool DeflatePool::launch (int count)
+{
+	ScopedLock guard (lock_);
+
+	while ((int) helpers_.size () < count)
+	{
+		Helper* h = new Helper (*this);
+		if (! h->start ())
+		{
+			ERROR(log_) << "Unable to start compression thread.";
+			delete h;
+			break;
+		}
+		helpers_.push_back (h);
+	}
+
+	return (! helpers_.empty ());
+}
+
+void DeflatePool::stop ()
+{
+	ScopedLock guard (lock_);
+
+	if (helpers_.empty ())
+		return;
+
+	pthread_mutex_lock (&mutex_);
+	stopping_ = true;
+	pthread_cond_broadcast (&ready_);
+	pthread_mutex_unlock (&mutex_);
+
+	for (unsigned n = 0; n < helpers_.size (); ++n)
+	{
+		helpers_[n]->stop ();
+		delete helpers_[n];
+	}
+	helpers_.clear ();
+	stopping_ = false;
+}
+
+/*
+ * The data must be preceded by history bytes of earlier input.  Blocks go
+ * to the queue but the first, which the caller compresses itself before
+ * helping with the rest, so a stream always progresses even if every
+ * helper is busy with the blocks of other connections.  The output of all
+ * of them is then appended in order and their checksums folded into adler.
+ */
+bool DeflatePool::compress (const uint8_t* data, unsigned history, unsigned length, int level, Buffer* out, uLong* adler)
+{
+	unsigned count, n, pos;
+	Batch batch;
+	Task task;
+	bool ok;
+
+	count = (length + DEFLATE_BLOCK_SIZE - 1) / DEFLATE_BLOCK_SIZE;
+	std::vector<Buffer> outputs (count);
+	std::vector<uLong> adlers (count);
+	std::vector<uint8_t> oks (count, 0);
+
+	batch.pending_ = 0;
+	pthread_cond_init (&batch.done_, 0);
+	task.level_ = level, task.batch_ = &batch;
+
+	pthread_mutex_lock (&mutex_);
+	for (n = 1; n < count && ! helpers_.empty (); ++n)
+	{
+		pos = n * DEFLATE_BLOCK_SIZE;
+		task.data_ = data + pos;
+		task.dictionary_ = (history + pos < DEFLATE_WINDOW ? history + pos : DEFLATE_WINDOW);
+		task.length_ = (length - pos < DEFLATE_BLOCK_SIZE ? length - pos : DEFLATE_BLOCK_SIZE);
+		task.out_ = &outputs[n], task.adler_ = &adlers[n], task.ok_ = (bool*) &oks[n];
+		queue_.push_back (task);
+		batch.pending_++;
+	}
+	if (batch.pending_ > 0)
+		pthread_cond_broadcast (&ready_);
+	pthread_mutex_unlock (&mutex_);
+
+	for (n = 0; n < count; n += (helpers_.empty () ? 1 : count))
+	{
+		pos = n * DEFLATE_BLOCK_SIZE;
+		task.data_ = data + pos;
+		task.dictionary_ = (history + pos < DEFLATE_WINDOW ? history + pos : DEFLATE_WINDOW);
+		task.length_ = (length - pos < DEFLATE_BLOCK_SIZE ? length - pos : DEFLATE_BLOCK_SIZE);
+		task.out_ = &outputs[n], task.adler_ = &adlers[n], task.ok_ = (bool*) &oks[n];
+		run (task);
+	}
+
+	pthread_mutex_lock (&mutex_);
+	while (batch.pending_ > 0)
+	{
+		if (! queue_.empty ())
+		{
+			task = queue_.front ();
+			queue_.pop_front ();
+			pthread_mutex_unlock (&mutex_);
+			run (task);
+			pthread_mutex_lock (&mutex_);
+			if (--task.batch_->pending_ == 0 && task.batch_ != &batch)
+				pthread_cond_signal (&task.batch_->done_);
+			continue;
+		}
+		pthread_cond_wait (&batch.done_, &mutex_);
+	}
+	pthread_mutex_unlock (&mutex_);
+
+	pthread_cond_destroy (&batch.done_);
+
+	ok = true;
+	for (n = 0; n < count; ++n)
+	{
+		if (! oks[n])
+			ok = false;
+		pos = n * DEFLATE_BLOCK_SIZE;
+		*adler = adler32_combine (*adler, adlers[n], (length - pos < DEFLATE_BLOCK_SIZE ? length - pos : DEFLATE_BLOCK_SIZE));
+		out->append (outputs[n]);
+	}
+	return ok;
+}
+
+void DeflatePool::serve ()
+{
+	Task task;
+
+	pthread_mutex_lock (&mutex_);
+	while (1)
+	{
+		while (queue_.empty () && ! stopping_)
+			pthread_cond_wait (&ready_, &mutex_);
+		if (stopping_)
+			break;
+		task = queue_.front ();
+		queue_.pop_front ();
+		pthread_mutex_unlock (&mutex_);
+
+		run (task);
+
+		pthread_mutex_lock (&mutex_);
+		if (--task.batch_->pending_ == 0)
+			pthread_cond_signal (&task.batch_->done_);
+	}
+	pthread_mutex_unlock (&mutex_);
+}
+
+void DeflatePool::run (const Task& task)
+{
+	uint8_t outbuf[DEFLATE_CHUNK_SIZE];
+	Stream* s = 0;
+	z_stream* z;
+	int rv;
+
+	*task.ok_ = false;
+	*task.adler_ = adler32 (adler32 (0L, Z_NULL, 0), task.data_, task.length_);
+
+	pthread_mutex_lock (&mutex_);
+	if (! streams_.empty ())
+		s = streams_.back (), streams_.pop_back ();
+	pthread_mutex_unlock (&mutex_);
+
+	if (s)
+	{
+		rv = deflateReset (&s->stream_);
+		if (rv == Z_OK && s->level_ != task.level_ && (rv = deflateParams (&s->stream_, task.level_, Z_DEFAULT_STRATEGY)) == Z_OK)
+			s->level_ = task.level_;
+	}
+	else
+	{
+		s = new Stream;
+		memset (&s->stream_, 0, sizeof s->stream_);
+		s->level_ = task.level_;
+		rv = deflateInit2 (&s->stream_, task.level_, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+		if (rv != Z_OK)
+		{
+			delete s;
+			return;
+		}
+		memory_budget.charge (MemoryUseCodecs, sizeof (Stream) + DEFLATE_STATE_SIZE);
+	}
+	z = &s->stream_;
+
+	if (rv == Z_OK && task.dictionary_ > 0)
+		rv = deflateSetDictionary (z, task.data_ - task.dictionary_, task.dictionary_);
+
+	z->next_in = (Bytef*) (uintptr_t) task.data_;
+	z->avail_in = task.length_;
+	while (rv == Z_OK)
+	{
+		z->next_out = outbuf;
+		z->avail_out = sizeof outbuf;
+		if ((rv = deflate (z, Z_SYNC_FLUSH)) != Z_OK && rv != Z_BUF_ERROR)
+			break;
+		task.out_->append (outbuf, sizeof outbuf - z->avail_out);
+		if (z->avail_in == 0 && z->avail_out > 0)
+		{
+			*task.ok_ = true;
+			break;
+		}
+		rv = Z_OK;
+	}
+
+	if (! *task.ok_)
+	{
+		deflateEnd (z);
+		delete s;
+		memory_budget.release (MemoryUseCodecs, sizeof (Stream) + DEFLATE_STATE_SIZE);
+		return;
+	}
+
+	pthread_mutex_lock (&mutex_);
+	streams_.push_back (s);
+	pthread_mutex_unlock (&mutex_);
+}
+
+DeflatePool deflate_pool;
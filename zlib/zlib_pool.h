@@ -0,0 +1,94 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+// File:           zlib_pool.h                                                //
+// Description:    parallel compression of large inputs of a deflate stream   //
+// Project:        WANProxy XTech                                             //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef	ZLIB_ZLIB_POOL_H
+#define	ZLIB_ZLIB_POOL_H
+
+#include <pthread.h>
+#include <deque>
+#include <vector>
+#include <zlib.h>
+#include <common/buffer.h>
+#include <common/thread/mutex.h>
+#include <common/thread/thread.h>
+
+#define DEFLATE_BLOCK_SIZE			0x4000		// bytes of input compressed by each task
+#define DEFLATE_PARALLEL_MINIMUM	0x8000		// smaller inputs are compressed inline
+#define DEFLATE_WINDOW				0x8000		// preceding input a block may refer to
+
+/*
+ * Compresses the input of a deflate stream in blocks spread over helper
+ * threads, as pigz does: each block is a raw deflate of its own, primed
+ * with the DEFLATE_WINDOW bytes that precede it as dictionary, and ends
+ * with a sync flush on a byte boundary.  Put one after the other they make
+ * a single valid stream, which any inflater reads as usual.  The Adler-32
+ * of every block is taken along and combined for the zlib trailer.  The
+ * zlib streams of finished tasks are kept for the next ones.
+ */
+class DeflatePool
+{
+	struct Batch
+	{
+		int pending_;
+		pthread_cond_t done_;
+	};
+
+	struct Stream
+	{
+		z_stream stream_;
+		int level_;
+	};
+
+	struct Task
+	{
+		const uint8_t* data_;
+		unsigned dictionary_, length_;
+		int level_;
+		Buffer* out_;
+		uLong* adler_;
+		bool* ok_;
+		Batch* batch_;
+	};
+
+	class Helper : public Thread
+	{
+		DeflatePool& owner_;
+
+	public:
+		Helper (DeflatePool& owner) : Thread ("DeflatePool"), owner_ (owner)	{ }
+
+		virtual void main ()		{ owner_.serve (); }
+	};
+
+	LogHandle log_;
+	Mutex lock_;
+	pthread_mutex_t mutex_;
+	pthread_cond_t ready_;
+	std::deque<Task> queue_;
+	std::vector<Stream*> streams_;
+	std::vector<Helper*> helpers_;
+	bool stopping_;
+
+public:
+	DeflatePool ();
+	~DeflatePool ();
+
+	bool launch (int count);
+	void stop ();
+	bool running () const		{ return (! helpers_.empty ()); }
+
+	bool compress (const uint8_t* data, unsigned history, unsigned length, int level, Buffer* out, uLong* adler);
+
+private:
+	void serve ();
+	void run (const Task& task);
+};
+
+extern DeflatePool deflate_pool;
+
+#endif /* !ZLIB_ZLIB_POOL_H */